@@ -666,6 +666,11 @@ struct ForStatement : CompoundStatement {
   std::shared_ptr<Expression> collection;
   std::shared_ptr<ElseStatement> else_suite; // may be NULL
 
+  // annotations
+  // if the collection is a call to range(), these are its arguments; the loop
+  // is then compiled as a counted loop instead of iterating over a list
+  std::vector<std::shared_ptr<Expression>> range_args;
+
   ForStatement(std::shared_ptr<Expression> variable,
       std::shared_ptr<Expression> collection,
       std::vector<std::shared_ptr<Statement>>&& items,
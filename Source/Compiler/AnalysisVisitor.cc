@@ -21,7 +21,7 @@ using namespace std;
 
 AnalysisVisitor::AnalysisVisitor(GlobalContext* global, ModuleContext* module)
     : global(global), module(module), in_function_id(0), in_class_id(0),
-    last_attribute_lookup_had_class_base(false) { }
+    last_attribute_lookup_had_class_base(false), last_range_call(NULL) { }
 
 void AnalysisVisitor::visit(UnaryOperation* a) {
   a->expr->accept(this);
@@ -220,6 +220,18 @@ void AnalysisVisitor::visit(FunctionCall* a) {
       }
     }
   }
+
+  // if this is a call to range(), visit(ForStatement) may not need to make
+  // the call at all
+  this->last_range_call = NULL;
+  if (function.value_known && (function.type == ValueType::Function) &&
+      !a->varargs.get() && !a->varkwargs.get() && a->kwargs.empty() &&
+      !a->args.empty() && (a->args.size() <= 3)) {
+    const Value& range = this->global->builtins_module->global_variables.at("range").value;
+    if (function.function_id == range.function_id) {
+      this->last_range_call = a;
+    }
+  }
 }
 
 void AnalysisVisitor::visit(ArrayIndex* a) {
@@ -812,10 +824,19 @@ void AnalysisVisitor::visit(ElifStatement* a) {
 }
 
 void AnalysisVisitor::visit(ForStatement* a) {
+  this->last_range_call = NULL;
   a->collection->accept(this);
 
+  // if the collection is a call to range(), CompilationVisitor generates a
+  // counted loop instead of creating the list, and the values are always Ints
+  a->range_args.clear();
+  if (this->last_range_call &&
+      (this->last_range_call == a->collection.get())) {
+    a->range_args = this->last_range_call->args;
+    this->current_value = Value(ValueType::Int);
+
   // if the current value is known, we can at least get the types of the values
-  if (this->current_value.value_known) {
+  } else if (this->current_value.value_known) {
     switch (this->current_value.type) {
       // if we don't know the collection type, we can't know the value type;
       // just proceed without knowing
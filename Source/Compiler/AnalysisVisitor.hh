@@ -88,6 +88,7 @@ private:
   int64_t in_function_id;
   int64_t in_class_id;
   bool last_attribute_lookup_had_class_base;
+  FunctionCall* last_range_call; // set if the last call visited was range()
 
   FunctionContext* current_function();
   ClassContext* current_class();
@@ -0,0 +1,120 @@
+#include "BackgroundCompiler.hh"
+
+#include <inttypes.h>
+#include <stdio.h>
+
+#include "../Debug.hh"
+#include "Compile.hh"
+
+using namespace std;
+
+
+
+static thread_local bool on_background_thread = false;
+
+
+
+BackgroundCompiler::Request::Request(int64_t function_id,
+    const vector<Value>& arg_types) : function_id(function_id),
+    arg_types(arg_types) { }
+
+BackgroundCompiler::BackgroundCompiler(GlobalContext* global) :
+    compiled_count(0), failed_count(0), skipped_count(0), global(global),
+    should_exit(false), thread(&BackgroundCompiler::thread_routine, this) { }
+
+BackgroundCompiler::~BackgroundCompiler() {
+  this->stop();
+}
+
+void BackgroundCompiler::enqueue(int64_t function_id,
+    const vector<Value>& arg_types) {
+  {
+    lock_guard<mutex> g(this->queue_lock);
+    if (this->should_exit) {
+      return;
+    }
+    this->queue.emplace_back(function_id, arg_types);
+  }
+  this->queue_cv.notify_one();
+}
+
+void BackgroundCompiler::stop() {
+  {
+    lock_guard<mutex> g(this->queue_lock);
+    this->should_exit = true;
+    this->queue.clear();
+  }
+  this->queue_cv.notify_one();
+
+  // this thread may hold the compiler lock, but the background thread gives up
+  // waiting for it once should_exit is set, so this can't deadlock
+  if (this->thread.joinable()) {
+    this->thread.join();
+  }
+}
+
+bool BackgroundCompiler::is_background_thread() {
+  return on_background_thread;
+}
+
+void BackgroundCompiler::thread_routine() {
+  on_background_thread = true;
+
+  for (;;) {
+    unique_lock<mutex> g(this->queue_lock);
+    this->queue_cv.wait(g, [&]() {
+      return this->should_exit || !this->queue.empty();
+    });
+    if (this->should_exit) {
+      break;
+    }
+    Request req = move(this->queue.front());
+    this->queue.pop_front();
+    g.unlock();
+
+    this->compile(req);
+  }
+}
+
+void BackgroundCompiler::compile(const Request& req) {
+  CompilerLock lock(this->global, this->should_exit);
+  if (!lock.is_locked() || this->should_exit) {
+    return;
+  }
+
+  FunctionContext* fn = this->global->context_for_function(req.function_id);
+  if (!fn || fn->is_builtin()) {
+    this->failed_count++;
+    return;
+  }
+
+  // the main thread may have needed this fragment before we got to it, or
+  // the same call may have been queued more than once
+  if (fn->fragment_index_for_call_args(req.arg_types) >= 0) {
+    this->skipped_count++;
+    return;
+  }
+
+  fn->fragments.emplace_back(fn, fn->fragments.size(), req.arg_types);
+  try {
+    compile_fragment(this->global, fn->module, &fn->fragments.back(),
+        "background");
+    this->compiled_count++;
+
+    if (debug_flags & DebugFlag::ShowJITEvents) {
+      fprintf(stderr, "[background] compiled fragment %zu of %s+%" PRId64 "\n",
+          fn->fragments.size() - 1, fn->name.c_str(), fn->id);
+    }
+
+  } catch (const exception& e) {
+    // the main thread will compile it when it's called (and will report the
+    // error if it happens again)
+    fn->fragments.pop_back();
+    this->failed_count++;
+
+    if (debug_flags & DebugFlag::ShowJITEvents) {
+      fprintf(stderr, "[background] failed to compile fragment of %s+%" PRId64 ": %s\n",
+          fn->name.c_str(), fn->id, e.what());
+    }
+  }
+}
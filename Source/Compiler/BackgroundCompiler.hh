@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "../Environment/Value.hh"
+#include "Contexts.hh"
+
+
+
+// compiles fragments on a separate thread. when BackgroundCompilation is
+// enabled, CompilationVisitor sends eagerly-compilable callees here instead of
+// compiling them before continuing, and generates a callsite for the call. if
+// the fragment has been compiled by the time the call is executed, the
+// callsite just uses it; otherwise the main thread compiles it (or waits for
+// the compiler lock, if this thread is compiling it at the time).
+//
+// compilation is serialized by the compiler lock (see CompilerLock in
+// Compile.hh), so there's only one background thread; a pool of them would
+// just wait for each other. the benefit is that the main thread can run
+// generated code while callees are compiled.
+//
+// background compilation can't advance any module's phase, since that could
+// run a module's root scope on this thread. fragments that would need to do so
+// fail here and are compiled by the main thread when they're called.
+class BackgroundCompiler {
+public:
+  explicit BackgroundCompiler(GlobalContext* global);
+  BackgroundCompiler(const BackgroundCompiler&) = delete;
+  BackgroundCompiler(BackgroundCompiler&&) = delete;
+  BackgroundCompiler& operator=(const BackgroundCompiler&) = delete;
+  BackgroundCompiler& operator=(BackgroundCompiler&&) = delete;
+  ~BackgroundCompiler();
+
+  void enqueue(int64_t function_id, const std::vector<Value>& arg_types);
+
+  // discards any queued requests and waits for the thread to exit
+  void stop();
+
+  static bool is_background_thread();
+
+  std::atomic<size_t> compiled_count;
+  std::atomic<size_t> failed_count;
+  std::atomic<size_t> skipped_count; // fragment already existed
+
+private:
+  struct Request {
+    int64_t function_id;
+    std::vector<Value> arg_types;
+
+    Request(int64_t function_id, const std::vector<Value>& arg_types);
+  };
+
+  GlobalContext* global;
+
+  std::mutex queue_lock;
+  std::condition_variable queue_cv;
+  std::deque<Request> queue;
+  std::atomic<bool> should_exit; // only changed while holding queue_lock
+
+  std::thread thread;
+
+  void thread_routine();
+  void compile(const Request& req);
+};
@@ -0,0 +1,531 @@
+#include "CodeCache.hh"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <phosg/Filesystem.hh>
+#include <phosg/Strings.hh>
+
+#include "../Debug.hh"
+#include "BuiltinFunctions.hh"
+#include "CommonObjects.hh"
+#include "Compile.hh"
+
+using namespace std;
+
+
+
+// bump this when the format of cache files or the generated code changes in a
+// way that the build id wouldn't catch
+static const char* CACHE_FORMAT = "nemesys-code-cache-1";
+
+static const int64_t PLACEHOLDER_BASE = 0x4E454D4500000000;
+
+
+
+static uint64_t fnv1a64(const void* data, size_t size,
+    uint64_t hash = 0xCBF29CE484222325) {
+  const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data);
+  for (size_t x = 0; x < size; x++) {
+    hash = (hash ^ bytes[x]) * 0x00000100000001B3;
+  }
+  return hash;
+}
+
+static void append_u64(string& s, uint64_t v) {
+  s.append(reinterpret_cast<const char*>(&v), sizeof(v));
+}
+
+static void append_string(string& s, const string& data) {
+  append_u64(s, data.size());
+  s += data;
+}
+
+struct CacheFileReader {
+  const string& data;
+  size_t offset;
+
+  CacheFileReader(const string& data) : data(data), offset(0) { }
+
+  uint64_t get_u64() {
+    if (this->offset + sizeof(uint64_t) > this->data.size()) {
+      throw out_of_range("cache file is truncated");
+    }
+    uint64_t ret;
+    memcpy(&ret, this->data.data() + this->offset, sizeof(uint64_t));
+    this->offset += sizeof(uint64_t);
+    return ret;
+  }
+
+  string get_string() {
+    uint64_t size = this->get_u64();
+    if (this->offset + size > this->data.size()) {
+      throw out_of_range("cache file is truncated");
+    }
+    string ret = this->data.substr(this->offset, size);
+    this->offset += size;
+    return ret;
+  }
+};
+
+// types are stored in the same format as FunctionContext::signature_for_types.
+// that format doesn't include values, so types that depend on their values
+// (functions, classes and modules) can't be stored
+static bool type_is_cacheable(const Value& type) {
+  if ((type.type == ValueType::Function) || (type.type == ValueType::Class) ||
+      (type.type == ValueType::Module) ||
+      (type.type == ValueType::ExtensionTypeReference)) {
+    return false;
+  }
+  for (const Value& extension_type : type.extension_types) {
+    if (!type_is_cacheable(extension_type)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool types_are_cacheable(const vector<Value>& types) {
+  for (const Value& type : types) {
+    if (!type_is_cacheable(type)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static Value parse_type_signature(const string& signature, size_t& offset) {
+  ValueType type = static_cast<ValueType>(signature.at(offset++));
+
+  Value ret;
+  if (type == ValueType::Instance) {
+    if (offset + sizeof(int64_t) > signature.size()) {
+      throw out_of_range("type signature is truncated");
+    }
+    int64_t class_id;
+    memcpy(&class_id, signature.data() + offset, sizeof(int64_t));
+    offset += sizeof(int64_t);
+    ret = Value(ValueType::Instance, class_id, nullptr);
+  } else {
+    ret = Value(type);
+  }
+
+  if ((offset < signature.size()) && (signature[offset] == '[')) {
+    offset++;
+    while (signature.at(offset) != ']') {
+      ret.extension_types.emplace_back(parse_type_signature(signature, offset));
+    }
+    offset++;
+  }
+  return ret;
+}
+
+static vector<Value> parse_types_signature(const string& signature) {
+  vector<Value> ret;
+  size_t offset = 0;
+  while (offset < signature.size()) {
+    ret.emplace_back(parse_type_signature(signature, offset));
+  }
+  return ret;
+}
+
+
+
+CodeRelocation::CodeRelocation(Type type, int64_t id, const string& data,
+    int64_t value) : type(type), id(id), data(data), value(value), offset(0) { }
+
+
+
+CodeCache::CodeCache(const string& directory,
+    const string& executable_filename) : hit_count(0), miss_count(0),
+    save_count(0), directory(directory), history(fnv1a64(NULL, 0)) {
+  // the generated code and the common object table both depend on the build,
+  // so entries are only valid for the exact executable that wrote them
+  auto st = stat(executable_filename);
+  this->build_id = string_printf("%s:%s:%" PRIu64 ":%" PRId64, CACHE_FORMAT,
+      executable_filename.c_str(), static_cast<uint64_t>(st.st_size),
+      static_cast<int64_t>(st.st_mtime));
+
+  if (!isdir(this->directory)) {
+    if (mkdir(this->directory.c_str(), 0755)) {
+      throw runtime_error("can\'t create code cache directory " + this->directory);
+    }
+  }
+}
+
+void CodeCache::record_module_phase(const ModuleContext* module) {
+  string data = module->name;
+  data.push_back('\0');
+  data.push_back(static_cast<char>(module->phase));
+  if (module->source.get()) {
+    const string& source = module->source->data();
+    append_u64(data, fnv1a64(source.data(), source.size()));
+  }
+  this->history = fnv1a64(data.data(), data.size(), this->history);
+}
+
+void CodeCache::record_global_type(const ModuleContext* module,
+    const string& name, const Value& type) {
+  string data = module->name;
+  data.push_back('\0');
+  data += name;
+  data.push_back('\0');
+  data += FunctionContext::signature_for_types({type});
+  this->history = fnv1a64(data.data(), data.size(), this->history);
+}
+
+string CodeCache::key_for_fragment(const Fragment* f) const {
+  // print flags don't affect the generated code, so they aren't part of the key
+  return string_printf("%s/%016" PRIX64 "/%016" PRIX64 "/%s.%s+%" PRId64 "/",
+      this->build_id.c_str(), debug_flags & ~DebugFlag::Verbose,
+      this->history, f->function->module->name.c_str(),
+      f->function->name.c_str(), f->function->id) +
+      FunctionContext::signature_for_types(f->arg_types);
+}
+
+string CodeCache::filename_for_key(const string& key) const {
+  return string_printf("%s/%016" PRIX64 ".fragment", this->directory.c_str(),
+      fnv1a64(key.data(), key.size()));
+}
+
+int64_t CodeCache::placeholder_for_relocation(size_t index) {
+  return PLACEHOLDER_BASE | static_cast<int64_t>(index);
+}
+
+void CodeCache::apply_relocations(string& code,
+    vector<CodeRelocation>& relocations) {
+  for (size_t x = 0; x < relocations.size(); x++) {
+    int64_t placeholder = placeholder_for_relocation(x);
+    string placeholder_data(reinterpret_cast<const char*>(&placeholder),
+        sizeof(placeholder));
+
+    size_t offset = code.find(placeholder_data);
+    if ((offset == string::npos) ||
+        (code.find(placeholder_data, offset + 1) != string::npos)) {
+      throw compile_error(string_printf(
+          "relocation %zu does not appear exactly once in the assembled code", x));
+    }
+
+    auto& relocation = relocations[x];
+    relocation.offset = offset;
+    memcpy(const_cast<char*>(code.data()) + offset, &relocation.value,
+        sizeof(relocation.value));
+  }
+}
+
+bool CodeCache::load_fragment(GlobalContext* global, ModuleContext* module,
+    Fragment* f, const string& key) {
+  string filename = this->filename_for_key(key);
+  string data;
+  try {
+    data = load_file(filename);
+  } catch (const exception& e) {
+    this->miss_count++;
+    return false;
+  }
+
+  // compiling other fragments can move the fragment in memory, so we have to
+  // find it again after resolving the relocations
+  FunctionContext* fn = f->function;
+  size_t fragment_index = f->index;
+
+  vector<int64_t> created_callsite_tokens;
+  unordered_set<const void*> called_fragment_code;
+  try {
+    CacheFileReader r(data);
+    if ((r.get_string() != CACHE_FORMAT) || (r.get_string() != key)) {
+      throw runtime_error("cache entry is for a different fragment");
+    }
+
+    string return_type_signature = r.get_string();
+    size_t return_type_offset = 0;
+    Value return_type = parse_type_signature(return_type_signature,
+        return_type_offset);
+
+    string code = r.get_string();
+
+    unordered_set<size_t> patch_offsets;
+    for (uint64_t count = r.get_u64(); count; count--) {
+      patch_offsets.emplace(r.get_u64());
+    }
+
+    multimap<size_t, string> compiled_labels;
+    for (uint64_t count = r.get_u64(); count; count--) {
+      size_t offset = r.get_u64();
+      compiled_labels.emplace(offset, r.get_string());
+    }
+
+    vector<string> call_split_labels;
+    vector<ssize_t> call_split_offsets;
+    for (uint64_t count = r.get_u64(); count; count--) {
+      call_split_labels.emplace_back(r.get_string());
+      call_split_offsets.emplace_back(static_cast<ssize_t>(r.get_u64()));
+    }
+
+    // compiling the fragment may have imported some modules, which runs their
+    // root scopes. do the same thing here so globals are initialized in the
+    // same order
+    for (uint64_t count = r.get_u64(); count; count--) {
+      auto imported_module = global->get_or_create_module(r.get_string());
+      advance_module_phase(global, imported_module.get(),
+          ModuleContext::Phase::Imported);
+    }
+
+    // callsites are recreated with new tokens
+    unordered_map<int64_t, int64_t> saved_token_to_token;
+    for (uint64_t count = r.get_u64(); count; count--) {
+      int64_t saved_token = r.get_u64();
+      int64_t callee_function_id = r.get_u64();
+      vector<Value> arg_types = parse_types_signature(r.get_string());
+      int64_t split_id = r.get_u64();
+      string callsite_return_type_signature = r.get_string();
+      size_t callsite_return_type_offset = 0;
+
+      int64_t callsite_token = global->next_callsite_token++;
+      auto* callsite = &global->unresolved_callsites.emplace(piecewise_construct,
+          forward_as_tuple(callsite_token), forward_as_tuple(
+            callee_function_id, arg_types, module, fn->id, fragment_index,
+            split_id)).first->second;
+      created_callsite_tokens.emplace_back(callsite_token);
+      callsite->return_type = parse_type_signature(
+          callsite_return_type_signature, callsite_return_type_offset);
+      callsite->call_target = void_fn_ptr(&_resolve_function_call);
+      saved_token_to_token.emplace(saved_token, callsite_token);
+    }
+
+    for (uint64_t count = r.get_u64(); count; count--) {
+      auto type = static_cast<CodeRelocation::Type>(r.get_u64());
+      size_t offset = r.get_u64();
+      int64_t id = r.get_u64();
+      string relocation_data = r.get_string();
+
+      int64_t value;
+      switch (type) {
+        case CodeRelocation::Type::CommonObjectBase:
+          value = reinterpret_cast<int64_t>(common_object_base());
+          break;
+
+        case CodeRelocation::Type::GlobalContext:
+          value = reinterpret_cast<int64_t>(global);
+          break;
+
+        case CodeRelocation::Type::ModuleGlobalSpace: {
+          auto other_module = global->modules.at(relocation_data);
+          if (!other_module->global_space) {
+            throw runtime_error("module global space does not exist");
+          }
+          value = reinterpret_cast<int64_t>(other_module->global_space);
+          break;
+        }
+
+        case CodeRelocation::Type::FunctionContext:
+        case CodeRelocation::Type::ClassContext:
+        case CodeRelocation::Type::ClassDestructor: {
+          const void* ptr;
+          if (type == CodeRelocation::Type::FunctionContext) {
+            ptr = global->context_for_function(id);
+          } else {
+            const ClassContext* cls = global->context_for_class(id);
+            ptr = (cls && (type == CodeRelocation::Type::ClassDestructor)) ?
+                cls->destructor : cls;
+          }
+          if (!ptr) {
+            throw runtime_error("function or class does not exist");
+          }
+          value = reinterpret_cast<int64_t>(ptr);
+          break;
+        }
+
+        case CodeRelocation::Type::BytesConstant:
+          value = reinterpret_cast<int64_t>(
+              global->get_or_create_constant(relocation_data));
+          break;
+
+        case CodeRelocation::Type::UnicodeConstant: {
+          wstring s(reinterpret_cast<const wchar_t*>(relocation_data.data()),
+              relocation_data.size() / sizeof(wchar_t));
+          value = reinterpret_cast<int64_t>(global->get_or_create_constant(s));
+          break;
+        }
+
+        case CodeRelocation::Type::FragmentCode: {
+          // if the callee fragment was compiled along with this fragment, it
+          // may not exist yet in this run; compile it if needed
+          FunctionContext* callee = global->context_for_function(id);
+          if (!callee) {
+            throw runtime_error("callee function does not exist");
+          }
+          const Fragment* callee_fragment = NULL;
+          for (const auto& fragment : callee->fragments) {
+            if (FunctionContext::signature_for_types(fragment.arg_types) == relocation_data) {
+              callee_fragment = &fragment;
+              break;
+            }
+          }
+          if (!callee_fragment) {
+            if (callee->is_builtin()) {
+              throw runtime_error("built-in callee fragment does not exist");
+            }
+            callee->fragments.emplace_back(callee, callee->fragments.size(),
+                parse_types_signature(relocation_data));
+            try {
+              compile_fragment(global, callee->module,
+                  &callee->fragments.back(), "code cache callee");
+            } catch (const exception& e) {
+              callee->fragments.pop_back();
+              throw;
+            }
+            callee_fragment = &callee->fragments.back();
+          }
+          if (!callee_fragment->compiled) {
+            throw runtime_error("callee fragment is not compiled");
+          }
+          value = reinterpret_cast<int64_t>(callee_fragment->compiled);
+          called_fragment_code.emplace(callee_fragment->compiled);
+          break;
+        }
+
+        case CodeRelocation::Type::CallsiteToken:
+        case CodeRelocation::Type::CallsiteTarget: {
+          int64_t callsite_token = saved_token_to_token.at(id);
+          if (type == CodeRelocation::Type::CallsiteToken) {
+            value = callsite_token;
+          } else {
+            value = reinterpret_cast<int64_t>(
+                &global->unresolved_callsites.at(callsite_token).call_target);
+          }
+          break;
+        }
+
+        default:
+          throw runtime_error("unknown relocation type");
+      }
+
+      if (offset + sizeof(value) > code.size()) {
+        throw runtime_error("relocation is outside of the code");
+      }
+      memcpy(const_cast<char*>(code.data()) + offset, &value, sizeof(value));
+    }
+
+    Fragment& loaded = fn->fragments.at(fragment_index);
+    loaded.return_type = move(return_type);
+    loaded.compiled_labels = move(compiled_labels);
+    loaded.call_split_labels = move(call_split_labels);
+    loaded.call_split_offsets = move(call_split_offsets);
+    loaded.compiled = global->install_code(code, patch_offsets,
+        move(called_fragment_code), unordered_set<int64_t>(
+          created_callsite_tokens.begin(), created_callsite_tokens.end()));
+    module->compiled_size += code.size();
+
+  } catch (const exception& e) {
+    for (int64_t token : created_callsite_tokens) {
+      global->unresolved_callsites.erase(token);
+    }
+    if (debug_flags & DebugFlag::ShowCompileDebug) {
+      fprintf(stderr, "[code_cache] can\'t use %s: %s\n", filename.c_str(),
+          e.what());
+    }
+    this->miss_count++;
+    return false;
+  }
+
+  this->hit_count++;
+  return true;
+}
+
+void CodeCache::save_fragment(GlobalContext* global, const string& key,
+    const Fragment* f, const string& code,
+    const unordered_set<size_t>& patch_offsets,
+    const vector<CodeRelocation>& relocations,
+    const vector<string>& imported_module_names) {
+  if (!type_is_cacheable(f->return_type) ||
+      !types_are_cacheable(f->arg_types)) {
+    return;
+  }
+
+  string data;
+  append_string(data, CACHE_FORMAT);
+  append_string(data, key);
+  append_string(data, FunctionContext::signature_for_types({f->return_type}));
+
+  // the code contains this process' values for the relocations, but they're
+  // all overwritten when it's loaded
+  append_string(data, code);
+
+  append_u64(data, patch_offsets.size());
+  for (size_t offset : patch_offsets) {
+    append_u64(data, offset);
+  }
+
+  append_u64(data, f->compiled_labels.size());
+  for (const auto& it : f->compiled_labels) {
+    append_u64(data, it.first);
+    append_string(data, it.second);
+  }
+
+  append_u64(data, f->call_split_labels.size());
+  for (size_t x = 0; x < f->call_split_labels.size(); x++) {
+    append_string(data, f->call_split_labels[x]);
+    append_u64(data, f->call_split_offsets[x]);
+  }
+
+  append_u64(data, imported_module_names.size());
+  for (const auto& name : imported_module_names) {
+    append_string(data, name);
+  }
+
+  // the callsites are referred to by CallsiteToken and CallsiteTarget
+  // relocations; save each one only once
+  string callsites_data;
+  size_t callsite_count = 0;
+  unordered_set<int64_t> saved_tokens;
+  for (const auto& relocation : relocations) {
+    if (((relocation.type != CodeRelocation::Type::CallsiteToken) &&
+         (relocation.type != CodeRelocation::Type::CallsiteTarget)) ||
+        !saved_tokens.emplace(relocation.id).second) {
+      continue;
+    }
+    const auto& callsite = global->unresolved_callsites.at(relocation.id);
+    if (!types_are_cacheable(callsite.arg_types) ||
+        !type_is_cacheable(callsite.return_type)) {
+      return;
+    }
+    append_u64(callsites_data, relocation.id);
+    append_u64(callsites_data, callsite.callee_function_id);
+    append_string(callsites_data, FunctionContext::signature_for_types(callsite.arg_types));
+    append_u64(callsites_data, callsite.caller_split_id);
+    append_string(callsites_data, FunctionContext::signature_for_types({callsite.return_type}));
+    callsite_count++;
+  }
+  append_u64(data, callsite_count);
+  data += callsites_data;
+
+  append_u64(data, relocations.size());
+  for (const auto& relocation : relocations) {
+    append_u64(data, static_cast<uint64_t>(relocation.type));
+    append_u64(data, relocation.offset);
+    append_u64(data, relocation.id);
+    append_string(data, relocation.data);
+  }
+
+  // write to a temporary file first so other processes never see a partial
+  // entry
+  string filename = this->filename_for_key(key);
+  string temp_filename = string_printf("%s.%d", filename.c_str(), getpid());
+  try {
+    save_file(temp_filename, data);
+    if (rename(temp_filename.c_str(), filename.c_str())) {
+      unlink(temp_filename.c_str());
+      throw runtime_error("can\'t rename cache file");
+    }
+    this->save_count++;
+  } catch (const exception& e) {
+    if (debug_flags & DebugFlag::ShowCompileDebug) {
+      fprintf(stderr, "[code_cache] can\'t write %s: %s\n", filename.c_str(),
+          e.what());
+    }
+  }
+}
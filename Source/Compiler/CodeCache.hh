@@ -0,0 +1,99 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "../Environment/Value.hh"
+#include "Contexts.hh"
+
+
+
+// the code cache keeps compiled function fragments on disk so later runs of the
+// same program don't have to compile them again. generated code contains the
+// addresses of many things that only exist in the current process (global
+// spaces, constants, contexts, other fragments, callsites), so the compiler
+// records each of these as a relocation, and they're looked up again when the
+// fragment is loaded.
+//
+// entries are keyed by the function, the fragment's argument types, and a hash
+// of every module phase change and compile-time global type change that
+// happened before the fragment was compiled. this covers the source of every
+// module the fragment could depend on, and the function and class ids that
+// were assigned to them (these are embedded in the code as plain integers).
+// module root scopes and fragments that change global state when compiled
+// aren't cached.
+
+struct CodeRelocation {
+  enum class Type {
+    CommonObjectBase = 0,
+    GlobalContext,
+    ModuleGlobalSpace, // data is the module name
+    FunctionContext, // id is the function id
+    ClassContext, // id is the class id
+    ClassDestructor, // id is the class id
+    BytesConstant, // data is the contents
+    UnicodeConstant, // data is the contents (raw wchar_t array)
+    FragmentCode, // id is the function id; data is the arg type signature
+    CallsiteToken, // id is the callsite token at compile time
+    CallsiteTarget, // id is the callsite token at compile time
+  };
+
+  Type type;
+  int64_t id;
+  std::string data;
+
+  int64_t value; // value in the current process; not saved
+  size_t offset; // location of the value in the assembled code
+
+  CodeRelocation(Type type, int64_t id, const std::string& data,
+      int64_t value);
+};
+
+class CodeCache {
+public:
+  CodeCache(const std::string& directory,
+      const std::string& executable_filename);
+  ~CodeCache() = default;
+
+  // these update the history hash that's part of every key
+  void record_module_phase(const ModuleContext* module);
+  void record_global_type(const ModuleContext* module, const std::string& name,
+      const Value& type);
+
+  std::string key_for_fragment(const Fragment* f) const;
+
+  // loads the fragment's code and metadata from the cache. returns false if
+  // the entry doesn't exist or can't be used (in which case the fragment
+  // should be compiled normally)
+  bool load_fragment(GlobalContext* global, ModuleContext* module, Fragment* f,
+      const std::string& key);
+
+  // writes the fragment to the cache. code is the assembled code, after
+  // apply_relocations has been called on it. failures are ignored
+  void save_fragment(GlobalContext* global, const std::string& key,
+      const Fragment* f, const std::string& code,
+      const std::unordered_set<size_t>& patch_offsets,
+      const std::vector<CodeRelocation>& relocations,
+      const std::vector<std::string>& imported_module_names);
+
+  // the compiler writes placeholder_for_relocation(index) into the code
+  // instead of the relocation's value. apply_relocations finds the
+  // placeholders, fills in each relocation's offset, and writes the values
+  static int64_t placeholder_for_relocation(size_t index);
+  static void apply_relocations(std::string& code,
+      std::vector<CodeRelocation>& relocations);
+
+  size_t hit_count;
+  size_t miss_count;
+  size_t save_count;
+
+private:
+  std::string directory;
+  std::string build_id;
+  uint64_t history;
+
+  std::string filename_for_key(const std::string& key) const;
+};
@@ -10,9 +10,11 @@
 #include "BuiltinFunctions.hh"
 #include "Compile.hh"
 #include "Exception.hh"
+#include "../Types/Allocator.hh"
 #include "../Types/Reference.hh"
 #include "../Types/Strings.hh"
 #include "../Types/Format.hh"
+#include "../Types/Instance.hh"
 #include "../Types/List.hh"
 #include "../Types/Tuple.hh"
 #include "../Types/Dictionary.hh"
@@ -25,6 +27,9 @@ static const vector<const void*> objects({
 
   void_fn_ptr(&malloc),
   void_fn_ptr(&free),
+  void_fn_ptr(&nemesys_malloc),
+  void_fn_ptr(&nemesys_free),
+  allocator_main_thread_state(),
 
   // have to cast this pointer so the compiler knows which overloaded function
   // we want
@@ -32,8 +37,10 @@ static const vector<const void*> objects({
 
   void_fn_ptr(&add_reference),
   void_fn_ptr(&delete_reference),
+  void_fn_ptr(&stack_instance_destructor),
 
   void_fn_ptr(&_unwind_exception_internal),
+  &exception_raise_count,
   void_fn_ptr(&_resolve_function_call),
 
   void_fn_ptr(&bytes_equal),
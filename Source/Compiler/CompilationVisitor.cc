@@ -5,6 +5,8 @@
 #include <stdlib.h>
 #include <stdio.h>
 
+#include <algorithm>
+
 #include <phosg/Filesystem.hh>
 #include <phosg/Strings.hh>
 #include <libamd64/AMD64Assembler.hh>
@@ -17,14 +19,19 @@
 #include "../Environment/Value.hh"
 #include "../Types/Reference.hh"
 #include "../Types/Strings.hh"
+#include "../Types/Allocator.hh"
 #include "../Types/Format.hh"
+#include "../Types/Instance.hh"
 #include "../Types/List.hh"
 #include "../Types/Tuple.hh"
 #include "../Types/Dictionary.hh"
+#include "BackgroundCompiler.hh"
 #include "CommonObjects.hh"
 #include "Exception.hh"
 #include "BuiltinFunctions.hh"
 #include "Compile.hh"
+#include "PerfMap.hh"
+#include "Profiler.hh"
 
 using namespace std;
 
@@ -43,6 +50,552 @@ static const int64_t default_available_int_registers =
     (1 << Register::R9) | (1 << Register::R10) | (1 << Register::R11);
 static const int64_t default_available_float_registers = 0xFFFF; // all of them
 
+// registers that can hold locals, in order of preference. rbx is callee-save,
+// so it only needs to be spilled if the local can be read by an except block;
+// the others have to be spilled and reloaded around every call. rbx is also
+// used as scratch by list/tuple construction and for loops, and r10/r11 are
+// needed as temps when arguments are passed on the stack, so these are only
+// used when the function doesn't do either of those things
+static const vector<Register> local_int_register_order = {
+    Register::RBX, Register::R11, Register::R10};
+static const vector<Register> local_float_register_order = {
+    Register::XMM8, Register::XMM9, Register::XMM10, Register::XMM11,
+    Register::XMM12, Register::XMM13, Register::XMM14, Register::XMM15};
+
+// generated code allocates and frees instances using the main thread's free
+// lists directly (see Allocator.hh), unless another thread could be running
+// destructors at the same time
+static bool allocation_can_be_inlined() {
+  return !(debug_flags & (DebugFlag::NoInlineAllocation |
+      DebugFlag::BackgroundCompilation));
+}
+
+// refcount incs/decs only need the lock prefix if another thread could be
+// changing refcounts at the same time (see refcounts_are_atomic)
+static void write_refcount_lock_prefix(AMD64Assembler& as) {
+  if (refcounts_are_atomic()) {
+    as.write_lock();
+  }
+}
+
+
+
+// collects how often each local is used in a function's body (uses inside
+// loops count for more) and which of the local registers can't be used
+class LocalUsageVisitor : public RecursiveASTVisitor {
+public:
+  LocalUsageVisitor(GlobalContext* global, int64_t function_id) :
+      global(global), function_id(function_id), loop_depth(0),
+      uses_rbx(false), has_try(false), max_call_arg_count(0) { }
+  ~LocalUsageVisitor() = default;
+
+  using RecursiveASTVisitor::visit;
+
+  virtual void visit(VariableLookup* a) {
+    this->add_use(a->name);
+  }
+
+  virtual void visit(AttributeLValueReference* a) {
+    if (a->base.get()) {
+      a->base->accept(this);
+    } else {
+      this->add_use(a->name);
+    }
+  }
+
+  virtual void visit(ListConstructor* a) {
+    this->uses_rbx = true;
+    this->RecursiveASTVisitor::visit(a);
+  }
+
+  virtual void visit(TupleConstructor* a) {
+    this->uses_rbx = true;
+    this->RecursiveASTVisitor::visit(a);
+  }
+
+  virtual void visit(FunctionCall* a) {
+    // the callee's argument count includes default values, which are passed
+    // explicitly
+    size_t arg_count = a->args.size() + a->kwargs.size() + 1;
+    auto* fn = this->global->context_for_function(a->callee_function_id);
+    if (fn && (fn->args.size() > arg_count)) {
+      arg_count = fn->args.size();
+    }
+    if (arg_count > this->max_call_arg_count) {
+      this->max_call_arg_count = arg_count;
+    }
+    this->RecursiveASTVisitor::visit(a);
+  }
+
+  virtual void visit(ImportStatement* a) {
+    // imported values are copied directly into the local's stack slot
+    for (const auto& it : a->names) {
+      this->excluded_names.emplace(it.second);
+    }
+  }
+
+  virtual void visit(ForStatement* a) {
+    this->uses_rbx = true;
+    a->collection->accept(this);
+    this->loop_depth++;
+    a->variable->accept(this);
+    this->visit_list(a->items);
+    this->loop_depth--;
+    if (a->else_suite) {
+      a->else_suite->accept(this);
+    }
+  }
+
+  virtual void visit(WhileStatement* a) {
+    this->loop_depth++;
+    a->condition->accept(this);
+    this->visit_list(a->items);
+    this->loop_depth--;
+    if (a->else_suite) {
+      a->else_suite->accept(this);
+    }
+  }
+
+  virtual void visit(TryStatement* a) {
+    this->has_try = true;
+    this->RecursiveASTVisitor::visit(a);
+  }
+
+  virtual void visit(LambdaDefinition* a) {
+    if (a->function_id == this->function_id) {
+      this->RecursiveASTVisitor::visit(a);
+    }
+  }
+
+  virtual void visit(FunctionDefinition* a) {
+    if (a->function_id == this->function_id) {
+      this->RecursiveASTVisitor::visit(a);
+    }
+  }
+
+  virtual void visit(ClassDefinition* a) { }
+
+  GlobalContext* global;
+  int64_t function_id;
+  size_t loop_depth;
+
+  unordered_map<string, int64_t> name_to_weight;
+  unordered_set<string> excluded_names;
+  bool uses_rbx;
+  bool has_try;
+  size_t max_call_arg_count;
+
+private:
+  void add_use(const string& name) {
+    this->name_to_weight[name] += (1 << (3 * min<size_t>(this->loop_depth, 4)));
+  }
+};
+
+
+
+// callees whose body is a single expression of at most this many nodes are
+// compiled in place of the call (unless NoInlining is set)
+static const size_t max_inlined_expression_nodes = 16;
+
+// finds the expression that a call to a function can be replaced with. this
+// only works if the function is a lambda or its body is a single return
+// statement (optionally after a docstring), and the returned expression only
+// uses constants, operators, attribute lookups, and the function's arguments.
+// calls aren't allowed, so inlining never nests or recurses; neither are
+// list/tuple constructors, since they use rbx (see LocalUsageVisitor)
+class InlinableExpressionVisitor : public ASTVisitor {
+public:
+  InlinableExpressionVisitor(const FunctionContext* fn) : expression(NULL),
+      fn(fn), node_count(0), inlinable(true), handled(false), constant(false),
+      statement_value(NULL), statement_is_return(false) { }
+  ~InlinableExpressionVisitor() = default;
+
+  using ASTVisitor::visit;
+
+  virtual void visit(FunctionDefinition* a) {
+    if (!a->decorators.empty() || a->items.empty() || (a->items.size() > 2)) {
+      return;
+    }
+
+    // the docstring (if any) is dropped, so it had better not do anything
+    if (a->items.size() == 2) {
+      this->statement_value = NULL;
+      a->items[0]->accept(this);
+      if (this->statement_is_return || !this->statement_value) {
+        return;
+      }
+      this->constant = false;
+      this->statement_value->accept(this);
+      if (!this->constant) {
+        return;
+      }
+    }
+
+    this->statement_value = NULL;
+    a->items.back()->accept(this);
+    if (this->statement_is_return && this->statement_value) {
+      this->check_expression(this->statement_value);
+    }
+  }
+
+  virtual void visit(LambdaDefinition* a) {
+    // lambdas inside the expression aren't inlinable
+    if (this->node_count == 0) {
+      this->check_expression(a->result.get());
+    }
+  }
+
+  virtual void visit(ExpressionStatement* a) {
+    this->statement_value = a->expr.get();
+    this->statement_is_return = false;
+  }
+
+  virtual void visit(ReturnStatement* a) {
+    this->statement_value = a->value.get();
+    this->statement_is_return = true;
+  }
+
+  virtual void visit(UnaryOperation* a) {
+    if (a->oper != UnaryOperator::Yield) {
+      this->check_node(a->expr.get());
+      this->handled = true;
+    }
+  }
+
+  virtual void visit(BinaryOperation* a) {
+    this->check_node(a->left.get());
+    this->check_node(a->right.get());
+    this->handled = true;
+  }
+
+  virtual void visit(TernaryOperation* a) {
+    this->check_node(a->left.get());
+    this->check_node(a->center.get());
+    this->check_node(a->right.get());
+    this->handled = true;
+  }
+
+  virtual void visit(VariableLookup* a) {
+    for (const auto& arg : this->fn->args) {
+      if (arg.name == a->name) {
+        this->handled = true;
+        break;
+      }
+    }
+  }
+
+  virtual void visit(AttributeLookup* a) {
+    if (a->base.get() && a->base_module_name.empty()) {
+      this->check_node(a->base.get());
+      this->handled = true;
+    }
+  }
+
+  virtual void visit(IntegerConstant* a) {
+    this->handled = this->constant = true;
+  }
+
+  virtual void visit(FloatConstant* a) {
+    this->handled = this->constant = true;
+  }
+
+  virtual void visit(BytesConstant* a) {
+    this->handled = this->constant = true;
+  }
+
+  virtual void visit(UnicodeConstant* a) {
+    this->handled = this->constant = true;
+  }
+
+  virtual void visit(TrueConstant* a) {
+    this->handled = this->constant = true;
+  }
+
+  virtual void visit(FalseConstant* a) {
+    this->handled = this->constant = true;
+  }
+
+  virtual void visit(NoneConstant* a) {
+    this->handled = this->constant = true;
+  }
+
+  Expression* expression; // NULL if the function can't be inlined
+
+private:
+  const FunctionContext* fn;
+  size_t node_count;
+  bool inlinable;
+  bool handled;
+  bool constant;
+
+  Expression* statement_value;
+  bool statement_is_return;
+
+  void check_expression(Expression* expr) {
+    this->check_node(expr);
+    if (this->inlinable && (this->node_count <= max_inlined_expression_nodes)) {
+      this->expression = expr;
+    }
+  }
+
+  void check_node(Expression* a) {
+    this->node_count++;
+    this->handled = false;
+    a->accept(this);
+    if (!this->handled) {
+      this->inlinable = false;
+    }
+  }
+};
+
+static Expression* inlinable_expression_for_function(FunctionContext* fn) {
+  if (!fn->ast_root || fn->is_class_init() || fn->pass_exception_block ||
+      !fn->varargs_name.empty() || !fn->varkwargs_name.empty()) {
+    return NULL;
+  }
+
+  InlinableExpressionVisitor v(fn);
+  fn->ast_root->accept(&v);
+  return v.expression;
+}
+
+// gets the value of an expression that's an integer constant, possibly with a
+// sign (e.g. the step in range(10, 0, -1))
+class IntegerConstantVisitor : public ASTVisitor {
+public:
+  IntegerConstantVisitor() : is_constant(false), value(0) { }
+  ~IntegerConstantVisitor() = default;
+
+  using ASTVisitor::visit;
+
+  virtual void visit(UnaryOperation* a) {
+    if ((a->oper == UnaryOperator::Positive) ||
+        (a->oper == UnaryOperator::Negative)) {
+      a->expr->accept(this);
+      if (a->oper == UnaryOperator::Negative) {
+        this->value = -static_cast<uint64_t>(this->value);
+      }
+    }
+  }
+
+  virtual void visit(IntegerConstant* a) {
+    this->is_constant = true;
+    this->value = a->value;
+  }
+
+  bool is_constant;
+  int64_t value;
+};
+
+// finds the variable lookup that an expression consists of, if any. if
+// instance_pointer is true, finds the base of an attribute lookup instead
+// (this is the instance pointer for a method call like `x.f()`)
+class VariableLookupVisitor : public ASTVisitor {
+public:
+  VariableLookupVisitor(bool instance_pointer) : lookup(NULL),
+      instance_pointer(instance_pointer) { }
+  ~VariableLookupVisitor() = default;
+
+  using ASTVisitor::visit;
+
+  virtual void visit(VariableLookup* a) {
+    if (!this->instance_pointer) {
+      this->lookup = a;
+    }
+  }
+
+  virtual void visit(AttributeLookup* a) {
+    if (this->instance_pointer && a->base.get() && a->base_module_name.empty()) {
+      this->instance_pointer = false;
+      a->base->accept(this);
+    }
+  }
+
+  VariableLookup* lookup;
+
+private:
+  bool instance_pointer;
+};
+
+// if a statement assigns a class construction directly to a local, finds the
+// local's name and the construction
+class LocalConstructionVisitor : public ASTVisitor {
+public:
+  LocalConstructionVisitor() : local_name(NULL), construction(NULL) { }
+  ~LocalConstructionVisitor() = default;
+
+  using ASTVisitor::visit;
+
+  virtual void visit(AttributeLValueReference* a) {
+    if (!a->base.get()) {
+      this->local_name = &a->name;
+    }
+  }
+
+  virtual void visit(FunctionCall* a) {
+    if (a->is_class_construction) {
+      this->construction = a;
+    }
+  }
+
+  const string* local_name;
+  FunctionCall* construction;
+};
+
+// finds the names in a function whose values may escape it. a name doesn't
+// escape if it's only used as the base of attribute reads and writes (method
+// calls pass the instance to the method, so they count as escapes). names that
+// are assigned class constructions are collected separately from names that
+// are assigned anything else, and a construction's arguments can't use the
+// name it's being assigned to, since the new instance replaces the old one
+// before the arguments are evaluated (see CompilationVisitor::visit
+// (AssignmentStatement))
+class EscapeAnalysisVisitor : public RecursiveASTVisitor {
+public:
+  EscapeAnalysisVisitor(int64_t function_id) : function_id(function_id),
+      constructing_name(NULL) { }
+  ~EscapeAnalysisVisitor() = default;
+
+  using RecursiveASTVisitor::visit;
+
+  virtual void visit(VariableLookup* a) {
+    this->escaped_names.emplace(a->name);
+  }
+
+  virtual void visit(AttributeLookup* a) {
+    VariableLookupVisitor v(false);
+    a->base->accept(&v);
+    if (!v.lookup) {
+      a->base->accept(this);
+    } else if (this->constructing_name &&
+        (v.lookup->name == *this->constructing_name)) {
+      this->escaped_names.emplace(v.lookup->name);
+    }
+  }
+
+  virtual void visit(AttributeLValueReference* a) {
+    if (!a->base.get()) {
+      this->assigned_names.emplace(a->name);
+      return;
+    }
+    VariableLookupVisitor v(false);
+    a->base->accept(&v);
+    if (!v.lookup) {
+      a->base->accept(this);
+    }
+  }
+
+  virtual void visit(FunctionCall* a) {
+    VariableLookupVisitor v(true);
+    a->function->accept(&v);
+    if (v.lookup) {
+      this->escaped_names.emplace(v.lookup->name);
+    }
+    this->RecursiveASTVisitor::visit(a);
+    for (const auto& it : a->kwargs) {
+      it.second->accept(this);
+    }
+    if (a->varargs.get()) {
+      a->varargs->accept(this);
+    }
+    if (a->varkwargs.get()) {
+      a->varkwargs->accept(this);
+    }
+  }
+
+  virtual void visit(AssignmentStatement* a) {
+    LocalConstructionVisitor v;
+    a->target->accept(&v);
+    a->value->accept(&v);
+    if (!v.local_name || !v.construction) {
+      this->RecursiveASTVisitor::visit(a);
+      return;
+    }
+
+    this->constructions.emplace_back(a, v.construction);
+    this->constructing_name = v.local_name;
+    a->value->accept(this);
+    this->constructing_name = NULL;
+  }
+
+  virtual void visit(ImportStatement* a) {
+    for (const auto& it : a->modules) {
+      this->assigned_names.emplace(it.second);
+    }
+    for (const auto& it : a->names) {
+      this->assigned_names.emplace(it.second);
+    }
+  }
+
+  virtual void visit(ExceptStatement* a) {
+    if (!a->name.empty()) {
+      this->assigned_names.emplace(a->name);
+    }
+    this->RecursiveASTVisitor::visit(a);
+  }
+
+  virtual void visit(WithStatement* a) {
+    for (const auto& it : a->item_to_name) {
+      if (!it.second.empty()) {
+        this->assigned_names.emplace(it.second);
+      }
+    }
+    this->RecursiveASTVisitor::visit(a);
+  }
+
+  virtual void visit(LambdaDefinition* a) {
+    if (a->function_id == this->function_id) {
+      this->RecursiveASTVisitor::visit(a);
+    }
+  }
+
+  virtual void visit(FunctionDefinition* a) {
+    if (a->function_id == this->function_id) {
+      this->RecursiveASTVisitor::visit(a);
+    } else {
+      this->assigned_names.emplace(a->name);
+    }
+  }
+
+  virtual void visit(ClassDefinition* a) {
+    this->assigned_names.emplace(a->name);
+  }
+
+  unordered_set<string> escaped_names;
+  unordered_set<string> assigned_names; // assigned something other than a construction
+  vector<pair<AssignmentStatement*, FunctionCall*>> constructions;
+
+private:
+  int64_t function_id;
+  const string* constructing_name;
+};
+
+// instances of a class can live in a function's stack frame if destroying them
+// doesn't do anything except release their memory (they have no __del__ and no
+// attributes with refcounts), and __init__ doesn't let self escape
+static bool class_can_be_stack_allocated(GlobalContext* global,
+    int64_t class_id) {
+  auto* cls = global->context_for_class(class_id);
+  if (!cls || cls->attribute_indexes.count("__del__")) {
+    return false;
+  }
+  for (const auto& attr : cls->attributes) {
+    if (type_has_refcount(attr.value.type)) {
+      return false;
+    }
+  }
+
+  auto* init = global->context_for_function(class_id);
+  if (!init || !init->ast_root || init->args.empty()) {
+    return false;
+  }
+  EscapeAnalysisVisitor v(init->id);
+  init->ast_root->accept(&v);
+  const string& self_name = init->args[0].name;
+  return !v.escaped_names.count(self_name) &&
+      !v.assigned_names.count(self_name);
+}
+
 
 
 CompilationVisitor::terminated_by_split::terminated_by_split(
@@ -52,13 +605,20 @@ CompilationVisitor::terminated_by_split::terminated_by_split(
 
 
 CompilationVisitor::CompilationVisitor(GlobalContext* global,
-    ModuleContext* module, Fragment* fragment) : file_offset(-1),
+    ModuleContext* module, Fragment* fragment, bool record_relocations) :
+    file_offset(-1),
     global(global), module(module), fragment(fragment),
     available_int_registers(default_available_int_registers),
     available_float_registers(default_available_float_registers),
     target_register(rax), float_target_register(xmm0), stack_bytes_used(0),
+    local_int_registers(0), local_float_registers(0),
+    local_registers_synced_for_exceptions(false),
+    function_body_stack_bytes_used(0), stack_instance_bytes(0),
     holding_reference(false), evaluating_instance_pointer(false),
-    in_finally_block(false) {
+    in_finally_block(false), branch_false_label(NULL), branch_fused(false),
+    record_relocations(record_relocations), global_side_effects(false),
+    elided_null_check_count(0), fused_branch_count(0), inlined_call_count(0),
+    elided_refcount_pair_count(0) {
 
   if (this->fragment->function) {
     if (this->fragment->function->args.size() != this->fragment->arg_types.size()) {
@@ -76,6 +636,15 @@ CompilationVisitor::CompilationVisitor(GlobalContext* global,
       this->local_variable_types.emplace(it.first, it.second);
     }
 
+    // pick the locals that will live in registers. this only depends on the
+    // AST and the fragment's argument types, so recompiling a fragment after a
+    // split always produces the same assignment
+    this->allocate_local_registers();
+    this->allocate_stack_instances();
+
+    this->fragment->osr_entry_labels.clear();
+    this->fragment->osr_entry_offsets.clear();
+
     // clear the split labels and offsets
     this->fragment->call_split_offsets.resize(this->fragment->function->num_splits);
     this->fragment->call_split_labels.resize(this->fragment->function->num_splits);
@@ -102,6 +671,49 @@ size_t CompilationVisitor::get_file_offset() const {
   return this->file_offset;
 }
 
+vector<CodeRelocation>& CompilationVisitor::relocations() {
+  return this->recorded_relocations;
+}
+
+const vector<string>& CompilationVisitor::imported_module_names() const {
+  return this->recorded_imported_module_names;
+}
+
+unordered_set<const void*>& CompilationVisitor::called_fragment_code() {
+  return this->recorded_called_fragment_code;
+}
+
+unordered_set<int64_t>& CompilationVisitor::created_callsite_tokens() {
+  return this->recorded_callsite_tokens;
+}
+
+bool CompilationVisitor::has_global_side_effects() const {
+  return this->global_side_effects;
+}
+
+size_t CompilationVisitor::get_elided_null_check_count() const {
+  return this->elided_null_check_count;
+}
+
+size_t CompilationVisitor::get_fused_branch_count() const {
+  return this->fused_branch_count;
+}
+
+size_t CompilationVisitor::get_inlined_call_count() const {
+  return this->inlined_call_count;
+}
+
+size_t CompilationVisitor::get_elided_refcount_pair_count() const {
+  return this->elided_refcount_pair_count;
+}
+
+size_t CompilationVisitor::get_stack_instance_count() const {
+  return this->stack_instance_locals.size();
+}
+
+CompilationVisitor::InlinedArgument::InlinedArgument(const Value& type,
+    int64_t stack_bytes_used) : type(type), stack_bytes_used(stack_bytes_used) { }
+
 
 
 CompilationVisitor::VariableLocation::VariableLocation() :
@@ -151,9 +763,11 @@ void CompilationVisitor::release_register(Register which, bool float_register) {
 
 void CompilationVisitor::release_all_registers(bool float_registers) {
   if (float_registers) {
-    this->available_float_registers = default_available_float_registers;
+    this->available_float_registers = default_available_float_registers &
+        ~this->local_float_registers;
   } else {
-    this->available_int_registers = default_available_int_registers;
+    this->available_int_registers = default_available_int_registers &
+        ~this->local_int_registers;
   }
 }
 
@@ -205,12 +819,19 @@ Register CompilationVisitor::available_register_except(
 }
 
 int64_t CompilationVisitor::write_push_reserved_registers() {
+  // registers holding locals are never reserved as temps; they're saved by
+  // write_spill_local_registers instead
+  int32_t temp_int_registers = default_available_int_registers &
+      ~this->local_int_registers;
+  int32_t temp_float_registers = default_available_float_registers &
+      ~this->local_float_registers;
+
   // push int registers
   Register which;
   for (which = Register::RAX; // = 0
       static_cast<int64_t>(which) < Register::Count;
        which = static_cast<Register>(static_cast<int64_t>(which) + 1)) {
-    if (!(default_available_int_registers & (1 << which))) {
+    if (!(temp_int_registers & (1 << which))) {
       continue; // this register isn't used by CompilationVisitor
     }
     if (this->available_int_registers & (1 << which)) {
@@ -224,7 +845,7 @@ int64_t CompilationVisitor::write_push_reserved_registers() {
   for (which = Register::XMM0; // = 0
       static_cast<int64_t>(which) < Register::Count;
        which = static_cast<Register>(static_cast<int64_t>(which) + 1)) {
-    if (!(default_available_float_registers & (1 << which))) {
+    if (!(temp_float_registers & (1 << which))) {
       continue; // this register isn't used by CompilationVisitor
     }
     if (this->available_float_registers & (1 << which)) {
@@ -238,14 +859,18 @@ int64_t CompilationVisitor::write_push_reserved_registers() {
 
   // reset the available flags and return the old flags
   int64_t ret = this->available_registers;
-  this->available_int_registers = default_available_int_registers;
-  this->available_float_registers = default_available_float_registers;
+  this->available_int_registers = temp_int_registers;
+  this->available_float_registers = temp_float_registers;
   return ret;
 }
 
 void CompilationVisitor::write_pop_reserved_registers(int64_t mask) {
-  if ((this->available_int_registers != default_available_int_registers) ||
-      (this->available_float_registers != default_available_float_registers)) {
+  int32_t temp_int_registers = default_available_int_registers &
+      ~this->local_int_registers;
+  int32_t temp_float_registers = default_available_float_registers &
+      ~this->local_float_registers;
+  if ((this->available_int_registers != temp_int_registers) ||
+      (this->available_float_registers != temp_float_registers)) {
     throw compile_error("some registers were not released when reserved were popped", this->file_offset);
   }
 
@@ -255,7 +880,7 @@ void CompilationVisitor::write_pop_reserved_registers(int64_t mask) {
   for (which = Register::XMM15;
       static_cast<int64_t>(which) > Register::None;
        which = static_cast<Register>(static_cast<int64_t>(which) - 1)) {
-    if (!(default_available_float_registers & (1 << which))) {
+    if (!(temp_float_registers & (1 << which))) {
       continue; // this register isn't used by CompilationVisitor
     }
     if (this->available_float_registers & (1 << which)) {
@@ -269,7 +894,7 @@ void CompilationVisitor::write_pop_reserved_registers(int64_t mask) {
   for (which = Register::R15;
       static_cast<int64_t>(which) > Register::None;
        which = static_cast<Register>(static_cast<int64_t>(which) - 1)) {
-    if (!(default_available_int_registers & (1 << which))) {
+    if (!(temp_int_registers & (1 << which))) {
       continue; // this register isn't used by CompilationVisitor
     }
     if (this->available_int_registers & (1 << which)) {
@@ -282,6 +907,178 @@ void CompilationVisitor::write_pop_reserved_registers(int64_t mask) {
 
 
 
+void CompilationVisitor::allocate_local_registers() {
+  // module root scopes have no locals (everything is global)
+  FunctionContext* fn = this->fragment->function;
+  if (!fn || !fn->ast_root) {
+    return;
+  }
+
+  LocalUsageVisitor v(this->global, fn->id);
+  fn->ast_root->accept(&v);
+  this->local_registers_synced_for_exceptions = v.has_try;
+
+  // order the candidates by weighted use count. ties are broken by name so the
+  // assignment is deterministic
+  vector<pair<int64_t, string>> candidates;
+  for (const auto& it : v.name_to_weight) {
+    if (!fn->locals.count(it.first) || v.excluded_names.count(it.first)) {
+      continue;
+    }
+    ValueType type = this->local_variable_types.at(it.first).type;
+    if ((type != ValueType::Int) && (type != ValueType::Float) &&
+        (type != ValueType::Bool)) {
+      continue;
+    }
+    candidates.emplace_back(-it.second, it.first);
+  }
+  sort(candidates.begin(), candidates.end());
+
+  vector<Register> int_registers;
+  for (Register reg : local_int_register_order) {
+    if ((reg == rbx) && v.uses_rbx) {
+      continue;
+    }
+    if ((reg != rbx) &&
+        (v.max_call_arg_count >= int_argument_register_order.size())) {
+      continue;
+    }
+    int_registers.emplace_back(reg);
+  }
+
+  size_t int_registers_used = 0, float_registers_used = 0;
+  for (const auto& it : candidates) {
+    const string& name = it.second;
+    if (this->local_variable_types.at(name).type == ValueType::Float) {
+      if (float_registers_used < local_float_register_order.size()) {
+        Register reg = local_float_register_order[float_registers_used++];
+        this->local_registers.emplace(name, reg);
+        this->local_float_registers |= (1 << reg);
+      }
+    } else if (int_registers_used < int_registers.size()) {
+      Register reg = int_registers[int_registers_used++];
+      this->local_registers.emplace(name, reg);
+      this->local_int_registers |= (1 << reg);
+    }
+  }
+
+  this->available_int_registers &= ~this->local_int_registers;
+  this->available_float_registers &= ~this->local_float_registers;
+
+  if (debug_flags & DebugFlag::ShowCompileDebug) {
+    for (const auto& it : this->local_registers) {
+      fprintf(stderr, "[%s:%zu] local %s is in register %s\n",
+          fn->name.c_str(), this->fragment->index, it.first.c_str(),
+          name_for_register(it.second));
+    }
+  }
+}
+
+void CompilationVisitor::allocate_stack_instances() {
+  FunctionContext* fn = this->fragment->function;
+  if (!fn || !fn->ast_root || (debug_flags & DebugFlag::NoEscapeAnalysis)) {
+    return;
+  }
+
+  EscapeAnalysisVisitor v(fn->id);
+  fn->ast_root->accept(&v);
+
+  // group the constructions by local. this is ordered by name so the frame
+  // layout is deterministic (like allocate_local_registers, this only depends
+  // on the AST and the argument types)
+  map<string, vector<pair<AssignmentStatement*, FunctionCall*>>> name_to_constructions;
+  for (const auto& it : v.constructions) {
+    LocalConstructionVisitor target_v;
+    it.first->target->accept(&target_v);
+    name_to_constructions[*target_v.local_name].emplace_back(it);
+  }
+
+  unordered_set<string> arg_names;
+  for (const auto& arg : fn->args) {
+    arg_names.emplace(arg.name);
+  }
+
+  // instances go below the locals and the saved rbx, if any
+  ssize_t frame_bytes = sizeof(int64_t) * (fn->locals.size() +
+      ((this->local_int_registers & (1 << rbx)) ? 1 : 0));
+  for (const auto& it : name_to_constructions) {
+    const string& name = it.first;
+    if (!fn->locals.count(name) || arg_names.count(name) ||
+        v.escaped_names.count(name) || v.assigned_names.count(name)) {
+      continue;
+    }
+    const Value& type = this->local_variable_types.at(name);
+    if ((type.type != ValueType::Instance) ||
+        !class_can_be_stack_allocated(this->global, type.class_id)) {
+      continue;
+    }
+    bool all_same_class = true;
+    for (const auto& construction : it.second) {
+      if (construction.second->callee_function_id != type.class_id) {
+        all_same_class = false;
+      }
+    }
+    if (!all_same_class) {
+      continue;
+    }
+
+    auto* cls = this->global->context_for_class(type.class_id);
+    this->stack_instance_bytes += cls->instance_size();
+    ssize_t offset = -(frame_bytes + this->stack_instance_bytes);
+    this->stack_instance_locals.emplace(name, offset);
+    for (const auto& construction : it.second) {
+      this->stack_instance_assignments.emplace(construction.first, name);
+      this->stack_instance_offsets.emplace(construction.second, offset);
+    }
+
+    if (debug_flags & DebugFlag::ShowCompileDebug) {
+      fprintf(stderr, "[%s:%zu] instances of %s in local %s are in the stack frame\n",
+          fn->name.c_str(), this->fragment->index, cls->name.c_str(),
+          name.c_str());
+    }
+  }
+}
+
+void CompilationVisitor::write_spill_local_registers(bool for_call) {
+  // before a call, locals in caller-save registers must be saved since the
+  // callee may clobber them. locals in callee-save registers only need to be
+  // saved if an except block in this function might read them
+  if (!for_call && !this->local_registers_synced_for_exceptions) {
+    return;
+  }
+
+  for (const auto& it : this->local_registers) {
+    if ((it.second == rbx) && !this->local_registers_synced_for_exceptions) {
+      continue;
+    }
+    MemoryReference slot = this->stack_slot_for_local(it.first);
+    if (this->local_float_registers & (1 << it.second)) {
+      this->as.write_movsd(slot, MemoryReference(it.second));
+    } else {
+      this->as.write_mov(slot, MemoryReference(it.second));
+    }
+  }
+}
+
+void CompilationVisitor::write_reload_local_registers(bool after_call) {
+  // after a call, only caller-save registers need to be reloaded. at the
+  // beginning of an except or finally block, everything must be reloaded since
+  // we may have come from anywhere
+  for (const auto& it : this->local_registers) {
+    if (after_call && (it.second == rbx)) {
+      continue;
+    }
+    MemoryReference slot = this->stack_slot_for_local(it.first);
+    if (this->local_float_registers & (1 << it.second)) {
+      this->as.write_movsd(MemoryReference(it.second), slot);
+    } else {
+      this->as.write_mov(MemoryReference(it.second), slot);
+    }
+  }
+}
+
+
+
 void CompilationVisitor::visit(UnaryOperation* a) {
   this->file_offset = a->file_offset;
   this->assert_not_evaluating_instance_pointer();
@@ -412,6 +1209,26 @@ bool CompilationVisitor::is_always_falsey(const Value& type) {
   return (type.type == ValueType::None);
 }
 
+void CompilationVisitor::write_condition_check(Expression* condition,
+    const string& false_label) {
+  // only a comparison at the top of the condition can branch by itself; its
+  // operands can't, since their results are used for something else
+  this->branch_false_label = NULL;
+  this->branch_fused = false;
+  if (!(debug_flags & DebugFlag::NoPeephole) &&
+      dynamic_cast<BinaryOperation*>(condition)) {
+    this->branch_false_label = &false_label;
+  }
+  condition->accept(this);
+  this->branch_false_label = NULL;
+
+  if (!this->branch_fused) {
+    this->write_current_truth_value_test();
+    this->as.write_jz(false_label);
+  }
+  this->branch_fused = false;
+}
+
 void CompilationVisitor::write_current_truth_value_test() {
 
   MemoryReference target_mem((this->current_type.type == ValueType::Float) ?
@@ -469,6 +1286,11 @@ void CompilationVisitor::visit(BinaryOperation* a) {
   this->file_offset = a->file_offset;
   this->assert_not_evaluating_instance_pointer();
 
+  // if this is an if/while condition, it may be able to jump to the false
+  // label itself (see write_condition_check). the operands can't
+  const string* branch_false_label = this->branch_false_label;
+  this->branch_false_label = NULL;
+
   MemoryReference target_mem(this->target_register);
   MemoryReference float_target_mem(this->float_target_register);
 
@@ -544,7 +1366,10 @@ void CompilationVisitor::visit(BinaryOperation* a) {
   // out a way to implement this without using memory access
   // TODO: delete the held reference to left if right raises
   this->as.write_label(string_printf("__BinaryOperation_%p_evaluate_left", a));
-  a->left->accept(this);
+  bool left_borrowed = this->write_borrowed_read(a->left.get());
+  if (!left_borrowed) {
+    a->left->accept(this);
+  }
   Value left_type = move(this->current_type);
   if (left_type.type == ValueType::Float) {
     this->as.write_movq_from_xmm(target_mem, this->float_target_register);
@@ -552,14 +1377,18 @@ void CompilationVisitor::visit(BinaryOperation* a) {
 
   this->write_push(this->target_register); // so right doesn't clobber it
   bool left_holding_reference = type_has_refcount(this->current_type.type);
-  if (left_holding_reference && !this->holding_reference) {
+  if (left_holding_reference && !left_borrowed && !this->holding_reference) {
     throw compile_error("non-held reference to left binary operator argument",
         this->file_offset);
   }
 
   this->as.write_label(string_printf("__BinaryOperation_%p_evaluate_right", a));
+  bool right_borrowed = false;
   try {
-    a->right->accept(this);
+    right_borrowed = this->write_borrowed_read(a->right.get());
+    if (!right_borrowed) {
+      a->right->accept(this);
+    }
   } catch (const terminated_by_split& e) {
     // TODO: delete reference to right if needed
     this->adjust_stack(8);
@@ -571,7 +1400,7 @@ void CompilationVisitor::visit(BinaryOperation* a) {
   }
   this->write_push(this->target_register); // for the destructor call later
   bool right_holding_reference = type_has_refcount(this->current_type.type);
-  if (right_holding_reference && !this->holding_reference) {
+  if (right_holding_reference && !right_borrowed && !this->holding_reference) {
     throw compile_error("non-held reference to right binary operator argument",
         this->file_offset);
   }
@@ -617,8 +1446,36 @@ void CompilationVisitor::visit(BinaryOperation* a) {
         MemoryReference xmm_mem(xmm);
         this->as.write_xor(target_mem, target_mem);
 
+        // Int vs Int, used only by a branch: compare and jump directly. the
+        // operands are loaded before they're removed from the stack, since
+        // adjusting rsp changes the flags
+        if (left_int && right_int && branch_false_label) {
+          this->as.write_mov(temp_mem, left_mem);
+          this->as.write_mov(target_mem, right_mem);
+          this->adjust_stack(0x10);
+          this->as.write_cmp(temp_mem, target_mem);
+          if (a->oper == BinaryOperator::LessThan) {
+            this->as.write_jge(*branch_false_label);
+          } else if (a->oper == BinaryOperator::GreaterThan) {
+            this->as.write_jle(*branch_false_label);
+          } else if (a->oper == BinaryOperator::LessOrEqual) {
+            this->as.write_jg(*branch_false_label);
+          } else if (a->oper == BinaryOperator::GreaterOrEqual) {
+            this->as.write_jl(*branch_false_label);
+          } else if (a->oper == BinaryOperator::Equality) {
+            this->as.write_jne(*branch_false_label);
+          } else if (a->oper == BinaryOperator::NotEqual) {
+            this->as.write_je(*branch_false_label);
+          }
+          this->branch_fused = true;
+          this->fused_branch_count++;
+          this->current_type = Value(ValueType::Bool);
+          this->holding_reference = false;
+          this->as.write_label(string_printf("__BinaryOperation_%p_complete", a));
+          return;
+
         // Int vs Int
-        if (left_int && right_int) {
+        } else if (left_int && right_int) {
           this->as.write_mov(temp_mem, left_mem);
           this->as.write_cmp(temp_mem, right_mem);
           target_mem.base_register = byte_register_for_register(target_mem.base_register);
@@ -1136,19 +1993,23 @@ void CompilationVisitor::visit(BinaryOperation* a) {
 
   this->as.write_label(string_printf("__BinaryOperation_%p_cleanup", a));
 
-  // if either value requires destruction, do so now
-  if (left_holding_reference || right_holding_reference) {
+  // if either value requires destruction, do so now. borrowed values don't
+  bool destroy_left = left_holding_reference && !left_borrowed;
+  bool destroy_right = right_holding_reference && !right_borrowed;
+  if (destroy_left || destroy_right) {
     // save the return value before destroying the temp values
     this->write_push(this->target_register);
 
     // destroy the temp values
-    if (type_has_refcount(left_type.type)) {
+    if (destroy_left) {
       this->as.write_label(string_printf("__BinaryOperation_%p_destroy_left", a));
-      this->write_delete_reference(MemoryReference(rsp, 8), left_type.type);
+      this->write_delete_reference(MemoryReference(rsp, 8), left_type.type,
+          true);
     }
-    if (type_has_refcount(right_type.type)) {
+    if (destroy_right) {
       this->as.write_label(string_printf("__BinaryOperation_%p_destroy_right", a));
-      this->write_delete_reference(MemoryReference(rsp, 16), right_type.type);
+      this->write_delete_reference(MemoryReference(rsp, 16), right_type.type,
+          true);
     }
 
     // load the result again and clean up the stack
@@ -1464,7 +2325,9 @@ void CompilationVisitor::visit(LambdaDefinition* a) {
     // variables don't point directly to the code; this is necessary for us to
     // figure out the right fragment at call time
     auto* declared_function_context = this->global->context_for_function(a->function_id);
-    this->as.write_mov(this->target_register, reinterpret_cast<int64_t>(declared_function_context));
+    this->as.write_mov(this->target_register, this->relocatable_immediate(
+        CodeRelocation::Type::FunctionContext,
+        reinterpret_cast<int64_t>(declared_function_context), a->function_id));
     this->current_type = Value(ValueType::Function, a->function_id);
     return;
   }
@@ -1479,7 +2342,7 @@ void CompilationVisitor::visit(LambdaDefinition* a) {
   this->write_function_cleanup(base_label, false);
 }
 
-struct FunctionCallArgumentValue {
+struct CompilationVisitor::FunctionCallArgumentValue {
   string name;
   shared_ptr<Expression> passed_value;
   Value default_value; // Indeterminate for positional args
@@ -1496,6 +2359,266 @@ struct FunctionCallArgumentValue {
       is_exception_block(false), evaluate_instance_pointer(false) { }
 };
 
+void CompilationVisitor::write_evaluate_function_call_argument(
+    FunctionCall* a, FunctionContext* fn, FunctionCallArgumentValue& arg,
+    size_t arg_index) {
+  // if the argument has a passed value, generate code to compute it
+  if (arg.passed_value.get()) {
+    // if this argument is `self`, then it actually comes from the function
+    // expression (and we evaluate the instance pointer there instead)
+    if (arg.evaluate_instance_pointer) {
+      this->as.write_label(string_printf("__FunctionCall_%p_get_instance_pointer", a));
+      if (this->evaluating_instance_pointer) {
+        throw compile_error("recursive instance pointer evaluation", this->file_offset);
+      }
+      this->evaluating_instance_pointer = true;
+      a->function->accept(this);
+      if (this->evaluating_instance_pointer) {
+        throw compile_error("instance pointer evaluation failed", this->file_offset);
+      }
+      if (!type_has_refcount(this->current_type.type)) {
+        throw compile_error("instance pointer evaluation resulted in " + this->current_type.str(),
+            this->file_offset);
+      }
+      arg.type = move(this->current_type);
+
+    } else {
+      this->as.write_label(string_printf("__FunctionCall_%p_evaluate_arg_%zu_passed_value",
+          a, arg_index));
+      arg.passed_value->accept(this);
+      arg.type = move(this->current_type);
+    }
+
+  // if the argument is the instance object, figure out what it is
+  } else if (fn->is_class_init() && (arg_index == 0)) {
+    if (arg.default_value.type != ValueType::Instance) {
+      throw compile_error("first argument to class constructor is not an instance", this->file_offset);
+    }
+
+    auto* cls = this->global->context_for_class(fn->id);
+    if (!cls) {
+      throw compile_error("__init__ call does not have an associated class", this->file_offset);
+    }
+
+    this->as.write_label(string_printf("__FunctionCall_%p_evaluate_arg_%zu_alloc_instance",
+        a, arg_index));
+    auto stack_offset_it = this->stack_instance_offsets.find(a);
+    if (stack_offset_it != this->stack_instance_offsets.end()) {
+      this->write_init_stack_class_instance(cls->id, stack_offset_it->second);
+    } else {
+      this->write_alloc_class_instance(cls->id);
+    }
+
+    arg.type = arg.default_value;
+    this->current_type = Value(ValueType::Instance, cls->id, NULL);
+    this->holding_reference = true;
+
+  // if the argument is the exception block, copy it from r14
+  } else if (arg.is_exception_block) {
+    this->as.write_label(string_printf("__FunctionCall_%p_evaluate_arg_%zu_exception_block",
+        a, arg_index));
+    this->as.write_mov(MemoryReference(this->target_register), r14);
+
+  } else {
+    this->as.write_label(string_printf("__FunctionCall_%p_evaluate_arg_%zu_default_value",
+        a, arg_index));
+    if (!arg.default_value.value_known) {
+      throw compile_error(string_printf(
+          "required function argument %zu (%s) does not have a value",
+          arg_index, arg.name.c_str()), this->file_offset);
+    }
+    this->write_code_for_value(arg.default_value);
+    arg.type = arg.default_value;
+  }
+
+  // bugcheck: if the value has a refcount, we had better be holding a
+  // reference to it
+  if (type_has_refcount(arg.type.type) && !this->holding_reference) {
+    string s = arg.type.str();
+    throw compile_error(string_printf(
+        "function call argument %zu (%s) is a non-held reference", arg_index, s.c_str()),
+        this->file_offset);
+  }
+}
+
+void CompilationVisitor::check_call_argument_annotations(FunctionContext* fn,
+    const vector<Value>& arg_types) {
+  vector<Value> types_from_annotation;
+  for (const auto& arg : fn->args) {
+    if (arg.type_annotation.get()) {
+      types_from_annotation.emplace_back(this->global->type_for_annotation(
+          this->module, arg.type_annotation));
+    } else {
+      types_from_annotation.emplace_back(ValueType::Indeterminate);
+    }
+  }
+  if (this->global->match_values_to_types(types_from_annotation, arg_types) < 0) {
+    throw compile_error("call argument does not match type annotation", this->file_offset);
+  }
+}
+
+void CompilationVisitor::write_inlined_function_call(FunctionCall* a,
+    FunctionContext* fn, vector<FunctionCallArgumentValue>& arg_values,
+    Expression* expr) {
+  // evaluate the arguments in order and push them. the callee's expression
+  // reads them from these stack slots (see location_for_variable), so they
+  // don't tie up any registers while it's evaluated. arguments that are the
+  // caller's locals don't need references, since the locals can't change
+  // until the call is done
+  unordered_map<string, InlinedArgument> inlined_arguments;
+  vector<Value> arg_types;
+  vector<bool> arg_borrowed;
+  for (size_t arg_index = 0; arg_index < arg_values.size(); arg_index++) {
+    auto& arg = arg_values[arg_index];
+    if (arg.passed_value.get() && this->write_borrowed_read(
+        arg.evaluate_instance_pointer ? a->function.get() : arg.passed_value.get(),
+        arg.evaluate_instance_pointer)) {
+      arg.type = this->current_type;
+      arg_borrowed.emplace_back(true);
+    } else {
+      this->write_evaluate_function_call_argument(a, fn, arg, arg_index);
+      arg_borrowed.emplace_back(false);
+    }
+    if (arg.type.type == ValueType::Float) {
+      this->adjust_stack(-8);
+      this->as.write_movsd(MemoryReference(rsp, 0),
+          MemoryReference(this->float_target_register));
+    } else {
+      this->write_push(this->target_register);
+    }
+    inlined_arguments.emplace(arg.name,
+        InlinedArgument(arg.type, this->stack_bytes_used));
+    arg_types.emplace_back(arg.type);
+  }
+  this->check_call_argument_annotations(fn, arg_types);
+
+  // the callee would have deleted the references to its arguments; do that
+  // here instead. the pushed values are held references, so they can't be NULL
+  auto write_delete_argument_references = [&]() {
+    for (size_t arg_index = 0; arg_index < arg_values.size(); arg_index++) {
+      const auto& arg = arg_values[arg_index];
+      if (!type_has_refcount(arg.type.type) || arg_borrowed[arg_index]) {
+        continue;
+      }
+      const auto& inlined_arg = inlined_arguments.at(arg.name);
+      this->write_delete_reference(MemoryReference(rsp,
+          this->stack_bytes_used - inlined_arg.stack_bytes_used), arg.type.type,
+          true);
+    }
+  };
+
+  // if the expression raises, the held arguments still have to be released, so
+  // catch the exception, delete them, and continue unwinding
+  bool holding_arguments = false;
+  for (size_t arg_index = 0; arg_index < arg_values.size(); arg_index++) {
+    if (type_has_refcount(arg_values[arg_index].type.type) &&
+        !arg_borrowed[arg_index]) {
+      holding_arguments = true;
+    }
+  }
+  int64_t stack_bytes_used_on_restore = this->stack_bytes_used;
+  string exc_label = string_printf("__FunctionCall_%p_inline_exception", a);
+  if (holding_arguments) {
+    this->write_create_exception_block({}, exc_label);
+  }
+
+  // evaluate the callee's expression. it can't contain calls, so the only
+  // arguments visible while it's evaluated are this call's
+  this->as.write_label(string_printf("__FunctionCall_%p_inline_function_%" PRId64,
+      a, a->callee_function_id));
+  this->inlined_arguments.swap(inlined_arguments);
+  expr->accept(this);
+  this->inlined_arguments.swap(inlined_arguments);
+  this->file_offset = a->file_offset;
+
+  if (holding_arguments) {
+    string end_label = string_printf("__FunctionCall_%p_inline_no_exception", a);
+    this->as.write_mov(r14, MemoryReference(rsp, 0));
+    this->adjust_stack_to(stack_bytes_used_on_restore);
+    this->as.write_jmp(end_label);
+
+    // _unwind_exception_internal has already removed the exception block and
+    // restored rsp. locals in registers may have been clobbered by the code
+    // that raised, but their stack slots are up to date
+    Value result_type = move(this->current_type);
+    bool result_holding_reference = this->holding_reference;
+    this->as.write_label(exc_label);
+    this->write_reload_local_registers(false);
+    write_delete_argument_references();
+    this->adjust_stack(arg_values.size() * sizeof(int64_t));
+    this->as.write_jmp(common_object_reference(void_fn_ptr(&_unwind_exception_internal)));
+    this->adjust_stack_to(stack_bytes_used_on_restore, false);
+
+    this->as.write_label(end_label);
+    this->current_type = move(result_type);
+    this->holding_reference = result_holding_reference;
+  }
+
+  // the result is treated like a returned value from here on
+  if (type_has_refcount(this->current_type.type) && !this->holding_reference) {
+    throw compile_error("can\'t return reference to " + this->current_type.str(),
+        this->file_offset);
+  }
+  const Value& annotated_return_type = fn->annotated_return_type;
+  if ((annotated_return_type.type != ValueType::Indeterminate) &&
+      (this->global->match_value_to_type(annotated_return_type, this->current_type) < 0)) {
+    throw compile_error("returned value does not match type annotation", this->file_offset);
+  }
+
+  // release the arguments, then remove them from the stack
+  this->as.write_label(string_printf("__FunctionCall_%p_inline_cleanup", a));
+  Value return_type = move(this->current_type);
+  bool return_float = (return_type.type == ValueType::Float);
+  Register return_register = return_float ? this->float_target_register :
+      this->target_register;
+  this->reserve_register(return_register, return_float);
+  write_delete_argument_references();
+  this->release_register(return_register, return_float);
+  this->adjust_stack(arg_values.size() * sizeof(int64_t));
+
+  this->current_type = move(return_type);
+  this->holding_reference = type_has_refcount(this->current_type.type);
+  this->inlined_call_count++;
+}
+
+// returns the type that a new fragment of fn will probably return, or
+// Indeterminate if there's no good guess. if a callee fragment doesn't exist
+// yet, the caller can be compiled past the call using this type, and is only
+// recompiled if the fragment turns out to return something else
+static Value predicted_return_type_for_call(const FunctionContext* fn) {
+  if (fn->is_class_init()) {
+    return Value(ValueType::Instance, fn->id, nullptr);
+  }
+  if (fn->annotated_return_type.has_complete_type()) {
+    return fn->annotated_return_type.type_only();
+  }
+
+  // the analysis phase may have found that the function always returns the
+  // same type, regardless of its arguments' types
+  if ((fn->return_types.size() == 1) &&
+      fn->return_types.begin()->has_complete_type()) {
+    return fn->return_types.begin()->type_only();
+  }
+
+  // otherwise, guess that it returns what its other fragments return, if they
+  // all agree
+  Value ret;
+  for (const auto& fragment : fn->fragments) {
+    if (!fragment.compiled) {
+      continue;
+    }
+    if (!fragment.return_type.has_complete_type()) {
+      return Value();
+    }
+    if (ret.type == ValueType::Indeterminate) {
+      ret = fragment.return_type.type_only();
+    } else if (!ret.types_equal(fragment.return_type)) {
+      return Value();
+    }
+  }
+  return ret;
+}
+
 void CompilationVisitor::visit(FunctionCall* a) {
   this->file_offset = a->file_offset;
 
@@ -1632,6 +2755,17 @@ void CompilationVisitor::visit(FunctionCall* a) {
     arg_values.back().is_exception_block = true;
   }
 
+  // if the callee is small enough, compile its body here instead of calling it
+  if (!(debug_flags & DebugFlag::NoInlining) && (fn->module == this->module) &&
+      !this->inlined_function_ids.count(fn->id)) {
+    Expression* inlined_expr = inlinable_expression_for_function(fn);
+    if (inlined_expr) {
+      this->inlined_function_ids.emplace(fn->id);
+      this->write_inlined_function_call(a, fn, arg_values, inlined_expr);
+      return;
+    }
+  }
+
   // push all reserved registers and r13 if necessary
   int64_t previously_reserved_registers = this->write_push_reserved_registers();
   if (update_global_space_pointer) {
@@ -1666,80 +2800,7 @@ void CompilationVisitor::visit(FunctionCall* a) {
         this->float_target_register = float_argument_register_order[float_registers_used];
       }
 
-      // generate code for the argument's value
-
-      // if the argument has a passed value, generate code to compute it
-      if (arg.passed_value.get()) {
-        // if this argument is `self`, then it actually comes from the function
-        // expression (and we evaluate the instance pointer there instead)
-        if (arg.evaluate_instance_pointer) {
-          this->as.write_label(string_printf("__FunctionCall_%p_get_instance_pointer", a));
-          if (this->evaluating_instance_pointer) {
-            throw compile_error("recursive instance pointer evaluation", this->file_offset);
-          }
-          this->evaluating_instance_pointer = true;
-          a->function->accept(this);
-          if (this->evaluating_instance_pointer) {
-            throw compile_error("instance pointer evaluation failed", this->file_offset);
-          }
-          if (!type_has_refcount(this->current_type.type)) {
-            throw compile_error("instance pointer evaluation resulted in " + this->current_type.str(),
-                this->file_offset);
-          }
-          arg.type = move(this->current_type);
-
-        } else {
-          this->as.write_label(string_printf("__FunctionCall_%p_evaluate_arg_%zu_passed_value",
-              a, arg_index));
-          arg.passed_value->accept(this);
-          arg.type = move(this->current_type);
-        }
-
-      // if the argument is the instance object, figure out what it is
-      } else if (fn->is_class_init() && (arg_index == 0)) {
-        if (arg.default_value.type != ValueType::Instance) {
-          throw compile_error("first argument to class constructor is not an instance", this->file_offset);
-        }
-
-        auto* cls = this->global->context_for_class(fn->id);
-        if (!cls) {
-          throw compile_error("__init__ call does not have an associated class", this->file_offset);
-        }
-
-        this->as.write_label(string_printf("__FunctionCall_%p_evaluate_arg_%zu_alloc_instance",
-            a, arg_index));
-        this->write_alloc_class_instance(cls->id);
-
-        arg.type = arg.default_value;
-        this->current_type = Value(ValueType::Instance, cls->id, NULL);
-        this->holding_reference = true;
-
-      // if the argument is the exception block, copy it from r14
-      } else if (arg.is_exception_block) {
-        this->as.write_label(string_printf("__FunctionCall_%p_evaluate_arg_%zu_exception_block",
-            a, arg_index));
-        this->as.write_mov(MemoryReference(this->target_register), r14);
-
-      } else {
-        this->as.write_label(string_printf("__FunctionCall_%p_evaluate_arg_%zu_default_value",
-            a, arg_index));
-        if (!arg.default_value.value_known) {
-          throw compile_error(string_printf(
-              "required function argument %zu (%s) does not have a value",
-              arg_index, arg.name.c_str()), this->file_offset);
-        }
-        this->write_code_for_value(arg.default_value);
-        arg.type = arg.default_value;
-      }
-
-      // bugcheck: if the value has a refcount, we had better be holding a
-      // reference to it
-      if (type_has_refcount(arg.type.type) && !this->holding_reference) {
-        string s = arg.type.str();
-        throw compile_error(string_printf(
-            "function call argument %zu (%s) is a non-held reference", arg_index, s.c_str()),
-            this->file_offset);
-      }
+      this->write_evaluate_function_call_argument(a, fn, arg, arg_index);
 
       // store the value on the stack if needed; otherwise, mark the register as
       // reserved
@@ -1781,30 +2842,41 @@ void CompilationVisitor::visit(FunctionCall* a) {
     }
     int64_t callee_fragment_index = fn->fragment_index_for_call_args(arg_types);
 
+    // if the matching fragment is still being compiled (this is a recursive
+    // call), it doesn't have an address yet, so treat it like a missing
+    // fragment. don't try to compile another one, since that would be a
+    // recursive compilation
+    bool callee_fragment_in_progress = (callee_fragment_index >= 0) &&
+        !fn->fragments[callee_fragment_index].compiled;
+    if (callee_fragment_in_progress) {
+      callee_fragment_index = -1;
+    }
+
     string returned_label = string_printf("__FunctionCall_%p_returned", a);
 
     // if there's no existing fragment and the function isn't builtin, check
     // that the passed argument types match the type annotations
-    if ((callee_fragment_index < 0) && !fn->is_builtin()) {
-      vector<Value> types_from_annotation;
-      for (const auto& arg : fn->args) {
-        if (arg.type_annotation.get()) {
-          types_from_annotation.emplace_back(this->global->type_for_annotation(
-              this->module, arg.type_annotation));
-        } else {
-          types_from_annotation.emplace_back(ValueType::Indeterminate);
-        }
-      }
-      if (this->global->match_values_to_types(types_from_annotation, arg_types) < 0) {
-        throw compile_error("call argument does not match type annotation", this->file_offset);
-      }
+    if ((callee_fragment_index < 0) && !fn->is_builtin() &&
+        !callee_fragment_in_progress) {
+      this->check_call_argument_annotations(fn, arg_types);
 
       // if there's no existing fragment, the function isn't builtin, and eager
-      // compilation is enabled, try to compile a new fragment now
-      if (!(debug_flags & DebugFlag::NoEagerCompilation)) {
+      // compilation is enabled, try to compile a new fragment now. if
+      // background compilation is enabled, compile it on the background thread
+      // instead, but only if we can guess its return type: then this call goes
+      // through a patchable callsite (below) and the rest of this fragment can
+      // be compiled now. otherwise the call would split this fragment, and
+      // recompiling it later costs more than compiling the callee here
+      if (this->global->background_compiler &&
+          !(debug_flags & DebugFlag::NoEagerCompilation) &&
+          (predicted_return_type_for_call(fn).type != ValueType::Indeterminate)) {
+        this->global->background_compiler->enqueue(fn->id, arg_types);
+
+      } else if (!(debug_flags & DebugFlag::NoEagerCompilation)) {
         fn->fragments.emplace_back(fn, fn->fragments.size(), arg_types);
         try {
-          compile_fragment(this->global, fn->module, &fn->fragments.back());
+          compile_fragment(this->global, fn->module, &fn->fragments.back(),
+              "eager");
           callee_fragment_index = fn->fragments.size() - 1;
         } catch (const compile_error& e) {
           if (debug_flags & DebugFlag::ShowCompileErrors) {
@@ -1815,9 +2887,16 @@ void CompilationVisitor::visit(FunctionCall* a) {
       }
     }
 
+    // save any locals that the callee (or the compiler) could clobber. this
+    // has to happen before the split label, since a recompiled version of this
+    // fragment resumes there with the locals only in memory
+    this->write_spill_local_registers(true);
+
     // if there's no existing fragment with the right types and this isn't a
     // built-in function, write a call to the compiler instead. if this is a
     // built-in function, fail (there's nothing to recompile)
+    Value return_type;
+    string call_split_label;
     if (callee_fragment_index < 0) {
       if (fn->is_builtin()) {
         string args_str;
@@ -1837,54 +2916,104 @@ void CompilationVisitor::visit(FunctionCall* a) {
       // call with. to deal with this, we put some useful info in r10 and r11
       // before calling it.
       int64_t callsite_token = this->global->next_callsite_token++;
+      this->recorded_callsite_tokens.emplace(callsite_token);
+      GlobalContext::UnresolvedFunctionCall* callsite;
       if (this->fragment->function) {
-        this->global->unresolved_callsites.emplace(piecewise_construct,
+        callsite = &this->global->unresolved_callsites.emplace(piecewise_construct,
             forward_as_tuple(callsite_token), forward_as_tuple(
               a->callee_function_id, arg_types, this->module,
-              this->fragment->function->id, this->fragment->index, a->split_id));
+              this->fragment->function->id, this->fragment->index, a->split_id)).first->second;
       } else {
-        this->global->unresolved_callsites.emplace(piecewise_construct,
+        callsite = &this->global->unresolved_callsites.emplace(piecewise_construct,
             forward_as_tuple(callsite_token), forward_as_tuple(
-              a->callee_function_id, arg_types, this->module, 0, -1, a->split_id));
+              a->callee_function_id, arg_types, this->module, 0, -1, a->split_id)).first->second;
+      }
+
+      // if we can guess what the callee will return without compiling it, we
+      // can generate the rest of this fragment now. the call goes through a
+      // slot in the callsite object that initially points to the compiler;
+      // when the callee is compiled, the compiler replaces it with the
+      // fragment's address and this code doesn't have to be recompiled (unless
+      // the guess was wrong)
+      callsite->return_type = predicted_return_type_for_call(fn);
+      if (callsite->return_type.type != ValueType::Indeterminate) {
+        callsite->call_target = void_fn_ptr(&_resolve_function_call);
       }
+
       if (debug_flags & DebugFlag::ShowJITEvents) {
-        string s = this->global->unresolved_callsites.at(callsite_token).str();
+        string s = callsite->str();
         fprintf(stderr, "created unresolved callsite %" PRId64 ": %s\n",
             callsite_token, s.c_str());
       }
 
-      this->as.write_label(string_printf("__FunctionCall_%p_call_compiler_%" PRId64 "_callsite_%" PRId64,
-          a, a->callee_function_id, callsite_token));
-      this->as.write_mov(r10, reinterpret_cast<int64_t>(this->global));
-      this->as.write_mov(r11, callsite_token);
-
-      // if this call ever returns to this point in the code, it must raise an
-      // exception, so just go directly to the exception handler if it does.
-      this->as.write_push(common_object_reference(void_fn_ptr(&_unwind_exception_internal)));
-      this->as.write_jmp(common_object_reference(void_fn_ptr(&_resolve_function_call)));
-
-      // we're done here - can't compile any more since we don't know the return
-      // type of this function. but we have to compile the rest of the scope to
-      // get the exception handlers
-      this->current_type = Value(ValueType::Indeterminate);
-      this->holding_reference = false;
-      throw terminated_by_split(callsite_token);
-    }
-
-    // the fragment exists, so we can call it
-    const auto& callee_fragment = fn->fragments[callee_fragment_index];
+      if (callsite->call_target) {
+        call_split_label = string_printf("__FunctionCall_%p_call_patchable_%" PRId64 "_callsite_%" PRId64 "_split_%" PRId64,
+            a, a->callee_function_id, callsite_token, a->split_id);
+        this->as.write_label(call_split_label);
+        this->fragment->call_split_labels.at(a->split_id) = call_split_label;
+
+        // _resolve_function_call returns to the split label (above) after
+        // patching the target slot, so this sequence runs again and calls the
+        // new fragment. after that, it always calls the fragment directly
+        if (update_global_space_pointer) {
+          this->as.write_mov(r13, this->global_space_immediate(fn->module));
+        }
+        this->as.write_mov(r10, this->relocatable_immediate(
+            CodeRelocation::Type::GlobalContext,
+            reinterpret_cast<int64_t>(this->global)));
+        this->as.write_mov(r11, this->relocatable_immediate(
+            CodeRelocation::Type::CallsiteToken, callsite_token,
+            callsite_token));
+        this->as.write_mov(rax, this->relocatable_immediate(
+            CodeRelocation::Type::CallsiteTarget,
+            reinterpret_cast<int64_t>(&callsite->call_target), callsite_token));
+        this->as.write_call(MemoryReference(rax, 0));
+        return_type = callsite->return_type;
 
-    string call_split_label = string_printf("__FunctionCall_%p_call_function_%" PRId64 "_fragment_%" PRId64 "_split_%" PRId64,
-        a, a->callee_function_id, callee_fragment_index, a->split_id);
-    this->as.write_label(call_split_label);
-    this->fragment->call_split_labels.at(a->split_id) = call_split_label;
+      } else {
+        this->as.write_label(string_printf("__FunctionCall_%p_call_compiler_%" PRId64 "_callsite_%" PRId64,
+            a, a->callee_function_id, callsite_token));
+        this->as.write_mov(r10, this->relocatable_immediate(
+            CodeRelocation::Type::GlobalContext,
+            reinterpret_cast<int64_t>(this->global)));
+        this->as.write_mov(r11, this->relocatable_immediate(
+            CodeRelocation::Type::CallsiteToken, callsite_token,
+            callsite_token));
+
+        // if this call ever returns to this point in the code, it must raise an
+        // exception, so just go directly to the exception handler if it does.
+        this->as.write_push(common_object_reference(void_fn_ptr(&_unwind_exception_internal)));
+        this->as.write_jmp(common_object_reference(void_fn_ptr(&_resolve_function_call)));
+
+        // we're done here - can't compile any more since we don't know the
+        // return type of this function. but we have to compile the rest of the
+        // scope to get the exception handlers
+        this->current_type = Value(ValueType::Indeterminate);
+        this->holding_reference = false;
+        throw terminated_by_split(callsite_token);
+      }
 
-    // call the fragment. note that the stack is already properly aligned here
-    if (update_global_space_pointer) {
-      this->as.write_mov(r13, reinterpret_cast<int64_t>(fn->module->global_space));
+    } else {
+      // the fragment exists, so we can call it
+      const auto& callee_fragment = fn->fragments[callee_fragment_index];
+      this->recorded_called_fragment_code.emplace(callee_fragment.compiled);
+
+      call_split_label = string_printf("__FunctionCall_%p_call_function_%" PRId64 "_fragment_%" PRId64 "_split_%" PRId64,
+          a, a->callee_function_id, callee_fragment_index, a->split_id);
+      this->as.write_label(call_split_label);
+      this->fragment->call_split_labels.at(a->split_id) = call_split_label;
+
+      // call the fragment. note that the stack is already properly aligned here
+      if (update_global_space_pointer) {
+        this->as.write_mov(r13, this->global_space_immediate(fn->module));
+      }
+      this->as.write_mov(rax, this->relocatable_immediate(
+          CodeRelocation::Type::FragmentCode,
+          reinterpret_cast<int64_t>(callee_fragment.compiled), fn->id,
+          FunctionContext::signature_for_types(callee_fragment.arg_types)));
+      this->as.write_call(rax);
+      return_type = callee_fragment.return_type;
     }
-    this->as.write_mov(rax, reinterpret_cast<int64_t>(callee_fragment.compiled));
-    this->as.write_call(rax);
     this->as.write_label(returned_label);
 
     // if the function raised an exception, the return value is meaningless;
@@ -1894,9 +3023,10 @@ void CompilationVisitor::visit(FunctionCall* a) {
     this->as.write_jz(no_exc_label);
     this->as.write_jmp(common_object_reference(void_fn_ptr(&_unwind_exception_internal)));
     this->as.write_label(no_exc_label);
+    this->write_reload_local_registers(true);
 
     // put the return value into the target register
-    if (callee_fragment.return_type.type == ValueType::Float) {
+    if (return_type.type == ValueType::Float) {
       if (this->target_register != rax) {
         this->as.write_label(string_printf("__FunctionCall_%p_save_return_value", a));
         this->as.write_movsd(MemoryReference(this->float_target_register), xmm0);
@@ -1909,7 +3039,7 @@ void CompilationVisitor::visit(FunctionCall* a) {
     }
 
     // functions always return new references, unless they return trivial types
-    this->current_type = callee_fragment.return_type;
+    this->current_type = return_type;
     this->holding_reference = type_has_refcount(this->current_type.type);
 
     // note: we don't have to destroy the function arguments; we passed the
@@ -1982,9 +3112,27 @@ void CompilationVisitor::visit(ArrayIndex* a) {
       }
       this->release_register(rdi);
 
+      // Int and Float keys are stored unboxed, so look in the key's first
+      // group inline; if the key isn't there, dictionary_at does the full
+      // lookup (and raises KeyError if needed). Float keys are compared by
+      // their bits here, so lookups of -0.0 always use dictionary_at
+      string call_label = string_printf("__ArrayIndex_%p_dictionary_at", a);
+      string end_label = string_printf("__ArrayIndex_%p_end", a);
+      if (this->current_type.type == ValueType::Float) {
+        this->as.write_movq_from_xmm(MemoryReference(rsi),
+            this->float_target_register);
+      }
+      if ((this->current_type.type == ValueType::Int) ||
+          (this->current_type.type == ValueType::Float)) {
+        this->write_inline_dictionary_lookup(a, original_target_register,
+            call_label, end_label);
+      }
+
       // get the dict item
+      this->as.write_label(call_label);
       this->write_function_call(common_object_reference(void_fn_ptr(&dictionary_at)),
           {rdi, rsi, r14}, {}, -1, original_target_register);
+      this->as.write_label(end_label);
 
       // the return type is the value extension type
       this->current_type = collection_type.extension_types[1];
@@ -2097,8 +3245,7 @@ void CompilationVisitor::visit(BytesConstant* a) {
   this->file_offset = a->file_offset;
   this->assert_not_evaluating_instance_pointer();
 
-  const BytesObject* o = this->global->get_or_create_constant(a->value);
-  this->as.write_mov(this->target_register, reinterpret_cast<int64_t>(o));
+  this->as.write_mov(this->target_register, this->constant_immediate(a->value));
   this->write_add_reference(this->target_register);
 
   this->current_type = Value(ValueType::Bytes);
@@ -2109,8 +3256,7 @@ void CompilationVisitor::visit(UnicodeConstant* a) {
   this->file_offset = a->file_offset;
   this->assert_not_evaluating_instance_pointer();
 
-  const UnicodeObject* o = this->global->get_or_create_constant(a->value);
-  this->as.write_mov(this->target_register, reinterpret_cast<int64_t>(o));
+  this->as.write_mov(this->target_register, this->constant_immediate(a->value));
   this->write_add_reference(this->target_register);
 
   this->current_type = Value(ValueType::Unicode);
@@ -2173,6 +3319,7 @@ void CompilationVisitor::visit(AttributeLookup* a) {
     // so we require Imported phase here to enforce this ordering later.
     auto base_module = this->global->get_or_create_module(a->base_module_name);
     advance_module_phase(this->global, base_module.get(), ModuleContext::Phase::Imported);
+    this->recorded_imported_module_names.emplace_back(a->base_module_name);
 
     VariableLocation loc = this->location_for_global(base_module.get(), a->name);
     this->write_read_variable(this->target_register, this->float_target_register, loc);
@@ -2208,7 +3355,9 @@ void CompilationVisitor::visit(AttributeLookup* a) {
   Register base_register = this->available_register_except({attr_register});
   this->target_register = base_register;
   this->as.write_label(string_printf("__AttributeLookup_%p_evaluate_base", a));
-  a->base->accept(this);
+  if (!this->write_borrowed_read(a->base.get())) {
+    a->base->accept(this);
+  }
   bool base_holding_reference = this->holding_reference;
 
   // if the base object is a class, write code that gets the attribute
@@ -2285,7 +3434,9 @@ void CompilationVisitor::visit(AttributeLValueReference* a) {
     Value value_type = move(this->current_type);
 
     // evaluate the base object
-    a->base->accept(this);
+    if (!this->write_borrowed_read(a->base.get())) {
+      a->base->accept(this);
+    }
 
     if (this->current_type.type == ValueType::Instance) {
       // the class should have the attribute that we're setting
@@ -2331,6 +3482,7 @@ void CompilationVisitor::visit(AttributeLValueReference* a) {
       // note: we use Imported here to make sure the target module's root scope
       // runs before any external code that could modify it
       advance_module_phase(this->global, base_module.get(), ModuleContext::Phase::Imported);
+      this->recorded_imported_module_names.emplace_back(base_module->name);
 
       VariableLocation loc = this->location_for_global(base_module.get(), a->name);
       if (loc.variable_mem_valid) {
@@ -2365,6 +3517,13 @@ void CompilationVisitor::visit(AttributeLValueReference* a) {
     }
     if (target_variable->type == ValueType::Indeterminate) {
       *target_variable = this->current_type;
+      if (loc.global_module) {
+        this->global_side_effects = true;
+        if (this->global->code_cache) {
+          this->global->code_cache->record_global_type(loc.global_module,
+              loc.name, this->current_type);
+        }
+      }
     } else if (!target_variable->types_equal(loc.type)) {
       string target_type_str = target_variable->str();
       string value_type_str = current_type.str();
@@ -2402,9 +3561,11 @@ void CompilationVisitor::visit(ModuleStatement* a) {
   this->write_push(rbp);
   this->as.write_mov(rbp, rsp);
   this->write_push(r12);
-  this->as.write_mov(r12, reinterpret_cast<int64_t>(common_object_base()));
+  this->as.write_mov(r12, this->relocatable_immediate(
+      CodeRelocation::Type::CommonObjectBase,
+      reinterpret_cast<int64_t>(common_object_base())));
   this->write_push(r13);
-  this->as.write_mov(r13, reinterpret_cast<int64_t>(this->module->global_space));
+  this->as.write_mov(r13, this->global_space_immediate(this->module));
   this->write_push(r14);
   this->as.write_xor(r14, r14);
   this->write_push(r15);
@@ -2422,7 +3583,7 @@ void CompilationVisitor::visit(ModuleStatement* a) {
   this->target_register = rax;
   this->as.write_label(string_printf("__ModuleStatement_%p_body", a));
   try {
-    this->visit_list(a->items);
+    this->write_statements(a->items);
   } catch (const terminated_by_split&) { }
 
   // we're done; write the cleanup
@@ -2459,6 +3620,15 @@ void CompilationVisitor::visit(AssignmentStatement* a) {
 
   this->as.write_label(string_printf("__AssignmentStatement_%p", a));
 
+  // if the new value is constructed in the stack frame, it uses the same memory
+  // as the local's previous value, so that instance has to be destroyed first
+  auto stack_instance_it = this->stack_instance_assignments.find(a);
+  if (stack_instance_it != this->stack_instance_assignments.end()) {
+    MemoryReference slot = this->stack_slot_for_local(stack_instance_it->second);
+    this->write_delete_reference(slot, ValueType::Instance);
+    this->as.write_mov(slot, 0);
+  }
+
   // unlike in AnalysisVisitor, we look at the lvalue references first, so we
   // can know where to put the resulting values when generating their code
 
@@ -2515,6 +3685,7 @@ void CompilationVisitor::visit(ImportStatement* a) {
   const string& base_module_name = a->modules.begin()->first;
   auto base_module = this->global->get_or_create_module(base_module_name);
   advance_module_phase(this->global, base_module.get(), ModuleContext::Phase::Imported);
+  this->recorded_imported_module_names.emplace_back(base_module_name);
   MemoryReference target_mem(this->target_register);
   for (const auto& it : a->names) {
     VariableLocation src_loc = this->location_for_global(base_module.get(), it.first);
@@ -2524,7 +3695,7 @@ void CompilationVisitor::visit(ImportStatement* a) {
         a, it.first.c_str(), it.second.c_str()));
 
     // get the value from the other module
-    this->as.write_mov(target_mem, reinterpret_cast<int64_t>(src_loc.global_module->global_space));
+    this->as.write_mov(target_mem, this->global_space_immediate(src_loc.global_module));
     this->as.write_mov(target_mem, MemoryReference(this->target_register, sizeof(int64_t) * src_loc.global_index));
 
     // if it's an object, add a reference to it
@@ -2583,8 +3754,7 @@ void CompilationVisitor::visit(AssertStatement* a) {
     this->as.write_label(string_printf("__AssertStatement_%p_generate_message", a));
 
     // if no message is given, use a blank message
-    const UnicodeObject* message = this->global->get_or_create_constant(L"");
-    this->as.write_mov(this->target_register, reinterpret_cast<int64_t>(message));
+    this->as.write_mov(this->target_register, this->constant_immediate(L""));
     this->write_add_reference(this->target_register);
   }
   this->write_push(this->target_register);
@@ -2612,7 +3782,9 @@ void CompilationVisitor::visit(AssertStatement* a) {
   size_t init_offset = cls->offset_for_attribute(init_index);
   this->as.write_mov(MemoryReference(this->target_register, message_offset),
       MemoryReference(tmp));
-  this->as.write_mov(tmp, reinterpret_cast<int64_t>(cls_init));
+  this->as.write_mov(tmp, this->relocatable_immediate(
+      CodeRelocation::Type::FunctionContext, reinterpret_cast<int64_t>(cls_init),
+      this->global->AssertionError_class_id));
   this->as.write_mov(MemoryReference(this->target_register, init_offset),
       MemoryReference(tmp));
 
@@ -2625,7 +3797,8 @@ void CompilationVisitor::visit(AssertStatement* a) {
   // now jump to unwind_exception
   this->as.write_label(string_printf("__AssertStatement_%p_unwind", a));
   this->as.write_mov(r15, MemoryReference(this->target_register));
-  this->as.write_jmp(common_object_reference(void_fn_ptr(&_unwind_exception_internal)));
+  this->write_spill_local_registers(false);
+  this->write_unwind_new_exception();
 
   // if we get here, then the expression was truthy, but we may still need to
   // destroy it if it has a refcount
@@ -2720,7 +3893,8 @@ void CompilationVisitor::visit(RaiseStatement* a) {
   // now jump to unwind_exception
   this->as.write_label(string_printf("__RaiseStatement_%p_unwind", a));
   this->as.write_mov(r15, MemoryReference(this->target_register));
-  this->as.write_jmp(common_object_reference(void_fn_ptr(&_unwind_exception_internal)));
+  this->write_spill_local_registers(false);
+  this->write_unwind_new_exception();
 }
 
 void CompilationVisitor::visit(YieldStatement* a) {
@@ -2744,7 +3918,7 @@ void CompilationVisitor::visit(IfStatement* a) {
   if (a->always_true) {
     this->as.write_label(string_printf("__IfStatement_%p_always_true", a));
     try {
-      this->visit_list(a->items);
+      this->write_statements(a->items);
     } catch (const terminated_by_split&) { }
     return;
   }
@@ -2760,10 +3934,7 @@ void CompilationVisitor::visit(IfStatement* a) {
     if (!a->always_true) {
       this->as.write_label(string_printf("__IfStatement_%p_condition", a));
       this->target_register = this->available_register();
-      a->check->accept(this);
-      this->as.write_label(string_printf("__IfStatement_%p_test", a));
-      this->write_current_truth_value_test();
-      this->as.write_jz(false_label);
+      this->write_condition_check(a->check.get(), false_label);
       this->write_delete_held_reference(MemoryReference(this->target_register));
 
     } else {
@@ -2773,7 +3944,7 @@ void CompilationVisitor::visit(IfStatement* a) {
     // generate the body statements, then jump to the end (skip the elifs/else
     // if the condition was true)
     try {
-      this->visit_list(a->items);
+      this->write_statements(a->items);
     } catch (const terminated_by_split&) { }
     this->as.write_jmp(end_label);
   }
@@ -2802,11 +3973,7 @@ void CompilationVisitor::visit(IfStatement* a) {
     this->as.write_label(string_printf("__IfStatement_%p_elif_%p_condition",
         a, elif.get()));
     this->target_register = this->available_register();
-    elif->check->accept(this);
-    this->as.write_label(string_printf("__IfStatement_%p_elif_%p_test", a,
-        elif.get()));
-    this->write_current_truth_value_test();
-    this->as.write_jz(false_label);
+    this->write_condition_check(elif->check.get(), false_label);
     this->write_delete_held_reference(MemoryReference(this->target_register));
 
     // generate the body
@@ -2835,7 +4002,7 @@ void CompilationVisitor::visit(ElseStatement* a) {
   // or IfStatement
   this->as.write_label(string_printf("__ElseStatement_%p", a));
   try {
-    this->visit_list(a->items);
+    this->write_statements(a->items);
   } catch (const terminated_by_split&) { }
 }
 
@@ -2845,13 +4012,254 @@ void CompilationVisitor::visit(ElifStatement* a) {
   // just do the sub-statements; the encapsulating logic is all in IfStatement
   this->as.write_label(string_printf("__ElifStatement_%p", a));
   try {
-    this->visit_list(a->items);
+    this->write_statements(a->items);
   } catch (const terminated_by_split&) { }
 }
 
+void CompilationVisitor::write_range_loop(ForStatement* a) {
+  // we'll use rbx for the loop counter. it's separate from the loop variable
+  // since the body may modify the variable without affecting the iteration
+  if (this->target_register == rbx) {
+    throw compile_error("cannot use rbx as target register for range iteration", this->file_offset);
+  }
+
+  // range(stop), range(start, stop) or range(start, stop, step)
+  struct RangeArgument {
+    shared_ptr<Expression> expr; // NULL if not given
+    bool is_constant;
+    int64_t value;
+    int64_t stack_bytes_used; // after the value was pushed, if not constant
+  };
+  RangeArgument args[3];
+  args[0].expr = (a->range_args.size() > 1) ? a->range_args[0] : NULL;
+  args[1].expr = (a->range_args.size() > 1) ? a->range_args[1] : a->range_args[0];
+  args[2].expr = (a->range_args.size() > 2) ? a->range_args[2] : NULL;
+
+  // evaluate the arguments in order. constants (and missing arguments) are
+  // used as immediates; other values are saved on the stack
+  static const char* arg_names[3] = {"start", "stop", "step"};
+  int64_t initial_stack_bytes_used = this->stack_bytes_used;
+  for (size_t x = 0; x < 3; x++) {
+    auto& arg = args[x];
+    arg.stack_bytes_used = 0;
+    if (!arg.expr.get()) {
+      arg.is_constant = true;
+      arg.value = (x == 2) ? 1 : 0;
+      continue;
+    }
+
+    IntegerConstantVisitor v;
+    arg.expr->accept(&v);
+    arg.is_constant = v.is_constant;
+    arg.value = v.value;
+    if (arg.is_constant) {
+      continue;
+    }
+
+    this->as.write_label(string_printf("__ForStatement_%p_evaluate_range_%s",
+        a, arg_names[x]));
+    arg.expr->accept(this);
+    if ((this->current_type.type != ValueType::Int) &&
+        (this->current_type.type != ValueType::Bool)) {
+      throw compile_error(string_printf("range() %s is %s, not Int",
+          arg_names[x], this->current_type.str().c_str()), this->file_offset);
+    }
+    this->write_push(this->target_register);
+    arg.stack_bytes_used = this->stack_bytes_used;
+  }
+  this->file_offset = a->file_offset;
+
+  auto arg_mem = [&](const RangeArgument& arg) -> MemoryReference {
+    return MemoryReference(rsp, this->stack_bytes_used - arg.stack_bytes_used);
+  };
+  const auto& start = args[0];
+  const auto& stop = args[1];
+  const auto& step = args[2];
+
+  // a step of zero is an error
+  if (step.is_constant) {
+    if (step.value == 0) {
+      this->write_raise_exception(this->global->ValueError_class_id,
+          L"range() arg 3 must not be zero");
+    }
+  } else {
+    string nonzero_label = string_printf("__ForStatement_%p_range_step_nonzero", a);
+    this->as.write_cmp(arg_mem(step), 0);
+    this->as.write_jne(nonzero_label);
+    this->write_raise_exception(this->global->ValueError_class_id,
+        L"range() arg 3 must not be zero");
+    this->as.write_label(nonzero_label);
+  }
+
+  this->write_push(rbx);
+  if (start.is_constant) {
+    this->as.write_mov(rbx, start.value);
+  } else {
+    this->as.write_mov(MemoryReference(rbx), arg_mem(start));
+  }
+
+  string next_label = string_printf("__ForStatement_%p_next", a);
+  string body_label = string_printf("__ForStatement_%p_write_value", a);
+  string end_label = string_printf("__ForStatement_%p_complete", a);
+  string break_label = string_printf("__ForStatement_%p_broken", a);
+
+  try {
+    // check if we're at the end and skip the body if so. if the step's sign
+    // isn't known, we have to check it on every iteration
+    this->as.write_label(next_label);
+    MemoryReference rbx_mem(rbx);
+    MemoryReference stop_mem(this->target_register);
+    if (!stop.is_constant) {
+      stop_mem = arg_mem(stop);
+    } else if ((stop.value < -0x80000000LL) || (stop.value > 0x7FFFFFFFLL)) {
+      this->as.write_mov(this->target_register, stop.value);
+    }
+    auto write_stop_cmp = [&]() {
+      if (stop.is_constant && (stop.value >= -0x80000000LL) &&
+          (stop.value <= 0x7FFFFFFFLL)) {
+        this->as.write_cmp(rbx_mem, stop.value);
+      } else {
+        this->as.write_cmp(rbx_mem, stop_mem);
+      }
+    };
+    if (step.is_constant) {
+      write_stop_cmp();
+      if (step.value >= 0) {
+        this->as.write_jge(end_label);
+      } else {
+        this->as.write_jle(end_label);
+      }
+    } else {
+      string negative_step_label = string_printf("__ForStatement_%p_negative_step", a);
+      this->as.write_cmp(arg_mem(step), 0);
+      this->as.write_jl(negative_step_label);
+      write_stop_cmp();
+      this->as.write_jge(end_label);
+      this->as.write_jmp(body_label);
+      this->as.write_label(negative_step_label);
+      write_stop_cmp();
+      this->as.write_jle(end_label);
+    }
+
+    // write the current value into the loop variable and advance the counter
+    this->as.write_label(body_label);
+    this->as.write_mov(MemoryReference(this->target_register), rbx_mem);
+
+    // if adding the step would overflow, the counter would pass stop anyway,
+    // so set it to stop instead (this ends the loop at the next check). this
+    // can only happen if the counter is within step of the end of the int64
+    // range; if stop and step are both constant, we can tell if it's possible
+    // here and skip the check entirely
+    string advance_label = string_printf("__ForStatement_%p_advance", a);
+    string advanced_label = string_printf("__ForStatement_%p_advanced", a);
+    bool may_overflow = true;
+    if (stop.is_constant && step.is_constant) {
+      // the counter is always less than stop (or greater, for negative steps)
+      // when it's advanced
+      if (step.value >= 0) {
+        may_overflow = (stop.value != INT64_MIN) &&
+            (stop.value - 1 > INT64_MAX - step.value);
+      } else {
+        may_overflow = (stop.value != INT64_MAX) &&
+            (stop.value + 1 < INT64_MIN - step.value);
+      }
+    }
+    if (may_overflow) {
+      string clamp_label = string_printf("__ForStatement_%p_clamp", a);
+      Register limit_register = this->available_register_except({this->target_register});
+      MemoryReference limit_mem(limit_register);
+      if (step.is_constant) {
+        if (step.value >= 0) {
+          this->as.write_mov(limit_register, INT64_MAX - step.value);
+          this->as.write_cmp(rbx_mem, limit_mem);
+          this->as.write_jle(advance_label);
+        } else {
+          this->as.write_mov(limit_register, INT64_MIN - step.value);
+          this->as.write_cmp(rbx_mem, limit_mem);
+          this->as.write_jge(advance_label);
+        }
+      } else {
+        string negative_step_label = string_printf("__ForStatement_%p_advance_negative_step", a);
+        this->as.write_cmp(arg_mem(step), 0);
+        this->as.write_jl(negative_step_label);
+        this->as.write_mov(limit_register, INT64_MAX);
+        this->as.write_sub(limit_mem, arg_mem(step));
+        this->as.write_cmp(rbx_mem, limit_mem);
+        this->as.write_jle(advance_label);
+        this->as.write_jmp(clamp_label);
+        this->as.write_label(negative_step_label);
+        this->as.write_mov(limit_register, INT64_MIN);
+        this->as.write_sub(limit_mem, arg_mem(step));
+        this->as.write_cmp(rbx_mem, limit_mem);
+        this->as.write_jge(advance_label);
+      }
+      this->as.write_label(clamp_label);
+      if (stop.is_constant) {
+        this->as.write_mov(rbx, stop.value);
+      } else {
+        this->as.write_mov(rbx_mem, arg_mem(stop));
+      }
+      this->as.write_jmp(advanced_label);
+    }
+
+    this->as.write_label(advance_label);
+    if (!step.is_constant) {
+      this->as.write_add(rbx_mem, arg_mem(step));
+    } else if ((step.value >= -0x80000000LL) && (step.value <= 0x7FFFFFFFLL)) {
+      this->as.write_add(rbx_mem, step.value);
+    } else {
+      Register step_register = this->available_register_except({this->target_register});
+      this->as.write_mov(step_register, step.value);
+      this->as.write_add(rbx_mem, MemoryReference(step_register));
+    }
+    this->as.write_label(advanced_label);
+    this->current_type = Value(ValueType::Int);
+    this->holding_reference = false;
+    a->variable->accept(this);
+
+    // do the loop body
+    this->as.write_label(string_printf("__ForStatement_%p_body", a));
+    this->break_label_stack.emplace_back(break_label);
+    this->continue_label_stack.emplace_back(next_label);
+    try {
+      this->write_statements(a->items);
+    } catch (const terminated_by_split&) {
+      this->continue_label_stack.pop_back();
+      this->break_label_stack.pop_back();
+      throw;
+    }
+    this->continue_label_stack.pop_back();
+    this->break_label_stack.pop_back();
+    this->as.write_jmp(next_label);
+    this->as.write_label(end_label);
+
+    // if there's an else statement, generate the body here
+    if (a->else_suite.get()) {
+      a->else_suite->accept(this);
+    }
+
+    // any break statement will jump over the loop body and the else statement
+    this->as.write_label(break_label);
+
+  } catch (const terminated_by_split&) {
+    this->write_pop(rbx);
+    this->adjust_stack_to(initial_stack_bytes_used);
+    throw;
+  }
+
+  this->write_pop(rbx);
+  this->adjust_stack_to(initial_stack_bytes_used);
+}
+
 void CompilationVisitor::visit(ForStatement* a) {
   this->file_offset = a->file_offset;
 
+  // loops over range() don't create the list
+  if (!a->range_args.empty()) {
+    this->write_range_loop(a);
+    return;
+  }
+
   // get the collection object and save it on the stack
   this->as.write_label(string_printf("__ForStatement_%p_get_collection", a));
   a->collection->accept(this);
@@ -2938,7 +4346,7 @@ void CompilationVisitor::visit(ForStatement* a) {
       this->break_label_stack.emplace_back(break_label);
       this->continue_label_stack.emplace_back(next_label);
       try {
-        this->visit_list(a->items);
+        this->write_statements(a->items);
       } catch (const terminated_by_split&) {
         this->continue_label_stack.pop_back();
         this->break_label_stack.pop_back();
@@ -2953,14 +4361,18 @@ void CompilationVisitor::visit(ForStatement* a) {
 
       int64_t previously_reserved_registers = this->write_push_reserved_registers();
 
-      // create a SlotContents structure
+      // create a SlotContents structure. it holds the iteration cursor, so
+      // each call to dictionary_next_item continues where the last one stopped
       // TODO: figure out how this structure interacts with refcounting and
       // exceptions (or if it does at all)
+      static_assert(sizeof(DictionaryObject::SlotContents) % 8 == 0,
+          "SlotContents cannot be zeroed with 8-byte writes");
       this->adjust_stack(-sizeof(DictionaryObject::SlotContents));
       try {
-        this->as.write_mov(MemoryReference(rsp, 0), 0);
-        this->as.write_mov(MemoryReference(rsp, 8), 0);
-        this->as.write_mov(MemoryReference(rsp, 16), 0);
+        for (size_t offset = 0; offset < sizeof(DictionaryObject::SlotContents);
+             offset += 8) {
+          this->as.write_mov(MemoryReference(rsp, offset), 0);
+        }
 
         // get the dict object and SlotContents pointer. we +8 to the offset
         // because we saved rbx between the SlotContents struct and the
@@ -3000,7 +4412,7 @@ void CompilationVisitor::visit(ForStatement* a) {
         this->break_label_stack.emplace_back(break_label);
         this->continue_label_stack.emplace_back(next_label);
         try {
-          this->visit_list(a->items);
+          this->write_statements(a->items);
         } catch (const terminated_by_split&) {
           this->continue_label_stack.pop_back();
           this->break_label_stack.pop_back();
@@ -3038,14 +4450,14 @@ void CompilationVisitor::visit(ForStatement* a) {
     this->write_pop(rbx);
     this->write_pop(this->target_register);
     this->write_delete_reference(MemoryReference(this->target_register),
-        collection_type.type);
+        collection_type.type, true);
     throw;
   }
 
   this->write_pop(rbx);
   this->write_pop(this->target_register);
   this->write_delete_reference(MemoryReference(this->target_register),
-      collection_type.type);
+      collection_type.type, true);
 }
 
 void CompilationVisitor::visit(WhileStatement* a) {
@@ -3055,12 +4467,19 @@ void CompilationVisitor::visit(WhileStatement* a) {
   string end_label = string_printf("__WhileStatement_%p_condition_false", a);
   string break_label = string_printf("__WhileStatement_%p_broken", a);
 
+  // if the fragment was running in the interpreter, the interpreter may want
+  // to continue the current call in the compiled code from the top of this
+  // loop. this is only possible if nothing is on the stack except the locals
+  // (so not inside a for loop or try block)
+  if (this->fragment->function && this->fragment->interpreted &&
+      (this->stack_bytes_used == this->function_body_stack_bytes_used)) {
+    this->osr_loops.emplace_back(a);
+  }
+
   // generate the condition check
   this->as.write_label(start_label);
   this->target_register = this->available_register();
-  a->condition->accept(this);
-  this->write_current_truth_value_test();
-  this->as.write_jz(end_label);
+  this->write_condition_check(a->condition.get(), end_label);
 
   // generate the loop body
   this->write_delete_held_reference(MemoryReference(this->target_register));
@@ -3068,7 +4487,7 @@ void CompilationVisitor::visit(WhileStatement* a) {
   this->break_label_stack.emplace_back(break_label);
   this->continue_label_stack.emplace_back(start_label);
   try {
-    this->visit_list(a->items);
+    this->write_statements(a->items);
   } catch (const terminated_by_split&) { }
   this->continue_label_stack.pop_back();
   this->break_label_stack.pop_back();
@@ -3094,7 +4513,7 @@ void CompilationVisitor::visit(ExceptStatement* a) {
   // just do the sub-statements; the encapsulating logic is all in TryStatement
   this->as.write_label(string_printf("__FinallyStatement_%p", a));
   try {
-    this->visit_list(a->items);
+    this->write_statements(a->items);
   } catch (const terminated_by_split&) { }
 }
 
@@ -3112,7 +4531,7 @@ void CompilationVisitor::visit(FinallyStatement* a) {
 
   this->as.write_label(string_printf("__FinallyStatement_%p_body", a));
   try {
-    this->visit_list(a->items);
+    this->write_statements(a->items);
   } catch (const terminated_by_split&) { }
 
   // if there's now an active exception, then the finally block raised an
@@ -3124,6 +4543,7 @@ void CompilationVisitor::visit(FinallyStatement* a) {
   this->as.write_test(r15, r15);
   this->as.write_jz(no_exc_label);
   this->write_delete_reference(MemoryReference(r15, 0), ValueType::Instance);
+  this->write_spill_local_registers(false);
   this->as.write_jmp(common_object_reference(void_fn_ptr(&_unwind_exception_internal)));
 
   // the finally block did not raise an exception, but there may be a saved
@@ -3132,6 +4552,7 @@ void CompilationVisitor::visit(FinallyStatement* a) {
   this->write_pop(r15);
   this->as.write_test(r15, r15);
   this->as.write_jz(end_label);
+  this->write_spill_local_registers(false);
   this->as.write_jmp(common_object_reference(void_fn_ptr(&_unwind_exception_internal)));
   this->as.write_label(end_label);
 
@@ -3194,7 +4615,7 @@ void CompilationVisitor::visit(TryStatement* a) {
   // need to catch it
   try {
     this->as.write_label(string_printf("__TryStatement_%p_body", a));
-    this->visit_list(a->items);
+    this->write_statements(a->items);
   } catch (const terminated_by_split& e) { }
 
   // remove the exception block from the stack
@@ -3223,7 +4644,9 @@ void CompilationVisitor::visit(TryStatement* a) {
     this->adjust_stack_to(stack_bytes_used_on_restore);
   }
 
-  // go to the finally block
+  // go to the finally block. it can also be reached by unwinding, so it
+  // reloads locals from memory; make sure memory is up to date
+  this->write_spill_local_registers(false);
   this->as.write_jmp(finally_label);
 
   // generate the except blocks
@@ -3239,9 +4662,13 @@ void CompilationVisitor::visit(TryStatement* a) {
     // avoid unaligned function calls
     this->adjust_stack_to(stack_bytes_used_on_restore, false);
 
+    // locals in registers may have been clobbered by the code that raised the
+    // exception, but their stack slots are up to date
+    this->write_reload_local_registers(false);
+
     // if the exception object isn't assigned to a name, destroy it now
     if (except->name.empty()) {
-      this->write_delete_reference(r15, ValueType::Instance);
+      this->write_delete_reference(r15, ValueType::Instance, true);
 
     // else, assign the exception object to the appropriate name
     } else {
@@ -3289,6 +4716,7 @@ void CompilationVisitor::visit(TryStatement* a) {
 
     // we're done here; go to the finally block
     // for the last except block, don't bother jumping; just fall through
+    this->write_spill_local_registers(false);
     if (except_index != a->excepts.size() - 1) {
       this->as.write_label(string_printf("__TryStatement_%p_except_%zd_end", a,
           except_index));
@@ -3301,6 +4729,7 @@ void CompilationVisitor::visit(TryStatement* a) {
 
   // generate the finally block, if any
   this->as.write_label(string_printf("__TryStatement_%p_finally", a));
+  this->write_reload_local_registers(false);
   if (a->finally_suite.get()) {
     try {
       a->finally_suite->accept(this);
@@ -3339,7 +4768,9 @@ void CompilationVisitor::visit(FunctionDefinition* a) {
       throw compile_error("function definition reference not valid", this->file_offset);
     }
     this->as.write_label("__" + base_label);
-    this->as.write_mov(this->target_register, reinterpret_cast<int64_t>(declared_function_context));
+    this->as.write_mov(this->target_register, this->relocatable_immediate(
+        CodeRelocation::Type::FunctionContext,
+        reinterpret_cast<int64_t>(declared_function_context), a->function_id));
     this->as.write_mov(loc.variable_mem, MemoryReference(this->target_register));
     return;
   }
@@ -3351,6 +4782,7 @@ void CompilationVisitor::visit(FunctionDefinition* a) {
       (this->fragment->function->name == "__del__");
 
   this->write_function_setup(base_label, setup_special_regs);
+  this->function_body_stack_bytes_used = this->stack_bytes_used;
   this->target_register = rax;
   try {
     this->visit_list(a->decorators);
@@ -3359,7 +4791,7 @@ void CompilationVisitor::visit(FunctionDefinition* a) {
         arg.default_value->accept(this);
       }
     }
-    this->visit_list(a->items);
+    this->write_statements(a->items);
 
   } catch (const terminated_by_split&) {
     this->write_function_cleanup(base_label, setup_special_regs);
@@ -3387,12 +4819,23 @@ void CompilationVisitor::visit(FunctionDefinition* a) {
     this->write_add_reference(this->target_register);
   }
 
+  // the cleanup forgets the register assignments, but the OSR entries have to
+  // load the interpreter's locals into the same registers the body uses
+  auto local_registers = this->local_registers;
   this->write_function_cleanup(base_label, setup_special_regs);
+  if (!setup_special_regs) {
+    this->local_registers = move(local_registers);
+    this->write_osr_entries(base_label);
+    this->local_registers.clear();
+  }
 }
 
 void CompilationVisitor::visit(ClassDefinition* a) {
   this->file_offset = a->file_offset;
 
+  // this generates the class' destructor, which isn't part of the fragment
+  this->global_side_effects = true;
+
   // write the class' context to the variable
   auto loc = this->location_for_variable(a->name);
   if (!loc.variable_mem_valid) {
@@ -3401,13 +4844,16 @@ void CompilationVisitor::visit(ClassDefinition* a) {
 
   this->as.write_label(string_printf("__ClassDefinition_%p_assign", a));
   auto* cls = this->global->context_for_class(a->class_id);
-  this->as.write_mov(this->target_register, reinterpret_cast<int64_t>(cls));
+  this->as.write_mov(this->target_register, this->relocatable_immediate(
+      CodeRelocation::Type::ClassContext, reinterpret_cast<int64_t>(cls),
+      a->class_id));
   this->as.write_mov(loc.variable_mem, MemoryReference(this->target_register));
 
   // create the class destructor function
   if (!cls->destructor) {
     // if none of the class attributes have destructors and it doesn't have a
-    // __del__ method, then the overall class destructor trivializes to free()
+    // __del__ method, then the destructor only has to count the free and free
+    // the object
     ssize_t del_index = -1;
     try {
       del_index = cls->attribute_indexes.at("__del__");
@@ -3422,20 +4868,20 @@ void CompilationVisitor::visit(ClassDefinition* a) {
       }
     }
 
-    // no subdestructors; just use free()
+    string base_label = string_printf("__ClassDefinition_%p_destructor", a);
+    AMD64Assembler dtor_as;
+    dtor_as.write_label(base_label);
+
+    // the __del__ fragment (if any) must outlive this destructor's code
+    unordered_set<const void*> called_del_code;
+
     if (!has_subdestructors) {
-      cls->destructor = reinterpret_cast<void*>(&free);
       if (debug_flags & DebugFlag::ShowAssembly) {
         fprintf(stderr, "[%s.%s:%" PRId64 "] class has trivial destructor\n",
             this->module->name.c_str(), a->name.c_str(), a->class_id);
       }
 
-    // there are subdestructors; have to write a destructor function
     } else {
-      string base_label = string_printf("__ClassDefinition_%p_destructor", a);
-      AMD64Assembler dtor_as;
-      dtor_as.write_label(base_label);
-
       // lead-in (stack frame setup)
       dtor_as.write_push(rbp);
       dtor_as.write_mov(rbp, rsp);
@@ -3449,7 +4895,7 @@ void CompilationVisitor::visit(ClassDefinition* a) {
 
       // we have to add a fake reference to the object while destroying it;
       // otherwise __del__ will call this destructor recursively
-      dtor_as.write_lock();
+      write_refcount_lock_prefix(dtor_as);
       dtor_as.write_inc(MemoryReference(rbx, 0));
 
       // call __del__ before deleting attribute references
@@ -3474,7 +4920,8 @@ void CompilationVisitor::visit(ClassDefinition* a) {
         if (fn->fragments.empty()) {
           vector<Value> arg_types({Value(ValueType::Instance, a->class_id, NULL)});
           fn->fragments.emplace_back(fn, fn->fragments.size(), arg_types);
-          compile_fragment(this->global, fn->module, &fn->fragments.back());
+          compile_fragment(this->global, fn->module, &fn->fragments.back(),
+              "destructor");
         }
         auto fragment = fn->fragments.back();
         if (fragment.arg_types != expected_arg_types) {
@@ -3483,10 +4930,11 @@ void CompilationVisitor::visit(ClassDefinition* a) {
 
         // generate the call to the fragment. note that the instance pointer is
         // still in rdi, so we don't have to do anything to prepare
-        dtor_as.write_lock();
+        write_refcount_lock_prefix(dtor_as);
         dtor_as.write_inc(MemoryReference(rbx, 0)); // reference for the function arg
         dtor_as.write_mov(rax, reinterpret_cast<int64_t>(fragment.compiled));
         dtor_as.write_call(rax);
+        called_del_code.emplace(fragment.compiled);
 
         // __del__ can add new references to the object; if this happens, don't
         // proceed with the destruction
@@ -3495,7 +4943,7 @@ void CompilationVisitor::visit(ClassDefinition* a) {
         // TODO: do we need the lock prefix to do this compare?
         dtor_as.write_cmp(MemoryReference(rbx, 0), 1);
         dtor_as.write_je(base_label + "_proceed");
-        dtor_as.write_lock();
+        write_refcount_lock_prefix(dtor_as);
         dtor_as.write_dec(MemoryReference(rbx, 0)); // fake reference
         dtor_as.write_add(rsp, 8);
         dtor_as.write_pop(rbx);
@@ -3532,7 +4980,7 @@ void CompilationVisitor::visit(ClassDefinition* a) {
             dtor_as.write_je(skip_label);
 
             // decrement the refcount; if it's not zero, skip the destructor call
-            dtor_as.write_lock();
+            write_refcount_lock_prefix(dtor_as);
             dtor_as.write_dec(MemoryReference(rdi, 0));
             dtor_as.write_jnz(skip_label);
 
@@ -3551,32 +4999,75 @@ void CompilationVisitor::visit(ClassDefinition* a) {
       // added a reference in the meantime (e.g. while attributes were being
       // destroyed), then they're holding a reference to an incomplete object
       // and they deserve the segfault they will probably get
-      dtor_as.write_lock();
+      write_refcount_lock_prefix(dtor_as);
       dtor_as.write_dec(MemoryReference(rbx, 0));
 
-      // cheating time: "return" by jumping directly to free() so it will return
-      // to the caller
+      // cheating time: "return" by jumping directly to nemesys_free() so it
+      // will return to the caller
       dtor_as.write_mov(rdi, rbx);
       dtor_as.write_add(rsp, 8);
       dtor_as.write_pop(rbx);
       dtor_as.write_pop(rbp);
-      dtor_as.write_jmp(common_object_reference(void_fn_ptr(&free)));
+    }
 
-      // assemble it
-      multimap<size_t, string> compiled_labels;
-      unordered_set<size_t> patch_offsets;
-      string compiled = dtor_as.assemble(&patch_offsets, &compiled_labels);
-      cls->destructor = this->global->code.append(compiled, &patch_offsets);
-      this->module->compiled_size += compiled.size();
+    // count the free. generated code only runs on the main thread, so this
+    // doesn't need the lock prefix, and class definitions are never cached, so
+    // the counter's address can be used directly
+    dtor_as.write_mov(rax, reinterpret_cast<int64_t>(&cls->instance_free_count));
+    dtor_as.write_inc(MemoryReference(rax, 0));
+
+    // if the block came from the size class that this class' instances
+    // normally use, put it back on the free list here instead
+    ssize_t size_class = allocator_size_class_for_size(cls->instance_size());
+    if (allocation_can_be_inlined() && (size_class >= 0)) {
+      string slow_label = base_label + "_free_slow";
+      int64_t free_list_offset = offsetof(AllocatorState, free_lists) +
+          size_class * sizeof(void*);
+      int64_t free_count_offset = offsetof(AllocatorState, free_counts) +
+          size_class * sizeof(uint64_t);
+      dtor_as.write_cmp(MemoryReference(rdi,
+          -static_cast<int64_t>(allocator_header_size)),
+          size_class);
+      dtor_as.write_jne(slow_label);
+      dtor_as.write_mov(rax, common_object_reference(
+          allocator_main_thread_state()));
+      dtor_as.write_sub(rdi, allocator_header_size);
+      dtor_as.write_mov(rcx, MemoryReference(rax, free_list_offset));
+      dtor_as.write_mov(MemoryReference(rdi, 0), rcx);
+      dtor_as.write_mov(MemoryReference(rax, free_list_offset), rdi);
+      dtor_as.write_inc(MemoryReference(rax, free_count_offset));
+      dtor_as.write_ret();
+      dtor_as.write_label(slow_label);
+    }
+    dtor_as.write_jmp(common_object_reference(void_fn_ptr(&nemesys_free)));
+
+    // assemble it
+    multimap<size_t, string> compiled_labels;
+    unordered_set<size_t> patch_offsets;
+    string compiled = dtor_as.assemble(&patch_offsets, &compiled_labels);
+    cls->destructor = this->global->install_code(compiled, patch_offsets,
+        move(called_del_code));
+    this->module->compiled_size += compiled.size();
+
+    if (this->global->perf_map) {
+      this->global->perf_map->record_code(string_printf(
+          "%s.%s.<destructor>+%" PRId64, this->module->name.c_str(),
+          a->name.c_str(), a->class_id), cls->destructor, compiled.size(),
+          compiled_labels);
+    }
+    if (this->global->profiler) {
+      this->global->profiler->record_code(
+          this->module->name + "." + a->name + ".<destructor>", this->module,
+          cls->destructor, compiled.size(), a->file_offset);
+    }
 
-      if (debug_flags & DebugFlag::ShowAssembly) {
-        fprintf(stderr, "[%s:%" PRId64 "] class destructor assembled\n",
-            a->name.c_str(), a->class_id);
-        uint64_t addr = reinterpret_cast<uint64_t>(cls->destructor);
-        string disassembly = AMD64Assembler::disassemble(cls->destructor,
-            compiled.size(), addr, &compiled_labels);
-        fprintf(stderr, "\n%s\n", disassembly.c_str());
-      }
+    if (debug_flags & DebugFlag::ShowAssembly) {
+      fprintf(stderr, "[%s:%" PRId64 "] class destructor assembled\n",
+          a->name.c_str(), a->class_id);
+      uint64_t addr = reinterpret_cast<uint64_t>(cls->destructor);
+      string disassembly = AMD64Assembler::disassemble(cls->destructor,
+          compiled.size(), addr, &compiled_labels);
+      fprintf(stderr, "\n%s\n", disassembly.c_str());
     }
   }
 }
@@ -3607,10 +5098,9 @@ void CompilationVisitor::write_code_for_value(const Value& value) {
 
     case ValueType::Bytes:
     case ValueType::Unicode: {
-      const void* o = (value.type == ValueType::Bytes) ?
-          void_fn_ptr(this->global->get_or_create_constant(*value.bytes_value)) :
-          void_fn_ptr(this->global->get_or_create_constant(*value.unicode_value));
-      this->as.write_mov(this->target_register, reinterpret_cast<int64_t>(o));
+      this->as.write_mov(this->target_register, (value.type == ValueType::Bytes) ?
+          this->constant_immediate(*value.bytes_value) :
+          this->constant_immediate(*value.unicode_value));
       this->write_add_reference(this->target_register);
       this->holding_reference = true;
       break;
@@ -3773,7 +5263,9 @@ void CompilationVisitor::write_function_call(
   if (this->stack_bytes_used & 0x0F) {
     throw compile_error("stack not aligned at function call", this->file_offset);
   }
+  this->write_spill_local_registers(true);
   this->as.write_call(function_loc);
+  this->write_reload_local_registers(true);
 
   // put the return value into the target register
   if (return_float) {
@@ -3794,10 +5286,22 @@ void CompilationVisitor::write_function_call(
   this->write_pop_reserved_registers(previously_reserved_registers);
 }
 
+void CompilationVisitor::write_statements(vector<shared_ptr<Statement>>& items) {
+  // each statement begins with a label containing its source offset, so code
+  // addresses can be mapped back to source lines (see Profiler.hh)
+  static uint64_t label_id = 0;
+  for (auto& item : items) {
+    this->as.write_label(string_printf("%s%zu_%" PRIu64,
+        source_offset_label_prefix, item->file_offset, label_id++));
+    item->accept(this);
+  }
+}
+
 void CompilationVisitor::write_function_setup(const string& base_label,
-    bool setup_special_regs) {
+    bool setup_special_regs, const string& osr_entry_label) {
   // get ready to rumble
-  this->as.write_label("__" + base_label);
+  bool is_osr_entry = !osr_entry_label.empty();
+  this->as.write_label(is_osr_entry ? osr_entry_label : ("__" + base_label));
   this->stack_bytes_used = 8;
 
   // lead-in (stack frame setup)
@@ -3837,9 +5341,18 @@ void CompilationVisitor::write_function_setup(const string& base_label,
     }
   }
 
-  // reserve space for locals and special regs
-  size_t num_stack_slots = this->fragment->function->locals.size() + (setup_special_regs ? 4 : 0);
+  // reserve space for locals, the caller's rbx (if a local lives there), and
+  // special regs. rbx is saved immediately below the locals so it can be
+  // restored on both the normal and exception return paths
+  bool save_rbx = this->local_int_registers & (1 << rbx);
+  size_t num_stack_slots = this->fragment->function->locals.size() +
+      (save_rbx ? 1 : 0) + (this->stack_instance_bytes / sizeof(int64_t)) +
+      (setup_special_regs ? 4 : 0);
   this->adjust_stack(num_stack_slots * -sizeof(int64_t));
+  if (save_rbx) {
+    this->as.write_mov(MemoryReference(rbp, -static_cast<ssize_t>(
+        sizeof(int64_t) * (this->fragment->function->locals.size() + 1))), rbx);
+  }
 
   // save special regs if needed
   if (setup_special_regs) {
@@ -3847,8 +5360,10 @@ void CompilationVisitor::write_function_setup(const string& base_label,
     this->as.write_mov(MemoryReference(rsp, 8), r13);
     this->as.write_mov(MemoryReference(rsp, 16), r14);
     this->as.write_mov(MemoryReference(rsp, 24), r15);
-    this->as.write_mov(r12, reinterpret_cast<int64_t>(common_object_base()));
-    this->as.write_mov(r13, reinterpret_cast<int64_t>(this->module->global_space));
+    this->as.write_mov(r12, this->relocatable_immediate(
+        CodeRelocation::Type::CommonObjectBase,
+        reinterpret_cast<int64_t>(common_object_base())));
+    this->as.write_mov(r13, this->global_space_immediate(this->module));
     this->as.write_xor(r14, r14);
     this->as.write_xor(r15, r15);
   }
@@ -3861,6 +5376,14 @@ void CompilationVisitor::write_function_setup(const string& base_label,
     local_index++;
     MemoryReference dest(rbp, local_index * -8);
 
+    // OSR entries are called with rdi pointing to the values of all the locals,
+    // in the same order as their stack slots
+    if (is_osr_entry) {
+      this->as.write_mov(rax, MemoryReference(rdi, (local_index - 1) * 8));
+      this->as.write_mov(dest, rax);
+      continue;
+    }
+
     // if it's a float arg, write it from the xmm reg
     try {
       Register xmm_reg = float_arg_to_register.at(local.first);
@@ -3887,19 +5410,51 @@ void CompilationVisitor::write_function_setup(const string& base_label,
     this->as.write_mov(dest, 0);
   }
 
+  // load the locals that live in registers
+  this->write_reload_local_registers(false);
+
   // set up the exception block
   this->return_label = string_printf("__%s_return", base_label.c_str());
   this->exception_return_label = string_printf(
       "__%s_exception_return", base_label.c_str());
-  this->as.write_label(string_printf(
-      "__%s_create_except_block", base_label.c_str()));
+  this->as.write_label(is_osr_entry ?
+      (osr_entry_label + "_create_except_block") :
+      string_printf("__%s_create_except_block", base_label.c_str()));
   this->write_create_exception_block({}, this->exception_return_label);
 }
 
+void CompilationVisitor::write_osr_entries(const string& base_label) {
+  // each OSR entry sets up the stack frame the same way the function's normal
+  // entry does, but takes the locals' values from memory instead of from the
+  // arguments, then jumps to the top of its loop. they return through the
+  // function's normal return path
+  for (WhileStatement* loop : this->osr_loops) {
+    string entry_label = string_printf("__WhileStatement_%p_osr_entry", loop);
+    this->write_function_setup(base_label, false, entry_label);
+    if (this->stack_bytes_used != this->function_body_stack_bytes_used) {
+      throw compile_error("OSR entry stack size does not match function body",
+          this->file_offset);
+    }
+    this->as.write_jmp(string_printf("__WhileStatement_%p_condition", loop));
+    this->fragment->osr_entry_labels.emplace(loop, entry_label);
+  }
+  this->osr_loops.clear();
+
+  // the function's code is done; nothing after this point uses these
+  this->return_label.clear();
+  this->exception_return_label.clear();
+  this->stack_bytes_used = 8;
+}
+
 void CompilationVisitor::write_function_cleanup(const string& base_label,
     bool setup_special_regs) {
   this->as.write_label(this->return_label);
 
+  // locals are dead from here on, so the calls made while destroying them
+  // don't need to spill anything
+  bool restore_rbx = this->local_int_registers & (1 << rbx);
+  this->local_registers.clear();
+
   // clean up the exception block. note that this is after the return label but
   // before the destroy locals label - the latter is used when an exception
   // occurs, since _unwind_exception_internal already removes the exc block from
@@ -3921,6 +5476,25 @@ void CompilationVisitor::write_function_cleanup(const string& base_label,
   this->as.write_label(this->exception_return_label);
   this->return_label.clear();
   this->exception_return_label.clear();
+
+  // instances in the stack frame have to be destroyed before their memory is
+  // released, since the loop below would otherwise follow the locals' pointers
+  // into it. a local's slot is NULL if its construction never ran, and it's
+  // cleared afterward so the loop below skips it
+  if (this->stack_instance_bytes) {
+    this->write_push(rax);
+    for (const auto& it : this->stack_instance_locals) {
+      MemoryReference slot = this->stack_slot_for_local(it.first);
+      this->write_delete_reference(slot, ValueType::Instance);
+      this->as.write_mov(slot, 0);
+    }
+    this->write_pop(rax);
+    this->adjust_stack(this->stack_instance_bytes);
+  }
+
+  if (restore_rbx) {
+    this->write_pop(rbx);
+  }
   for (auto it = this->fragment->function->locals.crbegin();
        it != this->fragment->function->locals.crend(); it++) {
     if (type_has_refcount(it->second.type)) {
@@ -3957,7 +5531,7 @@ void CompilationVisitor::write_add_reference(Register addr_reg) {
         {MemoryReference(addr_reg)}, {});
     this->release_register(addr_reg);
   } else {
-    this->as.write_lock();
+    write_refcount_lock_prefix(this->as);
     this->as.write_inc(MemoryReference(addr_reg, 0));
   }
   // TODO: we should check if the value is 1. if it is, then we've encountered a
@@ -3969,13 +5543,49 @@ void CompilationVisitor::write_delete_held_reference(const MemoryReference& mem)
     if (!type_has_refcount(this->current_type.type)) {
       throw compile_error("holding a reference to a trivial type: " + this->current_type.str(), this->file_offset);
     }
-    this->write_delete_reference(mem, this->current_type.type);
+    // held references are always the results of expressions that succeeded,
+    // so they're never NULL
+    this->write_delete_reference(mem, this->current_type.type, true);
     this->holding_reference = false;
   }
 }
 
+bool CompilationVisitor::write_borrowed_read(Expression* expr,
+    bool instance_pointer) {
+  if (debug_flags & DebugFlag::NoRefcountElision) {
+    return false;
+  }
+
+  VariableLookupVisitor v(instance_pointer);
+  expr->accept(&v);
+  if (!v.lookup) {
+    return false;
+  }
+
+  // only locals and inlined call arguments can be borrowed. globals can't,
+  // since any code that runs while the value is in use (e.g. a destructor)
+  // could overwrite the global and delete the object
+  const string& name = v.lookup->name;
+  if (!this->inlined_arguments.count(name) && (!this->fragment->function ||
+      !this->fragment->function->locals.count(name))) {
+    return false;
+  }
+
+  VariableLocation loc = this->location_for_variable(name);
+  if (!type_has_refcount(loc.type.type)) {
+    return false;
+  }
+
+  this->as.write_label(string_printf("__VariableLookup_%p_borrow", v.lookup));
+  this->as.write_mov(MemoryReference(this->target_register), loc.variable_mem);
+  this->current_type = loc.type;
+  this->holding_reference = false;
+  this->elided_refcount_pair_count++;
+  return true;
+}
+
 void CompilationVisitor::write_delete_reference(const MemoryReference& mem,
-    ValueType type) {
+    ValueType type, bool known_non_null) {
   if (type == ValueType::Indeterminate) {
     throw compile_error("can\'t call destructor for Indeterminate value", this->file_offset);
   }
@@ -4001,11 +5611,15 @@ void CompilationVisitor::write_delete_reference(const MemoryReference& mem,
     }
 
     // if the pointer is NULL, do nothing
-    this->as.write_test(r_mem, r_mem);
-    this->as.write_je(skip_label);
+    if (!known_non_null) {
+      this->as.write_test(r_mem, r_mem);
+      this->as.write_je(skip_label);
+    } else {
+      this->elided_null_check_count++;
+    }
 
     // decrement the refcount; if it's not zero, skip the destructor call
-    this->as.write_lock();
+    write_refcount_lock_prefix(this->as);
     this->as.write_dec(MemoryReference(r, 0));
     this->as.write_jnz(skip_label);
 
@@ -4021,19 +5635,59 @@ void CompilationVisitor::write_alloc_class_instance(int64_t class_id,
     bool initialize_attributes) {
   auto* cls = this->global->context_for_class(class_id);
 
-  static uint64_t skip_label_id = 0;
+  static uint64_t label_id = 0;
+  uint64_t this_label_id = label_id++;
   string skip_label = string_printf("__alloc_class_instance_skip_%" PRIu64,
-      skip_label_id++);
-
-  // call malloc to create the class object. note that the stack is already
-  // adjusted to the right alignment here
+      this_label_id);
+
+  // if the instance fits in a size class, try to take a block from the main
+  // thread's free list for it without calling anything
+  ssize_t size_class = allocator_size_class_for_size(cls->instance_size());
+  string allocated_label = string_printf(
+      "__alloc_class_instance_allocated_%" PRIu64, this_label_id);
+  bool inline_allocation = allocation_can_be_inlined() && (size_class >= 0);
+  if (inline_allocation) {
+    string slow_label = string_printf(
+        "__alloc_class_instance_slow_%" PRIu64, this_label_id);
+    int64_t free_list_offset = offsetof(AllocatorState, free_lists) +
+        size_class * sizeof(void*);
+    int64_t allocation_count_offset = offsetof(AllocatorState,
+        allocation_counts) + size_class * sizeof(uint64_t);
+
+    Register state_reg = this->available_register_except({rax});
+    this->reserve_register(state_reg);
+    Register next_reg = this->available_register_except({rax});
+    this->release_register(state_reg);
+
+    this->as.write_mov(MemoryReference(state_reg), common_object_reference(
+        allocator_main_thread_state()));
+    this->as.write_mov(rax, MemoryReference(state_reg, free_list_offset));
+    this->as.write_test(rax, rax);
+    this->as.write_jz(slow_label);
+    this->as.write_mov(MemoryReference(next_reg), MemoryReference(rax, 0));
+    this->as.write_mov(MemoryReference(state_reg, free_list_offset),
+        MemoryReference(next_reg));
+    this->as.write_inc(MemoryReference(state_reg, allocation_count_offset));
+    this->as.write_mov(MemoryReference(rax, 0), size_class);
+    this->as.write_add(rax, allocator_header_size);
+    this->as.write_jmp(allocated_label);
+    this->as.write_label(slow_label);
+  }
+
+  // call nemesys_malloc to create the class object. note that the stack is
+  // already adjusted to the right alignment here
   // note: this is a semi-ugly hack, but we ignore reserved registers here
   // because this can only be the first argument - no registers can be
   // reserved at this point
   int64_t stack_bytes_used = this->write_function_call_stack_prep();
   this->as.write_mov(rdi, cls->instance_size());
-  this->as.write_call(common_object_reference(void_fn_ptr(&malloc)));
+  this->write_spill_local_registers(true);
+  this->as.write_call(common_object_reference(void_fn_ptr(&nemesys_malloc)));
+  this->write_reload_local_registers(true);
   this->adjust_stack(stack_bytes_used);
+  if (inline_allocation) {
+    this->as.write_label(allocated_label);
+  }
 
   // check if the result is NULL and raise MemoryError in that case
   this->as.write_test(rax, rax);
@@ -4041,8 +5695,8 @@ void CompilationVisitor::write_alloc_class_instance(int64_t class_id,
   this->as.write_mov(rax, common_object_reference(&MemoryError_instance));
   this->write_add_reference(rax);
   this->as.write_mov(r15, rax);
-  this->as.write_jmp(
-      common_object_reference(void_fn_ptr(&_unwind_exception_internal)));
+  this->write_spill_local_registers(false);
+  this->write_unwind_new_exception();
   this->as.write_label(skip_label);
 
   // fill in the refcount, destructor function and class id
@@ -4052,10 +5706,24 @@ void CompilationVisitor::write_alloc_class_instance(int64_t class_id,
     this->as.write_mov(MemoryReference(this->target_register), rax);
   }
   this->as.write_mov(MemoryReference(this->target_register, 0), 1);
-  this->as.write_mov(tmp, reinterpret_cast<int64_t>(cls->destructor));
+  this->as.write_mov(tmp, this->relocatable_immediate(
+      CodeRelocation::Type::ClassDestructor,
+      reinterpret_cast<int64_t>(cls->destructor), class_id));
   this->as.write_mov(MemoryReference(this->target_register, 8), tmp_mem);
   this->as.write_mov(MemoryReference(this->target_register, 16), class_id);
 
+  // count the allocation. built-in classes don't have generated destructors,
+  // so they couldn't count frees; they aren't counted at all (offsetof can't be
+  // used here since ClassContext isn't standard-layout)
+  if (cls->module) {
+    int64_t count_offset = reinterpret_cast<const uint8_t*>(
+        &cls->instance_allocation_count) - reinterpret_cast<const uint8_t*>(cls);
+    this->as.write_mov(tmp, this->relocatable_immediate(
+        CodeRelocation::Type::ClassContext, reinterpret_cast<int64_t>(cls),
+        class_id));
+    this->as.write_inc(MemoryReference(tmp, count_offset));
+  }
+
   // zero everything else in the class, if it has any attributes
   if (initialize_attributes && (cls->instance_size() != sizeof(InstanceObject))) {
     this->as.write_xor(tmp_mem, tmp_mem);
@@ -4065,6 +5733,30 @@ void CompilationVisitor::write_alloc_class_instance(int64_t class_id,
   }
 }
 
+void CompilationVisitor::write_init_stack_class_instance(int64_t class_id,
+    ssize_t rbp_offset) {
+  auto* cls = this->global->context_for_class(class_id);
+
+  // this is like write_alloc_class_instance, but the memory is already
+  // reserved in the stack frame, so there's nothing to call and nothing can
+  // fail. the destructor doesn't free the memory
+  Register tmp = this->available_register_except({this->target_register});
+  MemoryReference tmp_mem(tmp);
+  this->as.write_lea(this->target_register, MemoryReference(rbp, rbp_offset));
+  this->as.write_mov(MemoryReference(this->target_register, 0), 1);
+  this->as.write_mov(tmp_mem,
+      common_object_reference(void_fn_ptr(&stack_instance_destructor)));
+  this->as.write_mov(MemoryReference(this->target_register, 8), tmp_mem);
+  this->as.write_mov(MemoryReference(this->target_register, 16), class_id);
+
+  if (cls->instance_size() != sizeof(InstanceObject)) {
+    this->as.write_xor(tmp_mem, tmp_mem);
+    for (ssize_t x = sizeof(InstanceObject); x < cls->instance_size(); x += 8) {
+      this->as.write_mov(MemoryReference(this->target_register, x), tmp_mem);
+    }
+  }
+}
+
 void CompilationVisitor::write_raise_exception(int64_t class_id,
     const wchar_t* message) {
   const auto* cls = this->global->context_for_class(class_id);
@@ -4080,8 +5772,7 @@ void CompilationVisitor::write_raise_exception(int64_t class_id,
     // set message
     size_t message_index = cls->attribute_indexes.at("message");
     size_t message_offset = cls->offset_for_attribute(message_index);
-    const UnicodeObject* constant = this->global->get_or_create_constant(message);
-    this->as.write_mov(r15, reinterpret_cast<int64_t>(constant));
+    this->as.write_mov(r15, this->constant_immediate(message));
     this->as.write_mov(MemoryReference(this->target_register, message_offset), r15);
 
   } else {
@@ -4095,12 +5786,106 @@ void CompilationVisitor::write_raise_exception(int64_t class_id,
   size_t init_index = cls->attribute_indexes.at("__init__");
   size_t init_offset = cls->offset_for_attribute(init_index);
   const auto* cls_init = this->global->context_for_function(class_id);
-  this->as.write_mov(r15, reinterpret_cast<int64_t>(cls_init));
+  this->as.write_mov(r15, this->relocatable_immediate(
+      CodeRelocation::Type::FunctionContext, reinterpret_cast<int64_t>(cls_init),
+      class_id));
   this->as.write_mov(MemoryReference(this->target_register, init_offset), r15);
 
   this->as.write_mov(r15, MemoryReference(this->target_register));
 
   // raise the exception
+  this->write_spill_local_registers(false);
+  this->write_unwind_new_exception();
+}
+
+void CompilationVisitor::write_inline_dictionary_lookup(ArrayIndex* a,
+    Register result_register, const string& miss_label,
+    const string& end_label) {
+  // rdi is the dict and rsi is the key. the temporaries come from the
+  // registers that aren't reserved here (everything was saved by
+  // visit(ArrayIndex*)); registers holding locals are never available, which
+  // matters because the hit path skips the spill and reload around the call to
+  // dictionary_at. this has to compute the same hash as dictionary_int_key_hash
+  string loop_label = string_printf("__ArrayIndex_%p_probe", a);
+  string next_label = string_printf("__ArrayIndex_%p_probe_next", a);
+
+  vector<Register> used_registers = {rdi, rsi};
+  auto take_register = [&]() -> Register {
+    Register reg = this->available_register_except(used_registers);
+    used_registers.emplace_back(reg);
+    return reg;
+  };
+  Register hash_reg = take_register();
+  Register count_reg = take_register();
+  Register index_reg = take_register();
+  Register control_reg = take_register();
+  Register slot_reg = take_register();
+
+  // hash_reg = hash
+  this->as.write_mov(MemoryReference(hash_reg), MemoryReference(rsi));
+  this->as.write_mov(count_reg, dictionary_int_key_hash_multiplier);
+  this->as.write_imul(hash_reg, MemoryReference(count_reg));
+  this->as.write_mov(MemoryReference(count_reg), MemoryReference(hash_reg));
+  this->as.write_shr(MemoryReference(count_reg), 32);
+  this->as.write_xor(MemoryReference(hash_reg), MemoryReference(count_reg));
+
+  // index_reg = index of the first slot in the key's first group (see
+  // hash_group_for_hash). if the table is empty or is a trie, skip all this
+  this->as.write_mov(MemoryReference(count_reg), MemoryReference(rdi,
+      offsetof(DictionaryObject, hash_capacity)));
+  this->as.write_test(MemoryReference(count_reg), MemoryReference(count_reg));
+  this->as.write_jz(miss_label);
+  this->as.write_shr(MemoryReference(count_reg), 4);
+  this->as.write_dec(MemoryReference(count_reg));
+  this->as.write_mov(MemoryReference(index_reg), MemoryReference(hash_reg));
+  this->as.write_shr(MemoryReference(index_reg), 7);
+  this->as.write_and(MemoryReference(index_reg), MemoryReference(count_reg));
+  this->as.write_shl(MemoryReference(index_reg), 4);
+
+  // control_reg = &hash_control[index], slot_reg = &hash_slots[index]
+  static_assert(sizeof(DictionaryObject::HashSlot) == 24,
+      "inline dictionary lookup assumes 24-byte slots");
+  this->as.write_mov(MemoryReference(control_reg), MemoryReference(rdi,
+      offsetof(DictionaryObject, hash_control)));
+  this->as.write_add(MemoryReference(control_reg), MemoryReference(index_reg));
+  this->as.write_shl(MemoryReference(index_reg), 3);
+  this->as.write_mov(MemoryReference(slot_reg), MemoryReference(index_reg));
+  this->as.write_add(MemoryReference(slot_reg), MemoryReference(index_reg));
+  this->as.write_add(MemoryReference(slot_reg), MemoryReference(index_reg));
+  this->as.write_add(MemoryReference(slot_reg), MemoryReference(rdi,
+      offsetof(DictionaryObject, hash_slots)));
+
+  // check each slot in the group. an empty slot means the key isn't present;
+  // a deleted slot may still contain its old hash and key, so matching slots
+  // also have to be checked for that. control bytes are signed here: empty is
+  // -0x80, deleted is -2, and full slots are nonnegative
+  this->as.write_mov(count_reg, 16);
+  this->as.write_label(loop_label);
+  this->as.write_cmp(MemoryReference(control_reg, 0), -0x80, OperandSize::Byte);
+  this->as.write_je(miss_label);
+  this->as.write_cmp(MemoryReference(hash_reg), MemoryReference(slot_reg, 0));
+  this->as.write_jne(next_label);
+  this->as.write_cmp(MemoryReference(rsi), MemoryReference(slot_reg, 8));
+  this->as.write_jne(next_label);
+  this->as.write_cmp(MemoryReference(control_reg, 0), 0, OperandSize::Byte);
+  this->as.write_jl(next_label);
+  this->as.write_mov(MemoryReference(result_register), MemoryReference(slot_reg, 16));
+  this->as.write_jmp(end_label);
+  this->as.write_label(next_label);
+  this->as.write_inc(MemoryReference(control_reg));
+  this->as.write_add(MemoryReference(slot_reg), sizeof(DictionaryObject::HashSlot));
+  this->as.write_dec(MemoryReference(count_reg));
+  this->as.write_jnz(loop_label);
+
+  // the key wasn't in its first group; fall through to the full lookup
+}
+
+void CompilationVisitor::write_unwind_new_exception() {
+  // the unwinder doesn't use r11, and nothing can depend on it being preserved
+  // across the jump
+  this->as.write_mov(MemoryReference(r11),
+      common_object_reference(&exception_raise_count));
+  this->as.write_inc(MemoryReference(r11, 0));
   this->as.write_jmp(common_object_reference(void_fn_ptr(&_unwind_exception_internal)));
 }
 
@@ -4186,6 +5971,34 @@ void CompilationVisitor::adjust_stack_to(ssize_t bytes, bool write_opcode) {
   this->adjust_stack(this->stack_bytes_used - bytes, write_opcode);
 }
 
+int64_t CompilationVisitor::relocatable_immediate(CodeRelocation::Type type,
+    int64_t value, int64_t id, const string& data) {
+  if (!this->record_relocations) {
+    return value;
+  }
+  this->recorded_relocations.emplace_back(type, id, data, value);
+  return CodeCache::placeholder_for_relocation(
+      this->recorded_relocations.size() - 1);
+}
+
+int64_t CompilationVisitor::global_space_immediate(const ModuleContext* module) {
+  return this->relocatable_immediate(CodeRelocation::Type::ModuleGlobalSpace,
+      reinterpret_cast<int64_t>(module->global_space), 0, module->name);
+}
+
+int64_t CompilationVisitor::constant_immediate(const string& value) {
+  return this->relocatable_immediate(CodeRelocation::Type::BytesConstant,
+      reinterpret_cast<int64_t>(this->global->get_or_create_constant(value)),
+      0, value);
+}
+
+int64_t CompilationVisitor::constant_immediate(const wstring& value) {
+  return this->relocatable_immediate(CodeRelocation::Type::UnicodeConstant,
+      reinterpret_cast<int64_t>(this->global->get_or_create_constant(value)),
+      0, string(reinterpret_cast<const char*>(value.data()),
+        value.size() * sizeof(wchar_t)));
+}
+
 void CompilationVisitor::write_load_double(Register reg, double value) {
   Register tmp = this->available_register();
   const int64_t* int_value = reinterpret_cast<const int64_t*>(&value);
@@ -4201,12 +6014,17 @@ void CompilationVisitor::write_read_variable(Register target_register,
   // module; we need to get the module's global space pointer and then look up
   // the attribute
   if (!loc.variable_mem_valid) {
-    this->as.write_mov(target_register, reinterpret_cast<int64_t>(loc.global_module->global_space));
+    this->as.write_mov(target_register, this->global_space_immediate(loc.global_module));
     variable_mem = MemoryReference(target_register, loc.global_index * sizeof(int64_t));
   }
 
   if (loc.type.type == ValueType::Float) {
-    this->as.write_movq_to_xmm(float_target_register, variable_mem);
+    // Float locals may live in an xmm register instead of memory
+    if (!variable_mem.field_size) {
+      this->as.write_movsd(MemoryReference(float_target_register), variable_mem);
+    } else {
+      this->as.write_movq_to_xmm(float_target_register, variable_mem);
+    }
   } else {
     this->as.write_mov(MemoryReference(target_register), variable_mem);
     if (type_has_refcount(loc.type.type)) {
@@ -4225,7 +6043,8 @@ void CompilationVisitor::write_write_variable(Register value_register,
   Register target_module_global_space_reg;
   if (!loc.variable_mem_valid) {
     target_module_global_space_reg = this->available_register_except({value_register});
-    this->as.write_mov(target_module_global_space_reg, reinterpret_cast<int64_t>(loc.global_module->global_space));
+    this->as.write_mov(target_module_global_space_reg,
+        this->global_space_immediate(loc.global_module));
     variable_mem = MemoryReference(target_module_global_space_reg, loc.global_index * sizeof(int64_t));
   }
 
@@ -4266,6 +6085,18 @@ CompilationVisitor::VariableLocation CompilationVisitor::location_for_global(
 CompilationVisitor::VariableLocation CompilationVisitor::location_for_variable(
     const string& name) {
 
+  // if we're compiling an inlined call, the callee's arguments are on the stack
+  auto inlined_it = this->inlined_arguments.find(name);
+  if (inlined_it != this->inlined_arguments.end()) {
+    VariableLocation loc;
+    loc.name = name;
+    loc.type = inlined_it->second.type;
+    loc.variable_mem = MemoryReference(rsp,
+        this->stack_bytes_used - inlined_it->second.stack_bytes_used);
+    loc.variable_mem_valid = true;
+    return loc;
+  }
+
   // if we're writing a global, use its global slot offset (from R13)
   if (this->fragment->function &&
       this->fragment->function->explicit_globals.count(name) &&
@@ -4284,7 +6115,11 @@ CompilationVisitor::VariableLocation CompilationVisitor::location_for_variable(
 
   VariableLocation loc;
   loc.name = name;
-  loc.variable_mem = MemoryReference(rbp, sizeof(int64_t) * (-static_cast<ssize_t>(1 + distance(this->fragment->function->locals.begin(), it))));
+  try {
+    loc.variable_mem = MemoryReference(this->local_registers.at(name));
+  } catch (const out_of_range&) {
+    loc.variable_mem = this->stack_slot_for_local(name);
+  }
   loc.variable_mem_valid = true;
 
   // use the argument type if given
@@ -4297,6 +6132,14 @@ CompilationVisitor::VariableLocation CompilationVisitor::location_for_variable(
   return loc;
 }
 
+MemoryReference CompilationVisitor::stack_slot_for_local(const string& name) {
+  auto it = this->fragment->function->locals.find(name);
+  if (it == this->fragment->function->locals.end()) {
+    throw compile_error("nonexistent local: " + name, this->file_offset);
+  }
+  return MemoryReference(rbp, sizeof(int64_t) * (-static_cast<ssize_t>(1 + distance(this->fragment->function->locals.begin(), it))));
+}
+
 CompilationVisitor::VariableLocation CompilationVisitor::location_for_attribute(
     ClassContext* cls, const string& name, Register instance_reg) {
 
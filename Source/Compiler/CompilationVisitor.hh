@@ -1,6 +1,7 @@
 #pragma once
 
 #include <atomic>
+#include <map>
 #include <memory>
 #include <stdexcept>
 #include <string>
@@ -14,6 +15,7 @@
 #include "../AST/PythonASTNodes.hh"
 #include "../AST/PythonASTVisitor.hh"
 #include "../Environment/Value.hh"
+#include "CodeCache.hh"
 #include "Contexts.hh"
 
 
@@ -29,13 +31,43 @@ public:
   };
 
   CompilationVisitor(GlobalContext* global, ModuleContext* module,
-      Fragment* fragment);
+      Fragment* fragment, bool record_relocations = false);
   ~CompilationVisitor() = default;
 
   AMD64Assembler& assembler();
   const std::unordered_set<Value>& return_types() const;
   size_t get_file_offset() const;
 
+  // information for the code cache. relocations are only recorded if
+  // record_relocations was given to the constructor
+  std::vector<CodeRelocation>& relocations();
+  const std::vector<std::string>& imported_module_names() const;
+  bool has_global_side_effects() const;
+
+  // fragments this fragment's code calls directly, and the callsites it
+  // created. the resulting code block holds these (see GlobalContext::CodeBlock)
+  std::unordered_set<const void*>& called_fragment_code();
+  std::unordered_set<int64_t>& created_callsite_tokens();
+
+  // number of refcount decrements that didn't need a null check because the
+  // pointer was known to be non-null
+  size_t get_elided_null_check_count() const;
+
+  // number of if/while conditions that branched on a comparison's flags
+  // instead of testing its Bool result (see write_condition_check)
+  size_t get_fused_branch_count() const;
+
+  // number of calls that were replaced with the callee's body
+  size_t get_inlined_call_count() const;
+
+  // number of add/delete reference pairs that were omitted because the value
+  // was borrowed from a local variable (see write_borrowed_read)
+  size_t get_elided_refcount_pair_count() const;
+
+  // number of locals whose instances live in the fragment's stack frame
+  // instead of on the heap (see allocate_stack_instances)
+  size_t get_stack_instance_count() const;
+
   using RecursiveASTVisitor::visit;
 
   // expression evaluation
@@ -121,11 +153,47 @@ private:
   std::unordered_map<std::string, int64_t> variable_to_stack_offset;
   std::unordered_map<std::string, Value> local_variable_types;
 
+  // Int, Float and Bool locals that live in a register for the entire fragment.
+  // their stack slots are only kept up to date around calls and at exception
+  // boundaries; see allocate_local_registers
+  std::map<std::string, Register> local_registers;
+  int32_t local_int_registers; // bit masks; these aren't available as temps
+  int32_t local_float_registers;
+  bool local_registers_synced_for_exceptions; // fragment contains a try block
+
   std::string return_label;
   std::string exception_return_label;
   std::vector<std::string> break_label_stack;
   std::vector<std::string> continue_label_stack;
 
+  // while loops that get OSR entry points (see write_osr_entries). this is
+  // only used when compiling a fragment that was running in the interpreter
+  std::vector<WhileStatement*> osr_loops;
+  int64_t function_body_stack_bytes_used; // stack_bytes_used after setup
+
+  // arguments of the inlined call being compiled (see
+  // write_inlined_function_call). they live in stack slots pushed by the
+  // caller; stack_bytes_used is the value it had just after the push
+  struct InlinedArgument {
+    Value type;
+    int64_t stack_bytes_used;
+
+    InlinedArgument(const Value& type, int64_t stack_bytes_used);
+  };
+  std::unordered_map<std::string, InlinedArgument> inlined_arguments;
+  // functions whose expressions have already been compiled into this fragment.
+  // labels are named after AST nodes, so each one can only be inlined once
+  std::unordered_set<int64_t> inlined_function_ids;
+
+  // locals whose instances don't escape the fragment, so they live in its
+  // stack frame below the locals (and the saved rbx, if any). all the
+  // constructions assigned to one of these locals use the same memory, so the
+  // previous instance is destroyed before each one
+  std::map<std::string, ssize_t> stack_instance_locals; // name -> rbp offset
+  std::unordered_map<const FunctionCall*, ssize_t> stack_instance_offsets;
+  std::unordered_map<const AssignmentStatement*, std::string> stack_instance_assignments;
+  size_t stack_instance_bytes;
+
   struct VariableLocation {
     std::string name;
     Value type;
@@ -146,6 +214,25 @@ private:
   bool evaluating_instance_pointer;
   bool in_finally_block;
 
+  // set by write_condition_check while its condition is being compiled. if
+  // the condition is a comparison that can jump to branch_false_label itself,
+  // it does so and sets branch_fused
+  const std::string* branch_false_label;
+  bool branch_fused;
+
+  // code cache state. when record_relocations is set, process-specific values
+  // are written into the code as placeholders; see relocatable_immediate
+  bool record_relocations;
+  std::vector<CodeRelocation> recorded_relocations;
+  std::vector<std::string> recorded_imported_module_names;
+  bool global_side_effects; // compiling changed something outside the fragment
+  std::unordered_set<const void*> recorded_called_fragment_code;
+  std::unordered_set<int64_t> recorded_callsite_tokens;
+  size_t elided_null_check_count;
+  size_t fused_branch_count;
+  size_t inlined_call_count;
+  size_t elided_refcount_pair_count;
+
   // output manager
   AMD64Assembler as;
 
@@ -163,9 +250,16 @@ private:
   int64_t write_push_reserved_registers();
   void write_pop_reserved_registers(int64_t registers);
 
+  void allocate_local_registers();
+  void allocate_stack_instances();
+  void write_spill_local_registers(bool for_call);
+  void write_reload_local_registers(bool after_call);
+
   bool is_always_truthy(const Value& type);
   bool is_always_falsey(const Value& type);
   void write_current_truth_value_test();
+  void write_condition_check(Expression* condition,
+      const std::string& false_label);
 
   void write_code_for_value(const Value& value);
 
@@ -177,16 +271,34 @@ private:
       const std::vector<MemoryReference>& float_args,
       ssize_t arg_stack_bytes = -1, Register return_register = Register::None,
       bool return_float = false);
-  void write_function_setup(const std::string& base_label, bool setup_special_regs);
+  struct FunctionCallArgumentValue;
+  void write_evaluate_function_call_argument(FunctionCall* a,
+      FunctionContext* fn, FunctionCallArgumentValue& arg, size_t arg_index);
+  void check_call_argument_annotations(FunctionContext* fn,
+      const std::vector<Value>& arg_types);
+  void write_inlined_function_call(FunctionCall* a, FunctionContext* fn,
+      std::vector<FunctionCallArgumentValue>& arg_values, Expression* expr);
+  void write_range_loop(ForStatement* a);
+  void write_statements(std::vector<std::shared_ptr<Statement>>& items);
+  void write_function_setup(const std::string& base_label,
+      bool setup_special_regs, const std::string& osr_entry_label = "");
+  void write_osr_entries(const std::string& base_label);
   void write_function_cleanup(const std::string& base_label, bool setup_special_regs);
 
   void write_add_reference(Register addr_reg);
   void write_delete_held_reference(const MemoryReference& mem);
-  void write_delete_reference(const MemoryReference& mem, ValueType type);
+  bool write_borrowed_read(Expression* expr, bool instance_pointer = false);
+  void write_delete_reference(const MemoryReference& mem, ValueType type,
+      bool known_non_null = false);
 
   void write_alloc_class_instance(int64_t class_id, bool initialize_attributes = true);
+  void write_init_stack_class_instance(int64_t class_id, ssize_t rbp_offset);
 
   void write_raise_exception(int64_t class_id, const wchar_t* message = NULL);
+  // counts the exception in r15 as raised, then unwinds it
+  void write_inline_dictionary_lookup(ArrayIndex* a, Register result_register,
+      const std::string& miss_label, const std::string& end_label);
+  void write_unwind_new_exception();
   void write_create_exception_block(
       const std::vector<std::pair<std::string, std::unordered_set<int64_t>>>& label_to_class_ids,
       const std::string& exception_return_label);
@@ -198,6 +310,12 @@ private:
   void adjust_stack(ssize_t bytes, bool write_opcode = true);
   void adjust_stack_to(ssize_t bytes, bool write_opcode = true);
 
+  int64_t relocatable_immediate(CodeRelocation::Type type, int64_t value,
+      int64_t id = 0, const std::string& data = "");
+  int64_t global_space_immediate(const ModuleContext* module);
+  int64_t constant_immediate(const std::string& value);
+  int64_t constant_immediate(const std::wstring& value);
+
   void write_load_double(Register reg, double value);
   void write_read_variable(Register target_register,
       Register float_target_register, const VariableLocation& loc);
@@ -207,6 +325,7 @@ private:
   VariableLocation location_for_global(ModuleContext* module,
       const std::string& name);
   VariableLocation location_for_variable(const std::string& name);
+  MemoryReference stack_slot_for_local(const std::string& name);
   VariableLocation location_for_attribute(ClassContext* cls,
       const std::string& name, Register instance_reg);
 
@@ -1,5 +1,9 @@
 #include "Compile.hh"
 
+#include <time.h>
+
+#include <exception>
+
 #include <phosg/Strings.hh>
 
 #include "../Debug.hh"
@@ -7,8 +11,15 @@
 #include "../AST/PythonParser.hh"
 #include "AnnotationVisitor.hh"
 #include "AnalysisVisitor.hh"
+#include "BackgroundCompiler.hh"
 #include "BuiltinFunctions.hh"
+#include "CodeCache.hh"
 #include "CompilationVisitor.hh"
+#include "Interpreter.hh"
+#include "IRCompiler.hh"
+#include "PerfMap.hh"
+#include "Profiler.hh"
+#include "Trace.hh"
 #include "../Types/List.hh"
 #include "../Types/Dictionary.hh"
 
@@ -55,19 +66,30 @@ int64_t construct_value(GlobalContext* global, const Value& value,
     case ValueType::Dict: {
       size_t (*key_length)(const void*) = NULL;
       uint8_t (*key_at)(const void*, size_t) = NULL;
+      uint64_t (*key_hash)(const void*) = NULL;
+      bool (*key_equal)(const void*, const void*) = NULL;
       if (value.extension_types[0].type == ValueType::Bytes) {
         key_length = reinterpret_cast<size_t (*)(const void*)>(bytes_length);
         key_at = reinterpret_cast<uint8_t (*)(const void*, size_t)>(bytes_at);
+        key_hash = reinterpret_cast<uint64_t (*)(const void*)>(bytes_hash);
+        key_equal = reinterpret_cast<bool (*)(const void*, const void*)>(bytes_equal);
       } else if (value.extension_types[0].type == ValueType::Unicode) {
         key_length = reinterpret_cast<size_t (*)(const void*)>(unicode_length);
         key_at = reinterpret_cast<uint8_t (*)(const void*, size_t)>(unicode_at);
-      } else {
-        throw compile_error("dictionary key type does not have sequence functions");
+        key_hash = reinterpret_cast<uint64_t (*)(const void*)>(unicode_hash);
+        key_equal = reinterpret_cast<bool (*)(const void*, const void*)>(unicode_equal);
+      } else if (value.extension_types[0].type == ValueType::Float) {
+        key_hash = dictionary_float_key_hash;
+        key_equal = dictionary_float_key_equal;
+      } else if ((value.extension_types[0].type != ValueType::Int) &&
+                 (value.extension_types[0].type != ValueType::Bool)) {
+        throw compile_error("dictionary key type cannot be hashed");
       }
 
       uint64_t flags = (type_has_refcount(value.extension_types[0].type) ? DictionaryFlag::KeysAreObjects : 0) |
           (type_has_refcount(value.extension_types[1].type) ? DictionaryFlag::ValuesAreObjects : 0);
-      DictionaryObject* d = dictionary_new(key_length, key_at, flags);
+      DictionaryObject* d = dictionary_new(key_length, key_at, key_hash,
+          key_equal, flags);
 
       for (const auto& item : *value.dict_value) {
         dictionary_insert(d,
@@ -133,12 +155,74 @@ void initialize_global_space_for_module(GlobalContext* global,
   }
 }
 
+static thread_local size_t compiler_lock_depth = 0;
+
+CompilerLock::CompilerLock(GlobalContext* global) : global(global),
+    locked(true) {
+  if (compiler_lock_depth++ == 0) {
+    this->global->compiler_mutex.lock();
+  }
+}
+
+CompilerLock::CompilerLock(GlobalContext* global,
+    const atomic<bool>& cancel) : global(global), locked(true) {
+  if (compiler_lock_depth == 0) {
+    while (!this->global->compiler_mutex.try_lock_for(chrono::milliseconds(1))) {
+      if (cancel) {
+        this->locked = false;
+        return;
+      }
+    }
+  }
+  compiler_lock_depth++;
+}
+
+CompilerLock::~CompilerLock() {
+  if (this->locked && (--compiler_lock_depth == 0)) {
+    this->global->compiler_mutex.unlock();
+  }
+}
+
+bool CompilerLock::is_held() {
+  return compiler_lock_depth != 0;
+}
+
+bool CompilerLock::is_locked() const {
+  return this->locked;
+}
+
+CompilerLock::Release::Release(GlobalContext* global) : global(global),
+    released(compiler_lock_depth == 1) {
+  if (this->released) {
+    compiler_lock_depth = 0;
+    this->global->compiler_mutex.unlock();
+  }
+}
+
+CompilerLock::Release::~Release() {
+  if (this->released) {
+    this->global->compiler_mutex.lock();
+    compiler_lock_depth = 1;
+  }
+}
+
+
+
 void advance_module_phase(GlobalContext* global, ModuleContext* module,
     ModuleContext::Phase phase) {
+  CompilerLock lock(global);
+
   if (module->phase >= phase) {
     return;
   }
 
+  // the background compiler can't do this, since it could run the module's
+  // root scope on the wrong thread
+  if (BackgroundCompiler::is_background_thread()) {
+    throw compile_error("module " + module->name +
+        " can\'t be imported by the background compiler");
+  }
+
   // prevent infinite recursion: advance_module_phase cannot be called for a
   // module on which it is already executing (unless it would do nothing, above)
   string scope_name = module->name + "+ADVANCE";
@@ -150,7 +234,13 @@ void advance_module_phase(GlobalContext* global, ModuleContext* module,
     switch (module->phase) {
       case ModuleContext::Phase::Initial: {
         if (module->source.get()) {
-          shared_ptr<PythonLexer> lexer(new PythonLexer(module->source));
+          shared_ptr<PythonLexer> lexer;
+          {
+            TraceScope t(global, "module", module->name + ": lex");
+            t.set_arg("module", module->name);
+            t.set_arg("source_size", module->source->file_size());
+            lexer.reset(new PythonLexer(module->source));
+          }
           if (debug_flags & DebugFlag::ShowLexDebug) {
             fprintf(stderr, "[%s] ======== module lexed\n", module->name.c_str());
             const auto& tokens = lexer->get_tokens();
@@ -164,8 +254,13 @@ void advance_module_phase(GlobalContext* global, ModuleContext* module,
             }
             fputc('\n', stderr);
           }
-          PythonParser parser(lexer);
-          module->ast_root = parser.get_root();
+          {
+            TraceScope t(global, "module", module->name + ": parse");
+            t.set_arg("module", module->name);
+            t.set_arg("token_count", lexer->get_tokens().size());
+            PythonParser parser(lexer);
+            module->ast_root = parser.get_root();
+          }
           if (debug_flags & DebugFlag::ShowParseDebug) {
             fprintf(stderr, "[%s] ======== module parsed\n", module->name.c_str());
             module->ast_root->print(stderr);
@@ -181,6 +276,8 @@ void advance_module_phase(GlobalContext* global, ModuleContext* module,
 
       case ModuleContext::Phase::Parsed: {
         if (module->ast_root.get()) {
+          TraceScope t(global, "module", module->name + ": annotate");
+          t.set_arg("module", module->name);
           AnnotationVisitor v(global, module);
           try {
             module->ast_root->accept(&v);
@@ -216,6 +313,8 @@ void advance_module_phase(GlobalContext* global, ModuleContext* module,
 
       case ModuleContext::Phase::Annotated: {
         if (module->ast_root.get()) {
+          TraceScope t(global, "module", module->name + ": analyze");
+          t.set_arg("module", module->name);
           AnalysisVisitor v(global, module);
           try {
             module->ast_root->accept(&v);
@@ -241,7 +340,12 @@ void advance_module_phase(GlobalContext* global, ModuleContext* module,
           fputc('\n', stderr);
         }
 
-        initialize_global_space_for_module(global, module);
+        {
+          TraceScope t(global, "module", module->name + ": initialize globals");
+          t.set_arg("module", module->name);
+          t.set_arg("global_count", module->global_variables.size());
+          initialize_global_space_for_module(global, module);
+        }
 
         if (debug_flags & DebugFlag::ShowAnalyzeDebug) {
           fprintf(stderr, "[%s] ======== global space statically initialized\n",
@@ -257,7 +361,7 @@ void advance_module_phase(GlobalContext* global, ModuleContext* module,
 
       case ModuleContext::Phase::Analyzed: {
         if (module->ast_root.get()) {
-          compile_fragment(global, module, &module->root_fragment);
+          compile_fragment(global, module, &module->root_fragment, "import");
 
           if (debug_flags & DebugFlag::ShowCompileDebug) {
             fprintf(stderr, "[%s] ======== executing root scope\n",
@@ -267,7 +371,16 @@ void advance_module_phase(GlobalContext* global, ModuleContext* module,
           // all imports are done statically, so we can't translate this to a
           // python exception - just fail
           void* (*compiled_root_scope)() = reinterpret_cast<void* (*)()>(const_cast<void*>(module->root_fragment.compiled));
-          void* exc = compiled_root_scope();
+          void* exc;
+          {
+            // the trace event includes the time spent importing other modules
+            // and compiling functions called from the root scope
+            TraceScope t(global, "module", module->name + ": execute root scope");
+            t.set_arg("module", module->name);
+            CompilerLock::Release unlock(global);
+            exc = compiled_root_scope();
+            t.set_arg("result", exc ? "exception" : "ok");
+          }
           if (exc) {
             const InstanceObject* i = reinterpret_cast<const InstanceObject*>(exc);
             ClassContext* cls = global->context_for_class(i->class_id);
@@ -311,14 +424,119 @@ void advance_module_phase(GlobalContext* global, ModuleContext* module,
       case ModuleContext::Phase::Imported:
         break; // nothing to do
     }
+
+    if (global->code_cache) {
+      global->code_cache->record_module_phase(module);
+    }
   }
 
   global->scopes_in_progress.erase(scope_name);
 }
 
 
+// assembles the fragment's code and makes it callable, and returns the code's
+// size. if the fragment was already compiled, its previous code is retired (see
+// GlobalContext::CodeBlock). if cache_key isn't empty, also saves it in the
+// code cache
+static size_t install_fragment_code(GlobalContext* global,
+    ModuleContext* module, Fragment* f, const string& scope_name,
+    AMD64Assembler& as, vector<CodeRelocation>& relocations,
+    const string& cache_key, const vector<string>& imported_module_names,
+    unordered_set<const void*>&& called_fragment_code,
+    unordered_set<int64_t>&& callsite_tokens) {
+  unordered_set<size_t> patch_offsets;
+  f->compiled_labels.clear();
+  string compiled = as.assemble(&patch_offsets, &f->compiled_labels);
+  CodeCache::apply_relocations(compiled, relocations);
+  if (f->compiled) {
+    // interpreter stubs aren't code blocks, so replacing one isn't counted as
+    // a recompilation
+    if (global->code_blocks.count(f->compiled)) {
+      global->fragments_recompiled++;
+    }
+    global->retire_code(f->compiled);
+  }
+  global->fragments_compiled++;
+  f->compiled = global->install_code(compiled, patch_offsets,
+      move(called_fragment_code), move(callsite_tokens));
+  module->compiled_size += compiled.size();
+
+  if (global->perf_map) {
+    global->perf_map->record_code(scope_name, f->compiled, compiled.size(),
+        f->compiled_labels);
+  }
+  if (global->profiler) {
+    global->profiler->record_fragment(f, module, compiled.size());
+  }
+
+  f->resolve_call_split_labels();
+  f->resolve_osr_entry_labels();
+
+  if (!cache_key.empty()) {
+    global->code_cache->save_fragment(global, cache_key, f, compiled,
+        patch_offsets, relocations, imported_module_names);
+  }
+
+  if (debug_flags & DebugFlag::ShowAssembly) {
+    fprintf(stderr, "[%s] ======== scope assembled\n", scope_name.c_str());
+    uint64_t addr = reinterpret_cast<uint64_t>(f->compiled);
+    string disassembly = AMD64Assembler::disassemble(f->compiled,
+        compiled.size(), addr, &f->compiled_labels);
+    fprintf(stderr, "\n%s", disassembly.c_str());
+
+    for (size_t x = 0; x < f->call_split_offsets.size(); x++) {
+      ssize_t offset = f->call_split_offsets[x];
+      if (offset < 0) {
+        fprintf(stderr, "# split %zu is missing\n", x);
+      } else {
+        uint64_t addr = reinterpret_cast<uint64_t>(reinterpret_cast<const uint8_t*>(f->compiled) + offset);
+        fprintf(stderr, "# split %zu at offset %zu (%016" PRIX64 ")\n", x, offset, addr);
+      }
+    }
+  }
+
+  return compiled.size();
+}
+
+// adds compile_fragment's time and failures to the global counters. compiling
+// a fragment can compile other fragments (e.g. eagerly compiled callees), so
+// only the outermost call on each thread adds its time. failures are counted
+// at each level that an exception passes through
+static thread_local size_t compile_fragment_depth = 0;
+
+class CompileCounterScope {
+public:
+  explicit CompileCounterScope(GlobalContext* global) : global(global),
+      start_nsecs(compile_fragment_depth++ ? 0 : this->now_nsecs()) { }
+  CompileCounterScope(const CompileCounterScope&) = delete;
+  CompileCounterScope(CompileCounterScope&&) = delete;
+  CompileCounterScope& operator=(const CompileCounterScope&) = delete;
+  CompileCounterScope& operator=(CompileCounterScope&&) = delete;
+
+  ~CompileCounterScope() {
+    if (uncaught_exception()) {
+      this->global->fragment_compile_failures++;
+    }
+    if (--compile_fragment_depth == 0) {
+      this->global->compile_nsecs += this->now_nsecs() - this->start_nsecs;
+    }
+  }
+
+private:
+  GlobalContext* global;
+  uint64_t start_nsecs;
+
+  static uint64_t now_nsecs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+  }
+};
+
 void compile_fragment(GlobalContext* global, ModuleContext* module,
-    Fragment* f) {
+    Fragment* f, const char* reason) {
+  CompileCounterScope counter_scope(global);
+
   if (f->function && (f->function->module != module)) {
     throw compile_error("module context does not match fragment function module");
   }
@@ -359,8 +577,76 @@ void compile_fragment(GlobalContext* global, ModuleContext* module,
     scope_name = module->name + "+ROOT";
   }
 
+  TraceScope t(global, "compile", scope_name);
+  t.set_arg("module", module->name);
+  t.set_arg("reason", reason);
+  t.set_arg("replaces_code", f->compiled ? 1 : 0);
+
+  // function fragments may be in the code cache. module root scopes are never
+  // cached since they're only compiled once per run anyway. if the fragment
+  // was already compiled, it's being recompiled because something it depends
+  // on changed, so the cached version can't be used
+  string cache_key;
+  if (global->code_cache && f->function) {
+    cache_key = global->code_cache->key_for_fragment(f);
+    if (!f->compiled &&
+        global->code_cache->load_fragment(global, module, f, cache_key)) {
+      size_t size = global->code_blocks.at(f->compiled).size;
+      global->fragments_loaded_from_cache++;
+      t.set_arg("result", "code cache");
+      t.set_arg("code_size", size);
+      if (global->perf_map) {
+        global->perf_map->record_code(scope_name, f->compiled, size,
+            f->compiled_labels);
+      }
+      if (global->profiler) {
+        global->profiler->record_fragment(f, module, size);
+      }
+      if (debug_flags & DebugFlag::ShowCompileDebug) {
+        fprintf(stderr, "[%s] ======== scope loaded from code cache\n\n",
+            scope_name.c_str());
+      }
+      return;
+    }
+  }
+
+  // if the interpreter tier is enabled, new function fragments run in the
+  // interpreter until they've been used enough, if possible. the interpreter
+  // compiles them by calling this function again when that happens
+  if (global->interpreter_call_threshold && f->function && !f->compiled &&
+      interpret_fragment_if_possible(global, f)) {
+    global->fragments_interpreted++;
+    t.set_arg("result", "interpreted");
+    if (debug_flags & DebugFlag::ShowCompileDebug) {
+      fprintf(stderr, "[%s] ======== scope will be interpreted\n\n",
+          scope_name.c_str());
+    }
+    return;
+  }
+
+  // if enabled, fragments in the scalar subset are compiled through the IR
+  // instead of by CompilationVisitor
+  if ((debug_flags & DebugFlag::IRCompilation) && f->function) {
+    AMD64Assembler as;
+    Value return_type;
+    if (compile_fragment_ir(global, f, scope_name, as, &return_type)) {
+      if (debug_flags & DebugFlag::ShowCompileDebug) {
+        fprintf(stderr, "[%s] ======== scope compiled through IR\n\n",
+            scope_name.c_str());
+      }
+      f->return_type = move(return_type);
+      f->osr_entry_labels.clear();
+      vector<CodeRelocation> relocations;
+      size_t size = install_fragment_code(global, module, f, scope_name, as,
+          relocations, cache_key, {}, {}, {});
+      t.set_arg("result", "compiled through IR");
+      t.set_arg("code_size", size);
+      return;
+    }
+  }
+
   // create the compilation visitor
-  CompilationVisitor v(global, module, f);
+  CompilationVisitor v(global, module, f, !cache_key.empty());
 
   if (!global->scopes_in_progress.emplace(scope_name).second) {
     throw compile_error("recursive compilation attempt");
@@ -376,7 +662,9 @@ void compile_fragment(GlobalContext* global, ModuleContext* module,
 
   } catch (const CompilationVisitor::terminated_by_split&) {
     // if the fragment is incomplete, return types may include Indeterminate,
-    // which we check for separately below
+    // which we check for separately below. incomplete fragments are recompiled
+    // when the split is resolved, so they can't be cached
+    cache_key.clear();
 
   } catch (compile_error& e) {
     if (e.where < 0) {
@@ -403,8 +691,12 @@ void compile_fragment(GlobalContext* global, ModuleContext* module,
   global->scopes_in_progress.erase(scope_name);
 
   if (debug_flags & DebugFlag::ShowCompileDebug) {
-    fprintf(stderr, "[%s] ======== scope compiled\n\n",
-        scope_name.c_str());
+    fprintf(stderr, "[%s] ======== scope compiled (peephole: %zu null checks "
+        "elided, %zu branches fused; %zu calls inlined; %zu refcount pairs "
+        "elided; %zu stack instances)\n\n", scope_name.c_str(),
+        v.get_elided_null_check_count(), v.get_fused_branch_count(),
+        v.get_inlined_call_count(), v.get_elided_refcount_pair_count(),
+        v.get_stack_instance_count());
   }
 
   // modules cannot return values
@@ -443,36 +735,29 @@ void compile_fragment(GlobalContext* global, ModuleContext* module,
     f->return_type = move(new_return_type);
   }
 
-  unordered_set<size_t> patch_offsets;
-  f->compiled_labels.clear();
-  string compiled = v.assembler().assemble(&patch_offsets, &f->compiled_labels);
-  f->compiled = global->code.append(compiled, &patch_offsets);
-  module->compiled_size += compiled.size();
-
-  f->resolve_call_split_labels();
-
-  if (debug_flags & DebugFlag::ShowAssembly) {
-    fprintf(stderr, "[%s] ======== scope assembled\n", scope_name.c_str());
-    uint64_t addr = reinterpret_cast<uint64_t>(f->compiled);
-    string disassembly = AMD64Assembler::disassemble(f->compiled,
-        compiled.size(), addr, &f->compiled_labels);
-    fprintf(stderr, "\n%s", disassembly.c_str());
-
-    for (size_t x = 0; x < f->call_split_offsets.size(); x++) {
-      ssize_t offset = f->call_split_offsets[x];
-      if (offset < 0) {
-        fprintf(stderr, "# split %zu is missing\n", x);
-      } else {
-        uint64_t addr = reinterpret_cast<uint64_t>(reinterpret_cast<const uint8_t*>(f->compiled) + offset);
-        fprintf(stderr, "# split %zu at offset %zu (%016" PRIX64 ")\n", x, offset, addr);
-      }
-    }
+  // fragments with global side effects can't be cached, since loading them
+  // wouldn't reproduce the side effects
+  if (v.has_global_side_effects()) {
+    cache_key.clear();
   }
+  size_t size = install_fragment_code(global, module, f, scope_name,
+      v.assembler(), v.relocations(), cache_key, v.imported_module_names(),
+      move(v.called_fragment_code()), move(v.created_callsite_tokens()));
+  t.set_arg("result", "compiled");
+  t.set_arg("code_size", size);
 }
 
 
 const void* jit_compile_scope(GlobalContext* global, int64_t callsite_token,
     uint64_t* int_args, void** raise_exception) {
+  // the trace event includes the time spent waiting for the lock
+  TraceScope t(global, "jit", "jit_compile_scope");
+  t.set_arg("callsite_token", callsite_token);
+
+  // if the background compiler is working on the fragment we need, this waits
+  // for it to finish
+  CompilerLock lock(global);
+
   if (debug_flags & DebugFlag::ShowJITEvents) {
     fprintf(stderr, "[jit_callsite:%" PRId64 "] ======== jit compile call\n",
         callsite_token);
@@ -484,6 +769,8 @@ const void* jit_compile_scope(GlobalContext* global, int64_t callsite_token,
       fprintf(stderr, "[jit_callsite:%" PRId64 "] failed: %s\n",
           callsite_token, what);
     }
+    t.set_arg("result", "error");
+    t.set_arg("error", what);
 
     // TODO: this is a memory leak! we need to call delete_reference
     // appropriately here based on the contents of int_args and their types
@@ -518,6 +805,9 @@ const void* jit_compile_scope(GlobalContext* global, int64_t callsite_token,
     return NULL;
   }
 
+  if (global->trace_writer) {
+    t.set_arg("callsite", callsite->str());
+  }
   if (debug_flags & DebugFlag::ShowJITEvents) {
     string s = callsite->str();
     fprintf(stderr, "[jit_callsite:%" PRId64 "] callsite is %s\n",
@@ -550,20 +840,17 @@ const void* jit_compile_scope(GlobalContext* global, int64_t callsite_token,
     caller_fragment = &callsite->caller_module->root_fragment;
   }
 
-  if (caller_fragment->call_split_offsets[callsite->caller_split_id] < 0) {
-    if (debug_flags & DebugFlag::ShowJITEvents) {
-      fprintf(stderr, "[jit_callsite:%" PRId64 "] caller fragment does not contain split %" PRId64 "; recompiling\n",
-          callsite_token, callsite->caller_split_id);
-    }
-
-    // get the callee function object
-    FunctionContext* callee_fn;
+  // get the callee function object, and compile a fragment for it if there
+  // isn't already one for these argument types. returns -1 (and sets
+  // raise_exception) on failure
+  FunctionContext* callee_fn = NULL;
+  auto get_or_compile_callee_fragment = [&]() -> int64_t {
     try {
       callee_fn = &global->function_id_to_context.at(callsite->callee_function_id);
     } catch (const out_of_range&) {
       *raise_exception = create_compiler_error_exception(
           "callee function context is missing");
-      return NULL;
+      return -1;
     }
 
     if (debug_flags & DebugFlag::ShowJITEvents) {
@@ -600,27 +887,80 @@ const void* jit_compile_scope(GlobalContext* global, int64_t callsite_token,
 
       // compile the thing
       try {
-        compile_fragment(global, callee_fn->module, &new_fragment);
+        compile_fragment(global, callee_fn->module, &new_fragment, "callsite");
       } catch (const compile_error& e) {
+        callee_fn->fragments.pop_back();
         *raise_exception = create_compiler_error_exception(e.what(),
             callee_fn->module->source.get(), e.where);
-        return NULL;
+        return -1;
       } catch (const exception& e) {
+        callee_fn->fragments.pop_back();
         *raise_exception = create_compiler_error_exception(e.what());
-        return NULL;
+        return -1;
       }
     }
 
     if (debug_flags & DebugFlag::ShowJITEvents) {
-      string s = callee_fn->fragments.back().return_type.str();
+      string s = callee_fn->fragments[callee_fragment_index].return_type.str();
       fprintf(stderr, "[jit_callsite:%" PRId64 "] using callee fragment %" PRId64 " with return type %s\n",
           callsite_token, callee_fragment_index, s.c_str());
+    }
+    return callee_fragment_index;
+  };
+
+  // if the callsite calls through a patchable target, the caller was compiled
+  // past the call already; just point the target at the callee fragment and
+  // return to the split, which will call it. if the fragment doesn't return
+  // the type the caller expected (this shouldn't happen), recompile the caller
+  // as if this were a normal split
+  bool recompile_caller = (caller_fragment->call_split_offsets[callsite->caller_split_id] < 0);
+  const char* recompile_reason = "split resolved";
+  if (callsite->call_target) {
+    int64_t callee_fragment_index = get_or_compile_callee_fragment();
+    if (callee_fragment_index < 0) {
+      return NULL;
+    }
+
+    const auto& callee_fragment = callee_fn->fragments[callee_fragment_index];
+    if (callee_fragment.return_type.types_equal(callsite->return_type)) {
+      callsite->call_target = callee_fragment.compiled;
+      global->call_targets_patched++;
+      if (debug_flags & DebugFlag::ShowJITEvents) {
+        fprintf(stderr, "[jit_callsite:%" PRId64 "] patched call target to %p\n",
+            callsite_token, callsite->call_target);
+      }
+
+    } else {
+      if (debug_flags & DebugFlag::ShowJITEvents) {
+        string expected_str = callsite->return_type.str();
+        string actual_str = callee_fragment.return_type.str();
+        fprintf(stderr, "[jit_callsite:%" PRId64 "] callee returns %s, but caller expected %s\n",
+            callsite_token, actual_str.c_str(), expected_str.c_str());
+      }
+      recompile_caller = true;
+      recompile_reason = "callee return type mismatch";
+    }
+
+  } else if (recompile_caller) {
+    if (debug_flags & DebugFlag::ShowJITEvents) {
+      fprintf(stderr, "[jit_callsite:%" PRId64 "] caller fragment does not contain split %" PRId64 "; recompiling\n",
+          callsite_token, callsite->caller_split_id);
+    }
+    if (get_or_compile_callee_fragment() < 0) {
+      return NULL;
+    }
+  }
+
+  if (recompile_caller) {
+    if (debug_flags & DebugFlag::ShowJITEvents) {
       fprintf(stderr, "[jit_callsite:%" PRId64 "] recompiling caller fragment\n",
           callsite_token);
     }
 
+    t.set_arg("caller_recompiled", 1);
     try {
-      compile_fragment(global, callsite->caller_module, caller_fragment);
+      compile_fragment(global, callsite->caller_module, caller_fragment,
+          recompile_reason);
     } catch (const compile_error& e) {
       *raise_exception = create_compiler_error_exception(e.what(),
           callee_fn->module->source.get(), e.where);
@@ -644,6 +984,23 @@ const void* jit_compile_scope(GlobalContext* global, int64_t callsite_token,
     fprintf(stderr, "[jit_callsite:%" PRId64 "] compilation successful; returning to %p\n",
         callsite_token, split_location);
   }
+  t.set_arg("result", "ok");
+  global->splits_resolved++;
+
+  // if the caller was recompiled, its previous code may be unreachable now.
+  // this can delete the callsite, so it has to happen last
+  if (recompile_caller && !(debug_flags & DebugFlag::NoCodeReclamation)) {
+    size_t bytes_reclaimed;
+    {
+      TraceScope reclaim_t(global, "jit", "reclaim_code");
+      bytes_reclaimed = global->reclaim_code();
+      reclaim_t.set_arg("reclaimed_bytes", bytes_reclaimed);
+    }
+    if (debug_flags & DebugFlag::ShowJITEvents) {
+      fprintf(stderr, "[jit_callsite:%" PRId64 "] reclaimed %zu bytes of retired code\n",
+          callsite_token, bytes_reclaimed);
+    }
+  }
 
   return split_location;
 }
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <atomic>
 #include <memory>
 #include <unordered_map>
 #include <string>
@@ -9,10 +10,54 @@
 
 
 
+// the compiler isn't thread-safe, so any thread that uses the compiler's state
+// (anything reachable from the GlobalContext that can change after startup)
+// must hold this lock. a thread can take it more than once
+class CompilerLock {
+public:
+  explicit CompilerLock(GlobalContext* global);
+  // like the above, but gives up waiting for the lock if cancel becomes true.
+  // is_locked() says whether the lock was taken
+  CompilerLock(GlobalContext* global, const std::atomic<bool>& cancel);
+  CompilerLock(const CompilerLock&) = delete;
+  CompilerLock(CompilerLock&&) = delete;
+  CompilerLock& operator=(const CompilerLock&) = delete;
+  CompilerLock& operator=(CompilerLock&&) = delete;
+  ~CompilerLock();
+
+  static bool is_held(); // by the current thread
+  bool is_locked() const; // by this object
+
+  // releases the lock while generated code runs, so the background compiler
+  // can work. the lock is only released if the current thread holds it
+  // exactly once; if it holds it more than once, a compilation is in progress
+  // further up the stack and its state must not change
+  class Release {
+  public:
+    explicit Release(GlobalContext* global);
+    Release(const Release&) = delete;
+    Release(Release&&) = delete;
+    Release& operator=(const Release&) = delete;
+    Release& operator=(Release&&) = delete;
+    ~Release();
+
+  private:
+    GlobalContext* global;
+    bool released;
+  };
+
+private:
+  GlobalContext* global;
+  bool locked;
+};
+
 void advance_module_phase(GlobalContext* global, ModuleContext* module,
     ModuleContext::Phase phase);
 
-void compile_fragment(GlobalContext* global, ModuleContext* module, Fragment* f);
+// reason describes why the fragment is being compiled (e.g. "eager" or
+// "interpreter threshold"); it's only used in traces
+void compile_fragment(GlobalContext* global, ModuleContext* module, Fragment* f,
+    const char* reason);
 
 void initialize_global_space_for_module(GlobalContext* global,
     ModuleContext* module);
@@ -1,6 +1,7 @@
 #include "Contexts.hh"
 
 #include <inttypes.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -13,8 +14,12 @@
 #include "../AST/PythonLexer.hh"
 #include "../AST/PythonParser.hh"
 #include "../AST/PythonASTNodes.hh"
+#include "../Types/Allocator.hh"
 #include "../Types/Instance.hh"
+#include "BackgroundCompiler.hh"
 #include "BuiltinFunctions.hh"
+#include "Exception.hh"
+#include "Interpreter.hh"
 
 using namespace std;
 
@@ -51,7 +56,7 @@ BuiltinClassDefinition::BuiltinClassDefinition(const char* name,
 
 Fragment::Fragment(FunctionContext* fn, size_t index,
     const std::vector<Value>& arg_types) : function(fn), index(index),
-    arg_types(arg_types) { }
+    arg_types(arg_types), compiled(NULL) { }
 
 Fragment::Fragment(FunctionContext* fn, size_t index,
     const std::vector<Value>& arg_types, Value return_type,
@@ -81,6 +86,20 @@ void Fragment::resolve_call_split_labels() {
   }
 }
 
+void Fragment::resolve_osr_entry_labels() {
+  unordered_map<string, const WhileStatement*> label_to_loop;
+  for (const auto& it : this->osr_entry_labels) {
+    label_to_loop.emplace(it.second, it.first);
+  }
+
+  this->osr_entry_offsets.clear();
+  for (const auto& it : this->compiled_labels) {
+    try {
+      this->osr_entry_offsets.emplace(label_to_loop.at(it.second), it.first);
+    } catch (const out_of_range&) { }
+  }
+}
+
 
 
 ClassContext::ClassAttribute::ClassAttribute(const std::string& name,
@@ -89,7 +108,8 @@ ClassContext::ClassAttribute::ClassAttribute(const std::string& name,
 
 
 ClassContext::ClassContext(ModuleContext* module, int64_t id) : module(module),
-    id(id), ast_root(NULL), destructor(NULL) { }
+    id(id), ast_root(NULL), destructor(NULL), instance_allocation_count(0),
+    instance_free_count(0) { }
 
 int64_t ClassContext::attribute_count() const {
   return this->attributes.size();
@@ -112,13 +132,15 @@ int64_t ClassContext::offset_for_attribute(size_t index) const {
 
 FunctionContext::FunctionContext(ModuleContext* module, int64_t id) :
     module(module), id(id), class_id(0), ast_root(NULL), num_splits(0),
-    pass_exception_block(false) { }
+    pass_exception_block(false), indexed_fragment_count(0),
+    last_call_fragment_index(-1), last_call_fragment_count(0) { }
 
 FunctionContext::FunctionContext(ModuleContext* module, int64_t id,
     const char* name, const vector<BuiltinFragmentDefinition>& fragments,
     bool pass_exception_block) : module(module), id(id), class_id(0),
     name(name), ast_root(NULL), num_splits(0),
-    pass_exception_block(pass_exception_block) {
+    pass_exception_block(pass_exception_block), indexed_fragment_count(0),
+    last_call_fragment_index(-1), last_call_fragment_count(0) {
 
   // populate the arguments from the first fragment definition
   for (const auto& arg : fragments[0].arg_types) {
@@ -163,29 +185,96 @@ bool FunctionContext::is_builtin() const {
   return !this->ast_root;
 }
 
+static void append_type_signature(string& signature, const Value& type) {
+  signature.push_back(static_cast<char>(type.type));
+  if (type.type == ValueType::Instance) {
+    signature.append(reinterpret_cast<const char*>(&type.class_id),
+        sizeof(type.class_id));
+  }
+  if (!type.extension_types.empty()) {
+    signature.push_back('[');
+    for (const Value& extension_type : type.extension_types) {
+      append_type_signature(signature, extension_type);
+    }
+    signature.push_back(']');
+  }
+}
+
+string FunctionContext::signature_for_types(const vector<Value>& types) {
+  // this ignores values, just like match_values_to_types does
+  string signature;
+  for (const Value& type : types) {
+    append_type_signature(signature, type);
+  }
+  return signature;
+}
+
 int64_t FunctionContext::fragment_index_for_call_args(
     const vector<Value>& arg_types) const {
-  // go through the existing fragments and see if there are any that can satisfy
-  // this call. if there are multiple matches, choose the most specific one (
-  // the one that has the fewest Indeterminate substitutions)
-  // TODO: this is linear in the number of fragments. make it faster somehow
+  string signature = this->signature_for_types(arg_types);
+
+  // fragments are only ever added or removed at the end of the list, and only
+  // fragments that haven't finished compiling are ever removed. if the list got
+  // shorter than the index, something else happened; start over
+  if (this->fragments.size() < this->indexed_fragment_count) {
+    this->signature_to_fragment_index.clear();
+    this->indexed_fragment_count = 0;
+    this->last_call_fragment_count = 0;
+  }
+  for (; (this->indexed_fragment_count < this->fragments.size()) &&
+         this->fragments[this->indexed_fragment_count].compiled;
+       this->indexed_fragment_count++) {
+    const auto& fragment = this->fragments[this->indexed_fragment_count];
+    this->signature_to_fragment_index.emplace(
+        this->signature_for_types(fragment.arg_types),
+        this->indexed_fragment_count);
+  }
+
+  // if this is the same call as last time and no fragments have been added
+  // since then, the answer is the same
+  if ((this->last_call_fragment_count == this->fragments.size()) &&
+      (this->last_call_signature == signature)) {
+    return this->last_call_fragment_index;
+  }
+
+  // if there's a fragment that takes exactly these types, use it - there can't
+  // be a more specific match than that
   int64_t fragment_index = -1;
-  int64_t best_match_score = -1;
-  for (size_t x = 0; x < this->fragments.size(); x++) {
-    auto& fragment = this->fragments[x];
+  auto it = this->signature_to_fragment_index.find(signature);
+  if (it != this->signature_to_fragment_index.end()) {
+    fragment_index = it->second;
 
-    int64_t score = this->module->global->match_values_to_types(
-        fragment.arg_types, arg_types);
-    if (score < 0) {
-      continue; // not a match
-    }
+  } else {
+    // go through the existing fragments and see if there are any that can
+    // satisfy this call. if there are multiple matches, choose the most
+    // specific one (the one that has the fewest Indeterminate substitutions)
+    int64_t best_match_score = -1;
+    for (size_t x = 0; x < this->fragments.size(); x++) {
+      auto& fragment = this->fragments[x];
+
+      int64_t score = this->module->global->match_values_to_types(
+          fragment.arg_types, arg_types);
+      if (score < 0) {
+        continue; // not a match
+      }
 
-    if ((best_match_score < 0) || (score < best_match_score)) {
-      fragment_index = x;
-      best_match_score = score;
+      if ((best_match_score < 0) || (score < best_match_score)) {
+        fragment_index = x;
+        best_match_score = score;
+      }
     }
   }
 
+  // only remember the result if every fragment is compiled. fragments that are
+  // still compiling may be removed if compilation fails, and a failed lookup
+  // will probably be followed by a new fragment being compiled
+  if ((fragment_index >= 0) &&
+      (this->indexed_fragment_count == this->fragments.size())) {
+    this->last_call_signature = move(signature);
+    this->last_call_fragment_index = fragment_index;
+    this->last_call_fragment_count = this->fragments.size();
+  }
+
   return fragment_index;
 }
 
@@ -364,8 +453,14 @@ ModuleContext::GlobalVariable::GlobalVariable(const Value& value, size_t index,
 
 
 GlobalContext::GlobalContext(const vector<string>& import_paths) :
+    interpreter_call_threshold(0), interpreter_back_edge_threshold(0),
     import_paths(import_paths), next_user_function_id(1),
-    next_builtin_function_id(-1), next_callsite_token(1) {
+    next_builtin_function_id(-1), next_callsite_token(1),
+    reclaimed_code_bytes(0), reclaimed_code_block_count(0),
+    fragments_compiled(0), fragments_recompiled(0),
+    fragments_loaded_from_cache(0), fragments_interpreted(0),
+    fragment_compile_failures(0), splits_resolved(0), call_targets_patched(0),
+    code_bytes_installed(0), compile_nsecs(0) {
   this->builtins_module = create_builtin_module(this, "builtins");
   if (!this->builtins_module) {
     throw logic_error("builtins module does not exist");
@@ -373,19 +468,23 @@ GlobalContext::GlobalContext(const vector<string>& import_paths) :
 }
 
 GlobalContext::~GlobalContext() {
+  if (this->background_compiler) {
+    this->background_compiler->stop();
+  }
+
   for (const auto& it : this->bytes_constants) {
     if (debug_flags & DebugFlag::ShowRefcountChanges) {
       fprintf(stderr, "[refcount:constants] deleting Bytes constant %s\n",
           it.second->data);
     }
-    delete_reference(it.second);
+    destroy_immortal(it.second);
   }
   for (const auto& it : this->unicode_constants) {
     if (debug_flags & DebugFlag::ShowRefcountChanges) {
       fprintf(stderr, "[refcount:constants] deleting Unicode constant %ls\n",
-          it.second->data);
+          it.first.c_str());
     }
-    delete_reference(it.second);
+    destroy_immortal(it.second);
   }
 }
 
@@ -396,7 +495,8 @@ GlobalContext::UnresolvedFunctionCall::UnresolvedFunctionCall(
     callee_function_id(callee_function_id), arg_types(arg_types),
     caller_module(caller_module), caller_function_id(caller_function_id),
     caller_fragment_index(caller_fragment_index),
-    caller_split_id(caller_split_id) { }
+    caller_split_id(caller_split_id), return_type(ValueType::Indeterminate),
+    call_target(NULL) { }
 
 string GlobalContext::UnresolvedFunctionCall::str() const {
   string arg_types_str;
@@ -406,10 +506,244 @@ string GlobalContext::UnresolvedFunctionCall::str() const {
     }
     arg_types_str += v.str();
   }
+  string return_type_str = this->return_type.str();
   return string_printf("UnresolvedFunctionCall(%" PRId64 ", [%s], %p(%s), %" PRId64
-      ", %" PRId64 ", %" PRId64 ")", this->callee_function_id, arg_types_str.c_str(),
-      this->caller_module, this->caller_module->name.c_str(), this->caller_function_id,
-      this->caller_fragment_index, this->caller_split_id);
+      ", %" PRId64 ", %" PRId64 ", %s, %p)", this->callee_function_id,
+      arg_types_str.c_str(), this->caller_module,
+      this->caller_module->name.c_str(), this->caller_function_id,
+      this->caller_fragment_index, this->caller_split_id,
+      return_type_str.c_str(), this->call_target);
+}
+
+GlobalContext::CodeBlock::CodeBlock(size_t size,
+    unordered_set<const void*>&& referenced_blocks,
+    unordered_set<int64_t>&& callsite_tokens) : size(size), retired(false),
+    referenced_blocks(move(referenced_blocks)),
+    callsite_tokens(move(callsite_tokens)) { }
+
+const void* GlobalContext::install_code(const string& code,
+    const unordered_set<size_t>& patch_offsets,
+    unordered_set<const void*>&& referenced_blocks,
+    unordered_set<int64_t>&& callsite_tokens) {
+
+  // use the first reclaimed region that's large enough, if any. like
+  // CodeBuffer::append, this adds the code's address to each patch offset
+  const void* ret = NULL;
+  for (auto it = this->reclaimed_code_space.begin();
+       it != this->reclaimed_code_space.end(); it++) {
+    if (it->second < code.size()) {
+      continue;
+    }
+
+    uint8_t* dest = reinterpret_cast<uint8_t*>(const_cast<void*>(it->first));
+    memcpy(dest, code.data(), code.size());
+    for (size_t offset : patch_offsets) {
+      *reinterpret_cast<uint64_t*>(dest + offset) += reinterpret_cast<uint64_t>(dest);
+    }
+
+    size_t remaining_size = it->second - code.size();
+    this->reclaimed_code_space.erase(it);
+    if (remaining_size) {
+      this->reclaimed_code_space.emplace(dest + code.size(), remaining_size);
+    }
+    ret = dest;
+    break;
+  }
+  if (!ret) {
+    ret = this->code.append(code, &patch_offsets);
+  }
+
+  this->code_blocks.emplace(piecewise_construct, forward_as_tuple(ret),
+      forward_as_tuple(code.size(), move(referenced_blocks),
+        move(callsite_tokens)));
+  this->code_bytes_installed += code.size();
+  return ret;
+}
+
+void GlobalContext::retire_code(const void* code) {
+  auto it = this->code_blocks.find(code);
+  if (it != this->code_blocks.end()) {
+    it->second.retired = true;
+  }
+}
+
+// returns the code block that contains the given address, or end() if there
+// isn't one. the end address of each block is included, since a call at the
+// end of a block returns there
+static map<const void*, GlobalContext::CodeBlock>::iterator block_containing(
+    map<const void*, GlobalContext::CodeBlock>& blocks, const void* addr) {
+  auto it = blocks.upper_bound(addr);
+  if (it == blocks.begin()) {
+    return blocks.end();
+  }
+  it--;
+  const uint8_t* end = reinterpret_cast<const uint8_t*>(it->first) + it->second.size;
+  return (addr <= end) ? it : blocks.end();
+}
+
+static pair<const void* const*, const void* const*> current_thread_stack() {
+  // the caller's frame and everything above it are scanned
+  const void* top;
+#ifdef MACOSX
+  top = pthread_get_stackaddr_np(pthread_self());
+#else // LINUX
+  pthread_attr_t attr;
+  void* stack_addr;
+  size_t stack_size;
+  pthread_getattr_np(pthread_self(), &attr);
+  pthread_attr_getstack(&attr, &stack_addr, &stack_size);
+  pthread_attr_destroy(&attr);
+  top = reinterpret_cast<const uint8_t*>(stack_addr) + stack_size;
+#endif
+  uintptr_t bottom = reinterpret_cast<uintptr_t>(__builtin_frame_address(0));
+  return make_pair(reinterpret_cast<const void* const*>(bottom & ~7),
+      reinterpret_cast<const void* const*>(top));
+}
+
+size_t GlobalContext::reclaim_code() {
+  bool any_retired = false;
+  for (const auto& it : this->code_blocks) {
+    any_retired |= it.second.retired;
+  }
+  if (!any_retired) {
+    return 0;
+  }
+
+  // a retired block can still be executed if it's reachable from a live
+  // block (through a direct call or a callsite target), from an interpreter
+  // stub, or from the stack. the stack is scanned conservatively: any word
+  // that points into a block counts, which also catches exception handler
+  // addresses in exception blocks
+  unordered_set<const void*> reachable;
+  vector<const void*> pending;
+  auto mark = [&](const void* addr) {
+    auto it = block_containing(this->code_blocks, addr);
+    if ((it != this->code_blocks.end()) && it->second.retired &&
+        reachable.emplace(it->first).second) {
+      pending.emplace_back(it->first);
+    }
+  };
+  auto mark_references = [&](const CodeBlock& block) {
+    for (const void* addr : block.referenced_blocks) {
+      mark(addr);
+    }
+    for (int64_t token : block.callsite_tokens) {
+      auto callsite_it = this->unresolved_callsites.find(token);
+      if (callsite_it != this->unresolved_callsites.end()) {
+        mark(callsite_it->second.call_target);
+      }
+    }
+  };
+
+  for (const auto& it : this->code_blocks) {
+    if (!it.second.retired) {
+      mark_references(it.second);
+    }
+  }
+  for (const auto& it : this->function_id_to_context) {
+    for (const auto& fragment : it.second.fragments) {
+      if (fragment.interpreted.get()) {
+        mark(fragment.interpreted->target);
+      }
+    }
+  }
+  auto stack = current_thread_stack();
+  for (const void* const* word = stack.first; word < stack.second; word++) {
+    mark(*word);
+  }
+  while (!pending.empty()) {
+    const void* addr = pending.back();
+    pending.pop_back();
+    mark_references(this->code_blocks.at(addr));
+  }
+
+  // free everything else, and merge the freed space with adjacent free regions
+  size_t bytes_freed = 0;
+  for (auto it = this->code_blocks.begin(); it != this->code_blocks.end();) {
+    if (!it->second.retired || reachable.count(it->first)) {
+      it++;
+      continue;
+    }
+
+    for (int64_t token : it->second.callsite_tokens) {
+      this->unresolved_callsites.erase(token);
+    }
+
+    // fill the block with int3 so any stray jump into it traps immediately
+    uint8_t* addr = reinterpret_cast<uint8_t*>(const_cast<void*>(it->first));
+    size_t size = it->second.size;
+    memset(addr, 0xCC, size);
+    bytes_freed += size;
+    this->reclaimed_code_block_count++;
+
+    auto next_it = this->reclaimed_code_space.lower_bound(addr);
+    if ((next_it != this->reclaimed_code_space.end()) &&
+        (next_it->first == addr + size)) {
+      size += next_it->second;
+      next_it = this->reclaimed_code_space.erase(next_it);
+    }
+    if (next_it != this->reclaimed_code_space.begin()) {
+      auto prev_it = prev(next_it);
+      if (reinterpret_cast<const uint8_t*>(prev_it->first) + prev_it->second == addr) {
+        prev_it->second += size;
+        size = 0;
+      }
+    }
+    if (size) {
+      this->reclaimed_code_space.emplace(addr, size);
+    }
+
+    it = this->code_blocks.erase(it);
+  }
+
+  this->reclaimed_code_bytes += bytes_freed;
+  return bytes_freed;
+}
+
+size_t GlobalContext::reclaimed_code_space_size() const {
+  size_t ret = 0;
+  for (const auto& it : this->reclaimed_code_space) {
+    ret += it.second;
+  }
+  return ret;
+}
+
+vector<pair<string, uint64_t>> GlobalContext::counters() const {
+  vector<pair<string, uint64_t>> ret({
+    {"fragments_compiled", this->fragments_compiled},
+    {"fragments_recompiled", this->fragments_recompiled},
+    {"fragments_loaded_from_cache", this->fragments_loaded_from_cache},
+    {"fragments_interpreted", this->fragments_interpreted},
+    {"fragment_compile_failures", this->fragment_compile_failures},
+    {"splits_resolved", this->splits_resolved},
+    {"call_targets_patched", this->call_targets_patched},
+    {"code_bytes_installed", this->code_bytes_installed},
+    {"code_bytes_reclaimed", this->reclaimed_code_bytes},
+    {"compile_nsecs", this->compile_nsecs},
+    {"exceptions_raised", exception_raise_count},
+    {"exceptions_unwound", exception_unwind_count},
+  });
+
+  for (size_t x = 0; x < allocator_object_type_count; x++) {
+    string prefix = string("objects.") + name_for_allocator_object_type(x);
+    ret.emplace_back(prefix + ".allocated", allocator_object_allocation_count(x));
+    ret.emplace_back(prefix + ".freed", allocator_object_free_count(x));
+  }
+
+  // class_id_to_context is unordered, so sort the classes by id to keep the
+  // order stable
+  map<int64_t, const ClassContext*> classes;
+  for (const auto& it : this->class_id_to_context) {
+    if (it.second.module) {
+      classes.emplace(it.first, &it.second);
+    }
+  }
+  for (const auto& it : classes) {
+    string prefix = "instances." + it.second->module->name + "." + it.second->name;
+    ret.emplace_back(prefix + ".allocated", it.second->instance_allocation_count);
+    ret.emplace_back(prefix + ".freed", it.second->instance_free_count);
+  }
+  return ret;
 }
 
 static void print_source_location(FILE* stream, shared_ptr<const SourceFile> f,
@@ -602,6 +936,7 @@ const BytesObject* GlobalContext::get_or_create_constant(const string& s,
     o = this->bytes_constants.at(s);
   } catch (const out_of_range& e) {
     o = bytes_new(s.data(), s.size());
+    bytes_intern(o);
     this->bytes_constants.emplace(s, o);
   }
   return o;
@@ -618,6 +953,7 @@ const UnicodeObject* GlobalContext::get_or_create_constant(const wstring& s,
     o = this->unicode_constants.at(s);
   } catch (const out_of_range& e) {
     o = unicode_new(s.data(), s.size());
+    unicode_intern(o);
     this->unicode_constants.emplace(s, o);
   }
   return o;
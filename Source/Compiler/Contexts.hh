@@ -3,6 +3,7 @@
 #include <atomic>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <set>
 #include <stdexcept>
 #include <string>
@@ -31,6 +32,12 @@ public:
 struct ModuleContext;
 struct FunctionContext;
 struct GlobalContext;
+class CodeCache;
+class PerfMap;
+class Profiler;
+class TraceWriter;
+class BackgroundCompiler;
+struct InterpretedFragment;
 
 struct BuiltinFragmentDefinition {
   std::vector<Value> arg_types;
@@ -78,6 +85,16 @@ struct Fragment {
   const void* compiled;
   std::multimap<size_t, std::string> compiled_labels;
 
+  // if the fragment is running in the interpreter tier, compiled points to a
+  // stub that calls the interpreter (see Interpreter.hh)
+  std::shared_ptr<InterpretedFragment> interpreted;
+
+  // entry points that continue an interpreted call in the compiled code at the
+  // top of a loop (on-stack replacement). these only exist if the fragment was
+  // compiled after running in the interpreter
+  std::unordered_map<const WhileStatement*, std::string> osr_entry_labels;
+  std::unordered_map<const WhileStatement*, size_t> osr_entry_offsets;
+
   Fragment() = delete;
 
   // dynamic function constructor
@@ -89,6 +106,7 @@ struct Fragment {
       const void* compiled);
 
   void resolve_call_split_labels();
+  void resolve_osr_entry_labels();
 };
 
 
@@ -121,6 +139,12 @@ struct ClassContext {
   // the following are valid when the owning module is Imported or later
   const void* destructor; // generated when class def is visited by CompilationVisitor
 
+  // heap instances created and destroyed, for classes defined in Python code.
+  // generated code updates these directly, without the lock prefix (only the
+  // main thread runs generated code). stack instances aren't counted
+  uint64_t instance_allocation_count;
+  uint64_t instance_free_count;
+
   ClassContext(ModuleContext* module, int64_t id);
 
   void populate_dynamic_attributes();
@@ -168,6 +192,16 @@ struct FunctionContext {
   // the following are valid when the owning module is Imported or later
   std::vector<Fragment> fragments;
 
+  // lookup caches for fragment_index_for_call_args. signature_to_fragment_index
+  // indexes the fragments before indexed_fragment_count (only fragments that
+  // have finished compiling are indexed); the last_call_* fields remember the
+  // most recent lookup
+  mutable std::unordered_map<std::string, int64_t> signature_to_fragment_index;
+  mutable size_t indexed_fragment_count;
+  mutable std::string last_call_signature;
+  mutable int64_t last_call_fragment_index;
+  mutable size_t last_call_fragment_count;
+
   // constructor for dynamic functions (defined in .py files)
   FunctionContext(ModuleContext* module, int64_t id);
 
@@ -182,6 +216,7 @@ struct FunctionContext {
   // gets the index of the fragment that satisfies the given call args, or -1 if
   // no appropriate fragment exists
   int64_t fragment_index_for_call_args(const std::vector<Value>& arg_types) const;
+  static std::string signature_for_types(const std::vector<Value>& types);
 
   // gets the appropriate type for the given annotation
   Value type_for_annotation(std::shared_ptr<const TypeAnnotation> type_annotation) const;
@@ -250,6 +285,18 @@ struct ModuleContext {
 
 struct GlobalContext {
   CodeBuffer code;
+  std::shared_ptr<CodeCache> code_cache; // NULL unless enabled with -C
+  std::shared_ptr<BackgroundCompiler> background_compiler; // NULL unless enabled
+  std::shared_ptr<PerfMap> perf_map; // NULL unless enabled with -P
+  std::shared_ptr<Profiler> profiler; // NULL until a profile is started
+  std::shared_ptr<TraceWriter> trace_writer; // NULL unless enabled with -t
+
+  // fragments run in the interpreter until they've been called this many times
+  // or their loops have run this many iterations. 0 disables the interpreter
+  size_t interpreter_call_threshold;
+  size_t interpreter_back_edge_threshold;
+
+  std::timed_mutex compiler_mutex; // use CompilerLock instead of locking this directly
 
   std::unordered_map<std::string, std::shared_ptr<ModuleContext>> modules;
   std::shared_ptr<ModuleContext> builtins_module;
@@ -290,6 +337,15 @@ struct GlobalContext {
     int64_t caller_fragment_index;
     int64_t caller_split_id;
 
+    // if the callee's return type is known before it's compiled, the caller
+    // doesn't have to be recompiled when the callee is. in this case the
+    // callsite calls through call_target, which points to
+    // _resolve_function_call until the callee fragment exists, and is then
+    // patched to point to the fragment. return_type is Indeterminate for
+    // callsites that split the caller instead
+    Value return_type;
+    const void* call_target;
+
     UnresolvedFunctionCall(int64_t callee_function_id,
         const std::vector<Value>& arg_types, ModuleContext* caller_module,
         int64_t caller_function_id, int64_t caller_fragment_index,
@@ -298,11 +354,44 @@ struct GlobalContext {
     std::string str() const;
   };
 
-  // TODO: these should be in the fragment, not in the global context, so we can
-  // clean them up when a fragment is recompiled
+  // callsites are owned by the code block that calls them (see below), and are
+  // deleted when that block is reclaimed
   std::unordered_map<int64_t, UnresolvedFunctionCall> unresolved_callsites;
   std::atomic<int64_t> next_callsite_token;
 
+  // every compiled fragment and class destructor is a code block. when a
+  // fragment is recompiled, its previous block is retired, but it can't be
+  // freed yet - other code may still call it directly, a callsite's target may
+  // point to it, or a frame on the stack may return into it. reclaim_code
+  // frees retired blocks once none of these are true, and install_code reuses
+  // their space for new code
+  struct CodeBlock {
+    size_t size;
+    bool retired;
+    std::unordered_set<const void*> referenced_blocks; // called directly
+    std::unordered_set<int64_t> callsite_tokens; // owned by this block
+
+    CodeBlock(size_t size, std::unordered_set<const void*>&& referenced_blocks,
+        std::unordered_set<int64_t>&& callsite_tokens);
+  };
+  std::map<const void*, CodeBlock> code_blocks;
+  std::map<const void*, size_t> reclaimed_code_space; // address -> size
+  size_t reclaimed_code_bytes; // total over all reclaim_code calls
+  size_t reclaimed_code_block_count;
+
+  // compiler activity counters. these are only changed while holding the
+  // compiler lock; counters() returns them along with the runtime's exception
+  // and allocation counters
+  uint64_t fragments_compiled; // includes recompilations
+  uint64_t fragments_recompiled;
+  uint64_t fragments_loaded_from_cache;
+  uint64_t fragments_interpreted;
+  uint64_t fragment_compile_failures;
+  uint64_t splits_resolved; // jit_compile_scope calls that returned to a split
+  uint64_t call_targets_patched;
+  uint64_t code_bytes_installed; // by install_code, including cache loads
+  uint64_t compile_nsecs; // wall time in compile_fragment, not double-counted
+
 
   GlobalContext(const std::vector<std::string>& import_paths);
   ~GlobalContext();
@@ -320,6 +409,27 @@ struct GlobalContext {
   ClassContext* context_for_class(int64_t class_id,
       ModuleContext* module_for_create = NULL);
 
+  // copies the code into a reclaimed region if one is large enough, or appends
+  // it to the code buffer otherwise, and creates a code block for it
+  const void* install_code(const std::string& code,
+      const std::unordered_set<size_t>& patch_offsets,
+      std::unordered_set<const void*>&& referenced_blocks = {},
+      std::unordered_set<int64_t>&& callsite_tokens = {});
+  // marks a code block as retired. does nothing if the address isn't the start
+  // of a code block (e.g. for interpreter stubs)
+  void retire_code(const void* code);
+  // frees all retired code blocks that can no longer be executed, and returns
+  // the number of bytes freed. this scans the calling thread's stack for
+  // return addresses, so it must only be called on the thread that runs
+  // generated code
+  size_t reclaim_code();
+  // returns the number of bytes of reclaimed space that hasn't been reused yet
+  size_t reclaimed_code_space_size() const;
+
+  // returns all counters by name, in a stable order. the caller must hold the
+  // compiler lock
+  std::vector<std::pair<std::string, uint64_t>> counters() const;
+
   const BytesObject* get_or_create_constant(const std::string& s,
       bool use_shared_constants = true);
   const UnicodeObject* get_or_create_constant(const std::wstring& s,
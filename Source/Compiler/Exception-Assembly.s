@@ -1,5 +1,20 @@
 .intel_syntax noprefix
 
+# exception counters (see Exception.hh). only the main thread raises exceptions
+# in nemesys code, so these are incremented without the lock prefix
+.data
+.globl exception_raise_count
+.globl _exception_raise_count
+exception_raise_count:
+_exception_raise_count:
+  .quad 0
+.globl exception_unwind_count
+.globl _exception_unwind_count
+exception_unwind_count:
+_exception_unwind_count:
+  .quad 0
+.text
+
 # exception unwinding entry point from c code. this function searches the
 # exception blocks for one that matches the active exception and rewinds the
 # stack to that point. this function never returns to the point where it was
@@ -22,6 +37,7 @@ _raise_python_exception__block_valid:
 _raise_python_exception__exc_valid:
   mov r14, rdi
   mov r15, rsi
+  inc qword ptr [rip + exception_raise_count]
 
 # exception unwinding entry point when called from nemesys code. note that this
 # function does not follow the system v calling convention that we adhere to in
@@ -66,6 +82,8 @@ __unwind_exception_internal__check_spec_match__check_class_id:
   jmp __unwind_exception_internal__check_spec_match
 
 __unwind_exception_internal__restore_block:
+  inc qword ptr [rip + exception_unwind_count]
+
   # load rsp and rbp from the exception block, remove the exception block from
   # the list in r14, and jump to the rip from the exception spec (r8)
   mov rsp, [r14 + 8]
@@ -45,6 +45,14 @@ extern "C" {
 
 // everything in here is implemented in Exception-Assembly.s
 
+// the number of exceptions raised (by raise_python_exception, and by raise
+// statements, failed assertions and runtime errors in generated code), and the
+// number of times the unwinder has jumped to an exception block. an exception
+// passes through one block for each function it leaves and each try block it
+// reaches, so the unwind count is usually larger
+extern uint64_t exception_raise_count;
+extern uint64_t exception_unwind_count;
+
 // raise a python exception. exc_block should be the exception block passed to
 // the c function, and exc should be an instance of the exception class. this
 // function returns only if exc_block is NULL, in which case it does nothing.
@@ -0,0 +1,853 @@
+#include "IR.hh"
+
+#include <inttypes.h>
+#include <string.h>
+
+#include <algorithm>
+#include <map>
+#include <unordered_map>
+
+#include <phosg/Strings.hh>
+
+#include "../AST/PythonASTNodes.hh"
+#include "../AST/PythonASTVisitor.hh"
+#include "ScalarSubset.hh"
+
+using namespace std;
+
+
+
+const char* name_for_ir_opcode(IROpcode opcode) {
+  switch (opcode) {
+    case IROpcode::Constant:
+      return "Constant";
+    case IROpcode::Argument:
+      return "Argument";
+    case IROpcode::Phi:
+      return "Phi";
+    case IROpcode::Copy:
+      return "Copy";
+    case IROpcode::IntToFloat:
+      return "IntToFloat";
+    case IROpcode::Truth:
+      return "Truth";
+    case IROpcode::LogicalNot:
+      return "LogicalNot";
+    case IROpcode::Negate:
+      return "Negate";
+    case IROpcode::BitwiseNot:
+      return "BitwiseNot";
+    case IROpcode::Add:
+      return "Add";
+    case IROpcode::Subtract:
+      return "Subtract";
+    case IROpcode::Multiply:
+      return "Multiply";
+    case IROpcode::Divide:
+      return "Divide";
+    case IROpcode::And:
+      return "And";
+    case IROpcode::Or:
+      return "Or";
+    case IROpcode::Xor:
+      return "Xor";
+    case IROpcode::LeftShift:
+      return "LeftShift";
+    case IROpcode::RightShift:
+      return "RightShift";
+    case IROpcode::LessThan:
+      return "LessThan";
+    case IROpcode::GreaterThan:
+      return "GreaterThan";
+    case IROpcode::LessOrEqual:
+      return "LessOrEqual";
+    case IROpcode::GreaterOrEqual:
+      return "GreaterOrEqual";
+    case IROpcode::Equal:
+      return "Equal";
+    case IROpcode::NotEqual:
+      return "NotEqual";
+  }
+  return "Unknown";
+}
+
+bool ir_opcode_is_pure(IROpcode opcode) {
+  return (opcode != IROpcode::Argument) && (opcode != IROpcode::Phi);
+}
+
+
+
+IRInstruction::IRInstruction(IROpcode opcode, ValueType type,
+    vector<size_t>&& operands, int64_t value, size_t block) : opcode(opcode),
+    type(type), operands(move(operands)), value(value), block(block),
+    deleted(false) { }
+
+IRBlock::IRBlock() : terminator(Terminator::None), operand(0),
+    targets{0, 0}, deleted(false) { }
+
+vector<size_t> IRBlock::successors() const {
+  switch (this->terminator) {
+    case Terminator::Jump:
+      return {this->targets[0]};
+    case Terminator::Branch:
+      return {this->targets[0], this->targets[1]};
+    default:
+      return {};
+  }
+}
+
+IRFunction::IRFunction() : return_type(ValueType::None) {
+  this->add_block();
+}
+
+size_t IRFunction::add_block() {
+  this->blocks.emplace_back();
+  return this->blocks.size() - 1;
+}
+
+size_t IRFunction::add_instruction(size_t block, IROpcode opcode,
+    ValueType type, vector<size_t>&& operands, int64_t value) {
+  size_t index = this->values.size();
+  this->values.emplace_back(opcode, type, move(operands), value, block);
+  this->blocks[block].instructions.emplace_back(index);
+  return index;
+}
+
+size_t IRFunction::add_phi(size_t block, ValueType type) {
+  size_t index = this->values.size();
+  this->values.emplace_back(IROpcode::Phi, type, vector<size_t>(), 0, block);
+
+  // phis go after any existing phis in the block
+  auto& instructions = this->blocks[block].instructions;
+  auto it = instructions.begin();
+  for (; it != instructions.end(); it++) {
+    if (this->values[*it].opcode != IROpcode::Phi) {
+      break;
+    }
+  }
+  instructions.emplace(it, index);
+  return index;
+}
+
+size_t IRFunction::add_constant(ValueType type, int64_t value) {
+  return this->add_instruction(0, IROpcode::Constant, type, {}, value);
+}
+
+void IRFunction::add_edge(size_t from, size_t to) {
+  this->blocks[to].predecessors.emplace_back(from);
+}
+
+void IRFunction::remove_edge(size_t from, size_t to) {
+  IRBlock& block = this->blocks[to];
+  for (size_t x = 0; x < block.predecessors.size(); x++) {
+    if (block.predecessors[x] != from) {
+      continue;
+    }
+    block.predecessors.erase(block.predecessors.begin() + x);
+    for (size_t value : block.instructions) {
+      IRInstruction& i = this->values[value];
+      if (i.opcode != IROpcode::Phi) {
+        break;
+      }
+      if (x < i.operands.size()) {
+        i.operands.erase(i.operands.begin() + x);
+      }
+    }
+    return;
+  }
+  throw logic_error("removed edge does not exist");
+}
+
+void IRFunction::set_jump(size_t block, size_t target) {
+  IRBlock& b = this->blocks[block];
+  b.terminator = IRBlock::Terminator::Jump;
+  b.targets[0] = target;
+  this->add_edge(block, target);
+}
+
+void IRFunction::set_branch(size_t block, size_t condition,
+    size_t true_target, size_t false_target) {
+  IRBlock& b = this->blocks[block];
+  b.terminator = IRBlock::Terminator::Branch;
+  b.operand = condition;
+  b.targets[0] = true_target;
+  b.targets[1] = false_target;
+  this->add_edge(block, true_target);
+  this->add_edge(block, false_target);
+}
+
+void IRFunction::set_return(size_t block, size_t value) {
+  IRBlock& b = this->blocks[block];
+  b.terminator = IRBlock::Terminator::Return;
+  b.operand = value;
+}
+
+size_t IRFunction::resolve_copies(size_t value) const {
+  // copies can't form cycles except in unreachable code, so the limit here is
+  // just a safeguard
+  for (size_t x = 0; x < this->values.size(); x++) {
+    const IRInstruction& i = this->values[value];
+    if (i.opcode != IROpcode::Copy) {
+      return value;
+    }
+    value = i.operands[0];
+  }
+  throw logic_error("cycle of Copy instructions");
+}
+
+void IRFunction::delete_instruction(size_t value) {
+  IRInstruction& i = this->values[value];
+  if (i.deleted) {
+    return;
+  }
+  i.deleted = true;
+  auto& instructions = this->blocks[i.block].instructions;
+  for (auto it = instructions.begin(); it != instructions.end(); it++) {
+    if (*it == value) {
+      instructions.erase(it);
+      break;
+    }
+  }
+}
+
+vector<bool> IRFunction::reachable_blocks() const {
+  vector<bool> reachable(this->blocks.size(), false);
+  vector<size_t> pending({0});
+  reachable[0] = true;
+  while (!pending.empty()) {
+    size_t block = pending.back();
+    pending.pop_back();
+    for (size_t successor : this->blocks[block].successors()) {
+      if (!reachable[successor]) {
+        reachable[successor] = true;
+        pending.emplace_back(successor);
+      }
+    }
+  }
+  return reachable;
+}
+
+vector<size_t> IRFunction::reverse_postorder() const {
+  vector<size_t> postorder;
+  vector<bool> visited(this->blocks.size(), false);
+
+  // each stack entry is (block, index of next successor to visit)
+  vector<pair<size_t, size_t>> stack({make_pair(0, 0)});
+  visited[0] = true;
+  while (!stack.empty()) {
+    auto& entry = stack.back();
+    auto successors = this->blocks[entry.first].successors();
+    if (entry.second < successors.size()) {
+      size_t successor = successors[entry.second++];
+      if (!visited[successor]) {
+        visited[successor] = true;
+        stack.emplace_back(successor, 0);
+      }
+    } else {
+      postorder.emplace_back(entry.first);
+      stack.pop_back();
+    }
+  }
+
+  return vector<size_t>(postorder.rbegin(), postorder.rend());
+}
+
+void IRFunction::verify() const {
+  vector<bool> reachable = this->reachable_blocks();
+  for (size_t block_index = 0; block_index < this->blocks.size(); block_index++) {
+    const IRBlock& block = this->blocks[block_index];
+    if (!reachable[block_index] || block.deleted) {
+      continue;
+    }
+    if (block.terminator == IRBlock::Terminator::None) {
+      throw logic_error(string_printf("block %zu has no terminator",
+          block_index));
+    }
+
+    // every successor must list this block as a predecessor
+    for (size_t successor : block.successors()) {
+      const auto& preds = this->blocks[successor].predecessors;
+      if (find(preds.begin(), preds.end(), block_index) == preds.end()) {
+        throw logic_error(string_printf("block %zu is missing predecessor %zu",
+            successor, block_index));
+      }
+    }
+
+    bool phis_done = false;
+    for (size_t value : block.instructions) {
+      const IRInstruction& i = this->values[value];
+      if (i.deleted) {
+        throw logic_error(string_printf("deleted value %zu is in block %zu",
+            value, block_index));
+      }
+      if (i.block != block_index) {
+        throw logic_error(string_printf("value %zu is in the wrong block",
+            value));
+      }
+      if (i.opcode == IROpcode::Phi) {
+        if (phis_done) {
+          throw logic_error(string_printf("phi %zu is not at the beginning of block %zu",
+              value, block_index));
+        }
+        if (i.operands.size() != block.predecessors.size()) {
+          throw logic_error(string_printf("phi %zu has the wrong number of operands",
+              value));
+        }
+      } else {
+        phis_done = true;
+      }
+      for (size_t operand : i.operands) {
+        if ((operand >= this->values.size()) || this->values[operand].deleted) {
+          throw logic_error(string_printf("value %zu uses deleted value %zu",
+              value, operand));
+        }
+      }
+    }
+
+    if ((block.terminator == IRBlock::Terminator::Branch) ||
+        (block.terminator == IRBlock::Terminator::Return)) {
+      if ((block.operand >= this->values.size()) ||
+          this->values[block.operand].deleted) {
+        throw logic_error(string_printf("terminator of block %zu uses deleted value %zu",
+            block_index, block.operand));
+      }
+    }
+  }
+}
+
+string IRFunction::str() const {
+  string return_type_str = Value(this->return_type).str();
+  string ret = string_printf("function (return type %s)\n",
+      return_type_str.c_str());
+  for (size_t block_index = 0; block_index < this->blocks.size(); block_index++) {
+    const IRBlock& block = this->blocks[block_index];
+    if (block.deleted) {
+      continue;
+    }
+
+    ret += string_printf("block %zu (predecessors:", block_index);
+    for (size_t pred : block.predecessors) {
+      ret += string_printf(" %zu", pred);
+    }
+    ret += ")\n";
+
+    for (size_t value : block.instructions) {
+      const IRInstruction& i = this->values[value];
+      string type_str = Value(i.type).str();
+      ret += string_printf("  v%zu = %s %s", value, type_str.c_str(),
+          name_for_ir_opcode(i.opcode));
+      if ((i.opcode == IROpcode::Constant) || (i.opcode == IROpcode::Argument)) {
+        ret += string_printf(" %" PRId64, i.value);
+      }
+      for (size_t operand : i.operands) {
+        ret += string_printf(" v%zu", operand);
+      }
+      ret += '\n';
+    }
+
+    switch (block.terminator) {
+      case IRBlock::Terminator::None:
+        ret += "  (no terminator)\n";
+        break;
+      case IRBlock::Terminator::Jump:
+        ret += string_printf("  jump block %zu\n", block.targets[0]);
+        break;
+      case IRBlock::Terminator::Branch:
+        ret += string_printf("  branch v%zu block %zu block %zu\n",
+            block.operand, block.targets[0], block.targets[1]);
+        break;
+      case IRBlock::Terminator::Return:
+        ret += string_printf("  return v%zu\n", block.operand);
+        break;
+    }
+  }
+  return ret;
+}
+
+
+
+// generates SSA form directly from the AST, using the algorithm described in
+// "Simple and Efficient Construction of Static Single Assignment Form" (Braun
+// et al.). this only handles the scalar subset, so it doesn't check types
+// again; infer_scalar_fragment_types must have accepted the fragment first
+class IRBuilderVisitor : public ASTVisitor {
+public:
+  IRBuilderVisitor(IRFunction* fn, Fragment* fragment,
+      const map<string, ValueType>& local_types) : fn(fn),
+      fragment(fragment), variable_types(local_types), current_block(0),
+      current_value(0), current_type(ValueType::Indeterminate),
+      temp_variable_count(0) {
+    this->sealed.emplace_back(true);
+    this->definitions.emplace_back();
+    this->incomplete_phis.emplace_back();
+
+    FunctionContext* function = this->fragment->function;
+    for (size_t x = 0; x < this->fragment->arg_types.size(); x++) {
+      ValueType type = this->fragment->arg_types[x].type;
+      this->fn->arg_types.emplace_back(type);
+      size_t value = this->fn->add_instruction(0, IROpcode::Argument, type, {},
+          x);
+      this->write_variable(function->args[x].name, 0, value);
+    }
+  }
+
+  // expression visitation
+
+  virtual void visit(UnaryOperation* a) {
+    a->expr->accept(this);
+    ValueType type = this->current_type;
+    ValueType result_type = scalar_unary_result_type(a->oper, type);
+
+    switch (a->oper) {
+      case UnaryOperator::LogicalNot:
+        this->current_value = this->add(IROpcode::LogicalNot, ValueType::Bool,
+            {this->truth_value(this->current_value, type)});
+        break;
+      case UnaryOperator::Not:
+        this->current_value = this->add(IROpcode::BitwiseNot, result_type,
+            {this->current_value});
+        break;
+      case UnaryOperator::Positive:
+        break;
+      case UnaryOperator::Negative:
+        this->current_value = this->add(IROpcode::Negate, result_type,
+            {this->current_value});
+        break;
+      default:
+        throw logic_error("unsupported unary operation in IR builder");
+    }
+    this->current_type = result_type;
+  }
+
+  virtual void visit(BinaryOperation* a) {
+    if ((a->oper == BinaryOperator::LogicalOr) ||
+        (a->oper == BinaryOperator::LogicalAnd)) {
+      this->build_logical_operation(a);
+      return;
+    }
+
+    a->left->accept(this);
+    size_t left = this->current_value;
+    ValueType left_type = this->current_type;
+    a->right->accept(this);
+    size_t right = this->current_value;
+    ValueType right_type = this->current_type;
+    ValueType result_type = scalar_binary_result_type(a->oper, left_type,
+        right_type);
+
+    // comparisons and arithmetic involving a Float operand (and division) are
+    // done in floating-point
+    bool float_operands = (left_type == ValueType::Float) ||
+        (right_type == ValueType::Float) ||
+        (a->oper == BinaryOperator::Division);
+    if (float_operands) {
+      left = this->convert_to_float(left, left_type);
+      right = this->convert_to_float(right, right_type);
+    }
+
+    static const unordered_map<int, IROpcode> opcode_for_operator({
+      {static_cast<int>(BinaryOperator::LessThan), IROpcode::LessThan},
+      {static_cast<int>(BinaryOperator::GreaterThan), IROpcode::GreaterThan},
+      {static_cast<int>(BinaryOperator::LessOrEqual), IROpcode::LessOrEqual},
+      {static_cast<int>(BinaryOperator::GreaterOrEqual), IROpcode::GreaterOrEqual},
+      {static_cast<int>(BinaryOperator::Equality), IROpcode::Equal},
+      {static_cast<int>(BinaryOperator::NotEqual), IROpcode::NotEqual},
+      {static_cast<int>(BinaryOperator::Or), IROpcode::Or},
+      {static_cast<int>(BinaryOperator::And), IROpcode::And},
+      {static_cast<int>(BinaryOperator::Xor), IROpcode::Xor},
+      {static_cast<int>(BinaryOperator::LeftShift), IROpcode::LeftShift},
+      {static_cast<int>(BinaryOperator::RightShift), IROpcode::RightShift},
+      {static_cast<int>(BinaryOperator::Addition), IROpcode::Add},
+      {static_cast<int>(BinaryOperator::Subtraction), IROpcode::Subtract},
+      {static_cast<int>(BinaryOperator::Multiplication), IROpcode::Multiply},
+      {static_cast<int>(BinaryOperator::Division), IROpcode::Divide},
+    });
+    this->current_value = this->add(
+        opcode_for_operator.at(static_cast<int>(a->oper)), result_type,
+        {left, right});
+    this->current_type = result_type;
+  }
+
+  virtual void visit(TernaryOperation* a) {
+    a->center->accept(this);
+    ValueType condition_type = this->current_type;
+
+    // if the condition is None, only the right side is evaluated
+    if (condition_type == ValueType::None) {
+      a->right->accept(this);
+      return;
+    }
+
+    size_t condition = this->truth_value(this->current_value, condition_type);
+    size_t left_block = this->create_block(true);
+    size_t right_block = this->create_block(true);
+    size_t end_block = this->create_block(false);
+    this->fn->set_branch(this->current_block, condition, left_block,
+        right_block);
+
+    string temp_name = this->create_temp_variable();
+
+    this->current_block = left_block;
+    a->left->accept(this);
+    this->variable_types[temp_name] = this->current_type;
+    this->write_variable(temp_name, this->current_block, this->current_value);
+    this->fn->set_jump(this->current_block, end_block);
+
+    this->current_block = right_block;
+    a->right->accept(this);
+    this->write_variable(temp_name, this->current_block, this->current_value);
+    this->fn->set_jump(this->current_block, end_block);
+
+    this->seal_block(end_block);
+    this->current_block = end_block;
+    this->current_value = this->read_variable(temp_name, end_block);
+  }
+
+  virtual void visit(IntegerConstant* a) {
+    this->current_value = this->fn->add_constant(ValueType::Int, a->value);
+    this->current_type = ValueType::Int;
+  }
+
+  virtual void visit(FloatConstant* a) {
+    int64_t bits;
+    memcpy(&bits, &a->value, sizeof(bits));
+    this->current_value = this->fn->add_constant(ValueType::Float, bits);
+    this->current_type = ValueType::Float;
+  }
+
+  virtual void visit(TrueConstant* a) {
+    this->current_value = this->fn->add_constant(ValueType::Bool, 1);
+    this->current_type = ValueType::Bool;
+  }
+
+  virtual void visit(FalseConstant* a) {
+    this->current_value = this->fn->add_constant(ValueType::Bool, 0);
+    this->current_type = ValueType::Bool;
+  }
+
+  virtual void visit(NoneConstant* a) {
+    this->current_value = this->fn->add_constant(ValueType::None, 0);
+    this->current_type = ValueType::None;
+  }
+
+  virtual void visit(VariableLookup* a) {
+    this->current_value = this->read_variable(a->name, this->current_block);
+    this->current_type = this->variable_types.at(a->name);
+  }
+
+  virtual void visit(AttributeLValueReference* a) {
+    this->write_variable(a->name, this->current_block, this->current_value);
+  }
+
+  // statement visitation
+
+  virtual void visit(ExpressionStatement* a) {
+    // scalar expressions have no side effects, so there's nothing to do
+  }
+
+  virtual void visit(AssignmentStatement* a) {
+    a->value->accept(this);
+    a->target->accept(this);
+  }
+
+  virtual void visit(PassStatement* a) { }
+
+  virtual void visit(BreakStatement* a) {
+    this->fn->set_jump(this->current_block, this->loops.back().break_block);
+    this->current_block = this->create_block(true);
+  }
+
+  virtual void visit(ContinueStatement* a) {
+    this->fn->set_jump(this->current_block, this->loops.back().continue_block);
+    this->current_block = this->create_block(true);
+  }
+
+  virtual void visit(ReturnStatement* a) {
+    a->value->accept(this);
+    size_t value = this->current_value;
+    if (this->fn->return_type == ValueType::Float) {
+      value = this->convert_to_float(value, this->current_type);
+    }
+    this->fn->set_return(this->current_block, value);
+    this->current_block = this->create_block(true);
+  }
+
+  virtual void visit(IfStatement* a) {
+    // the always_true and always_false annotations skip the same code that
+    // CompilationVisitor skips
+    if (a->always_true) {
+      this->build_list(a->items);
+      return;
+    }
+
+    size_t end_block = this->create_block(false);
+    if (!a->always_false) {
+      this->build_conditional_suite(a->check.get(), a->items, end_block);
+    }
+    for (auto& elif : a->elifs) {
+      if (elif->always_false) {
+        continue;
+      }
+      if (elif->always_true) {
+        this->build_list(elif->items);
+        this->fn->set_jump(this->current_block, end_block);
+        this->seal_block(end_block);
+        this->current_block = end_block;
+        return;
+      }
+      this->build_conditional_suite(elif->check.get(), elif->items, end_block);
+    }
+    if (a->else_suite.get()) {
+      this->build_list(a->else_suite->items);
+    }
+    this->fn->set_jump(this->current_block, end_block);
+    this->seal_block(end_block);
+    this->current_block = end_block;
+  }
+
+  virtual void visit(WhileStatement* a) {
+    // the header block isn't sealed until the body is done, since the body
+    // adds more predecessors (the back edge and any continue statements)
+    size_t header_block = this->create_block(false);
+    size_t body_block = this->create_block(true);
+    size_t else_block = this->create_block(true);
+    size_t end_block = this->create_block(false);
+    this->fn->set_jump(this->current_block, header_block);
+
+    this->current_block = header_block;
+    size_t condition = this->build_condition(a->condition.get());
+    this->fn->set_branch(this->current_block, condition, body_block,
+        else_block);
+
+    this->loops.emplace_back(header_block, end_block);
+    this->current_block = body_block;
+    this->build_list(a->items);
+    this->fn->set_jump(this->current_block, header_block);
+    this->loops.pop_back();
+    this->seal_block(header_block);
+
+    // the else suite runs when the condition is false, but not after a break
+    this->current_block = else_block;
+    if (a->else_suite.get()) {
+      this->build_list(a->else_suite->items);
+    }
+    this->fn->set_jump(this->current_block, end_block);
+    this->seal_block(end_block);
+    this->current_block = end_block;
+  }
+
+  virtual void visit(FunctionDefinition* a) {
+    // default values have no side effects, so they aren't evaluated here
+    this->build_list(a->items);
+
+    // if the function doesn't end with a return statement, it returns zero (as
+    // the interpreter does)
+    if (this->fn->blocks[this->current_block].terminator ==
+        IRBlock::Terminator::None) {
+      this->fn->set_return(this->current_block,
+          this->fn->add_constant(this->fn->return_type, 0));
+    }
+  }
+
+private:
+  struct Loop {
+    size_t continue_block;
+    size_t break_block;
+
+    Loop(size_t continue_block, size_t break_block) :
+        continue_block(continue_block), break_block(break_block) { }
+  };
+
+  IRFunction* fn;
+  Fragment* fragment;
+  map<string, ValueType> variable_types;
+
+  size_t current_block;
+  size_t current_value;
+  ValueType current_type;
+
+  vector<Loop> loops;
+  size_t temp_variable_count;
+
+  // indexed by block
+  vector<bool> sealed;
+  vector<unordered_map<string, size_t>> definitions;
+  vector<unordered_map<string, size_t>> incomplete_phis;
+
+  size_t add(IROpcode opcode, ValueType type, vector<size_t>&& operands) {
+    return this->fn->add_instruction(this->current_block, opcode, type,
+        move(operands));
+  }
+
+  size_t create_block(bool sealed) {
+    size_t block = this->fn->add_block();
+    this->sealed.emplace_back(sealed);
+    this->definitions.emplace_back();
+    this->incomplete_phis.emplace_back();
+    return block;
+  }
+
+  string create_temp_variable() {
+    // temp variable names can't conflict with locals since they aren't valid
+    // identifiers
+    return string_printf("$%zu", this->temp_variable_count++);
+  }
+
+  void write_variable(const string& name, size_t block, size_t value) {
+    this->definitions[block][name] = value;
+  }
+
+  size_t read_variable(const string& name, size_t block) {
+    auto it = this->definitions[block].find(name);
+    if (it != this->definitions[block].end()) {
+      return it->second;
+    }
+
+    ValueType type = this->variable_types.at(name);
+    const auto& preds = this->fn->blocks[block].predecessors;
+    size_t value;
+    if (!this->sealed[block]) {
+      // not all predecessors are known yet; fill in the phi when they are
+      value = this->fn->add_phi(block, type);
+      this->incomplete_phis[block].emplace(name, value);
+
+    } else if (preds.empty()) {
+      // locals are zero before they're assigned (and unreachable blocks have
+      // no predecessors, so the value doesn't matter there)
+      value = this->fn->add_constant(type, 0);
+
+    } else if (preds.size() == 1) {
+      value = this->read_variable(name, preds[0]);
+
+    } else {
+      // write the phi before filling it in, in case there's a loop
+      value = this->fn->add_phi(block, type);
+      this->write_variable(name, block, value);
+      this->add_phi_operands(name, value);
+    }
+
+    this->write_variable(name, block, value);
+    return value;
+  }
+
+  void add_phi_operands(const string& name, size_t phi) {
+    size_t block = this->fn->values[phi].block;
+    // note: read_variable can add values, so this can't hold references into
+    // fn->values
+    for (size_t x = 0; x < this->fn->blocks[block].predecessors.size(); x++) {
+      size_t operand = this->read_variable(name,
+          this->fn->blocks[block].predecessors[x]);
+      this->fn->values[phi].operands.emplace_back(operand);
+    }
+  }
+
+  void seal_block(size_t block) {
+    // add_phi_operands can create more incomplete phis in other blocks, but not
+    // in this one, since it's not sealed yet
+    for (const auto& it : this->incomplete_phis[block]) {
+      this->add_phi_operands(it.first, it.second);
+    }
+    this->incomplete_phis[block].clear();
+    this->sealed[block] = true;
+  }
+
+  size_t truth_value(size_t value, ValueType type) {
+    if (type == ValueType::None) {
+      return this->fn->add_constant(ValueType::Bool, 0);
+    }
+    if (type == ValueType::Bool) {
+      return value;
+    }
+    return this->add(IROpcode::Truth, ValueType::Bool, {value});
+  }
+
+  size_t convert_to_float(size_t value, ValueType type) {
+    if (type == ValueType::Float) {
+      return value;
+    }
+    return this->add(IROpcode::IntToFloat, ValueType::Float, {value});
+  }
+
+  size_t build_condition(Expression* e) {
+    e->accept(this);
+    return this->truth_value(this->current_value, this->current_type);
+  }
+
+  void build_list(vector<shared_ptr<Statement>>& items) {
+    for (auto& item : items) {
+      item->accept(this);
+    }
+  }
+
+  // builds `if check: items`, jumping to end_block afterward. the current block
+  // is the one where the check is false when this returns
+  void build_conditional_suite(Expression* check,
+      vector<shared_ptr<Statement>>& items, size_t end_block) {
+    size_t condition = this->build_condition(check);
+    size_t true_block = this->create_block(true);
+    size_t false_block = this->create_block(true);
+    this->fn->set_branch(this->current_block, condition, true_block,
+        false_block);
+
+    this->current_block = true_block;
+    this->build_list(items);
+    this->fn->set_jump(this->current_block, end_block);
+
+    this->current_block = false_block;
+  }
+
+  void build_logical_operation(BinaryOperation* a) {
+    a->left->accept(this);
+    size_t left = this->current_value;
+    ValueType type = this->current_type;
+
+    // `None and x` doesn't evaluate x
+    if ((a->oper == BinaryOperator::LogicalAnd) && (type == ValueType::None)) {
+      return;
+    }
+
+    // the result is the left value if it decides the result, or the right
+    // value if not. both have the same type
+    string temp_name = this->create_temp_variable();
+    this->variable_types[temp_name] = type;
+    this->write_variable(temp_name, this->current_block, left);
+
+    size_t condition = this->truth_value(left, type);
+    size_t right_block = this->create_block(true);
+    size_t end_block = this->create_block(false);
+    if (a->oper == BinaryOperator::LogicalAnd) {
+      this->fn->set_branch(this->current_block, condition, right_block,
+          end_block);
+    } else {
+      this->fn->set_branch(this->current_block, condition, end_block,
+          right_block);
+    }
+
+    this->current_block = right_block;
+    a->right->accept(this);
+    this->write_variable(temp_name, this->current_block, this->current_value);
+    this->fn->set_jump(this->current_block, end_block);
+
+    this->seal_block(end_block);
+    this->current_block = end_block;
+    this->current_value = this->read_variable(temp_name, end_block);
+    this->current_type = type;
+  }
+};
+
+
+
+shared_ptr<IRFunction> build_ir_for_fragment(GlobalContext* global,
+    Fragment* f) {
+  map<string, ValueType> local_types;
+  Value return_type;
+  infer_scalar_fragment_types(global, f, &local_types, &return_type);
+
+  shared_ptr<IRFunction> fn(new IRFunction());
+  fn->return_type = return_type.type;
+
+  IRBuilderVisitor v(fn.get(), f, local_types);
+  f->function->ast_root->accept(&v);
+  fn->verify();
+  return fn;
+}
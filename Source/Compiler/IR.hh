@@ -0,0 +1,137 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "../Environment/Value.hh"
+#include "Contexts.hh"
+
+
+
+// the IR is a typed SSA representation of a function fragment, used to
+// optimize fragments before generating code for them (see IRPasses.hh and
+// IRCompiler.hh). currently it only represents fragments in the scalar subset
+// (see ScalarSubset.hh); other fragments are compiled by CompilationVisitor.
+//
+// a function is a list of basic blocks, and each block is a list of
+// instructions followed by a terminator (a jump, conditional branch, or
+// return). each instruction produces exactly one value, which is identified by
+// the instruction's index in IRFunction::values. values of type None, Bool and
+// Int have the same representation (a 64-bit integer; None is 0 and Bools are 0
+// or 1), so instructions that operate on integers accept any of these types.
+// Float values are only produced by Float instructions; ints are converted to
+// floats explicitly with IntToFloat.
+
+enum class IROpcode {
+  Constant = 0, // value is the raw contents of the constant
+  Argument, // value is the argument's index
+  Phi, // one operand for each of the block's predecessors, in the same order
+  Copy,
+  IntToFloat,
+  Truth, // Bool: true if the operand is truthy
+  LogicalNot, // operand is a Bool
+  Negate,
+  BitwiseNot,
+  Add,
+  Subtract,
+  Multiply,
+  Divide, // Float only
+  And,
+  Or,
+  Xor,
+  LeftShift,
+  RightShift,
+  LessThan, // comparisons produce a Bool; both operands have the same type
+  GreaterThan,
+  LessOrEqual,
+  GreaterOrEqual,
+  Equal,
+  NotEqual,
+};
+
+const char* name_for_ir_opcode(IROpcode opcode);
+
+// true for opcodes whose result depends only on their operands (and value).
+// all opcodes except Argument and Phi are pure
+bool ir_opcode_is_pure(IROpcode opcode);
+
+struct IRInstruction {
+  IROpcode opcode;
+  ValueType type; // of the result
+  std::vector<size_t> operands;
+  int64_t value; // for Constant and Argument
+  size_t block;
+  bool deleted;
+
+  IRInstruction(IROpcode opcode, ValueType type,
+      std::vector<size_t>&& operands, int64_t value, size_t block);
+};
+
+struct IRBlock {
+  enum class Terminator {
+    None = 0, // block isn't finished yet (or was deleted)
+    Jump, // to targets[0]
+    Branch, // to targets[0] if operand is truthy, targets[1] otherwise
+    Return, // returns operand
+  };
+
+  std::vector<size_t> instructions; // phis are always first
+  std::vector<size_t> predecessors;
+
+  Terminator terminator;
+  size_t operand;
+  size_t targets[2];
+
+  bool deleted;
+
+  IRBlock();
+
+  std::vector<size_t> successors() const;
+};
+
+struct IRFunction {
+  std::vector<IRInstruction> values;
+  std::vector<IRBlock> blocks; // blocks[0] is the entry block
+  std::vector<ValueType> arg_types;
+  ValueType return_type;
+
+  IRFunction();
+
+  size_t add_block();
+  size_t add_instruction(size_t block, IROpcode opcode, ValueType type,
+      std::vector<size_t>&& operands, int64_t value = 0);
+  size_t add_phi(size_t block, ValueType type); // with no operands yet
+  size_t add_constant(ValueType type, int64_t value); // in the entry block
+
+  // these don't change any terminators; callers have to do that separately.
+  // removing an edge also removes the corresponding phi operands
+  void add_edge(size_t from, size_t to);
+  void remove_edge(size_t from, size_t to);
+
+  void set_jump(size_t block, size_t target);
+  void set_branch(size_t block, size_t condition, size_t true_target,
+      size_t false_target);
+  void set_return(size_t block, size_t value);
+
+  // follows chains of Copy instructions
+  size_t resolve_copies(size_t value) const;
+
+  // marks the instruction as deleted and removes it from its block
+  void delete_instruction(size_t value);
+
+  std::vector<bool> reachable_blocks() const;
+  std::vector<size_t> reverse_postorder() const; // reachable blocks only
+
+  // checks that the function is consistent. throws logic_error if not
+  void verify() const;
+
+  std::string str() const;
+};
+
+// builds the IR for a fragment that's in the scalar subset. throws
+// not_in_scalar_subset if the fragment isn't in the subset
+std::shared_ptr<IRFunction> build_ir_for_fragment(GlobalContext* global,
+    Fragment* f);
@@ -0,0 +1,741 @@
+#include "IRCompiler.hh"
+
+#include <inttypes.h>
+#include <stdio.h>
+
+#include <unordered_map>
+
+#include <phosg/Strings.hh>
+
+#include "../Debug.hh"
+#include "IRPasses.hh"
+#include "ScalarSubset.hh"
+
+using namespace std;
+
+
+
+static const vector<Register> int_argument_register_order = {
+    Register::RDI, Register::RSI, Register::RDX, Register::RCX, Register::R8,
+    Register::R9};
+static const vector<Register> float_argument_register_order = {
+    Register::XMM0, Register::XMM1, Register::XMM2, Register::XMM3,
+    Register::XMM4, Register::XMM5, Register::XMM6, Register::XMM7};
+
+
+
+IRPeepholeStats::IRPeepholeStats() : loads_dropped(0), loads_forwarded(0),
+    branches_fused(0) { }
+
+
+
+class IRCodeGenerator {
+public:
+  IRCodeGenerator(const IRFunction* fn, AMD64Assembler& as) : fn(fn), as(as),
+      slot_for_value(fn->values.size(), -1), use_count(fn->values.size(), 0),
+      num_slots(0), num_phi_temp_slots(0),
+      peephole(!(debug_flags & DebugFlag::NoPeephole)),
+      registers_valid_after_terminator(false) {
+    this->block_order = this->fn->reverse_postorder();
+
+    for (size_t block_index : this->block_order) {
+      const IRBlock& block = this->fn->blocks[block_index];
+      for (size_t value : block.instructions) {
+        for (size_t operand : this->fn->values[value].operands) {
+          this->use_count[operand]++;
+        }
+      }
+      if ((block.terminator == IRBlock::Terminator::Branch) ||
+          (block.terminator == IRBlock::Terminator::Return)) {
+        this->use_count[block.operand]++;
+      }
+    }
+
+    // constants don't need slots since they're written directly into the code
+    for (size_t block_index : this->block_order) {
+      size_t num_phis = 0;
+      for (size_t value : this->fn->blocks[block_index].instructions) {
+        const IRInstruction& i = this->fn->values[value];
+        if (i.opcode == IROpcode::Phi) {
+          num_phis++;
+        }
+        if (i.opcode != IROpcode::Constant) {
+          this->slot_for_value[value] = this->num_slots++;
+        }
+      }
+      // phis need temporary slots if there's more than one in a block, since
+      // their operands may be other phis in the same block
+      if ((num_phis > 1) && (num_phis > this->num_phi_temp_slots)) {
+        this->num_phi_temp_slots = num_phis;
+      }
+    }
+  }
+
+  void generate() {
+    this->write_prologue();
+    for (size_t x = 0; x < this->block_order.size(); x++) {
+      size_t block_index = this->block_order[x];
+      ssize_t next_block = (x + 1 < this->block_order.size()) ?
+          this->block_order[x + 1] : -1;
+
+      // register contents carry over into a block only if the previous block
+      // (or the prologue, for the first block) is the only way to get there
+      const auto& predecessors = this->fn->blocks[block_index].predecessors;
+      bool registers_valid = (x == 0) ? predecessors.empty() :
+          ((predecessors.size() == 1) &&
+           (predecessors[0] == this->block_order[x - 1]) &&
+           this->registers_valid_after_terminator);
+      if (!registers_valid) {
+        this->clobber_all_registers();
+      }
+
+      this->as.write_label(this->label_for_block(block_index));
+      for (size_t value : this->fn->blocks[block_index].instructions) {
+        this->write_instruction(value);
+      }
+      this->write_terminator(block_index, next_block);
+    }
+  }
+
+private:
+  const IRFunction* fn;
+  AMD64Assembler& as;
+
+  vector<size_t> block_order;
+  vector<ssize_t> slot_for_value;
+  vector<size_t> use_count;
+  size_t num_slots;
+  size_t num_phi_temp_slots;
+
+  // peephole state. since every value is written only once (except phis,
+  // which are handled specially), a register that was loaded from or stored
+  // to a value's slot still holds that value until the register is written
+  // again. this lets loads be skipped or replaced with register moves
+  bool peephole;
+  unordered_map<int, size_t> value_in_int_register; // Register -> value
+  unordered_map<int, size_t> value_in_xmm_register;
+  bool registers_valid_after_terminator;
+
+public:
+  IRPeepholeStats peephole_stats;
+
+private:
+
+  static string label_for_block(size_t block) {
+    return string_printf("__ir_block_%zu", block);
+  }
+
+  static MemoryReference slot_reference(size_t slot) {
+    return MemoryReference(Register::RBP, -static_cast<ssize_t>(
+        (slot + 1) * sizeof(int64_t)));
+  }
+
+  MemoryReference value_reference(size_t value) const {
+    ssize_t slot = this->slot_for_value[value];
+    if (slot < 0) {
+      throw logic_error(string_printf("value %zu has no stack slot", value));
+    }
+    return this->slot_reference(slot);
+  }
+
+  MemoryReference phi_temp_reference(size_t index) const {
+    return this->slot_reference(this->num_slots + index);
+  }
+
+  bool is_constant(size_t value) const {
+    return this->fn->values[value].opcode == IROpcode::Constant;
+  }
+
+  unordered_map<int, size_t>& register_values(bool xmm) {
+    return xmm ? this->value_in_xmm_register : this->value_in_int_register;
+  }
+
+  const unordered_map<int, size_t>& register_values(bool xmm) const {
+    return xmm ? this->value_in_xmm_register : this->value_in_int_register;
+  }
+
+  void set_register_value(Register reg, bool xmm, size_t value) {
+    if (this->peephole) {
+      this->register_values(xmm)[reg] = value;
+    }
+  }
+
+  void clobber_register(Register reg, bool xmm) {
+    this->register_values(xmm).erase(reg);
+  }
+
+  void clobber_all_registers() {
+    this->value_in_int_register.clear();
+    this->value_in_xmm_register.clear();
+  }
+
+  // forgets all registers that hold the given value. this is needed when a
+  // phi's slot is overwritten, since the phi then has a different value
+  void clobber_value(size_t value) {
+    for (bool xmm : {false, true}) {
+      auto& values = this->register_values(xmm);
+      for (auto it = values.begin(); it != values.end();) {
+        if (it->second == value) {
+          it = values.erase(it);
+        } else {
+          it++;
+        }
+      }
+    }
+  }
+
+  bool register_holds_value(Register reg, bool xmm, size_t value) const {
+    const auto& values = this->register_values(xmm);
+    auto it = values.find(reg);
+    return (it != values.end()) && (it->second == value);
+  }
+
+  Register register_holding_value(size_t value, bool xmm) const {
+    for (const auto& it : this->register_values(xmm)) {
+      if (it.second == value) {
+        return static_cast<Register>(it.first);
+      }
+    }
+    return Register::None;
+  }
+
+  // loads the raw contents of a value (of any type) into an int register
+  void load_int(Register reg, size_t value) {
+    if (this->register_holds_value(reg, false, value)) {
+      this->peephole_stats.loads_dropped++;
+      return;
+    }
+
+    if (this->is_constant(value)) {
+      this->as.write_mov(reg, this->fn->values[value].value);
+    } else {
+      Register int_source = this->register_holding_value(value, false);
+      Register xmm_source = this->register_holding_value(value, true);
+      if (int_source != Register::None) {
+        this->as.write_mov(MemoryReference(reg), MemoryReference(int_source));
+        this->peephole_stats.loads_forwarded++;
+      } else if (xmm_source != Register::None) {
+        this->as.write_movq_from_xmm(MemoryReference(reg), xmm_source);
+        this->peephole_stats.loads_forwarded++;
+      } else {
+        this->as.write_mov(MemoryReference(reg), this->value_reference(value));
+      }
+    }
+    this->set_register_value(reg, false, value);
+  }
+
+  // loads a Float value into an xmm register. this may use rax for constants
+  void load_float(Register xmm, size_t value) {
+    if (this->register_holds_value(xmm, true, value)) {
+      this->peephole_stats.loads_dropped++;
+      return;
+    }
+
+    Register int_source = this->register_holding_value(value, false);
+    if (int_source != Register::None) {
+      this->as.write_movq_to_xmm(xmm, MemoryReference(int_source));
+      if (!this->is_constant(value)) {
+        this->peephole_stats.loads_forwarded++;
+      }
+    } else if (this->is_constant(value)) {
+      this->as.write_mov(rax, this->fn->values[value].value);
+      this->set_register_value(rax, false, value);
+      this->as.write_movq_to_xmm(xmm, MemoryReference(rax));
+    } else {
+      this->as.write_movsd(MemoryReference(xmm), this->value_reference(value));
+    }
+    this->set_register_value(xmm, true, value);
+  }
+
+  void store_int(size_t value, Register reg) {
+    this->as.write_mov(this->value_reference(value), MemoryReference(reg));
+    this->set_register_value(reg, false, value);
+  }
+
+  void store_float(size_t value, Register xmm) {
+    this->as.write_movsd(this->value_reference(value), MemoryReference(xmm));
+    this->set_register_value(xmm, true, value);
+  }
+
+  // returns true if the value is a comparison whose result is only used by
+  // the branch at the end of its block, and nothing is computed between them.
+  // these comparisons are generated as part of the branch instead
+  bool is_fused_comparison(size_t value) const {
+    if (!this->peephole || (this->use_count[value] != 1)) {
+      return false;
+    }
+    const IRInstruction& i = this->fn->values[value];
+    switch (i.opcode) {
+      case IROpcode::LessThan:
+      case IROpcode::GreaterThan:
+      case IROpcode::LessOrEqual:
+      case IROpcode::GreaterOrEqual:
+      case IROpcode::Equal:
+      case IROpcode::NotEqual:
+        break;
+      default:
+        return false;
+    }
+    const IRBlock& block = this->fn->blocks[i.block];
+    return (block.terminator == IRBlock::Terminator::Branch) &&
+        (block.operand == value) && !block.instructions.empty() &&
+        (block.instructions.back() == value);
+  }
+
+  void write_prologue() {
+    this->as.write_push(rbp);
+    this->as.write_mov(rbp, rsp);
+
+    // the frame size must be a multiple of 16 to keep the stack aligned
+    size_t frame_size = (this->num_slots + this->num_phi_temp_slots) *
+        sizeof(int64_t);
+    frame_size = (frame_size + 0x0F) & ~0x0F;
+    if (frame_size) {
+      this->as.write_sub(rsp, frame_size);
+    }
+
+    // save the arguments before anything can overwrite their registers. the
+    // Argument instructions themselves don't generate any code
+    vector<Register> register_for_arg;
+    size_t int_arg_count = 0, float_arg_count = 0;
+    for (ValueType type : this->fn->arg_types) {
+      if (type == ValueType::Float) {
+        register_for_arg.emplace_back(
+            float_argument_register_order.at(float_arg_count++));
+      } else {
+        register_for_arg.emplace_back(
+            int_argument_register_order.at(int_arg_count++));
+      }
+    }
+    for (size_t block_index : this->block_order) {
+      for (size_t value : this->fn->blocks[block_index].instructions) {
+        const IRInstruction& i = this->fn->values[value];
+        if (i.opcode != IROpcode::Argument) {
+          continue;
+        }
+        Register reg = register_for_arg.at(i.value);
+        if (i.type == ValueType::Float) {
+          this->store_float(value, reg);
+        } else {
+          this->store_int(value, reg);
+        }
+      }
+    }
+  }
+
+  void write_instruction(size_t value) {
+    const IRInstruction& i = this->fn->values[value];
+    bool float_operands = !i.operands.empty() &&
+        (this->fn->values[i.operands[0]].type == ValueType::Float);
+    MemoryReference rax_mem(rax);
+    MemoryReference rcx_mem(rcx);
+    MemoryReference xmm1_mem(xmm1);
+
+    switch (i.opcode) {
+      case IROpcode::Constant:
+      case IROpcode::Argument:
+      case IROpcode::Phi:
+        break; // handled elsewhere
+
+      case IROpcode::Copy:
+        this->load_int(rax, i.operands[0]);
+        this->store_int(value, rax);
+        break;
+
+      case IROpcode::IntToFloat:
+        this->load_int(rax, i.operands[0]);
+        this->as.write_cvtsi2sd(xmm0, rax_mem);
+        this->store_float(value, xmm0);
+        break;
+
+      case IROpcode::Truth:
+        // 0.0 and -0.0 are falsey, everything else is truthy. the sign bit is
+        // the highest bit, so we shift it out and check if the rest is zero
+        this->load_int(rcx, i.operands[0]);
+        this->as.write_xor(rax_mem, rax_mem);
+        if (float_operands) {
+          this->as.write_shl(rcx_mem, 1);
+          this->clobber_register(rcx, false);
+        }
+        this->as.write_test(rcx_mem, rcx_mem);
+        this->as.write_setne(MemoryReference(byte_register_for_register(rax)));
+        this->store_int(value, rax);
+        break;
+
+      case IROpcode::LogicalNot:
+        this->load_int(rax, i.operands[0]);
+        this->as.write_xor(rax_mem, 1);
+        this->store_int(value, rax);
+        break;
+
+      case IROpcode::Negate:
+        this->load_int(rax, i.operands[0]);
+        if (float_operands) {
+          // flip the sign bit
+          this->as.write_rol(rax_mem, 1);
+          this->as.write_xor(rax_mem, 1);
+          this->as.write_ror(rax_mem, 1);
+        } else {
+          this->as.write_neg(rax_mem);
+        }
+        this->store_int(value, rax);
+        break;
+
+      case IROpcode::BitwiseNot:
+        this->load_int(rax, i.operands[0]);
+        this->as.write_not(rax_mem);
+        this->store_int(value, rax);
+        break;
+
+      case IROpcode::Add:
+      case IROpcode::Subtract:
+      case IROpcode::Multiply:
+      case IROpcode::Divide:
+        if (float_operands) {
+          this->load_float(xmm0, i.operands[0]);
+          this->load_float(xmm1, i.operands[1]);
+          if (i.opcode == IROpcode::Add) {
+            this->as.write_addsd(xmm0, xmm1_mem);
+          } else if (i.opcode == IROpcode::Subtract) {
+            this->as.write_subsd(xmm0, xmm1_mem);
+          } else if (i.opcode == IROpcode::Multiply) {
+            this->as.write_mulsd(xmm0, xmm1_mem);
+          } else {
+            this->as.write_divsd(xmm0, xmm1_mem);
+          }
+          this->store_float(value, xmm0);
+          break;
+        }
+        if (i.opcode == IROpcode::Divide) {
+          throw logic_error("integer division in IR");
+        }
+        // fallthrough
+
+      case IROpcode::And:
+      case IROpcode::Or:
+      case IROpcode::Xor:
+        this->load_int(rax, i.operands[0]);
+        this->load_int(rcx, i.operands[1]);
+        if (i.opcode == IROpcode::Add) {
+          this->as.write_add(rax_mem, rcx_mem);
+        } else if (i.opcode == IROpcode::Subtract) {
+          this->as.write_sub(rax_mem, rcx_mem);
+        } else if (i.opcode == IROpcode::Multiply) {
+          this->as.write_imul(rax, rcx_mem);
+        } else if (i.opcode == IROpcode::And) {
+          this->as.write_and(rax_mem, rcx_mem);
+        } else if (i.opcode == IROpcode::Or) {
+          this->as.write_or(rax_mem, rcx_mem);
+        } else {
+          this->as.write_xor(rax_mem, rcx_mem);
+        }
+        this->store_int(value, rax);
+        break;
+
+      case IROpcode::LeftShift:
+      case IROpcode::RightShift:
+        this->load_int(rax, i.operands[0]);
+        this->load_int(rcx, i.operands[1]);
+        if (i.opcode == IROpcode::LeftShift) {
+          this->as.write_shl_cl(rax_mem);
+        } else {
+          this->as.write_sar_cl(rax_mem);
+        }
+        this->store_int(value, rax);
+        break;
+
+      case IROpcode::LessThan:
+      case IROpcode::GreaterThan:
+      case IROpcode::LessOrEqual:
+      case IROpcode::GreaterOrEqual:
+      case IROpcode::Equal:
+      case IROpcode::NotEqual:
+        if (this->is_fused_comparison(value)) {
+          break; // generated by write_terminator instead
+        }
+        if (float_operands) {
+          this->write_float_comparison(i);
+        } else {
+          this->write_int_comparison(i);
+        }
+        this->store_int(value, rax);
+        break;
+    }
+  }
+
+  // leaves the result (0 or 1) in rax
+  void write_int_comparison(const IRInstruction& i) {
+    this->load_int(rcx, i.operands[0]);
+    this->load_int(rdx, i.operands[1]);
+    MemoryReference rax_mem(rax);
+    this->as.write_xor(rax_mem, rax_mem);
+    this->as.write_cmp(MemoryReference(rcx), MemoryReference(rdx));
+    MemoryReference al_mem(byte_register_for_register(rax));
+    switch (i.opcode) {
+      case IROpcode::LessThan:
+        this->as.write_setl(al_mem);
+        break;
+      case IROpcode::GreaterThan:
+        this->as.write_setg(al_mem);
+        break;
+      case IROpcode::LessOrEqual:
+        this->as.write_setle(al_mem);
+        break;
+      case IROpcode::GreaterOrEqual:
+        this->as.write_setge(al_mem);
+        break;
+      case IROpcode::Equal:
+        this->as.write_sete(al_mem);
+        break;
+      case IROpcode::NotEqual:
+        this->as.write_setne(al_mem);
+        break;
+      default:
+        throw logic_error("non-comparison opcode in write_int_comparison");
+    }
+  }
+
+  // leaves the result (0 or 1) in rax. greater-than comparisons are done as
+  // less-than comparisons with the operands swapped, since the not-less-than
+  // comparisons are true for NaN
+  void write_float_comparison(const IRInstruction& i) {
+    bool swap = (i.opcode == IROpcode::GreaterThan) ||
+        (i.opcode == IROpcode::GreaterOrEqual);
+    this->load_float(xmm0, i.operands[swap ? 1 : 0]);
+    this->load_float(xmm1, i.operands[swap ? 0 : 1]);
+    MemoryReference xmm1_mem(xmm1);
+    switch (i.opcode) {
+      case IROpcode::LessThan:
+      case IROpcode::GreaterThan:
+        this->as.write_cmpltsd(xmm0, xmm1_mem);
+        break;
+      case IROpcode::LessOrEqual:
+      case IROpcode::GreaterOrEqual:
+        this->as.write_cmplesd(xmm0, xmm1_mem);
+        break;
+      case IROpcode::Equal:
+        this->as.write_cmpeqsd(xmm0, xmm1_mem);
+        break;
+      case IROpcode::NotEqual:
+        this->as.write_cmpneqsd(xmm0, xmm1_mem);
+        break;
+      default:
+        throw logic_error("non-comparison opcode in write_float_comparison");
+    }
+
+    // the comparison result is all 1s (-1) or all 0s; negating it gives 1 or 0
+    this->as.write_movq_from_xmm(MemoryReference(rax), xmm0);
+    this->as.write_neg(MemoryReference(rax));
+    this->clobber_register(xmm0, true);
+    this->clobber_register(rax, false);
+  }
+
+  // compares the operands of a fused comparison and jumps to false_label if
+  // the comparison is false
+  void write_fused_comparison_branch(const IRInstruction& i,
+      const string& false_label) {
+    if (this->fn->values[i.operands[0]].type == ValueType::Float) {
+      this->write_float_comparison(i);
+      this->as.write_test(MemoryReference(rax), MemoryReference(rax));
+      this->as.write_jz(false_label);
+      return;
+    }
+
+    this->load_int(rcx, i.operands[0]);
+    this->load_int(rdx, i.operands[1]);
+    this->as.write_cmp(MemoryReference(rcx), MemoryReference(rdx));
+    switch (i.opcode) {
+      case IROpcode::LessThan:
+        this->as.write_jge(false_label);
+        break;
+      case IROpcode::GreaterThan:
+        this->as.write_jle(false_label);
+        break;
+      case IROpcode::LessOrEqual:
+        this->as.write_jg(false_label);
+        break;
+      case IROpcode::GreaterOrEqual:
+        this->as.write_jl(false_label);
+        break;
+      case IROpcode::Equal:
+        this->as.write_jne(false_label);
+        break;
+      case IROpcode::NotEqual:
+        this->as.write_je(false_label);
+        break;
+      default:
+        throw logic_error("non-comparison opcode in write_fused_comparison_branch");
+    }
+  }
+
+  // copies the values of the target block's phis for the edge from block
+  void write_phi_copies(size_t block, size_t target) {
+    const IRBlock& target_block = this->fn->blocks[target];
+    vector<pair<size_t, size_t>> copies; // (phi, source value)
+    size_t pred_index;
+    for (pred_index = 0; pred_index < target_block.predecessors.size(); pred_index++) {
+      if (target_block.predecessors[pred_index] == block) {
+        break;
+      }
+    }
+    for (size_t value : target_block.instructions) {
+      const IRInstruction& i = this->fn->values[value];
+      if (i.opcode != IROpcode::Phi) {
+        break;
+      }
+      size_t source = i.operands.at(pred_index);
+      if (source != value) {
+        copies.emplace_back(value, source);
+      }
+    }
+
+    // if there's more than one phi, they're logically assigned all at once, so
+    // copy the sources to temporary slots first
+    if (copies.size() == 1) {
+      this->load_int(rax, copies[0].second);
+      this->clobber_value(copies[0].first);
+      this->store_int(copies[0].first, rax);
+    } else if (copies.size() > 1) {
+      for (size_t x = 0; x < copies.size(); x++) {
+        this->load_int(rax, copies[x].second);
+        this->as.write_mov(this->phi_temp_reference(x), MemoryReference(rax));
+      }
+      for (size_t x = 0; x < copies.size(); x++) {
+        this->as.write_mov(MemoryReference(rax), this->phi_temp_reference(x));
+        this->clobber_value(copies[x].first);
+        this->store_int(copies[x].first, rax);
+      }
+    }
+  }
+
+  bool has_phis(size_t block) const {
+    const auto& instructions = this->fn->blocks[block].instructions;
+    return !instructions.empty() &&
+        (this->fn->values[instructions[0]].opcode == IROpcode::Phi);
+  }
+
+  void write_terminator(size_t block_index, ssize_t next_block) {
+    const IRBlock& block = this->fn->blocks[block_index];
+    switch (block.terminator) {
+      case IRBlock::Terminator::Jump:
+        this->write_phi_copies(block_index, block.targets[0]);
+        if (static_cast<ssize_t>(block.targets[0]) != next_block) {
+          this->as.write_jmp(this->label_for_block(block.targets[0]));
+        }
+        this->registers_valid_after_terminator = true;
+        break;
+
+      case IRBlock::Terminator::Branch: {
+        // if the false target has phis, the copies have to be done on a
+        // separate path from the true target's copies
+        bool true_has_phis = this->has_phis(block.targets[0]);
+        bool false_has_phis = this->has_phis(block.targets[1]);
+        string false_label = false_has_phis ?
+            string_printf("__ir_block_%zu_false", block_index) :
+            this->label_for_block(block.targets[1]);
+        if (this->is_fused_comparison(block.operand)) {
+          this->write_fused_comparison_branch(this->fn->values[block.operand],
+              false_label);
+          this->peephole_stats.branches_fused++;
+        } else {
+          this->load_int(rax, block.operand);
+          this->as.write_test(MemoryReference(rax), MemoryReference(rax));
+          this->as.write_jz(false_label);
+        }
+
+        // the phi copies on the true path change the register contents, so
+        // save them for the false path
+        auto int_registers_at_branch = this->value_in_int_register;
+        auto xmm_registers_at_branch = this->value_in_xmm_register;
+        this->write_phi_copies(block_index, block.targets[0]);
+        if (false_has_phis ||
+            (static_cast<ssize_t>(block.targets[0]) != next_block)) {
+          this->as.write_jmp(this->label_for_block(block.targets[0]));
+        }
+        if (false_has_phis) {
+          this->value_in_int_register = move(int_registers_at_branch);
+          this->value_in_xmm_register = move(xmm_registers_at_branch);
+          this->as.write_label(false_label);
+          this->write_phi_copies(block_index, block.targets[1]);
+          if (static_cast<ssize_t>(block.targets[1]) != next_block) {
+            this->as.write_jmp(this->label_for_block(block.targets[1]));
+          }
+        }
+
+        // if there were no phi copies, the registers are the same on both
+        // paths
+        this->registers_valid_after_terminator = !true_has_phis &&
+            !false_has_phis;
+        break;
+      }
+
+      case IRBlock::Terminator::Return:
+        if (this->fn->return_type == ValueType::Float) {
+          this->load_float(xmm0, block.operand);
+        } else {
+          this->load_int(rax, block.operand);
+        }
+        this->as.write_mov(rsp, rbp);
+        this->as.write_pop(rbp);
+        this->as.write_ret();
+        this->registers_valid_after_terminator = false;
+        break;
+
+      case IRBlock::Terminator::None:
+        throw logic_error(string_printf("block %zu has no terminator",
+            block_index));
+    }
+  }
+};
+
+
+
+IRPeepholeStats generate_code_for_ir_function(const IRFunction* fn,
+    AMD64Assembler& as) {
+  IRCodeGenerator gen(fn, as);
+  gen.generate();
+  return gen.peephole_stats;
+}
+
+bool compile_fragment_ir(GlobalContext* global, Fragment* f,
+    const string& scope_name, AMD64Assembler& as, Value* return_type) {
+  shared_ptr<IRFunction> fn;
+  try {
+    fn = build_ir_for_fragment(global, f);
+  } catch (const not_in_scalar_subset& e) {
+    if (debug_flags & DebugFlag::ShowCompileDebug) {
+      fprintf(stderr, "[%s] ======== scope can\'t be compiled through IR: %s\n\n",
+          scope_name.c_str(), e.what());
+    }
+    return false;
+  }
+
+  if (debug_flags & DebugFlag::ShowIRDebug) {
+    string ir_str = fn->str();
+    fprintf(stderr, "[%s] ======== IR built\n%s\n", scope_name.c_str(),
+        ir_str.c_str());
+  }
+
+  IRPassManager pm;
+  pm.add_default_passes();
+  pm.run(fn.get());
+
+  if (debug_flags & DebugFlag::ShowIRDebug) {
+    string ir_str = fn->str();
+    fprintf(stderr, "[%s] ======== IR optimized (%zu rounds)\n",
+        scope_name.c_str(), pm.get_round_count());
+    for (const auto& pass : pm.get_passes()) {
+      fprintf(stderr, "# %s: %zu changes\n", pass.name, pass.change_count);
+    }
+    fprintf(stderr, "%s\n", ir_str.c_str());
+  }
+
+  IRPeepholeStats stats = generate_code_for_ir_function(fn.get(), as);
+  if (debug_flags & (DebugFlag::ShowIRDebug | DebugFlag::ShowCompileDebug)) {
+    fprintf(stderr, "[%s] ======== peephole: %zu loads dropped, %zu loads "
+        "forwarded, %zu branches fused\n\n", scope_name.c_str(),
+        stats.loads_dropped, stats.loads_forwarded, stats.branches_fused);
+  }
+  *return_type = Value(fn->return_type);
+  return true;
+}
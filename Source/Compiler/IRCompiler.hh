@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stddef.h>
+
+#include <string>
+
+#include <libamd64/AMD64Assembler.hh>
+
+#include "../Environment/Value.hh"
+#include "Contexts.hh"
+#include "IR.hh"
+
+
+
+// when IRCompilation is enabled, compile_fragment tries this before using
+// CompilationVisitor. if the fragment is in the scalar subset, this builds its
+// IR, optimizes it, and generates code for it in as, then sets return_type and
+// returns true. if the fragment isn't in the subset, returns false without
+// writing anything.
+//
+// the generated code follows the same calling convention as code generated by
+// CompilationVisitor. since scalar fragments can't raise exceptions, call
+// anything, or use globals, it doesn't need the exception block or any of the
+// special registers.
+bool compile_fragment_ir(GlobalContext* global, Fragment* f,
+    const std::string& scope_name, AMD64Assembler& as, Value* return_type);
+
+// counts of the peephole rewrites applied while generating code for an IR
+// function (unless NoPeephole is set)
+struct IRPeepholeStats {
+  size_t loads_dropped; // value was already in the right register
+  size_t loads_forwarded; // value was copied from another register
+  size_t branches_fused; // comparison was done by the branch's cmp/jcc
+
+  IRPeepholeStats();
+};
+
+// generates code for an optimized IR function. every value is kept in a stack
+// slot; values are loaded into registers to operate on them, but loads of
+// values that are still in a register from an earlier instruction are skipped
+IRPeepholeStats generate_code_for_ir_function(const IRFunction* fn,
+    AMD64Assembler& as);
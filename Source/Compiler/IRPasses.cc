@@ -0,0 +1,521 @@
+#include "IRPasses.hh"
+
+#include <string.h>
+
+#include <algorithm>
+#include <map>
+#include <stdexcept>
+
+#include "../Debug.hh"
+
+using namespace std;
+
+
+
+IRPassManager::Pass::Pass(const char* name, PassFunction run) : name(name),
+    run(run), change_count(0) { }
+
+IRPassManager::IRPassManager() : round_count(0) { }
+
+void IRPassManager::add_pass(const char* name, PassFunction run) {
+  this->passes.emplace_back(name, run);
+}
+
+void IRPassManager::add_default_passes() {
+  if (!(debug_flags & DebugFlag::NoConstantFolding)) {
+    this->add_pass("constant folding", ir_constant_folding);
+  }
+  if (!(debug_flags & DebugFlag::NoCopyPropagation)) {
+    this->add_pass("copy propagation", ir_copy_propagation);
+  }
+  if (!(debug_flags & DebugFlag::NoCommonSubexpressionElimination)) {
+    this->add_pass("common subexpression elimination",
+        ir_common_subexpression_elimination);
+  }
+  if (!(debug_flags & DebugFlag::NoDeadCodeElimination)) {
+    this->add_pass("dead code elimination", ir_dead_code_elimination);
+  }
+}
+
+void IRPassManager::run(IRFunction* fn) {
+  // each round should make the function smaller or simpler, so this should
+  // terminate quickly anyway; the limit is just a safeguard
+  static const size_t max_rounds = 16;
+
+  for (size_t round = 0; round < max_rounds; round++) {
+    this->round_count++;
+    size_t round_changes = 0;
+    for (auto& pass : this->passes) {
+      size_t changes = pass.run(fn);
+      pass.change_count += changes;
+      round_changes += changes;
+    }
+    if (round_changes == 0) {
+      break;
+    }
+  }
+
+  fn->verify();
+}
+
+const vector<IRPassManager::Pass>& IRPassManager::get_passes() const {
+  return this->passes;
+}
+
+size_t IRPassManager::get_round_count() const {
+  return this->round_count;
+}
+
+
+
+static double float_for_bits(int64_t bits) {
+  double ret;
+  memcpy(&ret, &bits, sizeof(ret));
+  return ret;
+}
+
+static int64_t bits_for_float(double value) {
+  int64_t ret;
+  memcpy(&ret, &value, sizeof(ret));
+  return ret;
+}
+
+// computes the result of an instruction with constant operands. the results
+// must match the generated code exactly (see IRCompiler.cc). returns false if
+// the instruction can't be folded
+static bool fold_instruction(const IRFunction* fn, const IRInstruction& i,
+    int64_t* result) {
+  switch (i.opcode) {
+    case IROpcode::Constant:
+    case IROpcode::Argument:
+    case IROpcode::Phi:
+    case IROpcode::Copy:
+      return false;
+    default:
+      break;
+  }
+
+  vector<int64_t> operands;
+  for (size_t operand : i.operands) {
+    const IRInstruction& op = fn->values[fn->resolve_copies(operand)];
+    if (op.opcode != IROpcode::Constant) {
+      return false;
+    }
+    operands.emplace_back(op.value);
+  }
+
+  // both operands of binary operations have the same type
+  bool is_float = fn->values[fn->resolve_copies(i.operands[0])].type ==
+      ValueType::Float;
+  int64_t a = operands[0];
+  int64_t b = (operands.size() > 1) ? operands[1] : 0;
+  double fa = float_for_bits(a);
+  double fb = float_for_bits(b);
+  uint64_t ua = a, ub = b;
+
+  switch (i.opcode) {
+    case IROpcode::IntToFloat:
+      *result = bits_for_float(static_cast<double>(a));
+      return true;
+    case IROpcode::Truth:
+      // 0.0 and -0.0 are both falsey
+      *result = is_float ? ((ua << 1) != 0) : (a != 0);
+      return true;
+    case IROpcode::LogicalNot:
+      *result = (a == 0);
+      return true;
+    case IROpcode::Negate:
+      *result = is_float ? (a ^ 0x8000000000000000) : -ua;
+      return true;
+    case IROpcode::BitwiseNot:
+      *result = ~a;
+      return true;
+
+    // integer arithmetic wraps around
+    case IROpcode::Add:
+      *result = is_float ? bits_for_float(fa + fb) : (ua + ub);
+      return true;
+    case IROpcode::Subtract:
+      *result = is_float ? bits_for_float(fa - fb) : (ua - ub);
+      return true;
+    case IROpcode::Multiply:
+      *result = is_float ? bits_for_float(fa * fb) : (ua * ub);
+      return true;
+    case IROpcode::Divide:
+      *result = bits_for_float(fa / fb);
+      return true;
+
+    case IROpcode::And:
+      *result = a & b;
+      return true;
+    case IROpcode::Or:
+      *result = a | b;
+      return true;
+    case IROpcode::Xor:
+      *result = a ^ b;
+      return true;
+    // like shl and sar, these only use the low 6 bits of the shift count
+    case IROpcode::LeftShift:
+      *result = ua << (b & 0x3F);
+      return true;
+    case IROpcode::RightShift:
+      *result = a >> (b & 0x3F);
+      return true;
+
+    case IROpcode::LessThan:
+      *result = is_float ? (fa < fb) : (a < b);
+      return true;
+    case IROpcode::GreaterThan:
+      *result = is_float ? (fa > fb) : (a > b);
+      return true;
+    case IROpcode::LessOrEqual:
+      *result = is_float ? (fa <= fb) : (a <= b);
+      return true;
+    case IROpcode::GreaterOrEqual:
+      *result = is_float ? (fa >= fb) : (a >= b);
+      return true;
+    case IROpcode::Equal:
+      *result = is_float ? (fa == fb) : (a == b);
+      return true;
+    case IROpcode::NotEqual:
+      *result = is_float ? (fa != fb) : (a != b);
+      return true;
+
+    default:
+      return false;
+  }
+}
+
+size_t ir_constant_folding(IRFunction* fn) {
+  size_t changes = 0;
+
+  for (size_t value = 0; value < fn->values.size(); value++) {
+    IRInstruction& i = fn->values[value];
+    if (i.deleted) {
+      continue;
+    }
+    int64_t result;
+    if (fold_instruction(fn, i, &result)) {
+      i.opcode = IROpcode::Constant;
+      i.operands.clear();
+      i.value = result;
+      changes++;
+    }
+  }
+
+  for (size_t block_index = 0; block_index < fn->blocks.size(); block_index++) {
+    IRBlock& block = fn->blocks[block_index];
+    if (block.deleted || (block.terminator != IRBlock::Terminator::Branch)) {
+      continue;
+    }
+    const IRInstruction& condition = fn->values[fn->resolve_copies(block.operand)];
+    if (condition.opcode != IROpcode::Constant) {
+      continue;
+    }
+
+    size_t taken = block.targets[condition.value ? 0 : 1];
+    size_t not_taken = block.targets[condition.value ? 1 : 0];
+    fn->remove_edge(block_index, not_taken);
+    block.terminator = IRBlock::Terminator::Jump;
+    block.targets[0] = taken;
+    changes++;
+  }
+
+  return changes;
+}
+
+
+
+size_t ir_copy_propagation(IRFunction* fn) {
+  size_t changes = 0;
+
+  // find phis that aren't really phis
+  for (size_t value = 0; value < fn->values.size(); value++) {
+    IRInstruction& i = fn->values[value];
+    if (i.deleted || (i.opcode != IROpcode::Phi)) {
+      continue;
+    }
+
+    // operands that refer to the phi itself come from loops that don't change
+    // the value, so they don't count
+    bool is_trivial = true;
+    ssize_t unique_operand = -1;
+    for (size_t operand : i.operands) {
+      size_t resolved = fn->resolve_copies(operand);
+      if (resolved == value) {
+        continue;
+      }
+      if (unique_operand < 0) {
+        unique_operand = resolved;
+      } else if (static_cast<size_t>(unique_operand) != resolved) {
+        is_trivial = false;
+        break;
+      }
+    }
+    if (!is_trivial) {
+      continue;
+    }
+
+    // a phi with no other operands is in an unreachable block (or a loop that
+    // can't be entered), so its value doesn't matter
+    if (unique_operand < 0) {
+      i.opcode = IROpcode::Constant;
+      i.operands.clear();
+      i.value = 0;
+    } else {
+      i.opcode = IROpcode::Copy;
+      i.operands.assign(1, unique_operand);
+    }
+
+    // phis must be at the beginning of the block, so move it after them
+    auto& instructions = fn->blocks[i.block].instructions;
+    instructions.erase(find(instructions.begin(), instructions.end(), value));
+    auto it = instructions.begin();
+    while ((it != instructions.end()) &&
+           (fn->values[*it].opcode == IROpcode::Phi)) {
+      it++;
+    }
+    instructions.emplace(it, value);
+    changes++;
+  }
+
+  // replace uses of copies with the original values
+  for (auto& i : fn->values) {
+    if (i.deleted) {
+      continue;
+    }
+    for (size_t& operand : i.operands) {
+      size_t resolved = fn->resolve_copies(operand);
+      if (resolved != operand) {
+        operand = resolved;
+        changes++;
+      }
+    }
+  }
+  for (auto& block : fn->blocks) {
+    if (block.deleted || ((block.terminator != IRBlock::Terminator::Branch) &&
+        (block.terminator != IRBlock::Terminator::Return))) {
+      continue;
+    }
+    size_t resolved = fn->resolve_copies(block.operand);
+    if (resolved != block.operand) {
+      block.operand = resolved;
+      changes++;
+    }
+  }
+
+  return changes;
+}
+
+
+
+size_t ir_dead_code_elimination(IRFunction* fn) {
+  size_t changes = 0;
+
+  // delete unreachable blocks. the entry block is always reachable
+  vector<bool> reachable = fn->reachable_blocks();
+  for (size_t block_index = 0; block_index < fn->blocks.size(); block_index++) {
+    if (reachable[block_index] || fn->blocks[block_index].deleted) {
+      continue;
+    }
+    for (size_t successor : fn->blocks[block_index].successors()) {
+      fn->remove_edge(block_index, successor);
+    }
+    IRBlock& block = fn->blocks[block_index];
+    for (size_t value : block.instructions) {
+      fn->values[value].deleted = true;
+    }
+    block.instructions.clear();
+    block.predecessors.clear();
+    block.terminator = IRBlock::Terminator::None;
+    block.deleted = true;
+    changes++;
+  }
+
+  // find all values that are used by a terminator, directly or indirectly
+  vector<bool> live(fn->values.size(), false);
+  vector<size_t> pending;
+  for (const auto& block : fn->blocks) {
+    if (!block.deleted && ((block.terminator == IRBlock::Terminator::Branch) ||
+        (block.terminator == IRBlock::Terminator::Return))) {
+      pending.emplace_back(block.operand);
+    }
+  }
+  while (!pending.empty()) {
+    size_t value = pending.back();
+    pending.pop_back();
+    if (live[value]) {
+      continue;
+    }
+    live[value] = true;
+    for (size_t operand : fn->values[value].operands) {
+      pending.emplace_back(operand);
+    }
+  }
+
+  for (size_t value = 0; value < fn->values.size(); value++) {
+    if (!live[value] && !fn->values[value].deleted) {
+      fn->delete_instruction(value);
+      changes++;
+    }
+  }
+
+  return changes;
+}
+
+
+
+struct ExpressionKey {
+  IROpcode opcode;
+  ValueType type;
+  int64_t value;
+  vector<size_t> operands;
+
+  bool operator<(const ExpressionKey& other) const {
+    if (this->opcode != other.opcode) {
+      return this->opcode < other.opcode;
+    }
+    if (this->type != other.type) {
+      return this->type < other.type;
+    }
+    if (this->value != other.value) {
+      return this->value < other.value;
+    }
+    return this->operands < other.operands;
+  }
+};
+
+static bool ir_opcode_is_commutative(IROpcode opcode) {
+  switch (opcode) {
+    case IROpcode::Add:
+    case IROpcode::Multiply:
+    case IROpcode::And:
+    case IROpcode::Or:
+    case IROpcode::Xor:
+    case IROpcode::Equal:
+    case IROpcode::NotEqual:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// computes each reachable block's immediate dominator, using the algorithm
+// described in "A Simple, Fast Dominance Algorithm" (Cooper, Harvey and
+// Kennedy). unreachable blocks have no dominator (-1)
+static vector<ssize_t> compute_immediate_dominators(const IRFunction* fn,
+    const vector<size_t>& rpo) {
+  vector<ssize_t> rpo_index(fn->blocks.size(), -1);
+  for (size_t x = 0; x < rpo.size(); x++) {
+    rpo_index[rpo[x]] = x;
+  }
+
+  vector<ssize_t> idom(fn->blocks.size(), -1);
+  idom[0] = 0;
+
+  auto intersect = [&](size_t b1, size_t b2) -> size_t {
+    while (b1 != b2) {
+      while (rpo_index[b1] > rpo_index[b2]) {
+        b1 = idom[b1];
+      }
+      while (rpo_index[b2] > rpo_index[b1]) {
+        b2 = idom[b2];
+      }
+    }
+    return b1;
+  };
+
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (size_t x = 1; x < rpo.size(); x++) {
+      size_t block = rpo[x];
+      ssize_t new_idom = -1;
+      for (size_t pred : fn->blocks[block].predecessors) {
+        if ((rpo_index[pred] < 0) || (idom[pred] < 0)) {
+          continue; // unreachable or not processed yet
+        }
+        new_idom = (new_idom < 0) ? pred : intersect(pred, new_idom);
+      }
+      if (new_idom != idom[block]) {
+        idom[block] = new_idom;
+        changed = true;
+      }
+    }
+  }
+
+  return idom;
+}
+
+size_t ir_common_subexpression_elimination(IRFunction* fn) {
+  vector<size_t> rpo = fn->reverse_postorder();
+  vector<ssize_t> idom = compute_immediate_dominators(fn, rpo);
+
+  vector<vector<size_t>> dominated_blocks(fn->blocks.size());
+  for (size_t x = 1; x < rpo.size(); x++) {
+    dominated_blocks[idom[rpo[x]]].emplace_back(rpo[x]);
+  }
+
+  // walk the dominator tree, keeping track of the expressions computed in the
+  // current block's dominators
+  size_t changes = 0;
+  map<ExpressionKey, size_t> available;
+  vector<pair<size_t, vector<ExpressionKey>>> stack;
+  stack.emplace_back(0, vector<ExpressionKey>());
+  size_t next_child_index = 0;
+  vector<size_t> child_indexes;
+
+  // blocks are processed when pushed; when all of a block's children are done,
+  // its expressions are removed from the available set
+  auto process_block = [&](size_t block_index, vector<ExpressionKey>& added) {
+    for (size_t value : fn->blocks[block_index].instructions) {
+      IRInstruction& i = fn->values[value];
+      if (!ir_opcode_is_pure(i.opcode) || (i.opcode == IROpcode::Copy)) {
+        continue;
+      }
+
+      ExpressionKey key;
+      key.opcode = i.opcode;
+      key.type = i.type;
+      key.value = i.value;
+      for (size_t operand : i.operands) {
+        key.operands.emplace_back(fn->resolve_copies(operand));
+      }
+      if (ir_opcode_is_commutative(i.opcode)) {
+        sort(key.operands.begin(), key.operands.end());
+      }
+
+      auto it = available.find(key);
+      if (it != available.end()) {
+        i.opcode = IROpcode::Copy;
+        i.operands.assign(1, it->second);
+        i.value = 0;
+        changes++;
+      } else {
+        available.emplace(key, value);
+        added.emplace_back(move(key));
+      }
+    }
+  };
+
+  process_block(0, stack.back().second);
+  child_indexes.emplace_back(0);
+  while (!stack.empty()) {
+    size_t block_index = stack.back().first;
+    next_child_index = child_indexes.back()++;
+    if (next_child_index < dominated_blocks[block_index].size()) {
+      size_t child = dominated_blocks[block_index][next_child_index];
+      stack.emplace_back(child, vector<ExpressionKey>());
+      child_indexes.emplace_back(0);
+      process_block(child, stack.back().second);
+    } else {
+      for (const auto& key : stack.back().second) {
+        available.erase(key);
+      }
+      stack.pop_back();
+      child_indexes.pop_back();
+    }
+  }
+
+  return changes;
+}
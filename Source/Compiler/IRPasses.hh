@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stddef.h>
+
+#include <vector>
+
+#include "IR.hh"
+
+
+
+// the pass manager runs optimization passes over an IR function. each pass
+// returns the number of changes it made; the manager runs all of its passes in
+// order, and repeats this until none of them changes anything. passes may
+// leave behind Copy instructions and unused values for later passes to clean
+// up, so the output is correct (but not necessarily clean) if any pass is
+// disabled.
+class IRPassManager {
+public:
+  typedef size_t (*PassFunction)(IRFunction* fn);
+
+  struct Pass {
+    const char* name;
+    PassFunction run;
+    size_t change_count; // total over all runs
+
+    Pass(const char* name, PassFunction run);
+  };
+
+  IRPassManager();
+  ~IRPassManager() = default;
+
+  void add_pass(const char* name, PassFunction run);
+
+  // adds the default passes, except those disabled by debug flags
+  void add_default_passes();
+
+  void run(IRFunction* fn);
+
+  const std::vector<Pass>& get_passes() const;
+  size_t get_round_count() const;
+
+private:
+  std::vector<Pass> passes;
+  size_t round_count;
+};
+
+// replaces instructions whose operands are all constants with constants, and
+// branches on constant conditions with jumps
+size_t ir_constant_folding(IRFunction* fn);
+
+// replaces uses of Copy instructions with the copied values, and phis whose
+// operands are all the same value with copies of that value
+size_t ir_copy_propagation(IRFunction* fn);
+
+// deletes unreachable blocks, and instructions whose values aren't used
+size_t ir_dead_code_elimination(IRFunction* fn);
+
+// replaces instructions that compute the same value as an instruction that
+// dominates them with copies of that instruction's value
+size_t ir_common_subexpression_elimination(IRFunction* fn);
@@ -0,0 +1,621 @@
+#include "Interpreter.hh"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <libamd64/AMD64Assembler.hh>
+#include <phosg/Strings.hh>
+
+#include "../Debug.hh"
+#include "../AST/PythonASTNodes.hh"
+#include "../AST/PythonASTVisitor.hh"
+#include "Compile.hh"
+#include "PerfMap.hh"
+#include "Profiler.hh"
+#include "ScalarSubset.hh"
+
+using namespace std;
+
+
+
+static const vector<Register> int_argument_register_order = {
+    Register::RDI, Register::RSI, Register::RDX, Register::RCX, Register::R8,
+    Register::R9};
+static const vector<Register> float_argument_register_order = {
+    Register::XMM0, Register::XMM1, Register::XMM2, Register::XMM3,
+    Register::XMM4, Register::XMM5, Register::XMM6, Register::XMM7};
+
+// the stub's stack frame contains the argument registers (ints first), the
+// OSR entry pointer, then the locals
+static const int64_t stub_int_args_offset = 0;
+static const int64_t stub_float_args_offset =
+    int_argument_register_order.size() * sizeof(int64_t);
+static const int64_t stub_osr_entry_offset = stub_float_args_offset +
+    float_argument_register_order.size() * sizeof(int64_t);
+static const int64_t stub_locals_offset = stub_osr_entry_offset +
+    sizeof(int64_t);
+
+static double float_for_bits(int64_t bits) {
+  double ret;
+  memcpy(&ret, &bits, sizeof(ret));
+  return ret;
+}
+
+static int64_t bits_for_float(double value) {
+  int64_t ret;
+  memcpy(&ret, &value, sizeof(ret));
+  return ret;
+}
+
+
+
+static bool compile_interpreted_fragment(InterpretedFragment* interp,
+    const WhileStatement* osr_loop = NULL, const void** osr_entry = NULL);
+
+// runs a fragment that infer_scalar_fragment_types accepted. values of all types
+// are stored as 64-bit integers, in the same format as in registers in
+// compiled code (Floats are stored as their bit patterns, Bools are 0 or 1,
+// and None is 0)
+class InterpreterVisitor : public ASTVisitor {
+public:
+  enum class Flow {
+    Normal = 0,
+    Break,
+    Continue,
+    Return,
+    OnStackReplacement,
+  };
+
+  InterpreterVisitor(InterpretedFragment* interp, int64_t* locals) :
+      interp(interp), locals(locals), current_value(0),
+      current_type(ValueType::Indeterminate), flow(Flow::Normal),
+      return_value(0), compiled(false), osr_entry(NULL) { }
+
+  int64_t get_return_value() const {
+    return this->return_value;
+  }
+
+  // true if the fragment was compiled during this call
+  bool get_compiled() const {
+    return this->compiled;
+  }
+
+  // if not NULL, the call should continue in the compiled code from here
+  const void* get_osr_entry() const {
+    return this->osr_entry;
+  }
+
+  // expression visitation
+
+  virtual void visit(UnaryOperation* a) {
+    a->expr->accept(this);
+    ValueType type = this->current_type;
+    this->current_type = scalar_unary_result_type(a->oper, type);
+
+    switch (a->oper) {
+      case UnaryOperator::LogicalNot:
+        this->current_value = !this->current_truth_value(type);
+        break;
+      case UnaryOperator::Not:
+        this->current_value = ~this->current_value;
+        break;
+      case UnaryOperator::Positive:
+        break;
+      case UnaryOperator::Negative:
+        if (type == ValueType::Float) {
+          this->current_value ^= 0x8000000000000000;
+        } else {
+          this->current_value = -static_cast<uint64_t>(this->current_value);
+        }
+        break;
+      default:
+        throw logic_error("unsupported unary operation in interpreter");
+    }
+  }
+
+  virtual void visit(BinaryOperation* a) {
+    a->left->accept(this);
+
+    if ((a->oper == BinaryOperator::LogicalOr) ||
+        (a->oper == BinaryOperator::LogicalAnd)) {
+      bool left_truthy = this->current_truth_value(this->current_type);
+      if ((a->oper == BinaryOperator::LogicalOr) ? !left_truthy : left_truthy) {
+        a->right->accept(this);
+      }
+      return;
+    }
+
+    int64_t left = this->current_value;
+    ValueType left_type = this->current_type;
+    a->right->accept(this);
+    int64_t right = this->current_value;
+    ValueType right_type = this->current_type;
+    this->current_type = scalar_binary_result_type(a->oper, left_type,
+        right_type);
+
+    bool int_operands = (left_type != ValueType::Float) &&
+        (right_type != ValueType::Float);
+    double left_float = (left_type == ValueType::Float) ?
+        float_for_bits(left) : static_cast<double>(left);
+    double right_float = (right_type == ValueType::Float) ?
+        float_for_bits(right) : static_cast<double>(right);
+
+    switch (a->oper) {
+      case BinaryOperator::LessThan:
+        this->current_value = int_operands ? (left < right) : (left_float < right_float);
+        break;
+      case BinaryOperator::GreaterThan:
+        this->current_value = int_operands ? (left > right) : (left_float > right_float);
+        break;
+      case BinaryOperator::LessOrEqual:
+        this->current_value = int_operands ? (left <= right) : (left_float <= right_float);
+        break;
+      case BinaryOperator::GreaterOrEqual:
+        this->current_value = int_operands ? (left >= right) : (left_float >= right_float);
+        break;
+      case BinaryOperator::Equality:
+        this->current_value = int_operands ? (left == right) : (left_float == right_float);
+        break;
+      case BinaryOperator::NotEqual:
+        this->current_value = int_operands ? (left != right) : (left_float != right_float);
+        break;
+
+      case BinaryOperator::Or:
+        this->current_value = left | right;
+        break;
+      case BinaryOperator::And:
+        this->current_value = left & right;
+        break;
+      case BinaryOperator::Xor:
+        this->current_value = left ^ right;
+        break;
+      // like shl and sar, these only use the low 6 bits of the shift count
+      case BinaryOperator::LeftShift:
+        this->current_value = static_cast<uint64_t>(left) << (right & 0x3F);
+        break;
+      case BinaryOperator::RightShift:
+        this->current_value = left >> (right & 0x3F);
+        break;
+
+      // integer arithmetic wraps around, as it does in compiled code
+      case BinaryOperator::Addition:
+        this->current_value = int_operands ?
+            static_cast<int64_t>(static_cast<uint64_t>(left) + static_cast<uint64_t>(right)) :
+            bits_for_float(left_float + right_float);
+        break;
+      case BinaryOperator::Subtraction:
+        this->current_value = int_operands ?
+            static_cast<int64_t>(static_cast<uint64_t>(left) - static_cast<uint64_t>(right)) :
+            bits_for_float(left_float - right_float);
+        break;
+      case BinaryOperator::Multiplication:
+        this->current_value = int_operands ?
+            static_cast<int64_t>(static_cast<uint64_t>(left) * static_cast<uint64_t>(right)) :
+            bits_for_float(left_float * right_float);
+        break;
+      case BinaryOperator::Division:
+        this->current_value = bits_for_float(left_float / right_float);
+        break;
+
+      default:
+        throw logic_error("unsupported binary operation in interpreter");
+    }
+  }
+
+  virtual void visit(TernaryOperation* a) {
+    a->center->accept(this);
+    if (this->current_truth_value(this->current_type)) {
+      a->left->accept(this);
+    } else {
+      a->right->accept(this);
+    }
+  }
+
+  virtual void visit(IntegerConstant* a) {
+    this->current_value = a->value;
+    this->current_type = ValueType::Int;
+  }
+
+  virtual void visit(FloatConstant* a) {
+    this->current_value = bits_for_float(a->value);
+    this->current_type = ValueType::Float;
+  }
+
+  virtual void visit(TrueConstant* a) {
+    this->current_value = 1;
+    this->current_type = ValueType::Bool;
+  }
+
+  virtual void visit(FalseConstant* a) {
+    this->current_value = 0;
+    this->current_type = ValueType::Bool;
+  }
+
+  virtual void visit(NoneConstant* a) {
+    this->current_value = 0;
+    this->current_type = ValueType::None;
+  }
+
+  virtual void visit(VariableLookup* a) {
+    auto it = this->interp->local_indexes.find(a->name);
+    if (it != this->interp->local_indexes.end()) {
+      this->current_value = this->locals[it->second];
+      this->current_type = this->interp->local_types[it->second];
+    } else {
+      const auto& var = this->global_variable(a->name);
+      this->current_value = this->global_space()[var.index];
+      this->current_type = var.value.type;
+    }
+  }
+
+  virtual void visit(AttributeLValueReference* a) {
+    auto it = this->interp->local_indexes.find(a->name);
+    if (it != this->interp->local_indexes.end()) {
+      this->locals[it->second] = this->current_value;
+    } else {
+      this->global_space()[this->global_variable(a->name).index] =
+          this->current_value;
+    }
+  }
+
+  // statement visitation
+
+  virtual void visit(ExpressionStatement* a) {
+    // interpretable expressions have no side effects, so there's nothing to do
+  }
+
+  virtual void visit(AssignmentStatement* a) {
+    a->value->accept(this);
+    a->target->accept(this);
+  }
+
+  virtual void visit(BreakStatement* a) {
+    this->flow = Flow::Break;
+  }
+
+  virtual void visit(ContinueStatement* a) {
+    this->flow = Flow::Continue;
+  }
+
+  virtual void visit(ReturnStatement* a) {
+    a->value->accept(this);
+    this->return_value = this->current_value;
+    this->flow = Flow::Return;
+  }
+
+  virtual void visit(IfStatement* a) {
+    if (a->always_true) {
+      this->execute_list(a->items);
+      return;
+    }
+    if (!a->always_false && this->condition_is_true(a->check.get())) {
+      this->execute_list(a->items);
+      return;
+    }
+    for (auto& elif : a->elifs) {
+      if (elif->always_false) {
+        continue;
+      }
+      if (elif->always_true || this->condition_is_true(elif->check.get())) {
+        this->execute_list(elif->items);
+        return;
+      }
+    }
+    if (a->else_suite.get()) {
+      this->execute_list(a->else_suite->items);
+    }
+  }
+
+  virtual void visit(WhileStatement* a) {
+    for (;;) {
+      if (!this->condition_is_true(a->condition.get())) {
+        if (a->else_suite.get()) {
+          this->execute_list(a->else_suite->items);
+        }
+        return;
+      }
+
+      this->execute_list(a->items);
+      if (this->flow == Flow::Break) {
+        this->flow = Flow::Normal;
+        return;
+      }
+      if ((this->flow == Flow::Return) ||
+          (this->flow == Flow::OnStackReplacement)) {
+        return;
+      }
+      this->flow = Flow::Normal;
+      this->interp->back_edge_count++;
+
+      // if the loop has run long enough, compile the fragment and continue
+      // this call in the compiled code at the top of this loop. if the
+      // compiled code has no entry point for this loop, the call finishes in
+      // the interpreter
+      if (!this->compiled && !this->interp->compile_failed &&
+          (this->interp->back_edge_count >=
+            this->interp->global->interpreter_back_edge_threshold)) {
+        this->compiled = compile_interpreted_fragment(this->interp, a,
+            &this->osr_entry);
+        if (this->osr_entry) {
+          this->flow = Flow::OnStackReplacement;
+          return;
+        }
+      }
+    }
+  }
+
+  virtual void visit(FunctionDefinition* a) {
+    // default values were checked by infer_scalar_fragment_types but don't need to
+    // be evaluated, since they have no side effects
+    this->execute_list(a->items);
+  }
+
+private:
+  InterpretedFragment* interp;
+  int64_t* locals;
+
+  int64_t current_value;
+  ValueType current_type;
+  Flow flow;
+  int64_t return_value;
+  bool compiled;
+  const void* osr_entry;
+
+  // infer_scalar_fragment_types checked that globals are in the function's
+  // module and have scalar types, so their values are stored like locals
+  const ModuleContext::GlobalVariable& global_variable(const string& name) const {
+    return this->interp->function->module->global_variables.at(name);
+  }
+
+  int64_t* global_space() const {
+    return reinterpret_cast<int64_t*>(this->interp->function->module->global_space);
+  }
+
+  void execute_list(vector<shared_ptr<Statement>>& items) {
+    for (auto& item : items) {
+      item->accept(this);
+      if (this->flow != Flow::Normal) {
+        return;
+      }
+    }
+  }
+
+  bool current_truth_value(ValueType type) const {
+    switch (type) {
+      case ValueType::None:
+        return false;
+      case ValueType::Float:
+        // 0.0 and -0.0 are both falsey
+        return (this->current_value << 1) != 0;
+      default:
+        return this->current_value != 0;
+    }
+  }
+
+  bool condition_is_true(Expression* e) {
+    e->accept(this);
+    return this->current_truth_value(this->current_type);
+  }
+};
+
+
+
+InterpretedFragment::InterpretedFragment(GlobalContext* global,
+    FunctionContext* fn, size_t fragment_index) : global(global), function(fn),
+    fragment_index(fragment_index), target(NULL), call_count(0),
+    back_edge_count(0), compile_failed(false) { }
+
+bool interpret_fragment_if_possible(GlobalContext* global, Fragment* f) {
+  FunctionContext* fn = f->function;
+
+  map<string, ValueType> local_types;
+  Value return_type;
+  try {
+    infer_scalar_fragment_types(global, f, &local_types, &return_type, true);
+  } catch (const not_in_scalar_subset& e) {
+    if (debug_flags & DebugFlag::ShowCompileDebug) {
+      fprintf(stderr, "[%s+%" PRId64 "] ======== fragment %zu not interpretable: %s\n",
+          fn->name.c_str(), fn->id, f->index, e.what());
+    }
+    return false;
+  }
+
+  shared_ptr<InterpretedFragment> interp(new InterpretedFragment(global, fn,
+      f->index));
+  // the interpreter keeps locals in the same order as the compiled function's
+  // stack slots, so OSR entries can copy them directly
+  for (const auto& it : fn->locals) {
+    interp->local_indexes.emplace(it.first, interp->local_types.size());
+    interp->local_types.emplace_back(local_types.at(it.first));
+  }
+  for (size_t x = 0; x < f->arg_types.size(); x++) {
+    size_t index = interp->local_indexes.at(fn->args[x].name);
+    if (f->arg_types[x].type == ValueType::Float) {
+      interp->float_arg_indexes.emplace_back(index);
+    } else {
+      interp->int_arg_indexes.emplace_back(index);
+    }
+  }
+
+  // generate the stub. the first part is the fragment's entry point; the rest
+  // runs the interpreter
+  AMD64Assembler as;
+  as.write_label("__interpreter_stub_entry");
+  as.write_mov(rax, reinterpret_cast<int64_t>(&interp->target));
+  as.write_jmp(MemoryReference(rax, 0));
+
+  // the frame size must be a multiple of 16 to keep the stack aligned
+  int64_t frame_size = stub_locals_offset +
+      interp->local_types.size() * sizeof(int64_t);
+  frame_size = (frame_size + 0x0F) & ~0x0F;
+
+  as.write_label("__interpreter_stub_interpret");
+  as.write_push(rbp);
+  as.write_mov(rbp, rsp);
+  as.write_sub(rsp, frame_size);
+  for (size_t x = 0; x < int_argument_register_order.size(); x++) {
+    as.write_mov(MemoryReference(rsp, stub_int_args_offset + x * 8),
+        MemoryReference(int_argument_register_order[x]));
+  }
+  for (size_t x = 0; x < float_argument_register_order.size(); x++) {
+    as.write_movsd(MemoryReference(rsp, stub_float_args_offset + x * 8),
+        MemoryReference(float_argument_register_order[x]));
+  }
+  as.write_mov(rdi, reinterpret_cast<int64_t>(interp.get()));
+  as.write_lea(rsi, MemoryReference(rsp, stub_int_args_offset));
+  as.write_lea(rdx, MemoryReference(rsp, stub_float_args_offset));
+  as.write_lea(rcx, MemoryReference(rsp, stub_locals_offset));
+  as.write_lea(r8, MemoryReference(rsp, stub_osr_entry_offset));
+  as.write_mov(rax, reinterpret_cast<int64_t>(&interpret_fragment));
+  as.write_call(rax);
+
+  // if the interpreter returned an OSR entry, call it with the locals. it
+  // returns the function's return value in the appropriate register already
+  as.write_mov(rcx, MemoryReference(rsp, stub_osr_entry_offset));
+  as.write_test(rcx, rcx);
+  as.write_jz("__interpreter_stub_return");
+  as.write_lea(rdi, MemoryReference(rsp, stub_locals_offset));
+  as.write_call(rcx);
+  as.write_jmp("__interpreter_stub_leave");
+
+  as.write_label("__interpreter_stub_return");
+  if (return_type.type == ValueType::Float) {
+    as.write_movq_to_xmm(xmm0, MemoryReference(rax));
+  }
+  as.write_label("__interpreter_stub_leave");
+  as.write_mov(rsp, rbp);
+  as.write_pop(rbp);
+  as.write_ret();
+
+  unordered_set<size_t> patch_offsets;
+  multimap<size_t, string> labels;
+  string compiled = as.assemble(&patch_offsets, &labels);
+  // the stub isn't a code block, so it's never reclaimed: old callers may
+  // still call it after the fragment is compiled, and it's reused if
+  // compilation fails
+  f->compiled = global->code.append(compiled, &patch_offsets);
+  fn->module->compiled_size += compiled.size();
+
+  if (global->perf_map) {
+    string name = string_printf("%s.%s+%" PRId64 ".<interpreter stub>",
+        fn->module->name.c_str(), fn->name.c_str(), fn->id);
+    global->perf_map->record_code(name, f->compiled, compiled.size(), labels);
+  }
+  if (global->profiler) {
+    global->profiler->record_fragment(f, fn->module, compiled.size());
+  }
+
+  for (const auto& it : labels) {
+    if (it.second == "__interpreter_stub_interpret") {
+      interp->target = reinterpret_cast<const uint8_t*>(f->compiled) + it.first;
+    }
+  }
+  if (!interp->target) {
+    throw logic_error("interpreter stub entry label is missing");
+  }
+
+  f->return_type = return_type;
+  f->compiled_labels = move(labels);
+  f->call_split_offsets.clear();
+  f->call_split_labels.clear();
+  f->interpreted = interp;
+  return true;
+}
+
+static bool compile_interpreted_fragment(InterpretedFragment* interp,
+    const WhileStatement* osr_loop, const void** osr_entry) {
+  GlobalContext* global = interp->global;
+  FunctionContext* fn = interp->function;
+  CompilerLock lock(global);
+
+  Fragment* f = &fn->fragments[interp->fragment_index];
+  const void* stub = f->compiled;
+  Value return_type = f->return_type;
+  multimap<size_t, string> labels = f->compiled_labels;
+
+  // if compilation fails or disagrees with the interpreter about the return
+  // type, the fragment stays in the interpreter. callers were already compiled
+  // with this return type, so it can't change now
+  try {
+    compile_fragment(global, fn->module, f,
+        osr_loop ? "on-stack replacement" : "interpreter threshold");
+    if (!f->return_type.types_equal(return_type)) {
+      string new_type_str = f->return_type.str();
+      string old_type_str = return_type.str();
+      throw compile_error(string_printf(
+          "compiled return type %s does not match interpreted return type %s",
+          new_type_str.c_str(), old_type_str.c_str()));
+    }
+
+  } catch (const exception& e) {
+    if (f->compiled != stub) {
+      global->retire_code(f->compiled);
+    }
+    f->compiled = stub;
+    f->return_type = return_type;
+    f->compiled_labels = move(labels);
+    interp->compile_failed = true;
+    if (debug_flags & DebugFlag::ShowJITEvents) {
+      fprintf(stderr, "[interpreter] failed to compile fragment %zu of %s+%" PRId64 ": %s\n",
+          interp->fragment_index, fn->name.c_str(), fn->id, e.what());
+    }
+    return false;
+  }
+
+  f->return_type = return_type;
+  interp->target = f->compiled;
+
+  if (osr_loop) {
+    auto it = f->osr_entry_offsets.find(osr_loop);
+    if (it != f->osr_entry_offsets.end()) {
+      *osr_entry = reinterpret_cast<const uint8_t*>(f->compiled) + it->second;
+    }
+  }
+
+  if (debug_flags & DebugFlag::ShowJITEvents) {
+    fprintf(stderr, "[interpreter] compiled fragment %zu of %s+%" PRId64 " after %zu calls and %zu loop iterations\n",
+        interp->fragment_index, fn->name.c_str(), fn->id, interp->call_count,
+        interp->back_edge_count);
+    if (osr_loop) {
+      fprintf(stderr, "[interpreter] %s OSR entry for loop at offset %zu\n",
+          (osr_entry && *osr_entry) ? "using" : "no", osr_loop->file_offset);
+    }
+  }
+  return true;
+}
+
+int64_t interpret_fragment(InterpretedFragment* interp,
+    const int64_t* int_args, const int64_t* float_args, int64_t* locals,
+    const void** osr_entry) {
+  FunctionContext* fn = interp->function;
+  interp->call_count++;
+
+  // this doesn't look at the fragment (the background compiler may be adding
+  // fragments to the function) and the AST doesn't change after analysis, so
+  // this doesn't need the compiler lock
+  memset(locals, 0, interp->local_types.size() * sizeof(int64_t));
+  for (size_t x = 0; x < interp->int_arg_indexes.size(); x++) {
+    locals[interp->int_arg_indexes[x]] = int_args[x];
+  }
+  for (size_t x = 0; x < interp->float_arg_indexes.size(); x++) {
+    locals[interp->float_arg_indexes[x]] = float_args[x];
+  }
+
+  InterpreterVisitor v(interp, locals);
+  fn->ast_root->accept(&v);
+
+  *osr_entry = v.get_osr_entry();
+  if (*osr_entry) {
+    return 0;
+  }
+
+  const GlobalContext* global = interp->global;
+  if (!v.get_compiled() && !interp->compile_failed &&
+      ((interp->call_count >= global->interpreter_call_threshold) ||
+       (interp->back_edge_count >= global->interpreter_back_edge_threshold))) {
+    compile_interpreted_fragment(interp);
+  }
+
+  return v.get_return_value();
+}
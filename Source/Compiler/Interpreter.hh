@@ -0,0 +1,78 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "../Environment/Value.hh"
+#include "Contexts.hh"
+
+
+
+// the interpreter tier runs cold function fragments by walking the AST instead
+// of compiling them. this is much slower than running compiled code, but it
+// costs almost nothing to start, so functions that are only called a few times
+// don't pay for compilation. when a fragment has been called enough times (or
+// its loops have run enough iterations), it's compiled normally, and later
+// calls run the compiled code.
+//
+// only the scalar subset of the language (see ScalarSubset.hh) can be
+// interpreted. fragments that use anything else are compiled immediately, as
+// if the interpreter were disabled.
+//
+// interpreted fragments are called like any other fragment. the fragment's
+// compiled pointer points to a stub that jumps through target; target starts
+// out pointing to code in the stub that calls interpret_fragment, and is
+// changed to point to the compiled code when the fragment is compiled.
+// callers compiled after that point call the compiled code directly.
+//
+// a call that's running in the interpreter can't switch to the compiled code
+// in most places, but it can at the top of a while loop: when a loop has run
+// enough iterations, the fragment is compiled with an extra entry point for
+// each while loop (on-stack replacement entries; see write_osr_entries in
+// CompilationVisitor). these set up the compiled function's stack frame with
+// the interpreter's locals, and jump to the top of the loop.
+
+struct InterpretedFragment {
+  GlobalContext* global;
+  FunctionContext* function;
+  size_t fragment_index;
+
+  const void* target; // called by the stub
+
+  size_t call_count;
+  size_t back_edge_count;
+  bool compile_failed; // if true, the fragment stays in the interpreter
+
+  // types and slot indexes of the fragment's locals (including arguments).
+  // the slots are in the same order as the compiled function's stack slots
+  std::unordered_map<std::string, size_t> local_indexes;
+  std::vector<ValueType> local_types;
+
+  // slot indexes for the arguments passed in int and float registers, in
+  // register order
+  std::vector<size_t> int_arg_indexes;
+  std::vector<size_t> float_arg_indexes;
+
+  InterpretedFragment(GlobalContext* global, FunctionContext* fn,
+      size_t fragment_index);
+};
+
+// if the fragment can be interpreted, sets up the interpreter stub as its code
+// and sets its return type. returns false (and changes nothing) if it can't
+bool interpret_fragment_if_possible(GlobalContext* global, Fragment* f);
+
+extern "C" {
+
+// called by interpreter stubs. int_args and float_args point to the values of
+// the argument registers at call time, and locals points to space for the
+// fragment's locals. returns the fragment's return value (the stub moves it
+// into xmm0 if it's a Float). if the fragment is compiled while one of its
+// loops is running, this sets osr_entry instead, and the stub calls it with
+// the locals to finish the call in the compiled code
+int64_t interpret_fragment(InterpretedFragment* interp, const int64_t* int_args,
+    const int64_t* float_args, int64_t* locals, const void** osr_entry);
+
+} // extern "C"
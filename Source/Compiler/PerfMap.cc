@@ -0,0 +1,255 @@
+#include "PerfMap.hh"
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef LINUX
+#include <sys/syscall.h>
+#endif
+
+#include <stdexcept>
+
+#include <phosg/Strings.hh>
+
+using namespace std;
+
+
+
+// see tools/perf/Documentation/jitdump-specification.txt in the linux source
+static const uint32_t JITDUMP_MAGIC = 0x4A695444;
+static const uint32_t JITDUMP_VERSION = 1;
+static const uint32_t JITDUMP_ELF_MACH_X86_64 = 62;
+
+enum JitdumpRecordType {
+  JIT_CODE_LOAD = 0,
+  JIT_CODE_DEBUG_INFO = 2,
+  JIT_CODE_CLOSE = 3,
+};
+
+struct JitdumpHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t total_size;
+  uint32_t elf_mach;
+  uint32_t pad1;
+  uint32_t pid;
+  uint64_t timestamp;
+  uint64_t flags;
+} __attribute__((packed));
+
+struct JitdumpRecordHeader {
+  uint32_t id;
+  uint32_t total_size;
+  uint64_t timestamp;
+} __attribute__((packed));
+
+struct JitdumpCodeLoad {
+  JitdumpRecordHeader header;
+  uint32_t pid;
+  uint32_t tid;
+  uint64_t vma;
+  uint64_t code_addr;
+  uint64_t code_size;
+  uint64_t code_index;
+  // followed by the null-terminated name, then the code
+} __attribute__((packed));
+
+struct JitdumpDebugInfo {
+  JitdumpRecordHeader header;
+  uint64_t code_addr;
+  uint64_t nr_entry;
+  // followed by nr_entry entries
+} __attribute__((packed));
+
+struct JitdumpDebugEntry {
+  uint64_t code_addr;
+  uint32_t line;
+  uint32_t discrim;
+  // followed by the null-terminated name
+} __attribute__((packed));
+
+// perf record -k mono uses this clock, so the timestamps in the jitdump file
+// can be matched with the samples
+static uint64_t jitdump_timestamp() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+static uint32_t current_tid() {
+#ifdef LINUX
+  return syscall(SYS_gettid);
+#else
+  return getpid();
+#endif
+}
+
+template <typename T>
+static void append_struct(string& data, const T& s) {
+  data.append(reinterpret_cast<const char*>(&s), sizeof(s));
+}
+
+static void append_cstr(string& data, const string& s) {
+  data.append(s);
+  data.push_back('\0');
+}
+
+
+
+PerfMap::PerfMap(bool write_map, bool write_labels, bool write_jitdump) :
+    write_labels(write_labels), map_file(NULL), jitdump_fd(-1),
+    jitdump_marker(NULL), next_code_index(0) {
+  if (write_map) {
+    string filename = string_printf("/tmp/perf-%d.map", getpid());
+    this->map_file = fopen(filename.c_str(), "wt");
+    if (!this->map_file) {
+      throw runtime_error("can\'t open " + filename);
+    }
+  }
+
+  if (write_jitdump) {
+    string filename = string_printf("jit-%d.dump", getpid());
+    this->jitdump_fd = open(filename.c_str(), O_CREAT | O_TRUNC | O_RDWR, 0644);
+    if (this->jitdump_fd < 0) {
+      if (this->map_file) {
+        fclose(this->map_file);
+      }
+      throw runtime_error("can\'t open " + filename);
+    }
+
+    // perf record finds the jitdump file by looking for an executable mapping
+    // of it, so we have to map it even though we never read the mapping
+    this->jitdump_marker = mmap(NULL, sysconf(_SC_PAGESIZE),
+        PROT_READ | PROT_EXEC, MAP_PRIVATE, this->jitdump_fd, 0);
+    if (this->jitdump_marker == MAP_FAILED) {
+      this->jitdump_marker = NULL;
+    }
+
+    JitdumpHeader header;
+    header.magic = JITDUMP_MAGIC;
+    header.version = JITDUMP_VERSION;
+    header.total_size = sizeof(header);
+    header.elf_mach = JITDUMP_ELF_MACH_X86_64;
+    header.pad1 = 0;
+    header.pid = getpid();
+    header.timestamp = jitdump_timestamp();
+    header.flags = 0;
+    if (write(this->jitdump_fd, &header, sizeof(header)) != sizeof(header)) {
+      throw runtime_error("can\'t write jitdump header");
+    }
+  }
+}
+
+PerfMap::~PerfMap() {
+  if (this->map_file) {
+    fclose(this->map_file);
+  }
+
+  if (this->jitdump_fd >= 0) {
+    JitdumpRecordHeader header;
+    header.id = JIT_CODE_CLOSE;
+    header.total_size = sizeof(header);
+    header.timestamp = jitdump_timestamp();
+    ssize_t bytes_written = write(this->jitdump_fd, &header, sizeof(header));
+    (void)bytes_written; // nothing to do if this fails
+
+    if (this->jitdump_marker) {
+      munmap(this->jitdump_marker, sysconf(_SC_PAGESIZE));
+    }
+    close(this->jitdump_fd);
+  }
+}
+
+void PerfMap::record_code(const string& name, const void* code, size_t size,
+    const multimap<size_t, string>& labels) {
+  if (this->map_file) {
+    this->write_map_entries(name, code, size, labels);
+  }
+  if (this->jitdump_fd >= 0) {
+    this->write_jitdump_records(name, code, size, labels);
+  }
+}
+
+void PerfMap::write_map_entries(const string& name, const void* code,
+    size_t size, const multimap<size_t, string>& labels) {
+  uint64_t addr = reinterpret_cast<uint64_t>(code);
+  if (!this->write_labels || labels.empty()) {
+    fprintf(this->map_file, "%" PRIx64 " %zx %s\n", addr, size, name.c_str());
+
+  } else {
+    // regions can't overlap, so each one is named after the first label at its
+    // start offset. code before the first label is named after the fragment
+    size_t region_start = 0;
+    string region_name = name;
+    for (auto it = labels.begin(); it != labels.end();
+         it = labels.upper_bound(it->first)) {
+      if (it->first > region_start) {
+        fprintf(this->map_file, "%" PRIx64 " %zx %s\n", addr + region_start,
+            it->first - region_start, region_name.c_str());
+      }
+      region_start = it->first;
+      region_name = name + ":" + it->second;
+    }
+    if (size > region_start) {
+      fprintf(this->map_file, "%" PRIx64 " %zx %s\n", addr + region_start,
+          size - region_start, region_name.c_str());
+    }
+  }
+
+  // perf reads the map after the process exits, but flush anyway so the map is
+  // usable if it crashes
+  fflush(this->map_file);
+}
+
+void PerfMap::write_jitdump_records(const string& name, const void* code,
+    size_t size, const multimap<size_t, string>& labels) {
+  uint64_t addr = reinterpret_cast<uint64_t>(code);
+  uint64_t timestamp = jitdump_timestamp();
+  string data;
+
+  // the debug info has to come before the code it describes
+  if (!labels.empty()) {
+    JitdumpDebugInfo info;
+    info.header.id = JIT_CODE_DEBUG_INFO;
+    info.header.timestamp = timestamp;
+    info.code_addr = addr;
+    info.nr_entry = 0;
+    append_struct(data, info);
+    for (auto it = labels.begin(); it != labels.end();
+         it = labels.upper_bound(it->first)) {
+      JitdumpDebugEntry entry;
+      entry.code_addr = addr + it->first;
+      entry.line = 1;
+      entry.discrim = 0;
+      append_struct(data, entry);
+      append_cstr(data, it->second);
+      info.nr_entry++;
+    }
+    info.header.total_size = data.size();
+    memcpy(&data[0], &info, sizeof(info));
+  }
+
+  size_t load_offset = data.size();
+  JitdumpCodeLoad load;
+  load.header.id = JIT_CODE_LOAD;
+  load.header.timestamp = timestamp;
+  load.pid = getpid();
+  load.tid = current_tid();
+  load.vma = addr;
+  load.code_addr = addr;
+  load.code_size = size;
+  load.code_index = this->next_code_index++;
+  append_struct(data, load);
+  append_cstr(data, name);
+  data.append(reinterpret_cast<const char*>(code), size);
+  load.header.total_size = data.size() - load_offset;
+  memcpy(&data[load_offset], &load, sizeof(load));
+
+  // failures are ignored, like code cache writes
+  ssize_t bytes_written = write(this->jitdump_fd, data.data(), data.size());
+  (void)bytes_written;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <map>
+#include <string>
+
+
+
+// describes generated code to Linux perf, so samples in it are attributed to
+// the fragments they're in instead of unknown addresses. there are two
+// formats:
+// - the perf map (/tmp/perf-<pid>.map) is a text file with one line per code
+//   region, which perf report reads directly. regions are whole fragments, or
+//   if write_labels is given, the ranges between the fragment's labels (so
+//   samples are attributed to the AST node that generated the code)
+// - the jitdump file (jit-<pid>.dump in the current directory) contains a copy
+//   of each fragment's code, so perf inject can turn it into an ELF object
+//   that perf annotate can disassemble. each fragment's labels are written as
+//   its debug info, so perf annotate shows the label for each instruction
+//
+// reclaimed code space (see GlobalContext::CodeBlock) is reused, so later
+// entries can describe the same addresses as earlier ones.
+class PerfMap {
+public:
+  PerfMap(bool write_map, bool write_labels, bool write_jitdump);
+  PerfMap(const PerfMap&) = delete;
+  PerfMap(PerfMap&&) = delete;
+  PerfMap& operator=(const PerfMap&) = delete;
+  PerfMap& operator=(PerfMap&&) = delete;
+  ~PerfMap();
+
+  // labels maps offsets within the code to label names, as returned by
+  // AMD64Assembler::assemble
+  void record_code(const std::string& name, const void* code, size_t size,
+      const std::multimap<size_t, std::string>& labels = {});
+
+private:
+  bool write_labels;
+  FILE* map_file;
+
+  int jitdump_fd;
+  void* jitdump_marker;
+  uint64_t next_code_index;
+
+  void write_map_entries(const std::string& name, const void* code,
+      size_t size, const std::multimap<size_t, std::string>& labels);
+  void write_jitdump_records(const std::string& name, const void* code,
+      size_t size, const std::multimap<size_t, std::string>& labels);
+};
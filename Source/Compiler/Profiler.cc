@@ -0,0 +1,401 @@
+#include "Profiler.hh"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include <ucontext.h>
+
+#include <algorithm>
+#include <set>
+#include <stdexcept>
+#include <unordered_set>
+#include <vector>
+
+#include <phosg/Strings.hh>
+
+using namespace std;
+
+
+
+const char* const source_offset_label_prefix = "__source_offset_";
+
+ssize_t source_offset_for_label(const string& label) {
+  size_t prefix_length = strlen(source_offset_label_prefix);
+  if (label.compare(0, prefix_length, source_offset_label_prefix)) {
+    return -1;
+  }
+  return strtoull(label.c_str() + prefix_length, NULL, 10);
+}
+
+
+
+atomic<Profiler*> Profiler::active_profiler(NULL);
+
+size_t Profiler::CodeRegion::line_for_offset(size_t offset) const {
+  auto it = this->offset_to_line.upper_bound(offset);
+  if (it == this->offset_to_line.begin()) {
+    return this->default_line;
+  }
+  return prev(it)->second;
+}
+
+Profiler::Counts::Counts() : flat(0), cumulative(0) { }
+
+Profiler::Profiler(GlobalContext* global) : global(global),
+    samples(new Sample[sample_buffer_capacity]), write_index(0),
+    read_index(0), dropped_count(0), other_thread_count(0), stack_top(NULL),
+    interval_usecs(0), running(false), processed_count(0),
+    no_generated_code_count(0) {
+
+  // record everything that was compiled before the profiler existed
+  for (const auto& module_it : this->global->modules) {
+    const ModuleContext* module = module_it.second.get();
+    const Fragment* f = &module->root_fragment;
+    auto block_it = this->global->code_blocks.find(f->compiled);
+    if (block_it != this->global->code_blocks.end()) {
+      this->record_fragment(f, module, block_it->second.size);
+    }
+  }
+  for (const auto& fn_it : this->global->function_id_to_context) {
+    const FunctionContext* fn = &fn_it.second;
+    for (const auto& f : fn->fragments) {
+      auto block_it = this->global->code_blocks.find(f.compiled);
+      if (block_it != this->global->code_blocks.end()) {
+        this->record_fragment(&f, fn->module, block_it->second.size);
+      }
+    }
+  }
+  for (const auto& cls_it : this->global->class_id_to_context) {
+    const ClassContext* cls = &cls_it.second;
+    auto block_it = this->global->code_blocks.find(cls->destructor);
+    if (block_it != this->global->code_blocks.end()) {
+      this->record_code(cls->module->name + "." + cls->name + ".<destructor>",
+          cls->module, cls->destructor, block_it->second.size);
+    }
+  }
+}
+
+Profiler::~Profiler() {
+  this->stop();
+}
+
+void Profiler::start(uint64_t interval_usecs) {
+  if (this->running) {
+    return;
+  }
+  Profiler* expected = NULL;
+  if (!active_profiler.compare_exchange_strong(expected, this)) {
+    throw logic_error("another profiler is already running");
+  }
+
+  // the stack bounds limit how far the signal handler follows the frame
+  // pointer chain
+  this->profiled_thread = pthread_self();
+#ifdef MACOSX
+  this->stack_top = pthread_get_stackaddr_np(this->profiled_thread);
+#else // LINUX
+  pthread_attr_t attr;
+  void* stack_addr;
+  size_t stack_size;
+  pthread_getattr_np(this->profiled_thread, &attr);
+  pthread_attr_getstack(&attr, &stack_addr, &stack_size);
+  pthread_attr_destroy(&attr);
+  this->stack_top = reinterpret_cast<const uint8_t*>(stack_addr) + stack_size;
+#endif
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_sigaction = &Profiler::handle_signal;
+  sa.sa_flags = SA_SIGINFO | SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGPROF, &sa, &this->prev_action);
+
+  struct itimerval timer;
+  timer.it_interval.tv_sec = interval_usecs / 1000000;
+  timer.it_interval.tv_usec = interval_usecs % 1000000;
+  timer.it_value = timer.it_interval;
+  setitimer(ITIMER_PROF, &timer, NULL);
+
+  this->interval_usecs = interval_usecs;
+  this->running = true;
+}
+
+void Profiler::stop() {
+  if (!this->running) {
+    return;
+  }
+
+  struct itimerval timer;
+  memset(&timer, 0, sizeof(timer));
+  setitimer(ITIMER_PROF, &timer, NULL);
+
+  // a signal could still be pending, and the default action for SIGPROF is to
+  // terminate the process, so ignore it instead of restoring the default
+  if (!(this->prev_action.sa_flags & SA_SIGINFO) &&
+      (this->prev_action.sa_handler == SIG_DFL)) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = SIG_IGN;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGPROF, &sa, NULL);
+  } else {
+    sigaction(SIGPROF, &this->prev_action, NULL);
+  }
+
+  active_profiler = NULL;
+  this->running = false;
+}
+
+bool Profiler::is_running() const {
+  return this->running;
+}
+
+void Profiler::handle_signal(int signum, siginfo_t* info, void* context) {
+  Profiler* p = active_profiler.load();
+  if (!p) {
+    return;
+  }
+  if (!pthread_equal(pthread_self(), p->profiled_thread)) {
+    p->other_thread_count++;
+    return;
+  }
+
+  size_t index = p->write_index.load(memory_order_relaxed);
+  if (index - p->read_index.load(memory_order_acquire) >= sample_buffer_capacity) {
+    p->dropped_count++;
+    return;
+  }
+  Sample& sample = p->samples[index % sample_buffer_capacity];
+
+  const ucontext_t* uc = reinterpret_cast<const ucontext_t*>(context);
+#ifdef MACOSX
+  uintptr_t rip = uc->uc_mcontext->__ss.__rip;
+  uintptr_t rsp = uc->uc_mcontext->__ss.__rsp;
+  uintptr_t rbp = uc->uc_mcontext->__ss.__rbp;
+#else // LINUX
+  uintptr_t rip = uc->uc_mcontext.gregs[REG_RIP];
+  uintptr_t rsp = uc->uc_mcontext.gregs[REG_RSP];
+  uintptr_t rbp = uc->uc_mcontext.gregs[REG_RBP];
+#endif
+
+  // follow the frame pointer chain. generated code and nemesys itself both
+  // keep frame pointers, but the chain is checked against the stack bounds in
+  // case the interrupted code is using rbp for something else
+  uintptr_t stack_top = reinterpret_cast<uintptr_t>(p->stack_top);
+  sample.addresses[0] = reinterpret_cast<const void*>(rip);
+  sample.depth = 1;
+  while (sample.depth < max_sample_depth) {
+    if ((rbp < rsp) || (rbp & 7) || (rbp + 2 * sizeof(uintptr_t) > stack_top)) {
+      break;
+    }
+    const uintptr_t* frame = reinterpret_cast<const uintptr_t*>(rbp);
+    sample.addresses[sample.depth++] = reinterpret_cast<const void*>(frame[1]);
+    if (frame[0] <= rbp) {
+      break;
+    }
+    rbp = frame[0];
+  }
+
+  p->write_index.store(index + 1, memory_order_release);
+}
+
+
+
+void Profiler::record_fragment(const Fragment* f, const ModuleContext* module,
+    size_t size) {
+  string function_name;
+  ssize_t source_offset = -1;
+  if (f->function) {
+    auto* cls = this->global->context_for_class(f->function->class_id);
+    if (cls) {
+      function_name = module->name + "." + cls->name + "." + f->function->name;
+    } else {
+      function_name = module->name + "." + f->function->name;
+    }
+    if (f->function->ast_root) {
+      source_offset = f->function->ast_root->file_offset;
+    }
+  } else {
+    function_name = module->name + ".<module>";
+  }
+  this->record_code(function_name, module, f->compiled, size, source_offset);
+
+  if (module->source.get()) {
+    auto& region = this->regions.at(f->compiled);
+    for (const auto& it : f->compiled_labels) {
+      ssize_t label_source_offset = source_offset_for_label(it.second);
+      if (label_source_offset >= 0) {
+        region.offset_to_line[it.first] =
+            module->source->line_number_of_offset(label_source_offset);
+      }
+    }
+  }
+}
+
+void Profiler::record_code(const string& function_name,
+    const ModuleContext* module, const void* code, size_t size,
+    ssize_t source_offset) {
+  // samples in any code that this replaces have to be attributed first
+  this->process_samples();
+
+  const uint8_t* start = reinterpret_cast<const uint8_t*>(code);
+  auto it = this->regions.lower_bound(code);
+  if (it != this->regions.begin()) {
+    auto prev_it = prev(it);
+    if (reinterpret_cast<const uint8_t*>(prev_it->first) + prev_it->second.size > start) {
+      it = prev_it;
+    }
+  }
+  while ((it != this->regions.end()) && (it->first < start + size)) {
+    it = this->regions.erase(it);
+  }
+
+  auto& region = this->regions[code];
+  region.size = size;
+  region.function_name = function_name;
+  region.module = module;
+  region.default_line = 0;
+  if ((source_offset >= 0) && module && module->source.get()) {
+    region.default_line = module->source->line_number_of_offset(source_offset);
+  }
+}
+
+const Profiler::CodeRegion* Profiler::region_for_address(const void* addr,
+    size_t* offset) const {
+  auto it = this->regions.upper_bound(addr);
+  if (it == this->regions.begin()) {
+    return NULL;
+  }
+  it--;
+  size_t region_offset = reinterpret_cast<const uint8_t*>(addr) -
+      reinterpret_cast<const uint8_t*>(it->first);
+  if (region_offset >= it->second.size) {
+    return NULL;
+  }
+  *offset = region_offset;
+  return &it->second;
+}
+
+void Profiler::process_samples() {
+  size_t end_index = this->write_index.load(memory_order_acquire);
+  size_t index = this->read_index.load(memory_order_relaxed);
+  for (; index != end_index; index++) {
+    const Sample& sample = this->samples[index % sample_buffer_capacity];
+    this->processed_count++;
+
+    // the innermost frame in generated code gets the flat count, which
+    // includes time spent in any runtime functions it called. every function
+    // and line on the stack gets one cumulative count, even if it appears more
+    // than once (e.g. in recursive calls)
+    bool found_innermost = false;
+    unordered_set<string> seen_functions;
+    set<pair<const ModuleContext*, size_t>> seen_lines;
+    for (size_t depth = 0; depth < sample.depth; depth++) {
+      // return addresses point after the call, which may be in a different
+      // region or on a different line
+      const uint8_t* addr = reinterpret_cast<const uint8_t*>(sample.addresses[depth]);
+      if (depth) {
+        addr--;
+      }
+
+      size_t offset;
+      const CodeRegion* region = this->region_for_address(addr, &offset);
+      if (!region) {
+        continue;
+      }
+      size_t line = region->line_for_offset(offset);
+      auto line_key = make_pair(region->module, line);
+
+      Counts& function_counts = this->function_counts[region->function_name];
+      if (!found_innermost) {
+        function_counts.flat++;
+        if (line) {
+          this->line_counts[line_key].flat++;
+        }
+        found_innermost = true;
+      }
+      if (seen_functions.emplace(region->function_name).second) {
+        function_counts.cumulative++;
+      }
+      if (line && seen_lines.emplace(line_key).second) {
+        this->line_counts[line_key].cumulative++;
+      }
+    }
+    if (!found_innermost) {
+      this->no_generated_code_count++;
+    }
+  }
+  this->read_index.store(end_index, memory_order_release);
+}
+
+size_t Profiler::sample_count() {
+  this->process_samples();
+  return this->processed_count;
+}
+
+void Profiler::print_report(FILE* stream) {
+  this->process_samples();
+
+  static const size_t max_functions = 20;
+  static const size_t max_lines = 30;
+
+  fprintf(stream, "[profile] %zu samples (%" PRIu64 "us interval); %zu not in generated code; %zu on other threads; %zu dropped\n",
+      this->processed_count, this->interval_usecs,
+      this->no_generated_code_count, this->other_thread_count.load(),
+      this->dropped_count.load());
+  if (!this->processed_count) {
+    return;
+  }
+  double total = this->processed_count;
+
+  auto by_counts = [](const Counts& a, const Counts& b) -> bool {
+    if (a.flat != b.flat) {
+      return a.flat > b.flat;
+    }
+    return a.cumulative > b.cumulative;
+  };
+
+  vector<pair<string, Counts>> functions(this->function_counts.begin(),
+      this->function_counts.end());
+  stable_sort(functions.begin(), functions.end(), [&](
+      const pair<string, Counts>& a, const pair<string, Counts>& b) {
+    return by_counts(a.second, b.second);
+  });
+  fprintf(stream, "[profile] functions:\n");
+  fprintf(stream, "     flat  flat%%      cum   cum%%  function\n");
+  for (size_t x = 0; (x < functions.size()) && (x < max_functions); x++) {
+    const auto& it = functions[x];
+    fprintf(stream, "  %7zu %5.1f%%  %7zu %5.1f%%  %s\n", it.second.flat,
+        100.0 * it.second.flat / total, it.second.cumulative,
+        100.0 * it.second.cumulative / total, it.first.c_str());
+  }
+
+  vector<pair<pair<const ModuleContext*, size_t>, Counts>> lines(
+      this->line_counts.begin(), this->line_counts.end());
+  stable_sort(lines.begin(), lines.end(), [&](
+      const pair<pair<const ModuleContext*, size_t>, Counts>& a,
+      const pair<pair<const ModuleContext*, size_t>, Counts>& b) {
+    return by_counts(a.second, b.second);
+  });
+  fprintf(stream, "[profile] lines:\n");
+  fprintf(stream, "     flat  flat%%      cum   cum%%  location\n");
+  for (size_t x = 0; (x < lines.size()) && (x < max_lines); x++) {
+    const auto& it = lines[x];
+    const ModuleContext* module = it.first.first;
+    size_t line_num = it.first.second;
+
+    string line_text;
+    try {
+      line_text = module->source->line(line_num);
+      size_t start = line_text.find_first_not_of(" \t");
+      size_t end = line_text.find_last_not_of(" \t\r\n");
+      line_text = (start == string::npos) ? "" : line_text.substr(start, end - start + 1);
+    } catch (const out_of_range&) { }
+
+    fprintf(stream, "  %7zu %5.1f%%  %7zu %5.1f%%  %s:%zu  %s\n",
+        it.second.flat, 100.0 * it.second.flat / total, it.second.cumulative,
+        100.0 * it.second.cumulative / total,
+        module->source->filename().c_str(), line_num, line_text.c_str());
+  }
+}
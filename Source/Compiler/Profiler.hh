@@ -0,0 +1,119 @@
+#pragma once
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+#include "Contexts.hh"
+
+
+
+// CompilationVisitor writes a label before each statement consisting of this
+// prefix, the statement's source offset, and a unique number. this returns the
+// source offset from such a label, or -1 if the label isn't one of these
+extern const char* const source_offset_label_prefix;
+ssize_t source_offset_for_label(const std::string& label);
+
+// a sampling profiler for generated code. while running, a SIGPROF timer
+// interrupts the main thread periodically, and the signal handler records the
+// interrupted address and the return addresses in the frame pointer chain.
+// when the samples are processed, each address is mapped to the code region
+// containing it and then to a source line, using the statement labels in the
+// fragment's compiled_labels. only the main thread runs generated code, so
+// samples that interrupt other threads are only counted.
+//
+// code regions are recorded as they're installed. reclaimed code space can be
+// reused (see GlobalContext::CodeBlock), so pending samples are processed
+// before each new region is recorded, while the old region's information is
+// still available.
+class Profiler {
+public:
+  explicit Profiler(GlobalContext* global);
+  Profiler(const Profiler&) = delete;
+  Profiler(Profiler&&) = delete;
+  Profiler& operator=(const Profiler&) = delete;
+  Profiler& operator=(Profiler&&) = delete;
+  ~Profiler();
+
+  // starts or stops sampling. start must be called on the main thread
+  void start(uint64_t interval_usecs = 10000);
+  void stop();
+  bool is_running() const;
+
+  // describe generated code to the profiler. all fragments and destructors
+  // that already existed are recorded when the profiler is created
+  void record_fragment(const Fragment* f, const ModuleContext* module,
+      size_t size);
+  void record_code(const std::string& function_name,
+      const ModuleContext* module, const void* code, size_t size,
+      ssize_t source_offset = -1);
+
+  size_t sample_count();
+  void print_report(FILE* stream);
+
+private:
+  static const size_t max_sample_depth = 32;
+  static const size_t sample_buffer_capacity = 0x10000;
+
+  struct Sample {
+    size_t depth;
+    const void* addresses[max_sample_depth];
+  };
+
+  struct CodeRegion {
+    size_t size;
+    std::string function_name;
+    const ModuleContext* module;
+    size_t default_line; // 0 if unknown
+    std::map<size_t, size_t> offset_to_line;
+
+    size_t line_for_offset(size_t offset) const;
+  };
+
+  struct Counts {
+    size_t flat;
+    size_t cumulative;
+
+    Counts();
+  };
+
+  GlobalContext* global;
+
+  // the signal handler writes samples at write_index, and process_samples
+  // reads them at read_index. there's only one writer (the handler, on the
+  // main thread) and one reader (which holds the compiler lock)
+  std::unique_ptr<Sample[]> samples;
+  std::atomic<size_t> write_index;
+  std::atomic<size_t> read_index;
+  std::atomic<size_t> dropped_count;
+  std::atomic<size_t> other_thread_count;
+
+  pthread_t profiled_thread;
+  const void* stack_top;
+  uint64_t interval_usecs;
+  bool running;
+  struct sigaction prev_action;
+
+  std::map<const void*, CodeRegion> regions;
+
+  size_t processed_count;
+  size_t no_generated_code_count;
+  std::unordered_map<std::string, Counts> function_counts;
+  std::map<std::pair<const ModuleContext*, size_t>, Counts> line_counts;
+
+  static std::atomic<Profiler*> active_profiler;
+  static void handle_signal(int signum, siginfo_t* info, void* context);
+
+  void process_samples();
+  const CodeRegion* region_for_address(const void* addr,
+      size_t* offset) const;
+};
@@ -0,0 +1,501 @@
+#include "ScalarSubset.hh"
+
+#include <inttypes.h>
+#include <stdio.h>
+
+#include "../AST/PythonASTNodes.hh"
+#include "../AST/PythonASTVisitor.hh"
+
+using namespace std;
+
+
+
+static const size_t int_argument_register_count = 6;
+static const size_t float_argument_register_count = 8;
+
+not_in_scalar_subset::not_in_scalar_subset(const string& what) :
+    runtime_error(what) { }
+
+bool is_scalar_type(ValueType type) {
+  return (type == ValueType::None) || (type == ValueType::Bool) ||
+         (type == ValueType::Int) || (type == ValueType::Float);
+}
+
+
+
+// the type rules here must match CompilationVisitor exactly, since callers may
+// be compiled against the fragment's return type before CompilationVisitor
+// sees the fragment. operations that CompilationVisitor implements but that
+// aren't listed here (e.g. integer division) are not in the subset
+
+ValueType scalar_unary_result_type(UnaryOperator oper, ValueType type) {
+  switch (oper) {
+    case UnaryOperator::LogicalNot:
+      return ValueType::Bool;
+    case UnaryOperator::Not:
+      if ((type == ValueType::Int) || (type == ValueType::Bool)) {
+        return ValueType::Int;
+      }
+      break;
+    case UnaryOperator::Positive:
+    case UnaryOperator::Negative:
+      if ((type == ValueType::Int) || (type == ValueType::Bool)) {
+        return ValueType::Int;
+      }
+      if (type == ValueType::Float) {
+        return ValueType::Float;
+      }
+      break;
+    default:
+      break;
+  }
+  throw not_in_scalar_subset("unsupported unary operation");
+}
+
+ValueType scalar_binary_result_type(BinaryOperator oper, ValueType left,
+    ValueType right) {
+  bool left_int = (left == ValueType::Int) || (left == ValueType::Bool);
+  bool right_int = (right == ValueType::Int) || (right == ValueType::Bool);
+  bool left_numeric = left_int || (left == ValueType::Float);
+  bool right_numeric = right_int || (right == ValueType::Float);
+
+  switch (oper) {
+    case BinaryOperator::LessThan:
+    case BinaryOperator::GreaterThan:
+    case BinaryOperator::LessOrEqual:
+    case BinaryOperator::GreaterOrEqual:
+    case BinaryOperator::Equality:
+    case BinaryOperator::NotEqual:
+      if (left_numeric && right_numeric) {
+        return ValueType::Bool;
+      }
+      break;
+
+    case BinaryOperator::Or:
+    case BinaryOperator::And:
+    case BinaryOperator::Xor:
+    case BinaryOperator::LeftShift:
+    case BinaryOperator::RightShift:
+      // note: CompilationVisitor uses the right operand's type here
+      if (left_int && right_int) {
+        return right;
+      }
+      break;
+
+    case BinaryOperator::Addition:
+    case BinaryOperator::Subtraction:
+    case BinaryOperator::Multiplication:
+      if (left_int && right_int) {
+        return right;
+      }
+      if (left_numeric && right_numeric) {
+        return ValueType::Float;
+      }
+      break;
+
+    case BinaryOperator::Division:
+      if (left_numeric && right_numeric) {
+        return ValueType::Float;
+      }
+      break;
+
+    default:
+      break;
+  }
+  throw not_in_scalar_subset("unsupported binary operation");
+}
+
+
+
+// walks the fragment's execution path (like CompilationVisitor does) and
+// checks that every node is in the subset. this also infers the types of
+// the fragment's locals and its return type
+class ScalarSubsetVisitor : public ASTVisitor {
+public:
+  ScalarSubsetVisitor(GlobalContext* global, Fragment* fragment,
+      bool allow_globals) : global(global), fragment(fragment),
+      allow_globals(allow_globals), current_type(ValueType::Indeterminate),
+      handled(false), loop_depth(0) {
+    FunctionContext* fn = this->fragment->function;
+
+    // argument types come from the fragment, and the others come from the
+    // analysis phase (and may be Indeterminate until they're assigned)
+    for (size_t x = 0; x < this->fragment->arg_types.size(); x++) {
+      this->local_types.emplace(fn->args[x].name,
+          this->fragment->arg_types[x].type);
+    }
+    for (const auto& it : fn->locals) {
+      this->local_types.emplace(it.first, it.second.type);
+    }
+  }
+
+  void check(ASTNode* a) {
+    this->handled = false;
+    a->accept(this);
+    if (!this->handled) {
+      throw not_in_scalar_subset("unsupported node: " + a->str());
+    }
+  }
+
+  template <typename T>
+  void check_list(vector<shared_ptr<T>>& list) {
+    for (auto& item : list) {
+      this->check(item.get());
+    }
+  }
+
+  Value return_type() const {
+    const Value& annotated = this->fragment->function->annotated_return_type;
+    if (annotated.type != ValueType::Indeterminate) {
+      return annotated;
+    }
+    if (this->return_types.size() > 1) {
+      throw not_in_scalar_subset("multiple return types");
+    }
+    if (this->return_types.empty()) {
+      return Value(ValueType::None);
+    }
+    return Value(*this->return_types.begin());
+  }
+
+  map<string, ValueType> local_types;
+
+  // expression visitation
+
+  virtual void visit(UnaryOperation* a) {
+    this->check(a->expr.get());
+    this->current_type = scalar_unary_result_type(a->oper,
+        this->current_type);
+    this->handled = true;
+  }
+
+  virtual void visit(BinaryOperation* a) {
+    this->check(a->left.get());
+    ValueType left_type = this->current_type;
+
+    if ((a->oper == BinaryOperator::LogicalOr) ||
+        (a->oper == BinaryOperator::LogicalAnd)) {
+      if (!is_scalar_type(left_type)) {
+        throw not_in_scalar_subset("unsupported logical operand");
+      }
+      // `None and x` doesn't evaluate x
+      if ((a->oper == BinaryOperator::LogicalAnd) &&
+          (left_type == ValueType::None)) {
+        this->handled = true;
+        return;
+      }
+      this->check(a->right.get());
+      if (this->current_type != left_type) {
+        throw not_in_scalar_subset("logical operands have different types");
+      }
+
+    } else {
+      this->check(a->right.get());
+      this->current_type = scalar_binary_result_type(a->oper, left_type,
+          this->current_type);
+    }
+    this->handled = true;
+  }
+
+  virtual void visit(TernaryOperation* a) {
+    if (a->oper != TernaryOperator::IfElse) {
+      throw not_in_scalar_subset("unsupported ternary operator");
+    }
+    this->check(a->center.get());
+    if (!is_scalar_type(this->current_type)) {
+      throw not_in_scalar_subset("unsupported condition type");
+    }
+
+    // if the condition is None, the left side isn't compiled
+    if (this->current_type == ValueType::None) {
+      this->check(a->right.get());
+      this->handled = true;
+      return;
+    }
+
+    this->check(a->left.get());
+    ValueType left_type = this->current_type;
+    this->check(a->right.get());
+    if (this->current_type != left_type) {
+      throw not_in_scalar_subset("ternary operator sides have different types");
+    }
+    this->handled = true;
+  }
+
+  virtual void visit(IntegerConstant* a) {
+    this->current_type = ValueType::Int;
+    this->handled = true;
+  }
+
+  virtual void visit(FloatConstant* a) {
+    this->current_type = ValueType::Float;
+    this->handled = true;
+  }
+
+  // these are only allowed as expression statements (e.g. docstrings), since
+  // nothing else accepts their types
+  virtual void visit(BytesConstant* a) {
+    this->current_type = ValueType::Bytes;
+    this->handled = true;
+  }
+
+  virtual void visit(UnicodeConstant* a) {
+    this->current_type = ValueType::Unicode;
+    this->handled = true;
+  }
+
+  virtual void visit(TrueConstant* a) {
+    this->current_type = ValueType::Bool;
+    this->handled = true;
+  }
+
+  virtual void visit(FalseConstant* a) {
+    this->current_type = ValueType::Bool;
+    this->handled = true;
+  }
+
+  virtual void visit(NoneConstant* a) {
+    this->current_type = ValueType::None;
+    this->handled = true;
+  }
+
+  virtual void visit(VariableLookup* a) {
+    if (this->fragment->function->locals.count(a->name)) {
+      this->current_type = this->type_for_local(a->name);
+    } else {
+      this->current_type = this->type_for_global(a->name);
+    }
+    if (this->current_type == ValueType::Indeterminate) {
+      throw not_in_scalar_subset("variable has Indeterminate type");
+    }
+    this->handled = true;
+  }
+
+  // only called for assignment targets; current_type is the assigned type
+  virtual void visit(AttributeLValueReference* a) {
+    if (a->base.get() || a->type_annotation.get()) {
+      throw not_in_scalar_subset("unsupported assignment target");
+    }
+    if (!is_scalar_type(this->current_type)) {
+      throw not_in_scalar_subset("unsupported assigned value type");
+    }
+
+    // CompilationVisitor sets a global's type if it's still Indeterminate,
+    // which the interpreter can't do, so the type must already be known
+    if (!this->fragment->function->locals.count(a->name)) {
+      if (this->type_for_global(a->name) != this->current_type) {
+        throw not_in_scalar_subset("global changes type");
+      }
+      this->handled = true;
+      return;
+    }
+
+    ValueType& local_type = this->type_for_local(a->name);
+    if (local_type == ValueType::Indeterminate) {
+      local_type = this->current_type;
+    } else if (local_type != this->current_type) {
+      throw not_in_scalar_subset("variable changes type");
+    }
+    this->handled = true;
+  }
+
+  // statement visitation
+
+  virtual void visit(ExpressionStatement* a) {
+    this->check(a->expr.get());
+    this->handled = true;
+  }
+
+  virtual void visit(AssignmentStatement* a) {
+    this->check(a->value.get());
+    this->check(a->target.get());
+    this->handled = true;
+  }
+
+  virtual void visit(GlobalStatement* a) {
+    if (!this->allow_globals) {
+      throw not_in_scalar_subset("global statement");
+    }
+    this->handled = true;
+  }
+
+  virtual void visit(PassStatement* a) {
+    this->handled = true;
+  }
+
+  virtual void visit(BreakStatement* a) {
+    if (!this->loop_depth) {
+      throw not_in_scalar_subset("break statement outside loop");
+    }
+    this->handled = true;
+  }
+
+  virtual void visit(ContinueStatement* a) {
+    if (!this->loop_depth) {
+      throw not_in_scalar_subset("continue statement outside loop");
+    }
+    this->handled = true;
+  }
+
+  virtual void visit(ReturnStatement* a) {
+    this->check(a->value.get());
+    if (!is_scalar_type(this->current_type)) {
+      throw not_in_scalar_subset("unsupported return type");
+    }
+    const Value& annotated = this->fragment->function->annotated_return_type;
+    if ((annotated.type != ValueType::Indeterminate) &&
+        (this->global->match_value_to_type(annotated,
+          Value(this->current_type)) < 0)) {
+      throw not_in_scalar_subset("returned value does not match type annotation");
+    }
+    this->return_types.emplace(this->current_type);
+    this->handled = true;
+  }
+
+  virtual void visit(IfStatement* a) {
+    // the always_true and always_false annotations skip the same code that
+    // CompilationVisitor skips
+    if (a->always_true) {
+      this->check_list(a->items);
+      this->handled = true;
+      return;
+    }
+    if (!a->always_false) {
+      this->check_condition(a->check.get());
+      this->check_list(a->items);
+    }
+    for (auto& elif : a->elifs) {
+      if (elif->always_false) {
+        continue;
+      }
+      if (elif->always_true) {
+        this->check_list(elif->items);
+        this->handled = true;
+        return;
+      }
+      this->check_condition(elif->check.get());
+      this->check_list(elif->items);
+    }
+    if (a->else_suite.get()) {
+      this->check_list(a->else_suite->items);
+    }
+    this->handled = true;
+  }
+
+  virtual void visit(WhileStatement* a) {
+    this->check_condition(a->condition.get());
+    this->loop_depth++;
+    this->check_list(a->items);
+    this->loop_depth--;
+    if (a->else_suite.get()) {
+      this->check_list(a->else_suite->items);
+    }
+    this->handled = true;
+  }
+
+  virtual void visit(FunctionDefinition* a) {
+    FunctionContext* fn = this->fragment->function;
+    if (a->function_id != fn->id) {
+      throw not_in_scalar_subset("nested function definition");
+    }
+    if (!a->decorators.empty()) {
+      throw not_in_scalar_subset("function has decorators");
+    }
+    for (auto& arg : a->args.args) {
+      if (arg.default_value.get()) {
+        this->check(arg.default_value.get());
+      }
+    }
+    this->check_list(a->items);
+    this->handled = true;
+  }
+
+private:
+  GlobalContext* global;
+  Fragment* fragment;
+  bool allow_globals;
+
+  ValueType current_type;
+  bool handled;
+  size_t loop_depth;
+  set<ValueType> return_types;
+
+  ValueType& type_for_local(const string& name) {
+    FunctionContext* fn = this->fragment->function;
+    if (!fn->locals.count(name) || fn->explicit_globals.count(name)) {
+      throw not_in_scalar_subset("non-local variable: " + name);
+    }
+    return this->local_types.at(name);
+  }
+
+  ValueType type_for_global(const string& name) {
+    if (!this->allow_globals) {
+      throw not_in_scalar_subset("non-local variable: " + name);
+    }
+    const auto& globals = this->fragment->function->module->global_variables;
+    auto it = globals.find(name);
+    if (it == globals.end()) {
+      throw not_in_scalar_subset("nonexistent global: " + name);
+    }
+    if (!is_scalar_type(it->second.value.type)) {
+      throw not_in_scalar_subset("unsupported global type: " + name);
+    }
+    return it->second.value.type;
+  }
+
+  void check_condition(Expression* e) {
+    this->check(e);
+    if (!is_scalar_type(this->current_type)) {
+      throw not_in_scalar_subset("unsupported condition type");
+    }
+  }
+};
+
+
+void infer_scalar_fragment_types(GlobalContext* global, Fragment* f,
+    map<string, ValueType>* local_types, Value* return_type,
+    bool allow_globals) {
+  FunctionContext* fn = f->function;
+  if (!fn) {
+    throw not_in_scalar_subset("fragment is a module root scope");
+  }
+  if (fn->class_id) {
+    throw not_in_scalar_subset("fragment is a class method");
+  }
+  if (fn->num_splits != 0) {
+    throw not_in_scalar_subset("fragment has splits");
+  }
+
+  // only register arguments are supported
+  size_t int_arg_count = 0, float_arg_count = 0;
+  for (const auto& arg_type : f->arg_types) {
+    if (!is_scalar_type(arg_type.type)) {
+      throw not_in_scalar_subset("unsupported argument type");
+    }
+    if (arg_type.type == ValueType::Float) {
+      float_arg_count++;
+    } else {
+      int_arg_count++;
+    }
+  }
+  if ((int_arg_count > int_argument_register_count) ||
+      (float_arg_count > float_argument_register_count)) {
+    throw not_in_scalar_subset("too many arguments");
+  }
+
+  ScalarSubsetVisitor v(global, f, allow_globals);
+  v.check(fn->ast_root);
+  *return_type = v.return_type();
+  for (const auto& it : v.local_types) {
+    if ((it.second != ValueType::Indeterminate) &&
+        !is_scalar_type(it.second)) {
+      throw not_in_scalar_subset("unsupported local type: " + it.first);
+    }
+    // arguments are always locals, but check anyway since callers only
+    // allocate space for locals
+    if (!fn->locals.count(it.first)) {
+      throw not_in_scalar_subset("variable is not a local: " + it.first);
+    }
+  }
+  *local_types = move(v.local_types);
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <map>
+#include <stdexcept>
+#include <string>
+
+#include "../AST/PythonASTNodes.hh"
+#include "../Environment/Value.hh"
+#include "Contexts.hh"
+
+
+
+// the interpreter and the IR compiler only support a small subset of the
+// language: functions whose arguments and locals are Int, Float, Bool or None,
+// which don't call anything, access globals, or raise exceptions, and which
+// only use arithmetic, comparisons, if/while statements and return statements.
+// fragments in this subset can't have side effects other than their return
+// values, and all their values fit in registers. the interpreter can also
+// read and write its module's globals, if they're Int, Float, Bool or None.
+
+class not_in_scalar_subset : public std::runtime_error {
+public:
+  explicit not_in_scalar_subset(const std::string& what);
+};
+
+bool is_scalar_type(ValueType type);
+
+// result types of operations on scalar values. these follow the same rules as
+// CompilationVisitor, and throw not_in_scalar_subset for operations that
+// aren't in the subset
+ValueType scalar_unary_result_type(UnaryOperator oper, ValueType type);
+ValueType scalar_binary_result_type(BinaryOperator oper, ValueType left,
+    ValueType right);
+
+// checks that the fragment is in the subset, and infers the types of its locals
+// (including arguments) and its return type. locals that are never assigned
+// have type Indeterminate. throws not_in_scalar_subset if the fragment isn't in
+// the subset (including the module's scalar globals if allow_globals is true)
+void infer_scalar_fragment_types(GlobalContext* global, Fragment* f,
+    std::map<std::string, ValueType>* local_types, Value* return_type,
+    bool allow_globals = false);
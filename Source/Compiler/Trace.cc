@@ -0,0 +1,146 @@
+#include "Trace.hh"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <exception>
+#include <stdexcept>
+
+#include "BackgroundCompiler.hh"
+
+using namespace std;
+
+
+
+static thread_local int64_t trace_thread_id = -1;
+
+static void write_json_string(FILE* f, const string& s) {
+  fputc('\"', f);
+  for (char ch : s) {
+    if ((ch == '\"') || (ch == '\\')) {
+      fputc('\\', f);
+      fputc(ch, f);
+    } else if (static_cast<uint8_t>(ch) < 0x20) {
+      fprintf(f, "\\u%04hhX", static_cast<uint8_t>(ch));
+    } else {
+      fputc(ch, f);
+    }
+  }
+  fputc('\"', f);
+}
+
+
+
+TraceWriter::TraceWriter(const string& filename) : pid(getpid()),
+    start_usecs(this->now_usecs()), record_count(0), named_thread_count(0) {
+  this->f = fopen(filename.c_str(), "wt");
+  if (!this->f) {
+    throw runtime_error("can\'t open " + filename);
+  }
+  fputc('[', this->f);
+}
+
+TraceWriter::~TraceWriter() {
+  fputs("\n]\n", this->f);
+  fclose(this->f);
+}
+
+double TraceWriter::now_usecs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<double>(ts.tv_sec) * 1000000.0 +
+      static_cast<double>(ts.tv_nsec) / 1000.0;
+}
+
+void TraceWriter::begin_record() {
+  if (this->record_count++) {
+    fputc(',', this->f);
+  }
+  fputc('\n', this->f);
+}
+
+int64_t TraceWriter::current_thread_id() {
+  // each thread is named the first time it writes an event, so its track in
+  // the timeline has a useful label
+  if (trace_thread_id < 0) {
+    trace_thread_id = this->named_thread_count++;
+    this->begin_record();
+    fprintf(this->f, "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,"
+        "\"tid\":%" PRId64 ",\"args\":{\"name\":\"%s\"}}", this->pid,
+        trace_thread_id, BackgroundCompiler::is_background_thread() ?
+          "background compiler" : "main");
+  }
+  return trace_thread_id;
+}
+
+void TraceWriter::write_event(const char* category, const string& name,
+    double start_usecs, double end_usecs,
+    const map<string, string>& string_args,
+    const map<string, int64_t>& int_args) {
+  lock_guard<mutex> g(this->lock);
+
+  int64_t tid = this->current_thread_id();
+  this->begin_record();
+  fprintf(this->f, "{\"ph\":\"X\",\"cat\":\"%s\",\"name\":", category);
+  write_json_string(this->f, name);
+  fprintf(this->f, ",\"pid\":%d,\"tid\":%" PRId64 ",\"ts\":%.3lf,\"dur\":%.3lf,"
+      "\"args\":{", this->pid, tid, start_usecs - this->start_usecs,
+      end_usecs - start_usecs);
+
+  bool is_first = true;
+  for (const auto& it : string_args) {
+    if (!is_first) {
+      fputc(',', this->f);
+    }
+    is_first = false;
+    write_json_string(this->f, it.first);
+    fputc(':', this->f);
+    write_json_string(this->f, it.second);
+  }
+  for (const auto& it : int_args) {
+    if (!is_first) {
+      fputc(',', this->f);
+    }
+    is_first = false;
+    write_json_string(this->f, it.first);
+    fprintf(this->f, ":%" PRId64, it.second);
+  }
+  fputs("}}", this->f);
+}
+
+
+
+TraceScope::TraceScope(GlobalContext* global, const char* category,
+    const string& name) : writer(global->trace_writer.get()),
+    category(category), start_usecs(0) {
+  if (this->writer) {
+    this->name = name;
+    this->start_usecs = TraceWriter::now_usecs();
+  }
+}
+
+TraceScope::~TraceScope() {
+  if (!this->writer) {
+    return;
+  }
+  if (uncaught_exception()) {
+    this->string_args.emplace("result", "error");
+  }
+  double end_usecs = TraceWriter::now_usecs();
+  this->writer->write_event(this->category, this->name, this->start_usecs,
+      end_usecs, this->string_args, this->int_args);
+}
+
+void TraceScope::set_arg(const string& key, const string& value) {
+  if (this->writer) {
+    this->string_args[key] = value;
+  }
+}
+
+void TraceScope::set_arg(const string& key, int64_t value) {
+  if (this->writer) {
+    this->int_args[key] = value;
+  }
+}
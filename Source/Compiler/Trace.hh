@@ -0,0 +1,75 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <map>
+#include <mutex>
+#include <string>
+
+#include "Contexts.hh"
+
+
+
+// writes a timeline of compiler events as a Chrome trace-event file (the JSON
+// array format), which can be opened in chrome://tracing or Perfetto. each
+// event has a category, a name, a start time and duration, and arguments that
+// are shown when the event is selected. events can be written from any thread;
+// each thread gets its own track in the timeline.
+//
+// the array format doesn't require the closing bracket, so the file is usable
+// even if nemesys crashes before the TraceWriter is destroyed (though records
+// are buffered, so the last few may be missing in this case).
+class TraceWriter {
+public:
+  explicit TraceWriter(const std::string& filename);
+  TraceWriter(const TraceWriter&) = delete;
+  TraceWriter(TraceWriter&&) = delete;
+  TraceWriter& operator=(const TraceWriter&) = delete;
+  TraceWriter& operator=(TraceWriter&&) = delete;
+  ~TraceWriter();
+
+  // times are from now_usecs()
+  void write_event(const char* category, const std::string& name,
+      double start_usecs, double end_usecs,
+      const std::map<std::string, std::string>& string_args,
+      const std::map<std::string, int64_t>& int_args);
+
+  static double now_usecs();
+
+private:
+  std::mutex lock;
+  FILE* f;
+  int pid;
+  double start_usecs;
+  size_t record_count;
+  int64_t named_thread_count;
+
+  void begin_record();
+  int64_t current_thread_id();
+};
+
+// records an event that covers the TraceScope's lifetime. this does nothing if
+// tracing isn't enabled. if the scope is destroyed by an exception, the event's
+// result argument is set to "error" unless it was already set
+class TraceScope {
+public:
+  TraceScope(GlobalContext* global, const char* category,
+      const std::string& name);
+  TraceScope(const TraceScope&) = delete;
+  TraceScope(TraceScope&&) = delete;
+  TraceScope& operator=(const TraceScope&) = delete;
+  TraceScope& operator=(TraceScope&&) = delete;
+  ~TraceScope();
+
+  void set_arg(const std::string& key, const std::string& value);
+  void set_arg(const std::string& key, int64_t value);
+
+private:
+  TraceWriter* writer;
+  const char* category;
+  std::string name;
+  double start_usecs;
+  std::map<std::string, std::string> string_args;
+  std::map<std::string, int64_t> int_args;
+};
@@ -37,12 +37,60 @@ DebugFlag debug_flag_for_name(const char* name) {
   if (!strcasecmp(name, "ShowJITEvents")) {
     return DebugFlag::ShowJITEvents;
   }
+  if (!strcasecmp(name, "ShowIRDebug")) {
+    return DebugFlag::ShowIRDebug;
+  }
+  if (!strcasecmp(name, "ShowCounters")) {
+    return DebugFlag::ShowCounters;
+  }
   if (!strcasecmp(name, "NoInlineRefcounting")) {
     return DebugFlag::NoInlineRefcounting;
   }
   if (!strcasecmp(name, "NoEagerCompilation")) {
     return DebugFlag::NoEagerCompilation;
   }
+  if (!strcasecmp(name, "BackgroundCompilation")) {
+    return DebugFlag::BackgroundCompilation;
+  }
+  if (!strcasecmp(name, "IRCompilation")) {
+    return DebugFlag::IRCompilation;
+  }
+  if (!strcasecmp(name, "NoConstantFolding")) {
+    return DebugFlag::NoConstantFolding;
+  }
+  if (!strcasecmp(name, "NoCopyPropagation")) {
+    return DebugFlag::NoCopyPropagation;
+  }
+  if (!strcasecmp(name, "NoCommonSubexpressionElimination")) {
+    return DebugFlag::NoCommonSubexpressionElimination;
+  }
+  if (!strcasecmp(name, "NoDeadCodeElimination")) {
+    return DebugFlag::NoDeadCodeElimination;
+  }
+  if (!strcasecmp(name, "NoPeephole")) {
+    return DebugFlag::NoPeephole;
+  }
+  if (!strcasecmp(name, "NoInlining")) {
+    return DebugFlag::NoInlining;
+  }
+  if (!strcasecmp(name, "NoRefcountElision")) {
+    return DebugFlag::NoRefcountElision;
+  }
+  if (!strcasecmp(name, "AtomicRefcounting")) {
+    return DebugFlag::AtomicRefcounting;
+  }
+  if (!strcasecmp(name, "NoEscapeAnalysis")) {
+    return DebugFlag::NoEscapeAnalysis;
+  }
+  if (!strcasecmp(name, "NoInlineAllocation")) {
+    return DebugFlag::NoInlineAllocation;
+  }
+  if (!strcasecmp(name, "NoCodeReclamation")) {
+    return DebugFlag::NoCodeReclamation;
+  }
+  if (!strcasecmp(name, "Profile")) {
+    return DebugFlag::Profile;
+  }
   if (!strcasecmp(name, "Code")) {
     return DebugFlag::Code;
   }
@@ -69,8 +117,24 @@ const unordered_map<string, DebugFlag> name_to_debug_flag({
   {"ShowRefcountChanges", DebugFlag::ShowRefcountChanges},
   {"ShowJITEvents"      , DebugFlag::ShowJITEvents},
   {"ShowCompileErrors"  , DebugFlag::ShowCompileErrors},
+  {"ShowIRDebug"        , DebugFlag::ShowIRDebug},
+  {"ShowCounters"       , DebugFlag::ShowCounters},
   {"NoInlineRefcounting", DebugFlag::NoInlineRefcounting},
   {"NoEagerCompilation" , DebugFlag::NoEagerCompilation},
+  {"BackgroundCompilation", DebugFlag::BackgroundCompilation},
+  {"IRCompilation"      , DebugFlag::IRCompilation},
+  {"NoConstantFolding"  , DebugFlag::NoConstantFolding},
+  {"NoCopyPropagation"  , DebugFlag::NoCopyPropagation},
+  {"NoCommonSubexpressionElimination", DebugFlag::NoCommonSubexpressionElimination},
+  {"NoDeadCodeElimination", DebugFlag::NoDeadCodeElimination},
+  {"NoPeephole", DebugFlag::NoPeephole},
+  {"NoInlining", DebugFlag::NoInlining},
+  {"NoRefcountElision", DebugFlag::NoRefcountElision},
+  {"AtomicRefcounting", DebugFlag::AtomicRefcounting},
+  {"NoEscapeAnalysis", DebugFlag::NoEscapeAnalysis},
+  {"NoInlineAllocation", DebugFlag::NoInlineAllocation},
+  {"NoCodeReclamation", DebugFlag::NoCodeReclamation},
+  {"Profile", DebugFlag::Profile},
   {"Code"               , DebugFlag::Code},
   {"Verbose"            , DebugFlag::Verbose},
   {"All"                , DebugFlag::All},
@@ -20,10 +20,26 @@ enum DebugFlag {
   ShowRefcountChanges = 0x0000000000000200,
   ShowJITEvents       = 0x0000000000000400,
   ShowCompileErrors   = 0x0000000000000800,
+  ShowIRDebug         = 0x0000000000001000,
+  ShowCounters        = 0x0000000000004000,
   NoInlineRefcounting = 0x0000000000010000,
   NoEagerCompilation  = 0x0000000000020000,
-
-  Code                = 0x0000000000000CF0, // transformation steps only
+  BackgroundCompilation = 0x0000000000040000,
+  IRCompilation       = 0x0000000000080000,
+  NoConstantFolding   = 0x0000000000100000,
+  NoCopyPropagation   = 0x0000000000200000,
+  NoCommonSubexpressionElimination = 0x0000000000400000,
+  NoDeadCodeElimination = 0x0000000000800000,
+  NoPeephole          = 0x0000000001000000,
+  NoInlining          = 0x0000000002000000,
+  NoRefcountElision   = 0x0000000004000000,
+  AtomicRefcounting   = 0x0000000008000000,
+  NoEscapeAnalysis    = 0x0000000010000000,
+  NoInlineAllocation  = 0x0000000020000000,
+  NoCodeReclamation   = 0x0000000040000000,
+  Profile             = 0x0000000080000000,
+
+  Code                = 0x0000000000001CF0, // transformation steps only
   Verbose             = 0x000000000000FFFF, // no behaviors, all debug info
   All                 = 0xFFFFFFFFFFFFFFFF, // all behaviors and debug info
 };
@@ -1,7 +1,9 @@
+#include <inttypes.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <signal.h>
+#include <unistd.h>
 
 #include <phosg/Strings.hh>
 
@@ -9,8 +11,13 @@
 #include "AST/SourceFile.hh"
 #include "AST/PythonLexer.hh"
 #include "AST/PythonParser.hh"
+#include "Compiler/BackgroundCompiler.hh"
 #include "Compiler/BuiltinFunctions.hh"
+#include "Compiler/CodeCache.hh"
 #include "Compiler/Compile.hh"
+#include "Compiler/PerfMap.hh"
+#include "Compiler/Profiler.hh"
+#include "Compiler/Trace.hh"
 #include "Modules/__nemesys__.hh"
 #include "Modules/sys.hh"
 
@@ -33,6 +40,24 @@ Options:\n\
   -m: find the given module on the search paths and load it instead of an\n\
       explicitly-specified file. All arguments passed after this option are\n\
       passed to the program in sys.argv.\n\
+  -C<directory>: save compiled functions in the given directory, and reuse them\n\
+      in later runs of the same program instead of compiling them again.\n\
+  -P[<formats>]: describe compiled code to Linux perf. formats is a comma-\n\
+      separated list of:\n\
+        map - write /tmp/perf-<pid>.map with an entry for each fragment\n\
+          (this is the default if no formats are given)\n\
+        labels - like map, but split each fragment into one entry for each\n\
+          of its labels, so samples are attributed to AST nodes\n\
+        jitdump - write jit-<pid>.dump in the current directory, for use with\n\
+          perf inject --jit and perf annotate\n\
+  -T<calls>[,<iterations>]: run functions in the interpreter until they've\n\
+      been called the given number of times, or their loops have run the given\n\
+      number of iterations (by default, the same as the call count). Functions\n\
+      that the interpreter can't run are compiled immediately. By default, all\n\
+      functions are compiled immediately.\n\
+  -t[<filename>]: write a timeline of module imports and compilation events\n\
+      to the given file (by default, nemesys-trace-<pid>.json), in the Chrome\n\
+      trace event format. It can be viewed in chrome://tracing or Perfetto.\n\
   -X<debug>: enable debug flags.\n\
       Flags which print extra messages but don\'t modify behavior:\n\
         ShowSearchDebug - show actions when looking for source files\n\
@@ -47,12 +72,40 @@ Options:\n\
         ShowRefcountChanges - show refcount change messages\n\
         ShowJITEvents - show JIT compilation calls\n\
         ShowCompileErrors - show compile errors (even when recoverable)\n\
+        ShowIRDebug - show IR before and after optimization\n\
+        ShowCounters - show compiler, exception and allocation counters when\n\
+          the program exits\n\
         Code - show most debug info (analysis, compilation, assembly)\n\
         Verbose - show all debug info\n\
       Flags which modify behavior:\n\
         NoInlineRefcounting - disable inline refcounting\n\
         NoEagerCompilation - disable compiling callees even when all argument\n\
           types are available\n\
+        BackgroundCompilation - compile callees on a background thread instead\n\
+          of before continuing to compile the caller\n\
+        IRCompilation - compile functions through the optimizing IR when\n\
+          possible\n\
+        NoConstantFolding - disable the IR constant folding pass\n\
+        NoCopyPropagation - disable the IR copy propagation pass\n\
+        NoCommonSubexpressionElimination - disable the IR common\n\
+          subexpression elimination pass\n\
+        NoDeadCodeElimination - disable the IR dead code elimination pass\n\
+        NoPeephole - disable peephole rewrites of generated code\n\
+        NoInlining - disable inlining of small functions at call sites\n\
+        NoRefcountElision - always add references to locals when reading\n\
+          them, even if the reference would be deleted before the local\n\
+          could change\n\
+        AtomicRefcounting - use atomic refcount changes even if no other\n\
+          threads are running (they're always atomic if BackgroundCompilation\n\
+          is enabled)\n\
+        NoEscapeAnalysis - always allocate class instances on the heap, even\n\
+          if they can't outlive the function that creates them\n\
+        NoInlineAllocation - always call the allocator to allocate and free\n\
+          class instances, instead of using its free lists directly\n\
+        NoCodeReclamation - never free the code of fragments that have been\n\
+          recompiled\n\
+        Profile - sample the program while it runs, and print the functions\n\
+          and lines that used the most time when it exits\n\
         All - enable all behavior flags and debug info\n\
       -X may be used multiple times to enable multiple flags.\n\
 \n\
@@ -78,6 +131,13 @@ int main(int argc, char* argv[]) {
   bool module_is_code = false;
   bool module_is_filename = true;
   vector<string> import_paths({"."});
+  const char* code_cache_directory = NULL;
+  bool write_perf_map = false;
+  bool write_perf_map_labels = false;
+  bool write_perf_jitdump = false;
+  const char* trace_filename = NULL;
+  size_t interpreter_call_threshold = 0;
+  size_t interpreter_back_edge_threshold = 0;
   int x;
   for (x = 1; x < argc; x++) {
     if (!strncmp(argv[x], "-X", 2)) {
@@ -95,6 +155,37 @@ int main(int argc, char* argv[]) {
     } else if (!strncmp(argv[x], "-A", 2)) {
       import_paths.emplace_back(&argv[x][2]);
 
+    } else if (!strncmp(argv[x], "-C", 2)) {
+      code_cache_directory = &argv[x][2];
+
+    } else if (!strncmp(argv[x], "-P", 2)) {
+      vector<string> format_strs = split(&argv[x][2], ',');
+      if (format_strs.empty()) {
+        write_perf_map = true;
+      }
+      for (const auto& format_str : format_strs) {
+        if (format_str.empty() || (format_str == "map")) {
+          write_perf_map = true;
+        } else if (format_str == "labels") {
+          write_perf_map = true;
+          write_perf_map_labels = true;
+        } else if (format_str == "jitdump") {
+          write_perf_jitdump = true;
+        } else {
+          fprintf(stderr, "warning: perf format %s does not exist (ignored)\n",
+              format_str.c_str());
+        }
+      }
+
+    } else if (!strncmp(argv[x], "-t", 2)) {
+      trace_filename = &argv[x][2];
+
+    } else if (!strncmp(argv[x], "-T", 2)) {
+      char* end;
+      interpreter_call_threshold = strtoull(&argv[x][2], &end, 0);
+      interpreter_back_edge_threshold = (*end == ',') ?
+          strtoull(end + 1, NULL, 0) : interpreter_call_threshold;
+
     } else if (!strcmp(argv[x], "-h") || !strcmp(argv[x], "-?") || !strcmp(argv[x], "--help")) {
       print_usage(argv[0]);
       return 0;
@@ -140,6 +231,52 @@ int main(int argc, char* argv[]) {
   }
   sys_set_argv(sys_argv);
 
+  global->interpreter_call_threshold = interpreter_call_threshold;
+  global->interpreter_back_edge_threshold = interpreter_back_edge_threshold;
+
+  // set up tracing if requested. this has to be done before anything is
+  // compiled, and before the background compiler thread is started
+  if (trace_filename) {
+    string filename = *trace_filename ? trace_filename :
+        string_printf("nemesys-trace-%d.json", getpid());
+    try {
+      global->trace_writer.reset(new TraceWriter(filename));
+    } catch (const exception& e) {
+      fprintf(stderr, "warning: tracing is disabled: %s\n", e.what());
+    }
+  }
+
+  if (debug_flags & DebugFlag::BackgroundCompilation) {
+    global->background_compiler.reset(new BackgroundCompiler(global.get()));
+  }
+
+  // set up the code cache if requested. this has to be done before any modules
+  // are imported, since the cache keys depend on the import history
+  if (code_cache_directory) {
+    try {
+      global->code_cache.reset(new CodeCache(code_cache_directory,
+          argv0_realpath ? argv0_realpath : argv[0]));
+    } catch (const exception& e) {
+      fprintf(stderr, "warning: code cache is disabled: %s\n", e.what());
+    }
+  }
+
+  // set up the perf map if requested. this has to be done before anything is
+  // compiled, so every fragment is described
+  if (write_perf_map || write_perf_jitdump) {
+    try {
+      global->perf_map.reset(new PerfMap(write_perf_map, write_perf_map_labels,
+          write_perf_jitdump));
+    } catch (const exception& e) {
+      fprintf(stderr, "warning: perf map is disabled: %s\n", e.what());
+    }
+  }
+
+  if (debug_flags & DebugFlag::Profile) {
+    global->profiler.reset(new Profiler(global.get()));
+    global->profiler->start();
+  }
+
   // find the module if necessary
   string found_filename;
   if (!module_is_filename) {
@@ -151,5 +288,21 @@ int main(int argc, char* argv[]) {
   auto module = global->get_or_create_module("__main__", module_spec, module_is_code);
   advance_module_phase(global.get(), module.get(), ModuleContext::Phase::Imported);
 
+  // the profile can also be started by __nemesys__.start_profile, so print it
+  // even if -XProfile wasn't given
+  if (global->profiler) {
+    CompilerLock lock(global.get());
+    global->profiler->stop();
+    global->profiler->print_report(stderr);
+  }
+
+  if (debug_flags & DebugFlag::ShowCounters) {
+    CompilerLock lock(global.get());
+    for (const auto& it : global->counters()) {
+      fprintf(stderr, "[counters] %s = %" PRIu64 "\n", it.first.c_str(),
+          it.second);
+    }
+  }
+
   return 0;
 }
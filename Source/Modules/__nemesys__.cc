@@ -17,6 +17,12 @@
 #include "../Compiler/Contexts.hh"
 #include "../Compiler/BuiltinFunctions.hh"
 #include "../Compiler/CommonObjects.hh"
+#include "../Compiler/Compile.hh"
+#include "../Compiler/Exception.hh"
+#include "../Compiler/Interpreter.hh"
+#include "../Compiler/Profiler.hh"
+#include "../Types/Allocator.hh"
+#include "../Types/List.hh"
 #include "../Types/Strings.hh"
 
 using namespace std;
@@ -35,11 +41,16 @@ static map<string, Value> globals({
 
 
 
+// note: the background compiler may be running while these functions are
+// called, so they have to hold the compiler lock to look at compiler state
+
 static std::shared_ptr<ModuleContext> get_module(UnicodeObject* module_name) {
+  CompilerLock lock(global.get());
+
   string module_name_str;
   module_name_str.reserve(module_name->count);
   for (size_t x = 0; x < module_name->count; x++) {
-    module_name_str += static_cast<char>(module_name->data[x]);
+    module_name_str += static_cast<char>(module_name->char_at(x));
   }
   try {
     return global->modules.at(module_name_str);
@@ -51,6 +62,8 @@ static std::shared_ptr<ModuleContext> get_module(UnicodeObject* module_name) {
 
 
 static const UnicodeObject* module_phase(ModuleContext* module) {
+  CompilerLock lock(global.get());
+
   if (!module) {
     return global->get_or_create_constant(L"Missing");
   }
@@ -90,6 +103,7 @@ shared_ptr<ModuleContext> __nemesys___initialize(GlobalContext* global_context)
   Value Unicode(ValueType::Unicode);
   Value Function(ValueType::Function);
   Value Module(ValueType::Module);
+  Value List_Unicode(ValueType::List, vector<Value>({Unicode}));
 
   vector<BuiltinFunctionDefinition> module_function_defs({
 
@@ -107,9 +121,11 @@ shared_ptr<ModuleContext> __nemesys___initialize(GlobalContext* global_context)
     {"module_compiled_size", {FragDef({Unicode}, Int, void_fn_ptr([](UnicodeObject* module_name) -> int64_t {
       auto module = get_module(module_name);
       delete_reference(module_name);
+      CompilerLock lock(global.get());
       return module.get() ? module->compiled_size : -1;
 
     })), FragDef({Module}, Int, void_fn_ptr([](ModuleContext* module) -> int64_t {
+      CompilerLock lock(global.get());
       return module ? module->compiled_size : -1;
 
     }))}, false},
@@ -149,6 +165,7 @@ shared_ptr<ModuleContext> __nemesys___initialize(GlobalContext* global_context)
       if (!fn) {
         return -1;
       }
+      CompilerLock lock(global.get());
       return fn->fragments.size();
     }), false},
 
@@ -166,19 +183,87 @@ shared_ptr<ModuleContext> __nemesys___initialize(GlobalContext* global_context)
       return fn->pass_exception_block;
     }), false},
 
+    // these count calls and loop iterations that ran in the interpreter tier,
+    // summed over all of the function's fragments
+    {"function_interpreted_call_count", {Function}, Int, void_fn_ptr([](FunctionContext* fn) -> int64_t {
+      if (!fn) {
+        return -1;
+      }
+      CompilerLock lock(global.get());
+      int64_t ret = 0;
+      for (const auto& f : fn->fragments) {
+        if (f.interpreted) {
+          ret += f.interpreted->call_count;
+        }
+      }
+      return ret;
+    }), false},
+
+    {"function_interpreted_back_edge_count", {Function}, Int, void_fn_ptr([](FunctionContext* fn) -> int64_t {
+      if (!fn) {
+        return -1;
+      }
+      CompilerLock lock(global.get());
+      int64_t ret = 0;
+      for (const auto& f : fn->fragments) {
+        if (f.interpreted) {
+          ret += f.interpreted->back_edge_count;
+        }
+      }
+      return ret;
+    }), false},
+
+    // number of the function's fragments that haven't been compiled yet
+    {"function_interpreted_fragment_count", {Function}, Int, void_fn_ptr([](FunctionContext* fn) -> int64_t {
+      if (!fn) {
+        return -1;
+      }
+      CompilerLock lock(global.get());
+      int64_t ret = 0;
+      for (const auto& f : fn->fragments) {
+        if (f.interpreted && (f.interpreted->target != f.compiled)) {
+          ret++;
+        }
+      }
+      return ret;
+    }), false},
+
+    {"interpreter_call_threshold", {}, Int, void_fn_ptr([]() -> int64_t {
+      return global->interpreter_call_threshold;
+    }), false},
+
+    {"interpreter_back_edge_threshold", {}, Int, void_fn_ptr([]() -> int64_t {
+      return global->interpreter_back_edge_threshold;
+    }), false},
+
     {"code_buffer_size", {}, Int, void_fn_ptr([]() -> int64_t {
+      CompilerLock lock(global.get());
       return global->code.total_size();
     }), false},
 
     {"code_buffer_used_size", {}, Int, void_fn_ptr([]() -> int64_t {
-      return global->code.total_used_bytes();
+      CompilerLock lock(global.get());
+      return global->code.total_used_bytes() -
+          global->reclaimed_code_space_size();
+    }), false},
+
+    {"code_buffer_reclaimed_size", {}, Int, void_fn_ptr([]() -> int64_t {
+      CompilerLock lock(global.get());
+      return global->reclaimed_code_bytes;
+    }), false},
+
+    {"code_buffer_reclaimed_block_count", {}, Int, void_fn_ptr([]() -> int64_t {
+      CompilerLock lock(global.get());
+      return global->reclaimed_code_block_count;
     }), false},
 
     {"bytes_constant_count", {}, Int, void_fn_ptr([]() -> int64_t {
+      CompilerLock lock(global.get());
       return global->bytes_constants.size();
     }), false},
 
     {"unicode_constant_count", {}, Int, void_fn_ptr([]() -> int64_t {
+      CompilerLock lock(global.get());
       return global->unicode_constants.size();
     }), false},
 
@@ -190,10 +275,94 @@ shared_ptr<ModuleContext> __nemesys___initialize(GlobalContext* global_context)
       debug_flags = new_debug_flags;
     }), false},
 
+    // the sampling profiler. the report is printed to stderr when the program
+    // exits, if a profile was ever started
+    {"start_profile", {}, None, void_fn_ptr([]() {
+      CompilerLock lock(global.get());
+      if (!global->profiler) {
+        global->profiler.reset(new Profiler(global.get()));
+      }
+      global->profiler->start();
+    }), false},
+
+    {"stop_profile", {}, None, void_fn_ptr([]() {
+      CompilerLock lock(global.get());
+      if (global->profiler) {
+        global->profiler->stop();
+      }
+    }), false},
+
+    {"profile_sample_count", {}, Int, void_fn_ptr([]() -> int64_t {
+      CompilerLock lock(global.get());
+      return global->profiler ? global->profiler->sample_count() : 0;
+    }), false},
+
+    // compiler, exception and allocation counters (see GlobalContext::counters).
+    // these are also printed at exit with -XShowCounters
+    {"counter_names", {}, List_Unicode, void_fn_ptr([]() -> void* {
+      CompilerLock lock(global.get());
+      auto counters = global->counters();
+      ListObject* l = list_new(counters.size(), true);
+      for (size_t x = 0; x < counters.size(); x++) {
+        l->items[x] = bytes_decode_ascii(counters[x].first.c_str());
+      }
+      return l;
+    }), false},
+
+    {"counter", {Unicode}, Int, void_fn_ptr([](UnicodeObject* name, ExceptionBlock* exc_block) -> int64_t {
+      BytesObject* name_bytes = unicode_encode_ascii(name);
+      delete_reference(name);
+
+      // raising an exception doesn't call destructors, so the lock has to be
+      // released first
+      bool found = false;
+      int64_t value = 0;
+      {
+        CompilerLock lock(global.get());
+        for (const auto& it : global->counters()) {
+          if (it.first == name_bytes->data) {
+            found = true;
+            value = it.second;
+            break;
+          }
+        }
+      }
+      delete_reference(name_bytes);
+
+      if (!found) {
+        raise_python_exception_with_message(exc_block, global->KeyError_class_id,
+            "no such counter");
+      }
+      return value;
+    }), true},
+
     {"common_object_count", {}, Int, void_fn_ptr([]() -> int64_t {
       return common_object_count();
     }), false},
 
+    // allocator statistics, summed over all threads. size classes are numbered
+    // from 0 to allocator_size_class_count(); the last one counts objects that
+    // were too large for the free lists (its block size is 0)
+    {"allocator_size_class_count", {}, Int, void_fn_ptr([]() -> int64_t {
+      return allocator_size_class_count;
+    }), false},
+
+    {"allocator_block_size", {Int}, Int, void_fn_ptr([](int64_t size_class) -> int64_t {
+      return allocator_block_size(size_class);
+    }), false},
+
+    {"allocator_allocation_count", {Int}, Int, void_fn_ptr([](int64_t size_class) -> int64_t {
+      return allocator_allocation_count(size_class);
+    }), false},
+
+    {"allocator_free_count", {Int}, Int, void_fn_ptr([](int64_t size_class) -> int64_t {
+      return allocator_free_count(size_class);
+    }), false},
+
+    {"allocator_refill_count", {Int}, Int, void_fn_ptr([](int64_t size_class) -> int64_t {
+      return allocator_refill_count(size_class);
+    }), false},
+
     {"errno", {}, Int, void_fn_ptr([]() -> int64_t {
       return errno;
     }), false},
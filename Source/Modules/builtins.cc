@@ -12,6 +12,7 @@
 #include "../AST/PythonLexer.hh" // for escape()
 #include "../Compiler/Contexts.hh"
 #include "../Compiler/BuiltinFunctions.hh"
+#include "../Types/Allocator.hh"
 #include "../Types/List.hh"
 #include "../Types/Tuple.hh"
 #include "../Types/Strings.hh"
@@ -24,7 +25,7 @@ using FragDef = BuiltinFragmentDefinition;
 
 extern shared_ptr<GlobalContext> global;
 
-static UnicodeObject* empty_unicode = unicode_new(NULL, 0);
+static UnicodeObject* empty_unicode = unicode_new_latin1("", 0);
 static const Value None(ValueType::None);
 static const Value Bool(ValueType::Bool);
 static const Value Bool_True(ValueType::Bool, true);
@@ -32,6 +33,7 @@ static const Value Bool_False(ValueType::Bool, false);
 static const Value Int(ValueType::Int);
 static const Value Int_Zero(ValueType::Int, static_cast<int64_t>(0));
 static const Value Int_NegOne(ValueType::Int, static_cast<int64_t>(-1));
+static const Value Int_One(ValueType::Int, static_cast<int64_t>(1));
 static const Value Float(ValueType::Float);
 static const Value Float_Zero(ValueType::Float, 0.0);
 static const Value Bytes(ValueType::Bytes);
@@ -41,6 +43,7 @@ static const Value Extension0(ValueType::ExtensionTypeReference, static_cast<int
 static const Value Extension1(ValueType::ExtensionTypeReference, static_cast<int64_t>(1));
 static const Value Self(ValueType::Instance, 0LL, nullptr);
 static const Value List_Any(ValueType::List, vector<Value>({Value()}));
+static const Value List_Int(ValueType::List, vector<Value>({Int}));
 static const Value List_Same(ValueType::List, vector<Value>({Extension0}));
 static const Value Set_Any(ValueType::Set, vector<Value>({Value()}));
 static const Value Set_Same(ValueType::Set, vector<Value>({Extension0}));
@@ -105,7 +108,6 @@ static map<string, Value> globals({
   // {"pow",             Value(ValueType::Function)},
   // {"property",        Value(ValueType::Function)},
   // {"quit",            Value(ValueType::Function)},
-  // {"range",           Value(ValueType::Function)},
   // {"reversed",        Value(ValueType::Function)},
   // {"round",           Value(ValueType::Function)},
   // {"setattr",         Value(ValueType::Function)},
@@ -120,6 +122,27 @@ static map<string, Value> globals({
   // {"zip",             Value(ValueType::Function)},
 });
 
+static ListObject* range_list(int64_t start, int64_t stop, int64_t step,
+    ExceptionBlock* exc_block) {
+  if (step == 0) {
+    raise_python_exception_with_message(exc_block, global->ValueError_class_id,
+        "range() arg 3 must not be zero");
+  }
+
+  uint64_t count = 0;
+  if ((step > 0) && (start < stop)) {
+    count = (static_cast<uint64_t>(stop) - start - 1) / step + 1;
+  } else if ((step < 0) && (start > stop)) {
+    count = (static_cast<uint64_t>(start) - stop - 1) / -static_cast<uint64_t>(step) + 1;
+  }
+
+  ListObject* l = list_new(count, false, exc_block);
+  for (uint64_t x = 0; x < count; x++) {
+    l->items[x] = reinterpret_cast<void*>(start + static_cast<int64_t>(x) * step);
+  }
+  return l;
+}
+
 shared_ptr<ModuleContext> builtins_initialize(GlobalContext* global_context) {
 
   static vector<BuiltinFunctionDefinition> function_defs({
@@ -151,7 +174,8 @@ shared_ptr<ModuleContext> builtins_initialize(GlobalContext* global_context) {
       delete_reference(str);
 
     })), FragDef({Unicode}, None, void_fn_ptr([](UnicodeObject* str) {
-      fprintf(stdout, "%.*ls\n", static_cast<int>(str->count), str->data);
+      unicode_write(stdout, str);
+      fputc('\n', stdout);
       delete_reference(str);
     }))}, false},
 
@@ -183,7 +207,7 @@ shared_ptr<ModuleContext> builtins_initialize(GlobalContext* global_context) {
     // Unicode input(Unicode='')
     {"input", {Unicode_Blank}, Unicode, void_fn_ptr([](UnicodeObject* prompt) -> UnicodeObject* {
       if (prompt->count) {
-        fprintf(stdout, "%.*ls", static_cast<int>(prompt->count), prompt->data);
+        unicode_write(stdout, prompt);
         fflush(stdout);
       }
       delete_reference(prompt);
@@ -282,11 +306,12 @@ shared_ptr<ModuleContext> builtins_initialize(GlobalContext* global_context) {
 
     })), FragDef({Unicode, Int_Zero}, Int, void_fn_ptr([](
         UnicodeObject* s, int64_t base, ExceptionBlock* exc_block) -> int64_t {
-      wchar_t* endptr;
-      int64_t ret = wcstoll(s->data, &endptr, base);
+      wstring data = unicode_to_cxx_wstring(s);
       delete_reference(s);
 
-      if (endptr != s->data + s->count) {
+      wchar_t* endptr;
+      int64_t ret = wcstoll(data.c_str(), &endptr, base);
+      if (endptr != data.c_str() + data.size()) {
         raise_python_exception_with_message(exc_block, global->ValueError_class_id,
             "invalid value for int()");
       }
@@ -323,11 +348,12 @@ shared_ptr<ModuleContext> builtins_initialize(GlobalContext* global_context) {
 
     })), FragDef({Unicode}, Float, void_fn_ptr([](
         UnicodeObject* s, ExceptionBlock* exc_block) -> double {
-      wchar_t* endptr;
-      double ret = wcstod(s->data, &endptr);
+      wstring data = unicode_to_cxx_wstring(s);
       delete_reference(s);
 
-      if (endptr != s->data + s->count) {
+      wchar_t* endptr;
+      double ret = wcstod(data.c_str(), &endptr);
+      if (endptr != data.c_str() + data.size()) {
         raise_python_exception_with_message(exc_block, global->ValueError_class_id,
             "invalid value for float()");
       }
@@ -376,29 +402,15 @@ shared_ptr<ModuleContext> builtins_initialize(GlobalContext* global_context) {
       return unicode_new(buf, wcslen(buf));
 
     })), FragDef({Bytes}, Unicode, void_fn_ptr([](BytesObject* v) -> UnicodeObject* {
-      string escape_ret = escape(reinterpret_cast<const char*>(v->data), v->count);
-      UnicodeObject* ret = unicode_new(NULL, escape_ret.size() + 3);
-      ret->data[0] = L'b';
-      ret->data[1] = L'\'';
-      for (size_t x = 0; x < escape_ret.size(); x++) {
-        ret->data[x + 2] = escape_ret[x];
-      }
-      ret->data[escape_ret.size() + 2] = L'\'';
-      ret->data[escape_ret.size() + 3] = 0;
+      string escape_ret = "b\'" + escape(reinterpret_cast<const char*>(v->data), v->count) + "\'";
       delete_reference(v);
-      return ret;
+      return unicode_new_latin1(escape_ret.data(), escape_ret.size());
 
     })), FragDef({Unicode}, Unicode, void_fn_ptr([](UnicodeObject* v) -> UnicodeObject* {
-      string escape_ret = escape(v->data, v->count);
-      UnicodeObject* ret = unicode_new(NULL, escape_ret.size() + 2);
-      ret->data[0] = L'\'';
-      for (size_t x = 0; x < escape_ret.size(); x++) {
-        ret->data[x + 1] = escape_ret[x];
-      }
-      ret->data[escape_ret.size() + 1] = L'\'';
-      ret->data[escape_ret.size() + 2] = 0;
+      wstring data = unicode_to_cxx_wstring(v);
       delete_reference(v);
-      return ret;
+      string escape_ret = "\'" + escape(data.data(), data.size()) + "\'";
+      return unicode_new_latin1(escape_ret.data(), escape_ret.size());
     }))}, false},
 
     // Int len(Bytes)
@@ -421,6 +433,17 @@ shared_ptr<ModuleContext> builtins_initialize(GlobalContext* global_context) {
       return ret;
     }))}, false},
 
+    // List[Int] range(Int, None=None, Int=1)
+    // List[Int] range(Int, Int, Int=1)
+    // `for x in range(...)` loops are compiled as counted loops and don't call
+    // this; it's only called when a range is used as a value, in which case it
+    // returns a list instead of a range object
+    {"range", {FragDef({Int, None, Int_One}, List_Int, void_fn_ptr([](int64_t stop, void*, int64_t step, ExceptionBlock* exc_block) -> ListObject* {
+      return range_list(0, stop, step, exc_block);
+    })), FragDef({Int, Int, Int_One}, List_Int, void_fn_ptr([](int64_t start, int64_t stop, int64_t step, ExceptionBlock* exc_block) -> ListObject* {
+      return range_list(start, stop, step, exc_block);
+    }))}, true},
+
     // Int abs(Int)
     // Float abs(Float)
     // Float abs(Complex) // unimplemented
@@ -437,9 +460,8 @@ shared_ptr<ModuleContext> builtins_initialize(GlobalContext* global_context) {
             "invalid value for chr()");
       }
 
-      UnicodeObject* s = unicode_new(NULL, 1);
-      s->data[0] = i;
-      s->data[1] = 0;
+      UnicodeObject* s = unicode_alloc(1, i);
+      s->set_char_at(0, i);
       return s;
     }), true},
 
@@ -461,7 +483,7 @@ shared_ptr<ModuleContext> builtins_initialize(GlobalContext* global_context) {
             "string contains more than one character");
       }
 
-      int64_t ret = (s->count < 1) ? -1 : s->data[0];
+      int64_t ret = (s->count < 1) ? -1 : s->char_at(0);
       delete_reference(s);
       return ret;
     }))}, true},
@@ -472,14 +494,14 @@ shared_ptr<ModuleContext> builtins_initialize(GlobalContext* global_context) {
         return unicode_new(L"0b0", 3);
       }
 
-      UnicodeObject* s = unicode_new(NULL, 67);
+      char data[67];
       size_t x = 0;
       if (i < 0) {
         i = -i;
-        s->data[x++] = L'-';
+        data[x++] = '-';
       }
-      s->data[x++] = L'0';
-      s->data[x++] = L'b';
+      data[x++] = '0';
+      data[x++] = 'b';
 
       bool should_write = false;
       for (size_t y = 0; y < sizeof(int64_t) * 8; y++) {
@@ -488,13 +510,11 @@ shared_ptr<ModuleContext> builtins_initialize(GlobalContext* global_context) {
           should_write = true;
         }
         if (should_write) {
-          s->data[x++] = bit_set ? L'1' : L'0';
+          data[x++] = bit_set ? '1' : '0';
         }
         i <<= 1;
       }
-      s->data[x] = 0;
-      s->count = x;
-      return s;
+      return unicode_new_latin1(data, x);
     }), false},
 
     // Unicode oct(Int)
@@ -509,14 +529,14 @@ shared_ptr<ModuleContext> builtins_initialize(GlobalContext* global_context) {
         return unicode_new(L"-0o1000000000000000000000", 25);
       }
 
-      UnicodeObject* s = unicode_new(NULL, 25);
+      char data[25];
       size_t x = 0;
       if (i < 0) {
         i = -i;
-        s->data[x++] = '-';
+        data[x++] = '-';
       }
-      s->data[x++] = L'0';
-      s->data[x++] = L'o';
+      data[x++] = '0';
+      data[x++] = 'o';
 
       i <<= 1;
       bool should_write = false;
@@ -526,20 +546,19 @@ shared_ptr<ModuleContext> builtins_initialize(GlobalContext* global_context) {
           should_write = true;
         }
         if (should_write) {
-          s->data[x++] = L'0' + value;
+          data[x++] = '0' + value;
         }
         i <<= 3;
       }
-      s->data[x] = 0;
-      s->count = x;
-      return s;
+      return unicode_new_latin1(data, x);
     }), false},
 
     // Unicode hex(Int)
     {"hex", {Int}, Unicode, void_fn_ptr([](int64_t i) -> UnicodeObject* {
-      UnicodeObject* s = unicode_new(NULL, 19);
-      s->count = swprintf(s->data, 19, L"%s0x%x", (i < 0) ? "-" : "", (i < 0) ? -i : i);
-      return s;
+      char data[20];
+      int count = snprintf(data, sizeof(data), "%s0x%" PRIx64, (i < 0) ? "-" : "",
+          (i < 0) ? -static_cast<uint64_t>(i) : static_cast<uint64_t>(i));
+      return unicode_new_latin1(data, count);
     }), false},
   });
 
@@ -553,10 +572,10 @@ shared_ptr<ModuleContext> builtins_initialize(GlobalContext* global_context) {
       delete_reference(*reinterpret_cast<void**>(o + sizeof(InstanceObject)));
       delete_reference(o);
     });
-  static auto trivial_destructor = void_fn_ptr(&free);
+  static auto trivial_destructor = void_fn_ptr(&nemesys_free);
 
   auto declare_trivial_exception = +[](const char* name) -> BuiltinClassDefinition {
-    return BuiltinClassDefinition(name, {}, {}, void_fn_ptr(&free));
+    return BuiltinClassDefinition(name, {}, {}, void_fn_ptr(&nemesys_free));
   };
 
   auto declare_message_exception = +[](const char* name) -> BuiltinClassDefinition {
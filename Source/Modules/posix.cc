@@ -24,6 +24,7 @@
 
 #include "../Compiler/Contexts.hh"
 #include "../Compiler/BuiltinFunctions.hh"
+#include "../Types/Allocator.hh"
 #include "../Types/Strings.hh"
 #include "../Types/List.hh"
 #include "../Types/Dictionary.hh"
@@ -307,7 +308,7 @@ shared_ptr<ModuleContext> posix_initialize(GlobalContext* global_context) {
         {"st_blocks", Int},
         {"st_blksize", Int},
         {"st_rdev", Int}},
-      {}, void_fn_ptr(&free));
+      {}, void_fn_ptr(&nemesys_free));
 
   // note: we don't create stat_result within posix_module because it doesn't
   // have an __init__ function, so it isn't constructible from python code
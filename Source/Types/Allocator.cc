@@ -0,0 +1,183 @@
+#include "Allocator.hh"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+
+// each refill carves a chunk of this size into blocks of one size class
+static const size_t allocator_chunk_size = 0x10000;
+
+static AllocatorState main_thread_state;
+
+// static initializers run on the main thread
+static const thread::id main_thread_id = this_thread::get_id();
+
+static thread_local AllocatorState* thread_state = NULL;
+
+// all states that have ever been created, for collecting statistics. states
+// are never deleted, since other threads may still have blocks that belong to
+// their free lists
+static mutex& all_states_lock() {
+  static mutex m;
+  return m;
+}
+
+static vector<AllocatorState*>& all_states() {
+  static vector<AllocatorState*> states({&main_thread_state});
+  return states;
+}
+
+static AllocatorState* current_state() {
+  if (!thread_state) {
+    if (this_thread::get_id() == main_thread_id) {
+      thread_state = &main_thread_state;
+    } else {
+      thread_state = new AllocatorState();
+      memset(thread_state, 0, sizeof(*thread_state));
+      lock_guard<mutex> g(all_states_lock());
+      all_states().emplace_back(thread_state);
+    }
+  }
+  return thread_state;
+}
+
+
+
+ssize_t allocator_size_class_for_size(size_t size) {
+  size_t block_size = size + allocator_header_size;
+  size_t size_class = (block_size + allocator_size_class_granularity - 1) /
+      allocator_size_class_granularity - 1;
+  if (size_class >= allocator_size_class_count) {
+    return -1;
+  }
+  return size_class;
+}
+
+size_t allocator_block_size(size_t size_class) {
+  if (size_class >= allocator_size_class_count) {
+    return 0;
+  }
+  return (size_class + 1) * allocator_size_class_granularity;
+}
+
+AllocatorState* allocator_main_thread_state() {
+  return &main_thread_state;
+}
+
+template <size_t Count>
+static uint64_t sum_over_states(uint64_t (AllocatorState::*counts)[Count],
+    size_t index) {
+  if (index >= Count) {
+    return 0;
+  }
+  lock_guard<mutex> g(all_states_lock());
+  uint64_t ret = 0;
+  for (const AllocatorState* state : all_states()) {
+    ret += (state->*counts)[index];
+  }
+  return ret;
+}
+
+uint64_t allocator_allocation_count(size_t size_class) {
+  return sum_over_states(&AllocatorState::allocation_counts, size_class);
+}
+
+uint64_t allocator_free_count(size_t size_class) {
+  return sum_over_states(&AllocatorState::free_counts, size_class);
+}
+
+uint64_t allocator_refill_count(size_t size_class) {
+  return sum_over_states(&AllocatorState::refill_counts, size_class);
+}
+
+void allocator_count_object_allocation(AllocatorObjectType type) {
+  current_state()->object_allocation_counts[static_cast<size_t>(type)]++;
+}
+
+void allocator_count_object_free(AllocatorObjectType type) {
+  current_state()->object_free_counts[static_cast<size_t>(type)]++;
+}
+
+const char* name_for_allocator_object_type(size_t type) {
+  static const char* names[allocator_object_type_count] = {
+      "bytes", "unicode", "list", "tuple", "dict"};
+  return (type < allocator_object_type_count) ? names[type] : NULL;
+}
+
+uint64_t allocator_object_allocation_count(size_t type) {
+  return sum_over_states(&AllocatorState::object_allocation_counts, type);
+}
+
+uint64_t allocator_object_free_count(size_t type) {
+  return sum_over_states(&AllocatorState::object_free_counts, type);
+}
+
+
+
+static bool refill(AllocatorState* state, size_t size_class) {
+  size_t block_size = allocator_block_size(size_class);
+  uint8_t* chunk = reinterpret_cast<uint8_t*>(malloc(allocator_chunk_size));
+  if (!chunk) {
+    return false;
+  }
+
+  // link the blocks in address order
+  size_t block_count = allocator_chunk_size / block_size;
+  for (size_t x = 0; x < block_count - 1; x++) {
+    *reinterpret_cast<void**>(chunk + x * block_size) =
+        chunk + (x + 1) * block_size;
+  }
+  *reinterpret_cast<void**>(chunk + (block_count - 1) * block_size) =
+      state->free_lists[size_class];
+  state->free_lists[size_class] = chunk;
+  state->refill_counts[size_class]++;
+  return true;
+}
+
+void* nemesys_malloc(size_t size) {
+  AllocatorState* state = current_state();
+
+  int64_t* block;
+  ssize_t size_class = allocator_size_class_for_size(size);
+  if (size_class < 0) {
+    block = reinterpret_cast<int64_t*>(malloc(size + allocator_header_size));
+    if (!block) {
+      return NULL;
+    }
+    size_class = allocator_size_class_count;
+
+  } else {
+    if (!state->free_lists[size_class] && !refill(state, size_class)) {
+      return NULL;
+    }
+    block = reinterpret_cast<int64_t*>(state->free_lists[size_class]);
+    state->free_lists[size_class] = *reinterpret_cast<void**>(block);
+  }
+
+  state->allocation_counts[size_class]++;
+  block[0] = size_class;
+  return &block[1];
+}
+
+void nemesys_free(void* o) {
+  if (!o) {
+    return;
+  }
+
+  AllocatorState* state = current_state();
+  int64_t* block = reinterpret_cast<int64_t*>(o) - 1;
+  size_t size_class = block[0];
+  state->free_counts[size_class]++;
+  if (size_class == allocator_size_class_count) {
+    free(block);
+  } else {
+    *reinterpret_cast<void**>(block) = state->free_lists[size_class];
+    state->free_lists[size_class] = block;
+  }
+}
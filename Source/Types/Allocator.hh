@@ -0,0 +1,80 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+
+// nemesys objects are allocated from per-thread free lists, one for each size
+// class. size classes are multiples of 16 bytes, up to 256 bytes; larger
+// objects are allocated with malloc. every block begins with an 8-byte header
+// containing its size class (or allocator_size_class_count for malloc'ed
+// blocks), so objects can be freed without knowing their size, and can be
+// freed on a different thread than the one that allocated them. blocks from
+// the free lists are never returned to the system
+
+static const size_t allocator_size_class_count = 16;
+static const size_t allocator_size_class_granularity = 16;
+static const size_t allocator_header_size = sizeof(int64_t);
+
+// built-in object types that are counted when they're created and destroyed.
+// class instances are counted per class instead (see ClassContext)
+enum class AllocatorObjectType {
+  Bytes = 0,
+  Unicode,
+  List,
+  Tuple,
+  Dictionary,
+};
+static const size_t allocator_object_type_count = 5;
+
+struct AllocatorState {
+  void* free_lists[allocator_size_class_count];
+
+  // the last entry in each of these counts objects that were too large for
+  // any size class. refill_counts[allocator_size_class_count] is always zero
+  uint64_t allocation_counts[allocator_size_class_count + 1];
+  uint64_t free_counts[allocator_size_class_count + 1];
+  uint64_t refill_counts[allocator_size_class_count + 1];
+
+  // indexed by AllocatorObjectType
+  uint64_t object_allocation_counts[allocator_object_type_count];
+  uint64_t object_free_counts[allocator_object_type_count];
+};
+
+// returns the size class that objects of the given size are allocated from, or
+// -1 if they're too large for all of them
+ssize_t allocator_size_class_for_size(size_t size);
+
+// returns the size of the blocks in the given size class (including the
+// header). this is 0 for allocator_size_class_count
+size_t allocator_block_size(size_t size_class);
+
+// returns the main thread's allocator state. generated code only runs on the
+// main thread, so CompilationVisitor inlines allocations and frees of class
+// instances by using this state's free lists directly (unless
+// NoInlineAllocation or BackgroundCompilation is set)
+AllocatorState* allocator_main_thread_state();
+
+// returns the total statistics for a size class over all threads' states. if
+// other threads are running, the counts may be slightly out of date
+uint64_t allocator_allocation_count(size_t size_class);
+uint64_t allocator_free_count(size_t size_class);
+uint64_t allocator_refill_count(size_t size_class);
+
+// the functions that create and destroy built-in objects call these
+void allocator_count_object_allocation(AllocatorObjectType type);
+void allocator_count_object_free(AllocatorObjectType type);
+
+// returns the name of a built-in object type (e.g. "bytes"), or NULL if type
+// isn't less than allocator_object_type_count
+const char* name_for_allocator_object_type(size_t type);
+// return the total counts for a built-in object type over all threads' states
+// (0 if type isn't valid)
+uint64_t allocator_object_allocation_count(size_t type);
+uint64_t allocator_object_free_count(size_t type);
+
+// like malloc and free, but for nemesys objects. objects allocated with
+// nemesys_malloc must be freed with nemesys_free and vice versa
+void* nemesys_malloc(size_t size);
+void nemesys_free(void* o);
@@ -1,9 +1,14 @@
 #include "Dictionary.hh"
 
 #include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include <phosg/Strings.hh>
 
+#include "Allocator.hh"
 #include "Instance.hh"
 #include "../Compiler/Contexts.hh"
 
@@ -29,10 +34,328 @@ static uint8_t dictionary_default_key_char(const void* k, size_t which) {
   return reinterpret_cast<const uint8_t*>(&k)[which];
 }
 
+uint64_t dictionary_int_key_hash(const void* k) {
+  // the low bits of the product only depend on the low bits of the key, so
+  // fold the high half into the low half. the group is chosen by bits 7 and up
+  // of the result, and the control byte holds bits 0-6
+  uint64_t h = reinterpret_cast<uint64_t>(k) * dictionary_int_key_hash_multiplier;
+  return h ^ (h >> 32);
+}
+
+uint64_t dictionary_float_key_hash(const void* k) {
+  double v;
+  memcpy(&v, &k, sizeof(v));
+  if (v == 0.0) {
+    return dictionary_int_key_hash(NULL);
+  }
+  return dictionary_int_key_hash(k);
+}
+
+bool dictionary_float_key_equal(const void* a, const void* b) {
+  double a_v, b_v;
+  memcpy(&a_v, &a, sizeof(a_v));
+  memcpy(&b_v, &b, sizeof(b_v));
+  // NaN keys with the same bits are equal, as if they were the same object.
+  // this is also what the inline lookup in generated code does
+  return (a == b) || (a_v == b_v);
+}
+
+static bool dictionary_default_key_equal(const void* a, const void* b) {
+  return a == b;
+}
+
+
+
+// hash table implementation. see the comment in Dictionary.hh
+
+static const size_t hash_group_size = 16;
+static const size_t hash_min_capacity = hash_group_size;
+static const uint8_t hash_control_empty = 0x80;
+static const uint8_t hash_control_deleted = 0xFE;
+
+static inline uint8_t hash_control_for_hash(uint64_t hash) {
+  return hash & 0x7F;
+}
+
+static inline size_t hash_group_for_hash(uint64_t hash, size_t capacity) {
+  return (hash >> 7) & ((capacity / hash_group_size) - 1);
+}
+
+static inline size_t hash_max_count_for_capacity(size_t capacity) {
+  return capacity - capacity / 8;
+}
+
+// the bits in these masks correspond to the slots in the group
+struct HashControlGroup {
+#ifdef __SSE2__
+  __m128i control;
+
+  explicit HashControlGroup(const uint8_t* control) : control(
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(control))) { }
+
+  uint16_t match(uint8_t value) const {
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(this->control,
+        _mm_set1_epi8(static_cast<char>(value))));
+  }
+
+  // empty and deleted are the only control values with the high bit set
+  uint16_t match_empty_or_deleted() const {
+    return _mm_movemask_epi8(this->control);
+  }
+#else
+  const uint8_t* control;
+
+  explicit HashControlGroup(const uint8_t* control) : control(control) { }
+
+  uint16_t match(uint8_t value) const {
+    uint16_t ret = 0;
+    for (size_t x = 0; x < hash_group_size; x++) {
+      ret |= (this->control[x] == value) << x;
+    }
+    return ret;
+  }
+
+  uint16_t match_empty_or_deleted() const {
+    uint16_t ret = 0;
+    for (size_t x = 0; x < hash_group_size; x++) {
+      ret |= (this->control[x] >> 7) << x;
+    }
+    return ret;
+  }
+#endif
+
+  uint16_t match_empty() const {
+    return this->match(hash_control_empty);
+  }
+
+  uint16_t match_full() const {
+    return ~this->match_empty_or_deleted();
+  }
+};
+
+ssize_t DictionaryObject::hash_find(const void* k, uint64_t hash) const {
+  if (!this->hash_capacity) {
+    return -1;
+  }
+
+  // groups are probed in triangular order (+1, +2, +3, ...), which visits
+  // every group when the group count is a power of 2. a probe ends at the first
+  // group with an empty slot, since an insert would have used that slot
+  uint8_t control = hash_control_for_hash(hash);
+  size_t group_mask = (this->hash_capacity / hash_group_size) - 1;
+  size_t group = hash_group_for_hash(hash, this->hash_capacity);
+  for (size_t step = 1;; step++) {
+    size_t base = group * hash_group_size;
+    HashControlGroup g(this->hash_control + base);
+    for (uint16_t matches = g.match(control); matches; matches &= matches - 1) {
+      size_t index = base + __builtin_ctz(matches);
+      const HashSlot& slot = this->hash_slots[index];
+      if ((slot.hash == hash) && this->key_equal(slot.key, k)) {
+        return index;
+      }
+    }
+    if (g.match_empty()) {
+      return -1;
+    }
+    group = (group + step) & group_mask;
+  }
+}
+
+size_t DictionaryObject::hash_find_insert_slot(uint64_t hash) const {
+  size_t group_mask = (this->hash_capacity / hash_group_size) - 1;
+  size_t group = hash_group_for_hash(hash, this->hash_capacity);
+  for (size_t step = 1;; step++) {
+    size_t base = group * hash_group_size;
+    uint16_t matches = HashControlGroup(this->hash_control + base).match_empty_or_deleted();
+    if (matches) {
+      return base + __builtin_ctz(matches);
+    }
+    group = (group + step) & group_mask;
+  }
+}
+
+void DictionaryObject::hash_rehash(size_t new_capacity,
+    ExceptionBlock* exc_block) {
+  uint8_t* new_control = reinterpret_cast<uint8_t*>(nemesys_malloc(
+      new_capacity * (sizeof(uint8_t) + sizeof(HashSlot))));
+  if (!new_control) {
+    raise_python_exception(exc_block, &MemoryError_instance);
+    throw bad_alloc();
+  }
+  memset(new_control, hash_control_empty, new_capacity);
+
+  uint8_t* old_control = this->hash_control;
+  HashSlot* old_slots = this->hash_slots;
+  size_t old_capacity = this->hash_capacity;
+  this->hash_control = new_control;
+  this->hash_slots = reinterpret_cast<HashSlot*>(new_control + new_capacity);
+  this->hash_capacity = new_capacity;
+  this->hash_growth_left = hash_max_count_for_capacity(new_capacity) - this->count;
+  this->node_count = new_capacity;
+
+  // the slots keep their keys' hashes, so this doesn't need to call key_hash.
+  // the keys are all different, so it doesn't need key_equal either
+  for (size_t x = 0; x < old_capacity; x++) {
+    if (old_control[x] & 0x80) {
+      continue;
+    }
+    const HashSlot& old_slot = old_slots[x];
+    size_t index = this->hash_find_insert_slot(old_slot.hash);
+    this->hash_control[index] = old_control[x];
+    this->hash_slots[index] = old_slot;
+  }
+
+  if (old_control) {
+    nemesys_free(old_control);
+  }
+}
+
+static void hash_insert(DictionaryObject* d, void* k, void* v,
+    ExceptionBlock* exc_block) {
+  uint64_t hash = d->key_hash(k);
+  ssize_t index = d->hash_find(k, hash);
+
+  if (index >= 0) {
+    // replace the existing key and value
+    DictionaryObject::HashSlot& slot = d->hash_slots[index];
+    if (d->flags & DictionaryFlag::KeysAreObjects) {
+      delete_reference(slot.key);
+    }
+    if (d->flags & DictionaryFlag::ValuesAreObjects) {
+      delete_reference(slot.value);
+    }
+    slot.key = k;
+    slot.value = v;
+
+  } else {
+    if (!d->hash_capacity) {
+      d->hash_rehash(hash_min_capacity, exc_block);
+    }
+    size_t insert_index = d->hash_find_insert_slot(hash);
+
+    // deleted slots can be reused without using up an empty slot. if there are
+    // no usable empty slots, rehash the table - in place if it's mostly
+    // deleted slots, or at twice the size otherwise
+    if (!d->hash_growth_left &&
+        (d->hash_control[insert_index] == hash_control_empty)) {
+      size_t new_capacity = d->hash_capacity;
+      if (d->count >= hash_max_count_for_capacity(d->hash_capacity) / 2) {
+        new_capacity *= 2;
+      }
+      d->hash_rehash(new_capacity, exc_block);
+      insert_index = d->hash_find_insert_slot(hash);
+    }
+
+    if (d->hash_control[insert_index] == hash_control_empty) {
+      d->hash_growth_left--;
+    }
+    d->hash_control[insert_index] = hash_control_for_hash(hash);
+    DictionaryObject::HashSlot& slot = d->hash_slots[insert_index];
+    slot.hash = hash;
+    slot.key = k;
+    slot.value = v;
+    d->count++;
+  }
+
+  if (d->flags & DictionaryFlag::KeysAreObjects) {
+    add_reference(k);
+  }
+  if (d->flags & DictionaryFlag::ValuesAreObjects) {
+    add_reference(v);
+  }
+}
+
+static bool hash_erase(DictionaryObject* d, void* k) {
+  ssize_t index = d->hash_find(k, d->key_hash(k));
+  if (index < 0) {
+    return false;
+  }
+
+  DictionaryObject::HashSlot& slot = d->hash_slots[index];
+  if (d->flags & DictionaryFlag::KeysAreObjects) {
+    delete_reference(slot.key);
+  }
+  if (d->flags & DictionaryFlag::ValuesAreObjects) {
+    delete_reference(slot.value);
+  }
+  d->count--;
+
+  // if the slot's group has an empty slot, no probe has continued past this
+  // group, so the slot can be marked empty instead of deleted
+  size_t base = index - (index % hash_group_size);
+  if (HashControlGroup(d->hash_control + base).match_empty()) {
+    d->hash_control[index] = hash_control_empty;
+    d->hash_growth_left++;
+  } else {
+    d->hash_control[index] = hash_control_deleted;
+  }
+  return true;
+}
+
+static void hash_clear(DictionaryObject* d) {
+  if (!d->hash_control) {
+    return;
+  }
+
+  bool keys_are_objects = d->flags & DictionaryFlag::KeysAreObjects;
+  bool values_are_objects = d->flags & DictionaryFlag::ValuesAreObjects;
+  if (keys_are_objects || values_are_objects) {
+    for (size_t x = 0; x < d->hash_capacity; x++) {
+      if (d->hash_control[x] & 0x80) {
+        continue;
+      }
+      if (keys_are_objects) {
+        delete_reference(d->hash_slots[x].key);
+      }
+      if (values_are_objects) {
+        delete_reference(d->hash_slots[x].value);
+      }
+    }
+  }
+
+  nemesys_free(d->hash_control);
+  d->hash_control = NULL;
+  d->hash_slots = NULL;
+  d->hash_capacity = 0;
+  d->hash_growth_left = 0;
+  d->count = 0;
+  d->node_count = 0;
+}
+
+static bool hash_next_item(const DictionaryObject* d,
+    DictionaryObject::SlotContents* ret) {
+  // skip a group at a time until there's a full slot
+  size_t index = ret->occupied ? ret->cursor : 0;
+  while (index < d->hash_capacity) {
+    size_t base = index - (index % hash_group_size);
+    uint16_t matches = HashControlGroup(d->hash_control + base).match_full();
+    matches &= 0xFFFF << (index - base);
+    if (matches) {
+      index = base + __builtin_ctz(matches);
+      const DictionaryObject::HashSlot& slot = d->hash_slots[index];
+      ret->key = slot.key;
+      ret->value = slot.value;
+      ret->occupied = true;
+      ret->is_subnode = false;
+      ret->cursor = index + 1;
+      return true;
+    }
+    index = base + hash_group_size;
+  }
+
+  ret->occupied = true;
+  ret->cursor = d->hash_capacity;
+  return false;
+}
+
+
+
 DictionaryObject* dictionary_new(size_t (*key_length)(const void* k),
-    uint8_t (*key_char)(const void* k, size_t offset), uint64_t flags,
+    uint8_t (*key_char)(const void* k, size_t offset),
+    uint64_t (*key_hash)(const void* k),
+    bool (*key_equal)(const void* a, const void* b), uint64_t flags,
     ExceptionBlock* exc_block) {
-  DictionaryObject* d = reinterpret_cast<DictionaryObject*>(malloc(
+  DictionaryObject* d = reinterpret_cast<DictionaryObject*>(nemesys_malloc(
       sizeof(DictionaryObject)));
   if (!d) {
     raise_python_exception(exc_block, &MemoryError_instance);
@@ -42,22 +365,35 @@ DictionaryObject* dictionary_new(size_t (*key_length)(const void* k),
   d->basic.destructor = dictionary_delete;
   d->key_length = key_length ? key_length : dictionary_default_key_length;
   d->key_char = key_char ? key_char : dictionary_default_key_char;
+  d->key_hash = key_hash ? key_hash : dictionary_int_key_hash;
+  d->key_equal = key_equal ? key_equal : dictionary_default_key_equal;
   d->count = 0;
   d->node_count = 0;
   d->flags = flags;
   d->root = NULL;
+  d->hash_control = NULL;
+  d->hash_slots = NULL;
+  d->hash_capacity = 0;
+  d->hash_growth_left = 0;
+  allocator_count_object_allocation(AllocatorObjectType::Dictionary);
   return d;
 }
 
 void dictionary_delete(void* d) {
   dictionary_clear(reinterpret_cast<DictionaryObject*>(d));
-  free(d);
+  allocator_count_object_free(AllocatorObjectType::Dictionary);
+  nemesys_free(d);
 }
 
 
 
 void dictionary_insert(DictionaryObject* d, void* k, void* v,
     ExceptionBlock* exc_block) {
+  if (!(d->flags & DictionaryFlag::KeysAreOrdered)) {
+    hash_insert(d, k, v, exc_block);
+    return;
+  }
+
   // find and clear the slot offset for the key, creating it if necessary
   auto t = d->traverse(k, false, true, exc_block);
   if (!t.node) {
@@ -92,6 +428,10 @@ void dictionary_insert(DictionaryObject* d, void* k, void* v,
 }
 
 bool dictionary_erase(DictionaryObject* d, void* k) {
+  if (!(d->flags & DictionaryFlag::KeysAreOrdered)) {
+    return hash_erase(d, k);
+  }
+
   // find the value slot for this key, tracking the node path as we go
   auto t = d->traverse(k, true);
   if (!t.node) {
@@ -133,7 +473,7 @@ bool dictionary_erase(DictionaryObject* d, void* k) {
     }
 
     // delete the child node
-    free(node);
+    nemesys_free(node);
     d->node_count--;
 
     // if the node had a value, we're done - the parent node is not empty since
@@ -147,7 +487,7 @@ bool dictionary_erase(DictionaryObject* d, void* k) {
 
   // if we made it to the root and the root is empty, delete it
   if ((t.nodes.size() == 1) && !d->root->has_children() && !d->root->has_value) {
-    free(d->root);
+    nemesys_free(d->root);
     d->root = NULL;
     d->node_count--;
   }
@@ -157,6 +497,11 @@ bool dictionary_erase(DictionaryObject* d, void* k) {
 
 
 void dictionary_clear(DictionaryObject* d) {
+  if (!(d->flags & DictionaryFlag::KeysAreOrdered)) {
+    hash_clear(d);
+    return;
+  }
+
   if (!d->root) {
     return;
   }
@@ -198,7 +543,7 @@ void dictionary_clear(DictionaryObject* d) {
       }
     }
 
-    free(node);
+    nemesys_free(node);
   }
 
   d->root = NULL;
@@ -208,6 +553,10 @@ void dictionary_clear(DictionaryObject* d) {
 
 
 bool dictionary_exists(const DictionaryObject* d, void* k) {
+  if (!(d->flags & DictionaryFlag::KeysAreOrdered)) {
+    return d->hash_find(k, d->key_hash(k)) >= 0;
+  }
+
   auto t = d->traverse(k, false);
 
   if (!t.node) {
@@ -219,6 +568,16 @@ bool dictionary_exists(const DictionaryObject* d, void* k) {
 
 void* dictionary_at(const DictionaryObject* d, void* k,
     ExceptionBlock* exc_block) {
+  if (!(d->flags & DictionaryFlag::KeysAreOrdered)) {
+    ssize_t index = d->hash_find(k, d->key_hash(k));
+    if (index < 0) {
+      raise_python_exception_with_message(exc_block, global->KeyError_class_id,
+          "key not present");
+      throw out_of_range("key does not exist in dictionary");
+    }
+    return d->hash_slots[index].value;
+  }
+
   // find the value slot for this key
   auto t = d->traverse(k, false);
   if (!t.node) {
@@ -248,11 +607,12 @@ size_t dictionary_node_size(const DictionaryObject* d) {
 
 
 DictionaryObject::SlotContents::SlotContents() : key(NULL), value(NULL),
-    occupied(false), is_subnode(false) { }
+    occupied(false), is_subnode(false), cursor_node(NULL), cursor(0) { }
 
-DictionaryObject::Node::Node(uint8_t start, uint8_t end, uint8_t parent_slot,
-    void* key, void* value, bool has_value) : start(start), end(end),
-    parent_slot(parent_slot), has_value(has_value), key(key), value(value) {
+DictionaryObject::Node::Node(uint8_t start, uint8_t end, Node* parent,
+    uint8_t parent_slot, void* key, void* value, bool has_value) :
+    start(start), end(end), parent_slot(parent_slot), has_value(has_value),
+    parent(parent), key(key), value(value) {
   // warning: this constructor does not clear the value slots! the caller has to
   // do this itself if it uses this constructor
 
@@ -263,9 +623,10 @@ DictionaryObject::Node::Node(uint8_t start, uint8_t end, uint8_t parent_slot,
   }
 }
 
-DictionaryObject::Node::Node(uint8_t slot, uint8_t parent_slot, void* key,
-    void* value, bool has_value) : start(slot), end(slot),
-    parent_slot(parent_slot), has_value(has_value), key(key), value(value) {
+DictionaryObject::Node::Node(uint8_t slot, Node* parent, uint8_t parent_slot,
+    void* key, void* value, bool has_value) : start(slot), end(slot),
+    parent_slot(parent_slot), has_value(has_value), parent(parent), key(key),
+    value(value) {
   this->set_slot(slot, NULL, NULL, false, false);
 
   // clear the last byte in the flags array in case there are some nonzero bits
@@ -396,12 +757,12 @@ DictionaryObject::Traversal DictionaryObject::traverse(void* k, bool with_nodes,
     this->node_count++;
 
     if (k_len == 0) {
-      this->root = reinterpret_cast<Node*>(malloc(Node::size_for_range(1, 0)));
+      this->root = reinterpret_cast<Node*>(nemesys_malloc(Node::size_for_range(1, 0)));
       if (!this->root) {
         raise_python_exception(exc_block, &MemoryError_instance);
         throw bad_alloc();
       }
-      new (this->root) Node(1, 0, 0, NULL, NULL, false);
+      new (this->root) Node(1, 0, NULL, 0, NULL, NULL, false);
       t.node = this->root;
       t.ch = 0x100;
       if (with_nodes) {
@@ -411,12 +772,12 @@ DictionaryObject::Traversal DictionaryObject::traverse(void* k, bool with_nodes,
     }
 
     uint8_t ch = this->key_char(k, 0);
-    this->root = reinterpret_cast<Node*>(malloc(Node::size_for_range(ch, ch)));
+    this->root = reinterpret_cast<Node*>(nemesys_malloc(Node::size_for_range(ch, ch)));
     if (!this->root) {
       raise_python_exception(exc_block, &MemoryError_instance);
       throw bad_alloc();
     }
-    new (this->root) Node(ch, ch, 0, NULL, NULL, false);
+    new (this->root) Node(ch, ch, NULL, 0, NULL, NULL, false);
   }
 
   Node* parent_node = NULL;
@@ -486,14 +847,14 @@ DictionaryObject::Traversal DictionaryObject::traverse(void* k, bool with_nodes,
       // make a new node
       uint8_t new_start = extend_start ? t.ch : t.node->start;
       uint8_t new_end = (!extend_start) ? t.ch : t.node->end;
-      Node* new_node = reinterpret_cast<Node*>(malloc(
+      Node* new_node = reinterpret_cast<Node*>(nemesys_malloc(
           Node::size_for_range(new_start, new_end)));
       if (!new_node) {
         raise_python_exception(exc_block, &MemoryError_instance);
         throw bad_alloc();
       }
-      new (new_node) Node(new_start, new_end, t.node->parent_slot, t.node->key,
-          t.node->value, t.node->has_value);
+      new (new_node) Node(new_start, new_end, t.node->parent,
+          t.node->parent_slot, t.node->key, t.node->value, t.node->has_value);
 
       // copy the relevant data from the old node and clear the values in the
       // newly-created slots. we have to do this explicitly because the Node
@@ -519,16 +880,24 @@ DictionaryObject::Traversal DictionaryObject::traverse(void* k, bool with_nodes,
         }
       }
 
+      // the children have to point to the new node
+      for (x = new_node->start; x <= new_node->end; x++) {
+        auto c = new_node->get_slot(x);
+        if (c.occupied && c.is_subnode) {
+          reinterpret_cast<Node*>(c.value)->parent = new_node;
+        }
+      }
+
       // delete the old node. if it's the root, update this->root appropriately
       if (parent_node) {
         auto old_slot_contents = parent_node->get_slot(new_node->parent_slot);
         if (!old_slot_contents.occupied || !old_slot_contents.is_subnode) {
           throw logic_error("replaced node not found in parent");
         }
-        free(old_slot_contents.value);
+        nemesys_free(old_slot_contents.value);
         parent_node->set_slot(new_node->parent_slot, NULL, new_node, true, true);
       } else { // we're replacing the root node
-        free(this->root);
+        nemesys_free(this->root);
         this->root = new_node;
       }
 
@@ -557,14 +926,14 @@ DictionaryObject::Traversal DictionaryObject::traverse(void* k, bool with_nodes,
     if (slot_contents.occupied && slot_contents.is_subnode) {
       throw logic_error("new leaf node replaces existing node");
     }
-    Node* new_node = reinterpret_cast<Node*>(malloc(
+    Node* new_node = reinterpret_cast<Node*>(nemesys_malloc(
         Node::size_for_range(next_ch, next_ch)));
     if (!new_node) {
       raise_python_exception(exc_block, &MemoryError_instance);
       throw bad_alloc();
     }
-    new (new_node) Node(next_ch, t.ch, slot_contents.key, slot_contents.value,
-        slot_contents.occupied);
+    new (new_node) Node(next_ch, t.node, t.ch, slot_contents.key,
+        slot_contents.value, slot_contents.occupied);
 
     // link to the new node from the parent
     t.node->set_slot(t.ch, NULL, new_node, true, true);
@@ -590,118 +959,91 @@ DictionaryObject::Traversal DictionaryObject::traverse(void* k,
 
 bool dictionary_next_item(const DictionaryObject* d,
     DictionaryObject::SlotContents* ret) {
-  ret->is_subnode = false;
-
-  DictionaryObject::Node* node = d->root;
-  if (!node) {
-    return false;
+  if (!(d->flags & DictionaryFlag::KeysAreOrdered)) {
+    return hash_next_item(d, ret);
   }
 
-  int16_t slot_id = 0;
-  size_t k_len = ret->occupied ? d->key_length(ret->key) : 0;
-  vector<DictionaryObject::Node*> nodes;
-  nodes.reserve(k_len);
-  nodes.emplace_back(node);
-
+  // if this is the first call, start at the root. otherwise, continue from the
+  // cursor; a NULL cursor node means the previous call reached the end
+  const DictionaryObject::Node* node;
+  int64_t slot_id;
   if (!ret->occupied) {
-    if (node->has_value) {
-      ret->key = node->key;
-      ret->value = node->value;
-      ret->occupied = true;
-      return true;
-    }
-
-  // current is not NULL - we're continuing iteration
+    node = d->root;
+    slot_id = -1;
   } else {
-    size_t k_offset = 0;
-
-    // follow links to the leaf node as far as possible
-    while (k_offset != k_len) {
-      uint8_t ch = d->key_char(ret->key, k_offset);
-      // if current is before anything in this node, then we have to iterate the
-      // node's children, but not the node itself (the node's value is at some
-      // prefix of current, so it's not after current).
-      if (ch < node->start) {
-        slot_id = node->start;
-        break;
-      }
-
-      // if current is after anything in this node, then we don't iterate the
-      // node at all - we'll have to unwind the stack
-      if (ch > node->end) {
-        slot_id = 0x100;
-        break;
-      }
-
-      // if the slot does not contain a subnode, we're done here; we'll start by
-      // examining the following slot
-      auto slot_contents = node->get_slot(ch);
-      if (!slot_contents.is_subnode) {
-        slot_id = ch + 1;
-        break;
-      }
-
-      // slot contains a subnode, not a value - move down to it
-      node = reinterpret_cast<DictionaryObject::Node*>(slot_contents.value);
-      nodes.emplace_back(node);
-      k_offset++;
-    }
+    node = reinterpret_cast<const DictionaryObject::Node*>(ret->cursor_node);
+    slot_id = ret->cursor;
   }
+  ret->is_subnode = false;
 
-  // we found the position in the tree that's immediately after the given key.
-  // now find the next non-null value in the tree at or after that position.
-  while (!nodes.empty()) {
-    // check the node's value if we need to
+  // each node's value comes before its children. when all of a node's slots
+  // have been checked, continue in its parent at the following slot
+  while (node) {
     if (slot_id < 0) {
+      slot_id = node->start;
       if (node->has_value) {
-        ret->occupied = true;
         ret->key = node->key;
         ret->value = node->value;
+        ret->occupied = true;
+        ret->cursor_node = node;
+        ret->cursor = slot_id;
         return true;
       }
-      slot_id = node->start;
-
-    } else if (slot_id < node->start) {
-      slot_id = node->start;
     }
 
-    // if we're done with this node, go to the next slot in the parent node
     if (slot_id > node->end) {
-      nodes.pop_back();
-      if (nodes.empty()) {
-        return false;
-      }
       slot_id = node->parent_slot + 1;
-      node = nodes.back();
+      node = node->parent;
       continue;
     }
 
-    // if the slot is empty, keep going in this node
     auto slot_contents = node->get_slot(slot_id);
     if (!slot_contents.occupied) {
       slot_id++;
-      continue;
-    }
 
-    // if the slot contains a value, we're done
-    if (!slot_contents.is_subnode) {
+    } else if (slot_contents.is_subnode) {
+      node = reinterpret_cast<const DictionaryObject::Node*>(slot_contents.value);
+      slot_id = -1;
+
+    } else {
       ret->key = slot_contents.key;
       ret->value = slot_contents.value;
       ret->occupied = true;
+      ret->cursor_node = node;
+      ret->cursor = slot_id + 1;
       return true;
     }
-
-    // the slot contains a subnode, so move to it and check if it has a value
-    node = reinterpret_cast<DictionaryObject::Node*>(slot_contents.value);
-    nodes.emplace_back(node);
-    slot_id = -1;
   }
 
-  // if we didn't find a value, we're done iterating the tree
+  ret->occupied = true;
+  ret->cursor_node = NULL;
   return false;
 }
 
 string dictionary_structure(const DictionaryObject* d) {
+  // hash tables are described by their control bytes, one group per
+  // parenthesized list: E is empty, D is deleted, and full slots are shown as
+  // their hash's low 7 bits
+  if (!(d->flags & DictionaryFlag::KeysAreOrdered)) {
+    string ret;
+    for (size_t x = 0; x < d->hash_capacity; x++) {
+      if (!(x % hash_group_size)) {
+        ret += x ? ")(" : "(";
+      } else {
+        ret += ',';
+      }
+      uint8_t control = d->hash_control[x];
+      if (control == hash_control_empty) {
+        ret += 'E';
+      } else if (control == hash_control_deleted) {
+        ret += 'D';
+      } else {
+        ret += string_printf("%02hhX", control);
+      }
+    }
+    return ret.empty() ? "()" : (ret + ')');
+  }
+
   if (d->root == NULL) {
     return "()";
   }
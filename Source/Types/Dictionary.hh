@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdint.h>
+#include <sys/types.h>
 
 #include <atomic>
 #include <string>
@@ -13,24 +14,68 @@
 enum DictionaryFlag {
   KeysAreObjects   = 0x01,
   ValuesAreObjects = 0x02,
+  // keys are stored in a byte-wise trie (using key_length and key_char)
+  // instead of a hash table (using key_hash and key_equal), so iteration is in
+  // key order
+  KeysAreOrdered   = 0x04,
 };
 
+// a dictionary is either a hash table or a trie, depending on whether
+// KeysAreOrdered is given when it's created. the hash table is the default; it
+// uses open addressing with groups of 16 slots, like Abseil's SwissTable. each
+// slot has a control byte, which is either empty, deleted, or the low 7 bits of
+// the key's hash. lookups compare all 16 control bytes in a group at once and
+// only call key_equal for slots whose control byte and full hash both match,
+// so most lookups call key_hash once and key_equal once. each slot keeps its
+// key's hash, so resizing doesn't call key_hash at all.
 struct DictionaryObject {
   BasicObject basic;
 
   size_t (*key_length)(const void* k);
   uint8_t (*key_char)(const void* k, size_t offset);
+  uint64_t (*key_hash)(const void* k);
+  bool (*key_equal)(const void* a, const void* b);
 
   uint64_t count;
-  uint64_t node_count;
+  uint64_t node_count; // trie nodes or hash table slots
   uint64_t flags;
 
+  struct HashSlot {
+    uint64_t hash;
+    void* key;
+    void* value;
+  };
+
+  // the hash table is one allocation containing capacity control bytes
+  // followed by capacity slots. capacity is 0 or a power of 2 that's at least
+  // the group size. growth_left is the number of empty slots that can still be
+  // used before the table has to be rehashed; it's less than the actual number
+  // of empty slots so that probes always find an empty slot eventually
+  uint8_t* hash_control;
+  HashSlot* hash_slots;
+  uint64_t hash_capacity;
+  uint64_t hash_growth_left;
+
+  ssize_t hash_find(const void* k, uint64_t hash) const;
+  size_t hash_find_insert_slot(uint64_t hash) const;
+  void hash_rehash(size_t new_capacity, ExceptionBlock* exc_block);
+
+  // this is also the iteration state for dictionary_next_item, which uses the
+  // cursor fields to continue where the previous call stopped. it must be
+  // zeroed before the first call (generated code does this directly). if the
+  // dictionary is modified during iteration, the behavior is undefined
   struct SlotContents {
     void* key;
     void* value;
     uint8_t occupied;
     uint8_t is_subnode;
 
+    // for hash tables, cursor is the index of the next slot to check. for
+    // tries, cursor_node is the node to continue in and cursor is the next
+    // slot to check in it (-1 means the node's own value hasn't been checked)
+    const void* cursor_node;
+    int64_t cursor;
+
     SlotContents();
   };
 
@@ -39,14 +84,15 @@ struct DictionaryObject {
     uint8_t end;
     uint8_t parent_slot;
     bool has_value;
+    Node* parent; // NULL for the root
     void* key;
     void* value;
     uint8_t data[0];
 
-    Node(uint8_t start, uint8_t end, uint8_t parent_slot, void* key,
+    Node(uint8_t start, uint8_t end, Node* parent, uint8_t parent_slot,
+        void* key, void* value, bool has_value);
+    Node(uint8_t slot, Node* parent, uint8_t parent_slot, void* key,
         void* value, bool has_value);
-    Node(uint8_t slot, uint8_t parent_slot, void* key, void* value,
-        bool has_value);
 
     static size_t size_for_range(uint8_t start, uint8_t end);
 
@@ -76,8 +122,24 @@ struct DictionaryObject {
   std::string structure_for_node(const Node* n) const;
 };
 
+// Int and Float keys are stored unboxed. Int keys use the default key
+// functions; dictionary_int_key_hash is a multiplicative hash, which
+// CompilationVisitor also computes inline for Dict[Int, V] lookups. Float keys
+// are hashed the same way, except that -0.0 is hashed as 0.0 since they're
+// equal, and are compared as floats, except that NaNs with the same bits are
+// equal
+static const uint64_t dictionary_int_key_hash_multiplier = 0x9E3779B97F4A7C15ULL;
+uint64_t dictionary_int_key_hash(const void* k);
+uint64_t dictionary_float_key_hash(const void* k);
+bool dictionary_float_key_equal(const void* a, const void* b);
+
+// key_length and key_char are only used for ordered (trie) dictionaries, and
+// key_hash and key_equal are only used for hash tables. if any of them are
+// NULL, the keys are treated as 8-byte values (e.g. Ints) rather than pointers
 DictionaryObject* dictionary_new(size_t (*key_length)(const void* k),
-    uint8_t (*key_char)(const void* k, size_t which), uint64_t flags,
+    uint8_t (*key_char)(const void* k, size_t which),
+    uint64_t (*key_hash)(const void* k),
+    bool (*key_equal)(const void* a, const void* b), uint64_t flags,
     ExceptionBlock* exc_block = NULL);
 void dictionary_delete(void* d);
 
@@ -89,6 +151,8 @@ void dictionary_clear(DictionaryObject* d);
 bool dictionary_exists(const DictionaryObject* d, void* k);
 void* dictionary_at(const DictionaryObject* d, void* k,
     ExceptionBlock* exc_block = NULL);
+// returns the next item in the dictionary, or false if there are no more.
+// item must be zeroed before the first call
 bool dictionary_next_item(const DictionaryObject* d,
     DictionaryObject::SlotContents* item);
 size_t dictionary_size(const DictionaryObject* d);
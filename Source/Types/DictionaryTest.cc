@@ -7,9 +7,12 @@
 #include <sys/types.h>
 
 #include <phosg/UnitTest.hh>
+#include <phosg/Strings.hh>
 #include <string>
 #include <unordered_map>
+#include <vector>
 
+#include "Allocator.hh"
 #include "Dictionary.hh"
 #include "Strings.hh"
 #include "Instance.hh"
@@ -79,7 +82,7 @@ static size_t num_bytes_objects = 0;
 
 static void tracked_bytes_delete(void* o) {
   num_bytes_objects--;
-  free(o);
+  nemesys_free(o);
 }
 
 BytesObject* tracked_bytes_new(const char* data, size_t count) {
@@ -95,12 +98,13 @@ BytesObject* tracked_bytes_new(const char* text) {
 
 
 void run_basic_test() {
-  printf("-- basic\n");
+  printf("-- basic (trie)\n");
 
   DictionaryObject* d = dictionary_new(
       reinterpret_cast<size_t (*)(const void*)>(bytes_length),
-      reinterpret_cast<uint8_t (*)(const void*, size_t)>(bytes_at),
-      DictionaryFlag::KeysAreObjects | DictionaryFlag::ValuesAreObjects);
+      reinterpret_cast<uint8_t (*)(const void*, size_t)>(bytes_at), NULL, NULL,
+      DictionaryFlag::KeysAreObjects | DictionaryFlag::ValuesAreObjects |
+        DictionaryFlag::KeysAreOrdered);
 
   expect_eq(0, num_bytes_objects);
   expect_eq(0, dictionary_size(d));
@@ -214,12 +218,13 @@ void run_basic_test() {
 }
 
 void run_reorganization_test() {
-  printf("-- reorganization\n");
+  printf("-- reorganization (trie)\n");
 
   DictionaryObject* d = dictionary_new(
       reinterpret_cast<size_t (*)(const void*)>(bytes_length),
-      reinterpret_cast<uint8_t (*)(const void*, size_t)>(bytes_at),
-      DictionaryFlag::KeysAreObjects | DictionaryFlag::ValuesAreObjects);
+      reinterpret_cast<uint8_t (*)(const void*, size_t)>(bytes_at), NULL, NULL,
+      DictionaryFlag::KeysAreObjects | DictionaryFlag::ValuesAreObjects |
+        DictionaryFlag::KeysAreOrdered);
 
   expect_eq(0, dictionary_size(d));
   expect_eq(0, num_bytes_objects);
@@ -423,6 +428,16 @@ void run_reorganization_test() {
       "        66:V)))))");
   expect_eq(3, abcef->basic.refcount);
 
+  // tries are iterated in key order
+  vector<BytesObject*> expected_order({blank, abcd, abcde, abcdf, abce, abcef});
+  DictionaryObject::SlotContents item;
+  for (BytesObject* expected_key : expected_order) {
+    expect_eq(true, dictionary_next_item(d, &item));
+    expect_eq(expected_key, item.key);
+  }
+  expect_eq(false, dictionary_next_item(d, &item));
+  expect_eq(false, dictionary_next_item(d, &item));
+
   // <> null
   expect_eq(8, num_bytes_objects);
   dictionary_clear(d);
@@ -445,10 +460,152 @@ void run_reorganization_test() {
 }
 
 
+void run_hash_table_test() {
+  printf("-- hash table\n");
+
+  DictionaryObject* d = dictionary_new(NULL, NULL,
+      reinterpret_cast<uint64_t (*)(const void*)>(bytes_hash),
+      reinterpret_cast<bool (*)(const void*, const void*)>(bytes_equal),
+      DictionaryFlag::KeysAreObjects | DictionaryFlag::ValuesAreObjects);
+
+  expect_eq(0, dictionary_size(d));
+  expect_eq(0, dictionary_node_size(d));
+  expect_eq(0, num_bytes_objects);
+
+  // insert enough keys to make the table grow several times. the values are
+  // the keys themselves, so each object gets 2 references from the dict
+  unordered_map<BytesObject*, BytesObject*> expected_state;
+  vector<BytesObject*> keys;
+  for (size_t x = 0; x < 1000; x++) {
+    string s = string_printf("key%zu", x);
+    BytesObject* k = tracked_bytes_new(s.data(), s.size());
+    dictionary_insert(d, k, k);
+    expected_state.emplace(k, k);
+    keys.emplace_back(k);
+  }
+  verify_state(expected_state, d, 2048);
+  for (BytesObject* k : keys) {
+    expect_eq(3, k->basic.refcount);
+  }
+
+  // lookups with equal keys that are different objects should work
+  BytesObject* k500 = tracked_bytes_new("key500");
+  expect_eq(keys[500], dictionary_at(d, k500));
+  BytesObject* missing = tracked_bytes_new("key1000");
+  expect_key_missing(d, missing);
+  delete_reference(missing);
+
+  // replacing a value releases the old key and value
+  BytesObject* v = tracked_bytes_new("value");
+  dictionary_insert(d, k500, v);
+  expect_eq(1, keys[500]->basic.refcount);
+  expect_eq(2, k500->basic.refcount);
+  expect_eq(2, v->basic.refcount);
+  expect_eq(v, dictionary_at(d, keys[500]));
+  expected_state.erase(keys[500]);
+  expected_state.emplace(k500, v);
+  verify_state(expected_state, d, 2048);
+
+  // erase every other key, then insert and erase more keys than the table's
+  // capacity; the deleted slots should be reused or cleaned up without the
+  // table growing
+  for (size_t x = 0; x < keys.size(); x += 2) {
+    BytesObject* k = (x == 500) ? k500 : keys[x];
+    expect_eq(true, dictionary_erase(d, keys[x]));
+    expect_eq(false, dictionary_erase(d, keys[x]));
+    expected_state.erase(k);
+  }
+  verify_state(expected_state, d, 2048);
+  for (size_t x = 0; x < 5000; x++) {
+    string s = string_printf("temp%zu", x);
+    BytesObject* k = tracked_bytes_new(s.data(), s.size());
+    dictionary_insert(d, k, k);
+    expect_eq(true, dictionary_erase(d, k));
+    delete_reference(k);
+  }
+  verify_state(expected_state, d, 2048);
+
+  // the dict's references should all be released when it's cleared
+  dictionary_clear(d);
+  expected_state.clear();
+  verify_state(expected_state, d, 0, "()");
+  for (BytesObject* k : keys) {
+    expect_eq(1, k->basic.refcount);
+    delete_reference(k);
+  }
+  expect_eq(1, k500->basic.refcount);
+  expect_eq(1, v->basic.refcount);
+  delete_reference(k500);
+  delete_reference(v);
+  expect_eq(0, num_bytes_objects);
+
+  delete_reference(d);
+}
+
+void run_int_and_float_key_test() {
+  printf("-- int and float keys\n");
+
+  // keys that differ only in their high bits should all be distinct
+  DictionaryObject* d = dictionary_new(NULL, NULL, NULL, NULL, 0);
+  vector<int64_t> keys;
+  for (int64_t x = -500; x < 500; x++) {
+    keys.emplace_back(x);
+    keys.emplace_back(static_cast<int64_t>(static_cast<uint64_t>(x) << 32));
+    keys.emplace_back(static_cast<int64_t>(static_cast<uint64_t>(x) << 48));
+  }
+  keys.emplace_back(INT64_MIN);
+  keys.emplace_back(INT64_MAX);
+  for (int64_t k : keys) {
+    dictionary_insert(d, reinterpret_cast<void*>(k), reinterpret_cast<void*>(~k));
+  }
+  expect_eq(keys.size() - 2, dictionary_size(d)); // 0 appears three times
+  for (int64_t k : keys) {
+    expect_eq(~k, reinterpret_cast<int64_t>(
+        dictionary_at(d, reinterpret_cast<void*>(k))));
+  }
+  expect_key_missing(d, reinterpret_cast<void*>(1000));
+  delete_reference(d);
+
+  // float keys are compared as floats, so 0.0 and -0.0 are the same key
+  d = dictionary_new(NULL, NULL, dictionary_float_key_hash,
+      dictionary_float_key_equal, 0);
+  auto float_key = +[](double v) -> void* {
+    void* k;
+    memcpy(&k, &v, sizeof(k));
+    return k;
+  };
+  for (int64_t x = -500; x < 500; x++) {
+    dictionary_insert(d, float_key(x * 0.25), reinterpret_cast<void*>(x));
+  }
+  expect_eq(1000, dictionary_size(d));
+  for (int64_t x = -500; x < 500; x++) {
+    expect_eq(x, reinterpret_cast<int64_t>(dictionary_at(d, float_key(x * 0.25))));
+  }
+  expect_eq(0, reinterpret_cast<int64_t>(dictionary_at(d, float_key(-0.0))));
+  dictionary_insert(d, float_key(-0.0), reinterpret_cast<void*>(7));
+  expect_eq(1000, dictionary_size(d));
+  expect_eq(7, reinterpret_cast<int64_t>(dictionary_at(d, float_key(0.0))));
+  expect_key_missing(d, float_key(0.1));
+
+  // NaN isn't equal to itself, but a NaN key is found by the same bits (as if
+  // it were the same object); NaNs with different bits are different keys
+  void* nan_key = reinterpret_cast<void*>(0x7FF8000000000000);
+  void* other_nan_key = reinterpret_cast<void*>(0x7FF8000000000001);
+  dictionary_insert(d, nan_key, reinterpret_cast<void*>(8));
+  dictionary_insert(d, nan_key, reinterpret_cast<void*>(9));
+  expect_eq(1001, dictionary_size(d));
+  expect_eq(9, reinterpret_cast<int64_t>(dictionary_at(d, nan_key)));
+  expect_key_missing(d, other_nan_key);
+  delete_reference(d);
+}
+
+
 int main(int argc, char* argv[]) {
   global.reset(new GlobalContext({}));
   run_basic_test();
   run_reorganization_test();
+  run_hash_table_test();
+  run_int_and_float_key_test();
   printf("all tests passed\n");
   return 0;
 }
@@ -314,8 +314,10 @@ void unicode_typecheck_format(const wstring& format, const vector<Value>& types)
 
 
 
+// if unicode_args is true, output is the Latin-1 data for a Unicode object,
+// and the arguments for %s are Unicode objects with 1-byte characters
 void execute_format_spec(string& output, struct FormatSpecifier spec,
-    const TupleObject* args, size_t& input_index) {
+    const TupleObject* args, size_t& input_index, bool unicode_args = false) {
   if (spec.format_code == '%') {
     output += '%';
     return;
@@ -335,9 +337,14 @@ void execute_format_spec(string& output, struct FormatSpecifier spec,
   input_index++;
 
   if (spec.format_code == 's') {
-    const BytesObject* s = reinterpret_cast<const BytesObject*>(x);
     // TODO: implement width and precision here
-    output.append(s->data, s->count);
+    if (unicode_args) {
+      const UnicodeObject* s = reinterpret_cast<const UnicodeObject*>(x);
+      output.append(reinterpret_cast<const char*>(s->data), s->count);
+    } else {
+      const BytesObject* s = reinterpret_cast<const BytesObject*>(x);
+      output.append(s->data, s->count);
+    }
 
   } else if ((spec.format_code == 'd') || (spec.format_code == 'i') ||
       (spec.format_code == 'u') || (spec.format_code == 'o') ||
@@ -355,9 +362,10 @@ void execute_format_spec(string& output, struct FormatSpecifier spec,
   }
 }
 
-// TODO: deduplicate this code with the above function
+// TODO: deduplicate this code with the above function. the arguments for %s
+// are always Unicode objects here
 void execute_format_spec(wstring& output, struct FormatSpecifier spec,
-    const TupleObject* args, size_t& input_index) {
+    const TupleObject* args, size_t& input_index, bool unicode_args = true) {
   if (spec.format_code == '%') {
     output += L'%';
     return;
@@ -379,7 +387,7 @@ void execute_format_spec(wstring& output, struct FormatSpecifier spec,
   if (spec.format_code == 's') {
     const UnicodeObject* s = reinterpret_cast<const UnicodeObject*>(x);
     // TODO: implement width and precision here
-    output.append(s->data, s->count);
+    output += unicode_to_cxx_wstring(s);
 
   } else if ((spec.format_code == 'd') || (spec.format_code == 'i') ||
       (spec.format_code == 'u') || (spec.format_code == 'o') ||
@@ -415,32 +423,89 @@ void execute_format_spec(wstring& output, struct FormatSpecifier spec,
   }
 }
 
-// TODO: this is a stupid template; make it require fewer arguments
-template <typename ObjectType, typename StringType,
-    ObjectType* (*string_new)(const StringType&)>
-ObjectType* string_format(ObjectType* format, TupleObject* args,
-    ExceptionBlock* exc_block, bool delete_tuple_reference = false) {
-  ObjectType* ret = NULL;
-  try {
-    auto specs = extract_formats(format->data, format->count);
-    size_t spec_index = 0;
-    size_t input_index = 0;
-    size_t format_index = 0;
-    StringType output;
-
-    while (format_index < format->count) {
-      if (format->data[format_index] == '%') {
-        auto& spec = specs[spec_index];
-        execute_format_spec(output, spec, args, input_index);
-        format_index += spec.length;
-        spec_index++;
-      } else {
-        output += format->data[format_index];
-        format_index++;
+template <typename CharType, typename StringType>
+static void format_chars(StringType& output, const CharType* format,
+    size_t count, const vector<FormatSpecifier>& specs,
+    const TupleObject* args, bool unicode_args) {
+  size_t spec_index = 0;
+  size_t input_index = 0;
+  size_t format_index = 0;
+  while (format_index < count) {
+    if (format[format_index] == '%') {
+      auto& spec = specs[spec_index];
+      execute_format_spec(output, spec, args, input_index, unicode_args);
+      format_index += spec.length;
+      spec_index++;
+    } else {
+      output += format[format_index];
+      format_index++;
+    }
+  }
+}
+
+// returns true if the result of a format with a Latin-1 format string can be
+// built as Latin-1 too; that is, if all the %s arguments have 1-byte
+// characters and all the %c arguments are ASCII (the narrow printf functions
+// would encode other characters as multibyte sequences)
+static bool format_args_are_latin1(const vector<FormatSpecifier>& specs,
+    const TupleObject* args) {
+  size_t input_index = 0;
+  for (const auto& spec : specs) {
+    if (spec.format_code == '%') {
+      continue;
+    }
+    input_index += spec.variable_width + spec.variable_precision;
+    void* arg = tuple_get_item(args, input_index);
+    if (spec.format_code == 's') {
+      if (reinterpret_cast<const UnicodeObject*>(arg)->char_size != 1) {
+        return false;
+      }
+    } else if (spec.format_code == 'c') {
+      if (reinterpret_cast<uint64_t>(arg) >= 0x80) {
+        return false;
       }
     }
+    input_index++;
+  }
+  return true;
+}
+
+static BytesObject* bytes_format_data(const BytesObject* format,
+    const TupleObject* args) {
+  auto specs = extract_formats(format->data, format->count);
+  string output;
+  format_chars(output, format->data, format->count, specs, args, false);
+  return bytes_from_cxx_string(output);
+}
 
-    ret = string_new(output);
+static UnicodeObject* unicode_format_data(const UnicodeObject* format,
+    const TupleObject* args) {
+  // most format strings and arguments are Latin-1 (usually ASCII), so avoid
+  // converting everything to wchar_t and back in that case
+  if (format->char_size == 1) {
+    auto specs = extract_formats(format->data, format->count);
+    if (format_args_are_latin1(specs, args)) {
+      string output;
+      format_chars(output, format->data, format->count, specs, args, true);
+      return unicode_new_latin1(output.data(), output.size());
+    }
+  }
+
+  wstring format_str = unicode_to_cxx_wstring(format);
+  auto specs = extract_formats(format_str.data(), format_str.size());
+  wstring output;
+  format_chars(output, format_str.data(), format_str.size(), specs, args, true);
+  return unicode_from_cxx_wstring(output);
+}
+
+template <typename ObjectType>
+static ObjectType* string_format(
+    ObjectType* (*format_data)(const ObjectType*, const TupleObject*),
+    ObjectType* format, TupleObject* args, ExceptionBlock* exc_block,
+    bool delete_tuple_reference = false) {
+  ObjectType* ret = NULL;
+  try {
+    ret = format_data(format, args);
 
   } catch (const exception& e) {
     if (delete_tuple_reference) {
@@ -458,28 +523,24 @@ ObjectType* string_format(ObjectType* format, TupleObject* args,
 
 BytesObject* bytes_format(BytesObject* format, TupleObject* args,
     ExceptionBlock* exc_block) {
-  return string_format<BytesObject, string, bytes_from_cxx_string>(
-      format, args, exc_block);
+  return string_format(bytes_format_data, format, args, exc_block);
 }
 
 UnicodeObject* unicode_format(UnicodeObject* format, TupleObject* args,
     ExceptionBlock* exc_block) {
-  return string_format<UnicodeObject, wstring, unicode_from_cxx_wstring>(
-      format, args, exc_block);
+  return string_format(unicode_format_data, format, args, exc_block);
 }
 
 BytesObject* bytes_format_one(BytesObject* format, void* arg, bool is_object,
     ExceptionBlock* exc_block) {
   TupleObject* t = tuple_new(1, exc_block);
   tuple_set_item(t, 0, arg, is_object, exc_block);
-  return string_format<BytesObject, string, bytes_from_cxx_string>(
-      format, t, exc_block, true);
+  return string_format(bytes_format_data, format, t, exc_block, true);
 }
 
 UnicodeObject* unicode_format_one(UnicodeObject* format, void* arg, bool is_object,
     ExceptionBlock* exc_block) {
   TupleObject* t = tuple_new(1, exc_block);
   tuple_set_item(t, 0, arg, is_object, exc_block);
-  return string_format<UnicodeObject, wstring, unicode_from_cxx_wstring>(
-      format, t, exc_block, true);
+  return string_format(unicode_format_data, format, t, exc_block, true);
 }
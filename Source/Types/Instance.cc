@@ -6,6 +6,8 @@
 #include <string>
 #include <stdexcept>
 
+#include "Allocator.hh"
+
 using namespace std;
 
 
@@ -36,17 +38,21 @@ void InstanceObject::set_attribute_object(size_t index, void* value) {
 
 
 
+void stack_instance_destructor(void* o) { }
+
+
+
 // create an instance with no attributes
 
 InstanceObject* create_instance(int64_t class_id, size_t attribute_count) {
-  InstanceObject* i = reinterpret_cast<InstanceObject*>(malloc(
+  InstanceObject* i = reinterpret_cast<InstanceObject*>(nemesys_malloc(
       sizeof(InstanceObject) + attribute_count * sizeof(int64_t)));
   if (!i) {
     throw bad_alloc();
   }
 
   i->basic.refcount = 1;
-  i->basic.destructor = &free;
+  i->basic.destructor = &nemesys_free;
   i->class_id = class_id;
   return i;
 }
@@ -85,7 +91,7 @@ InstanceObject* create_single_attr_instance(int64_t class_id, void* attribute_va
     if (b) {
       b->destructor(b);
     }
-    free(i);
+    nemesys_free(i);
   };
 
   *reinterpret_cast<void**>(i + 1) = attribute_value;
@@ -23,6 +23,12 @@ struct InstanceObject {
   void set_attribute_object(size_t index, void* value);
 };
 
+// destructor for instances that live in a compiled function's stack frame
+// instead of on the heap. these instances have no __del__ and no attributes
+// with refcounts, and their memory goes away when the function returns, so
+// there's nothing to do
+void stack_instance_destructor(void* o);
+
 // shortcuts for common instance objects
 
 // create an instance with no attributes
@@ -7,6 +7,7 @@
 #include <phosg/Strings.hh>
 
 #include "../Compiler/BuiltinFunctions.hh"
+#include "Allocator.hh"
 
 using namespace std;
 
@@ -16,7 +17,7 @@ extern shared_ptr<GlobalContext> global;
 
 ListObject* list_new(uint64_t count, bool items_are_objects,
     ExceptionBlock* exc_block) {
-  ListObject* l = reinterpret_cast<ListObject*>(malloc(sizeof(ListObject)));
+  ListObject* l = reinterpret_cast<ListObject*>(nemesys_malloc(sizeof(ListObject)));
   if (!l) {
     raise_python_exception(exc_block, &MemoryError_instance);
     throw bad_alloc();
@@ -26,6 +27,7 @@ ListObject* list_new(uint64_t count, bool items_are_objects,
   l->count = count;
   l->capacity = count;
   l->items_are_objects = items_are_objects;
+  allocator_count_object_allocation(AllocatorObjectType::List);
   if (l->count) {
     l->items = reinterpret_cast<void**>(malloc(l->count * sizeof(void*)));
   } else {
@@ -43,7 +45,8 @@ void list_delete(ListObject* l) {
     }
     free(l->items);
   }
-  free(l);
+  allocator_count_object_free(AllocatorObjectType::List);
+  nemesys_free(l);
 }
 
 
@@ -15,12 +15,27 @@ BasicObject::BasicObject(void (*destructor)(void*)) : refcount(1),
     destructor(destructor) { }
 
 
+bool refcounts_are_atomic() {
+  return debug_flags & (DebugFlag::AtomicRefcounting |
+      DebugFlag::BackgroundCompilation);
+}
+
+// when only one thread can touch objects, the read-modify-write doesn't need to
+// be atomic; relaxed loads and stores compile to plain movs and incs/decs
+static inline uint64_t change_refcount(BasicObject* obj, int64_t delta) {
+  if (refcounts_are_atomic()) {
+    return obj->refcount.fetch_add(delta) + delta;
+  }
+  uint64_t count = obj->refcount.load(memory_order_relaxed) + delta;
+  obj->refcount.store(count, memory_order_relaxed);
+  return count;
+}
+
 void* add_reference(void* o) {
   BasicObject* obj = reinterpret_cast<BasicObject*>(o);
+  uint64_t count = change_refcount(obj, 1);
   if (debug_flags & DebugFlag::ShowRefcountChanges) {
-    fprintf(stderr, "[refcount] %p++ == %" PRId64 "\n", o, ++obj->refcount);
-  } else {
-    obj->refcount++;
+    fprintf(stderr, "[refcount] %p++ == %" PRId64 "\n", o, count);
   }
   return o;
 }
@@ -31,7 +46,7 @@ void delete_reference(void* o, ExceptionBlock* exc_block) {
     return;
   }
 
-  int64_t count = --obj->refcount;
+  int64_t count = change_refcount(obj, -1);
   if (debug_flags & DebugFlag::ShowRefcountChanges) {
     fprintf(stderr, "[refcount] %p-- == %" PRId64 "%s\n", o, count,
         (count == 0) ? " (destroying)" : "");
@@ -42,3 +57,21 @@ void delete_reference(void* o, ExceptionBlock* exc_block) {
     obj->destructor(o);
   }
 }
+
+void make_immortal(void* o) {
+  reinterpret_cast<BasicObject*>(o)->refcount = immortal_refcount;
+}
+
+bool is_immortal(const void* o) {
+  // the refcount can drift below immortal_refcount (e.g. if a reference to the
+  // object is deleted twice), but it can't get anywhere near zero
+  return reinterpret_cast<const BasicObject*>(o)->refcount >= (immortal_refcount >> 1);
+}
+
+void destroy_immortal(void* o) {
+  BasicObject* obj = reinterpret_cast<BasicObject*>(o);
+  if (debug_flags & DebugFlag::ShowRefcountChanges) {
+    fprintf(stderr, "[refcount] %p destroying immortal object\n", o);
+  }
+  obj->destructor(o);
+}
@@ -14,7 +14,22 @@ struct BasicObject {
   BasicObject(void (*destructor)(void*));
 };
 
+// refcount changes only need to be atomic if another thread can touch objects.
+// this is the case only if background compilation is enabled, or if the
+// AtomicRefcounting flag forces it; otherwise both add_reference/
+// delete_reference and compiled code change refcounts without the lock prefix
+bool refcounts_are_atomic();
+
 // for convenience, add_reference returns o (so callers don't have to push it
 // onto the stack to keep it)
 void* add_reference(void* o);
 void delete_reference(void* o, ExceptionBlock* exc_block = NULL);
+
+// immortal objects start with a refcount so large that unbalanced
+// delete_references can't bring it to zero, so they're never destroyed while
+// anything (including generated code) still uses them. their owner has to
+// destroy them explicitly with destroy_immortal
+static const uint64_t immortal_refcount = 0x4000000000000000;
+void make_immortal(void* o);
+bool is_immortal(const void* o);
+void destroy_immortal(void* o);
@@ -4,11 +4,14 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <algorithm>
+
 #include <phosg/Strings.hh>
 
 #include "../Debug.hh"
 #include "../Compiler/Exception.hh"
 #include "../Compiler/BuiltinFunctions.hh"
+#include "Allocator.hh"
 
 using namespace std;
 
@@ -16,7 +19,33 @@ using namespace std;
 
 extern shared_ptr<GlobalContext> global;
 
-BytesObject::BytesObject() : basic(free), count(0) { }
+// hashes 8 bytes at a time, then mixes the result with the finalizer from
+// MurmurHash3 so all bits of the result depend on all bits of the data
+static uint64_t hash_data(const void* data, size_t size) {
+  static const uint64_t multiplier = 0x9E3779B97F4A7C15ULL;
+  const uint8_t* p = reinterpret_cast<const uint8_t*>(data);
+  uint64_t h = size * multiplier;
+  for (; size >= 8; p += 8, size -= 8) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    h = ((h ^ v) * multiplier);
+    h ^= h >> 29;
+  }
+  if (size) {
+    uint64_t v = 0;
+    memcpy(&v, p, size);
+    h = ((h ^ v) * multiplier);
+  }
+  h ^= h >> 33;
+  h *= 0xFF51AFD7ED558CCDULL;
+  h ^= h >> 33;
+  h *= 0xC4CEB9FE1A85EC53ULL;
+  h ^= h >> 33;
+  // 0 means the hash hasn't been computed yet (see Strings.hh)
+  return h ? h : 1;
+}
+
+BytesObject::BytesObject() : basic(free), count(0), hash(0), flags(0) { }
 
 BytesObject* bytes_new(const char* data, ssize_t count,
     ExceptionBlock* exc_block) {
@@ -25,14 +54,17 @@ BytesObject* bytes_new(const char* data, ssize_t count,
   }
 
   size_t size = sizeof(BytesObject) + sizeof(char) * (count + 1);
-  BytesObject* s = reinterpret_cast<BytesObject*>(malloc(size));
+  BytesObject* s = reinterpret_cast<BytesObject*>(nemesys_malloc(size));
   if (!s) {
     raise_python_exception(exc_block, &MemoryError_instance);
     throw bad_alloc();
   }
   s->basic.refcount = 1;
-  s->basic.destructor = free;
+  s->basic.destructor = bytes_delete;
   s->count = count;
+  s->hash = 0;
+  s->flags = 0;
+  allocator_count_object_allocation(AllocatorObjectType::Bytes);
   if (data) {
     memcpy(s->data, data, sizeof(char) * count);
     s->data[s->count] = 0;
@@ -47,6 +79,11 @@ BytesObject* bytes_new(const char* data, ssize_t count,
   return s;
 }
 
+void bytes_delete(void* s) {
+  allocator_count_object_free(AllocatorObjectType::Bytes);
+  nemesys_free(s);
+}
+
 BytesObject* bytes_from_cxx_string(const string& data) {
   return bytes_new(data.data(), data.size());
 }
@@ -76,12 +113,31 @@ size_t bytes_length(const BytesObject* s) {
 }
 
 bool bytes_equal(const BytesObject* a, const BytesObject* b) {
-  if (a->count != b->count) {
+  if (a == b) {
+    return true;
+  }
+  if ((a->flags & b->flags & StringFlag::Interned) || (a->count != b->count)) {
+    return false;
+  }
+  if (a->hash && b->hash && (a->hash != b->hash)) {
     return false;
   }
   return !memcmp(a->data, b->data, a->count * sizeof(a->data[0]));
 }
 
+uint64_t bytes_hash(const BytesObject* s) {
+  if (!s->hash) {
+    s->hash = hash_data(s->data, s->count * sizeof(s->data[0]));
+  }
+  return s->hash;
+}
+
+void bytes_intern(BytesObject* s) {
+  bytes_hash(s);
+  s->flags |= StringFlag::Interned;
+  make_immortal(s);
+}
+
 int64_t bytes_compare(const BytesObject* a, const BytesObject* b) {
   for (size_t x = 0; (x < a->count) && (x < b->count); x++) {
     if (a->data[x] < b->data[x]) {
@@ -114,48 +170,156 @@ string bytes_to_cxx_string(const BytesObject* s) {
 
 
 
-UnicodeObject::UnicodeObject() : basic(free), count(0) { }
+UnicodeObject::UnicodeObject() : basic(free), count(0), hash(0), flags(0),
+    char_size(1) { }
 
-UnicodeObject* unicode_new(const wchar_t* data, ssize_t count,
-    ExceptionBlock* exc_block) {
-  if (count < 0) {
-    count = wcslen(data);
+// returns the largest character that can appear in an object with the given
+// object's character size and flags. when an object is built from other
+// objects' characters, this gives the same character size and flags as
+// scanning the characters would
+static wchar_t max_char_for_object(const UnicodeObject* s) {
+  if (s->flags & StringFlag::ASCII) {
+    return 0x7F;
+  }
+  if (s->char_size == 1) {
+    return 0xFF;
   }
-  size_t size = sizeof(UnicodeObject) + sizeof(wchar_t) * (count + 1);
-  UnicodeObject* s = reinterpret_cast<UnicodeObject*>(malloc(size));
+  if (s->char_size == 2) {
+    return 0xFFFF;
+  }
+  return 0x10FFFF;
+}
+
+template <typename DestType>
+static void convert_chars(DestType* dest, const void* src,
+    size_t src_char_size, size_t count) {
+  if (src_char_size == 1) {
+    const uint8_t* src_chars = reinterpret_cast<const uint8_t*>(src);
+    for (size_t x = 0; x < count; x++) {
+      dest[x] = src_chars[x];
+    }
+  } else if (src_char_size == 2) {
+    const uint16_t* src_chars = reinterpret_cast<const uint16_t*>(src);
+    for (size_t x = 0; x < count; x++) {
+      dest[x] = src_chars[x];
+    }
+  } else {
+    const uint32_t* src_chars = reinterpret_cast<const uint32_t*>(src);
+    for (size_t x = 0; x < count; x++) {
+      dest[x] = src_chars[x];
+    }
+  }
+}
+
+// copies characters into s's data at the given character offset. s's
+// character size must be large enough for all of the characters
+static void copy_chars(UnicodeObject* s, size_t offset, const void* src,
+    size_t src_char_size, size_t count) {
+  uint8_t* dest = s->data + offset * s->char_size;
+  if (s->char_size == src_char_size) {
+    memcpy(dest, src, count * src_char_size);
+  } else if (s->char_size == 1) {
+    convert_chars(dest, src, src_char_size, count);
+  } else if (s->char_size == 2) {
+    convert_chars(reinterpret_cast<uint16_t*>(dest), src, src_char_size, count);
+  } else {
+    convert_chars(reinterpret_cast<uint32_t*>(dest), src, src_char_size, count);
+  }
+}
+
+static UnicodeObject* allocate_unicode(uint64_t count, wchar_t max_char,
+    ExceptionBlock* exc_block) {
+  uint32_t max_char_value = static_cast<uint32_t>(max_char);
+  size_t char_size = (max_char_value < 0x100) ? 1 :
+      ((max_char_value < 0x10000) ? 2 : 4);
+
+  size_t size = sizeof(UnicodeObject) + char_size * (count + 1);
+  UnicodeObject* s = reinterpret_cast<UnicodeObject*>(nemesys_malloc(size));
   if (!s) {
     raise_python_exception(exc_block, &MemoryError_instance);
     throw bad_alloc();
   }
   s->basic.refcount = 1;
-  s->basic.destructor = free;
+  s->basic.destructor = unicode_delete;
   s->count = count;
-  if (data) {
-    memcpy(s->data, data, sizeof(wchar_t) * count);
-    s->data[s->count] = 0;
-    if (debug_flags & DebugFlag::ShowRefcountChanges) {
-      fprintf(stderr, "[refcount:create] created Unicode object %p: %ls\n",
-          s, data);
+  s->hash = 0;
+  s->flags = (max_char_value < 0x80) ? StringFlag::ASCII : 0;
+  s->char_size = char_size;
+  memset(&s->data[count * char_size], 0, char_size);
+  allocator_count_object_allocation(AllocatorObjectType::Unicode);
+  return s;
+}
+
+UnicodeObject* unicode_new(const wchar_t* data, ssize_t count,
+    ExceptionBlock* exc_block) {
+  if (count < 0) {
+    count = wcslen(data);
+  }
+
+  uint32_t max_char = 0;
+  for (ssize_t x = 0; x < count; x++) {
+    if (static_cast<uint32_t>(data[x]) > max_char) {
+      max_char = data[x];
+    }
+  }
+
+  UnicodeObject* s = allocate_unicode(count, max_char, exc_block);
+  copy_chars(s, 0, data, sizeof(wchar_t), count);
+  if (debug_flags & DebugFlag::ShowRefcountChanges) {
+    fprintf(stderr, "[refcount:create] created Unicode object %p: %ls\n",
+        s, data);
+  }
+  return s;
+}
+
+UnicodeObject* unicode_new_latin1(const char* data, ssize_t count,
+    ExceptionBlock* exc_block) {
+  if (count < 0) {
+    count = strlen(data);
+  }
+
+  wchar_t max_char = 0x7F;
+  for (ssize_t x = 0; x < count; x++) {
+    if (data[x] & 0x80) {
+      max_char = 0xFF;
+      break;
     }
-  } else if (debug_flags & DebugFlag::ShowRefcountChanges) {
-    fprintf(stderr, "[refcount:create] created Unicode object %p with %zd chars\n",
-        s, count);
   }
 
+  UnicodeObject* s = allocate_unicode(count, max_char, exc_block);
+  memcpy(s->data, data, count);
+  if (debug_flags & DebugFlag::ShowRefcountChanges) {
+    fprintf(stderr, "[refcount:create] created Unicode object %p: %.*s\n",
+        s, static_cast<int>(count), data);
+  }
   return s;
 }
 
+UnicodeObject* unicode_alloc(uint64_t count, wchar_t max_char,
+    ExceptionBlock* exc_block) {
+  UnicodeObject* s = allocate_unicode(count, max_char, exc_block);
+  if (debug_flags & DebugFlag::ShowRefcountChanges) {
+    fprintf(stderr, "[refcount:create] created Unicode object %p with %" PRIu64 " chars\n",
+        s, count);
+  }
+  return s;
+}
+
+void unicode_delete(void* s) {
+  allocator_count_object_free(AllocatorObjectType::Unicode);
+  nemesys_free(s);
+}
+
 UnicodeObject* unicode_from_cxx_wstring(const wstring& data) {
   return unicode_new(data.data(), data.size());
 }
 
 UnicodeObject* unicode_concat(const UnicodeObject* a, const UnicodeObject* b,
     ExceptionBlock* exc_block) {
-  uint64_t count = a->count + b->count;
-  UnicodeObject* s = unicode_new(NULL, count, exc_block);
-  memcpy(s->data, a->data, sizeof(wchar_t) * a->count);
-  memcpy(&s->data[a->count], b->data, sizeof(wchar_t) * b->count);
-  s->data[s->count] = 0;
+  wchar_t max_char = max(max_char_for_object(a), max_char_for_object(b));
+  UnicodeObject* s = unicode_alloc(a->count + b->count, max_char, exc_block);
+  copy_chars(s, 0, a->data, a->char_size, a->count);
+  copy_chars(s, a->count, b->data, b->char_size, b->count);
   return s;
 }
 
@@ -166,7 +330,7 @@ wchar_t unicode_at(const UnicodeObject* s, size_t which,
         "unicode index out of range");
     throw out_of_range("index out of range for unicode object");
   }
-  return s->data[which];
+  return s->char_at(which);
 }
 
 size_t unicode_length(const UnicodeObject* s) {
@@ -174,19 +338,50 @@ size_t unicode_length(const UnicodeObject* s) {
 }
 
 bool unicode_equal(const UnicodeObject* a, const UnicodeObject* b) {
-  if (a->count != b->count) {
+  if (a == b) {
+    return true;
+  }
+  if ((a->flags & b->flags & StringFlag::Interned) || (a->count != b->count) ||
+      (a->char_size != b->char_size)) {
     return false;
   }
-  return !memcmp(a->data, b->data, a->count * sizeof(a->data[0]));
+  if (a->hash && b->hash && (a->hash != b->hash)) {
+    return false;
+  }
+  return !memcmp(a->data, b->data, a->count * a->char_size);
+}
+
+uint64_t unicode_hash(const UnicodeObject* s) {
+  if (!s->hash) {
+    s->hash = hash_data(s->data, s->count * s->char_size);
+  }
+  return s->hash;
+}
+
+void unicode_intern(UnicodeObject* s) {
+  unicode_hash(s);
+  s->flags |= StringFlag::Interned;
+  make_immortal(s);
 }
 
 int64_t unicode_compare(const UnicodeObject* a, const UnicodeObject* b) {
-  for (size_t x = 0; (x < a->count) && (x < b->count); x++) {
-    if (a->data[x] < b->data[x]) {
-      return -1;
+  size_t min_count = min(a->count, b->count);
+  if ((a->char_size == 1) && (b->char_size == 1)) {
+    // Latin-1 bytes sort in the same order as their characters
+    int ret = memcmp(a->data, b->data, min_count);
+    if (ret) {
+      return (ret < 0) ? -1 : 1;
     }
-    if (a->data[x] > b->data[x]) {
-      return 1;
+  } else {
+    for (size_t x = 0; x < min_count; x++) {
+      uint32_t a_ch = a->char_at(x);
+      uint32_t b_ch = b->char_at(x);
+      if (a_ch < b_ch) {
+        return -1;
+      }
+      if (a_ch > b_ch) {
+        return 1;
+      }
     }
   }
   if (a->count == b->count) {
@@ -198,26 +393,81 @@ int64_t unicode_compare(const UnicodeObject* a, const UnicodeObject* b) {
   return 1;
 }
 
+// memmem can find matches that don't start on a character boundary, so this
+// skips those and searches again
+static bool contains_chars(const uint8_t* haystack, size_t haystack_count,
+    const void* needle, size_t needle_count, size_t char_size) {
+  const uint8_t* end = haystack + haystack_count * char_size;
+  size_t needle_size = needle_count * char_size;
+  for (const uint8_t* start = haystack; start + needle_size <= end;) {
+    const uint8_t* match = reinterpret_cast<const uint8_t*>(
+        memmem(start, end - start, needle, needle_size));
+    if (!match) {
+      return false;
+    }
+    if (((match - haystack) % char_size) == 0) {
+      return true;
+    }
+    start = match + 1;
+  }
+  return false;
+}
+
 bool unicode_contains(const UnicodeObject* haystack, const UnicodeObject* needle) {
   if (needle->count == 0) {
     return true;
   }
-  if (memmem(haystack->data, haystack->count * sizeof(wchar_t),
-      needle->data, needle->count * sizeof(wchar_t)) != NULL) {
-    return true;
-  } else {
+  // if the needle has a wider character size, it contains a character that
+  // can't be in the haystack
+  if ((needle->count > haystack->count) ||
+      (needle->char_size > haystack->char_size)) {
     return false;
   }
+  if (needle->char_size == haystack->char_size) {
+    return contains_chars(haystack->data, haystack->count, needle->data,
+        needle->count, needle->char_size);
+  }
+
+  // the needle is narrower than the haystack, so widen it first
+  string wide_needle(needle->count * haystack->char_size, '\0');
+  if (haystack->char_size == 2) {
+    convert_chars(reinterpret_cast<uint16_t*>(&wide_needle[0]), needle->data,
+        needle->char_size, needle->count);
+  } else {
+    convert_chars(reinterpret_cast<uint32_t*>(&wide_needle[0]), needle->data,
+        needle->char_size, needle->count);
+  }
+  return contains_chars(haystack->data, haystack->count, wide_needle.data(),
+      needle->count, haystack->char_size);
 }
 
 wstring unicode_to_cxx_wstring(const UnicodeObject* s) {
-  return wstring(s->data, s->count);
+  wstring ret(s->count, L'\0');
+  convert_chars(&ret[0], s->data, s->char_size, s->count);
+  return ret;
+}
+
+void unicode_write(FILE* stream, const UnicodeObject* s) {
+  if (s->flags & StringFlag::ASCII) {
+    fwrite(s->data, 1, s->count, stream);
+  } else {
+    wstring data = unicode_to_cxx_wstring(s);
+    fprintf(stream, "%ls", data.c_str());
+  }
 }
 
 
 
 BytesObject* unicode_encode_ascii(const UnicodeObject* s) {
-  return unicode_encode_ascii(s->data, s->count);
+  if (s->flags & StringFlag::ASCII) {
+    return bytes_new(reinterpret_cast<const char*>(s->data), s->count);
+  }
+  BytesObject* ret = bytes_new(NULL, s->count);
+  for (size_t x = 0; x < s->count; x++) {
+    ret->data[x] = s->char_at(x);
+  }
+  ret->data[s->count] = 0;
+  return ret;
 }
 
 BytesObject* unicode_encode_ascii(const wchar_t* s, ssize_t count) {
@@ -237,13 +487,5 @@ UnicodeObject* bytes_decode_ascii(const BytesObject* s) {
 }
 
 UnicodeObject* bytes_decode_ascii(const char* s, ssize_t count) {
-  if (count < 0) {
-    count = strlen(s);
-  }
-  UnicodeObject* ret = unicode_new(NULL, count);
-  for (int64_t x = 0; x < count; x++) {
-    ret->data[x] = s[x];
-  }
-  ret->data[count] = 0;
-  return ret;
+  return unicode_new_latin1(s, count);
 }
@@ -1,5 +1,8 @@
 #pragma once
 
+#include <stdint.h>
+#include <stdio.h>
+
 #include <string>
 #include <unordered_map>
 
@@ -10,28 +13,76 @@
 // string and bytes objects are null-terminated for convenience (so we can use
 // C standard library functions on them). this means that the number of
 // allocated characters is actually (count + 1).
+//
+// the hash is computed the first time it's needed (0 means it hasn't been
+// computed yet), so an object's data must not be modified after it's been
+// hashed. interned objects are the shared constants owned by the
+// GlobalContext; there's only one interned object with any given contents, so
+// two different interned objects are never equal. interned objects are also
+// immortal (see Reference.hh), so the GlobalContext destroys them itself.
+
+enum StringFlag {
+  Interned = 0x01,
+  // unicode objects only: all characters are less than 0x80
+  ASCII    = 0x02,
+};
 
 struct BytesObject {
   BasicObject basic;
 
   uint64_t count;
+  mutable uint64_t hash;
+  uint64_t flags;
   char data[0];
 
   BytesObject();
 };
 
+// unicode objects store each character in 1 byte (Latin-1), 2 bytes (UCS-2) or
+// 4 bytes (UCS-4), whichever is the smallest that can hold all of the object's
+// characters. the character size is chosen when the object is created and
+// never changes, so equal objects always have the same character size and
+// their data can be compared directly.
 struct UnicodeObject {
   BasicObject basic;
 
   uint64_t count;
-  wchar_t data[0];
+  mutable uint64_t hash;
+  uint64_t flags;
+  uint64_t char_size;
+  uint8_t data[0];
 
   UnicodeObject();
+
+  inline wchar_t char_at(size_t index) const {
+    switch (this->char_size) {
+      case 1:
+        return this->data[index];
+      case 2:
+        return reinterpret_cast<const uint16_t*>(this->data)[index];
+      default:
+        return reinterpret_cast<const uint32_t*>(this->data)[index];
+    }
+  }
+
+  inline void set_char_at(size_t index, wchar_t ch) {
+    switch (this->char_size) {
+      case 1:
+        this->data[index] = ch;
+        break;
+      case 2:
+        reinterpret_cast<uint16_t*>(this->data)[index] = ch;
+        break;
+      default:
+        reinterpret_cast<uint32_t*>(this->data)[index] = ch;
+    }
+  }
 };
 
 
 BytesObject* bytes_new(const char* data, ssize_t count,
     ExceptionBlock* exc_block = NULL);
+void bytes_delete(void* s);
 BytesObject* bytes_from_cxx_string(const std::string& data);
 BytesObject* bytes_concat(const BytesObject* a, const BytesObject* b,
     ExceptionBlock* exc_block = NULL);
@@ -39,12 +90,22 @@ char bytes_at(const BytesObject* s, size_t which,
     ExceptionBlock* exc_block = NULL);
 size_t bytes_length(const BytesObject* s);
 bool bytes_equal(const BytesObject* a, const BytesObject* b);
+uint64_t bytes_hash(const BytesObject* s);
+void bytes_intern(BytesObject* s);
 int64_t bytes_compare(const BytesObject* a, const BytesObject* b);
 bool bytes_contains(const BytesObject* needle, const BytesObject* haystack);
 std::string bytes_to_cxx_string(const BytesObject* s);
 
 UnicodeObject* unicode_new(const wchar_t* data, ssize_t count,
     ExceptionBlock* exc_block = NULL);
+UnicodeObject* unicode_new_latin1(const char* data, ssize_t count,
+    ExceptionBlock* exc_block = NULL);
+// creates an object whose characters are uninitialized; the caller fills them
+// in with set_char_at. max_char must be the largest character that will be
+// written, so the object gets the right character size and flags
+UnicodeObject* unicode_alloc(uint64_t count, wchar_t max_char,
+    ExceptionBlock* exc_block = NULL);
+void unicode_delete(void* s);
 UnicodeObject* unicode_from_cxx_wstring(const std::wstring& data);
 UnicodeObject* unicode_concat(const UnicodeObject* a, const UnicodeObject* b,
     ExceptionBlock* exc_block = NULL);
@@ -52,9 +113,12 @@ wchar_t unicode_at(const UnicodeObject* s, size_t which,
     ExceptionBlock* exc_block = NULL);
 size_t unicode_length(const UnicodeObject* s);
 bool unicode_equal(const UnicodeObject* a, const UnicodeObject* b);
+uint64_t unicode_hash(const UnicodeObject* s);
+void unicode_intern(UnicodeObject* s);
 int64_t unicode_compare(const UnicodeObject* a, const UnicodeObject* b);
 bool unicode_contains(const UnicodeObject* needle, const UnicodeObject* haystack);
 std::wstring unicode_to_cxx_wstring(const UnicodeObject* s);
+void unicode_write(FILE* stream, const UnicodeObject* s);
 
 BytesObject* unicode_encode_ascii(const UnicodeObject* s);
 BytesObject* unicode_encode_ascii(const wchar_t* s, ssize_t size = -1);
@@ -0,0 +1,160 @@
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <phosg/UnitTest.hh>
+#include <string>
+
+#include "Allocator.hh"
+#include "Reference.hh"
+#include "Strings.hh"
+#include "../Compiler/Contexts.hh"
+
+using namespace std;
+
+shared_ptr<GlobalContext> global;
+
+
+static size_t num_bytes_objects = 0;
+
+static void tracked_bytes_delete(void* o) {
+  num_bytes_objects--;
+  nemesys_free(o);
+}
+
+BytesObject* tracked_bytes_new(const char* text) {
+  num_bytes_objects++;
+  BytesObject* b = bytes_new(text, strlen(text));
+  b->basic.destructor = tracked_bytes_delete;
+  return b;
+}
+
+
+void run_hash_test() {
+  printf("-- cached hashes\n");
+
+  BytesObject* a = bytes_new("hash me", 7);
+  BytesObject* b = bytes_new("hash me", 7);
+  BytesObject* c = bytes_new("hash us", 7);
+
+  // the hash isn't computed until it's needed, then it's kept in the object
+  expect_eq(0, a->hash);
+  uint64_t hash = bytes_hash(a);
+  expect_ne(0, hash);
+  expect_eq(hash, a->hash);
+  expect_eq(hash, bytes_hash(a));
+  expect_eq(0, b->hash);
+
+  // comparing objects doesn't compute their hashes
+  expect(bytes_equal(a, b));
+  expect(!bytes_equal(a, c));
+  expect_eq(0, b->hash);
+  expect_eq(0, c->hash);
+
+  // equal objects have equal hashes
+  expect_eq(hash, bytes_hash(b));
+  expect_ne(hash, bytes_hash(c));
+  expect(bytes_equal(a, b));
+  expect(!bytes_equal(a, c));
+
+  // if both hashes are known and differ, the data isn't compared. this can only
+  // be observed by breaking the rule that hashed objects don't change
+  b->hash++;
+  expect(!bytes_equal(a, b));
+
+  delete_reference(a);
+  delete_reference(b);
+  delete_reference(c);
+
+  UnicodeObject* u1 = unicode_new(L"h\u00E9llo", 5);
+  UnicodeObject* u2 = unicode_new(L"h\u00E9llo", 5);
+  UnicodeObject* u3 = unicode_new(L"h\u0101llo", 5);
+  expect_eq(0, u1->hash);
+  expect_eq(unicode_hash(u1), unicode_hash(u2));
+  expect_eq(u1->hash, u2->hash);
+  expect_ne(unicode_hash(u1), unicode_hash(u3));
+  expect(unicode_equal(u1, u2));
+  expect(!unicode_equal(u1, u3));
+  u2->hash++;
+  expect(!unicode_equal(u1, u2));
+  delete_reference(u1);
+  delete_reference(u2);
+  delete_reference(u3);
+}
+
+void run_intern_test() {
+  printf("-- interned objects\n");
+
+  BytesObject* a = tracked_bytes_new("constant");
+  BytesObject* b = tracked_bytes_new("constant");
+  BytesObject* c = tracked_bytes_new("constant");
+  expect(!(a->flags & StringFlag::Interned));
+
+  // interning computes the hash and makes the object immortal
+  bytes_intern(a);
+  expect(a->flags & StringFlag::Interned);
+  expect_eq(bytes_hash(c), a->hash);
+  expect(is_immortal(a));
+  expect(!is_immortal(c));
+
+  // an interned object is equal to itself and to uninterned copies, but two
+  // interned objects are never equal, even if their data is (this can only
+  // happen if they weren't created by get_or_create_constant)
+  expect(bytes_equal(a, a));
+  expect(bytes_equal(a, c));
+  expect(bytes_equal(c, a));
+  bytes_intern(b);
+  expect(!bytes_equal(a, b));
+
+  // deleting references to immortal objects never destroys them
+  for (size_t x = 0; x < 10; x++) {
+    delete_reference(a);
+  }
+  add_reference(a);
+  expect(is_immortal(a));
+  expect_eq(3, num_bytes_objects);
+
+  destroy_immortal(a);
+  destroy_immortal(b);
+  delete_reference(c);
+  expect_eq(0, num_bytes_objects);
+}
+
+void run_constant_test() {
+  printf("-- shared constants\n");
+
+  // each string constant has one shared, interned object
+  const BytesObject* b1 = global->get_or_create_constant(string("abc"));
+  const BytesObject* b2 = global->get_or_create_constant(string("abc"));
+  const BytesObject* b3 = global->get_or_create_constant(string("abd"));
+  expect_eq(b1, b2);
+  expect_ne(b1, b3);
+  expect(b1->flags & StringFlag::Interned);
+  expect_ne(0, b1->hash);
+  expect(is_immortal(b1));
+
+  // unshared constants are ordinary objects
+  const BytesObject* b4 = global->get_or_create_constant(string("abc"), false);
+  expect_ne(b1, b4);
+  expect(!(b4->flags & StringFlag::Interned));
+  expect_eq(1, b4->basic.refcount);
+  expect(bytes_equal(b1, b4));
+  delete_reference(const_cast<BytesObject*>(b4));
+
+  const UnicodeObject* u1 = global->get_or_create_constant(wstring(L"abc"));
+  const UnicodeObject* u2 = global->get_or_create_constant(wstring(L"abc"));
+  expect_eq(u1, u2);
+  expect(u1->flags & StringFlag::Interned);
+  expect(is_immortal(u1));
+}
+
+
+int main(int argc, char* argv[]) {
+  global.reset(new GlobalContext({}));
+  run_hash_test();
+  run_intern_test();
+  run_constant_test();
+  printf("all tests passed\n");
+  return 0;
+}
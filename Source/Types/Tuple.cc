@@ -7,6 +7,7 @@
 #include <phosg/Strings.hh>
 
 #include "../Compiler/BuiltinFunctions.hh"
+#include "Allocator.hh"
 
 using namespace std;
 
@@ -33,7 +34,7 @@ const uint8_t* TupleObject::has_refcount_map() const {
 
 
 TupleObject* tuple_new(uint64_t count, ExceptionBlock* exc_block) {
-  TupleObject* t = reinterpret_cast<TupleObject*>(malloc(
+  TupleObject* t = reinterpret_cast<TupleObject*>(nemesys_malloc(
       sizeof(TupleObject) + (count * sizeof(void*)) + ((count + 7) / 8)));
   if (!t) {
     raise_python_exception(exc_block, &MemoryError_instance);
@@ -42,6 +43,7 @@ TupleObject* tuple_new(uint64_t count, ExceptionBlock* exc_block) {
   t->basic.refcount = 1;
   t->basic.destructor = reinterpret_cast<void (*)(void*)>(tuple_delete);
   t->count = count;
+  allocator_count_object_allocation(AllocatorObjectType::Tuple);
 
   // clear the data and has_refcount map
   for (size_t x = 0; x < t->count; x++) {
@@ -59,7 +61,8 @@ void tuple_delete(TupleObject* t) {
       delete_reference(t->data[x]);
     }
   }
-  free(t);
+  allocator_count_object_free(AllocatorObjectType::Tuple);
+  nemesys_free(t);
 }
 
 
@@ -0,0 +1,30 @@
+import errno
+
+
+def error_name(code):
+  return errno.errorcode[code]
+
+print(error_name(errno.ENOENT))
+print(error_name(errno.EACCES))
+print(errno.errorcode[errno.EBADF])
+
+try:
+  print(error_name(-1))
+except KeyError:
+  print('no error named -1')
+
+
+# the lookups here are found by the inline probe, so they don't go through the
+# call that would save and restore locals held in registers
+def sum_codes(first, last):
+  total = 0
+  count = 0
+  code = first
+  while code < last:
+    name = errno.errorcode[errno.ENOENT]
+    total = total + code
+    count = count + len(name)
+    code = code + 1
+  return total * 1000 + count
+
+print(sum_codes(3, 40))
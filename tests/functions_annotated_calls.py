@@ -0,0 +1,33 @@
+# calls to functions whose return types are known before they're compiled
+# (annotated functions and class constructors) don't split the caller
+
+class Point:
+  def __init__(self, x=0, y=0):
+    self.x = x
+    self.y = y
+
+def fib(n: int) -> int:
+  if n < 2:
+    return n
+  return fib(n - 1) + fib(n - 2)
+
+def half(x: float) -> float:
+  return x / 2.0
+
+def make_point(x, y):
+  p = Point(x, y)
+  return p
+
+def test():
+  total = 0
+  n = 0
+  while n < 10:
+    total = total + fib(n)
+    n = n + 1
+  print('sum of fib(0..9) = %d' % total)
+  print('half of 5 is %g' % half(5.0))
+  p = make_point(3, 4)
+  print('point is (%d, %d)' % (p.x, p.y))
+
+test()
+test()
@@ -0,0 +1,74 @@
+class Point:
+  def __init__(self, name, x, y):
+    self.name = name
+    self.x = x
+    self.y = y
+
+  def __del__(self):
+    print('destroying ' + self.name)
+
+  def get_x(self):
+    return self.x
+
+  def get_name(self):
+    return self.name
+
+  def norm2(self):
+    '''squared distance from the origin'''
+    return self.x * self.x + self.y * self.y
+
+def add(a, b):
+  return a + b
+
+def scale(x, factor=2.5):
+  return x * factor
+
+def pick(a, b, c):
+  return a if c else b
+
+def greet(s):
+  return 'hello ' + s
+
+def x_of(p):
+  return p.x
+
+def annotated_add(a: int, b: int) -> int:
+  return a + b
+
+def not_inlined(a):
+  # more than one statement, so this is called normally
+  b = a + 1
+  return b * 2
+
+triple = lambda x: x + x + x
+
+def test_scalars(n):
+  total = 0
+  i = n
+  while i > 0:
+    total = add(total, i)
+    i = add(i, -1)
+  print('total = ' + repr(total))
+  print('scale(4) = ' + repr(scale(4)))
+  print('scale(4, 0.5) = ' + repr(scale(4, 0.5)))
+  print('scale(1.5, factor=4.0) = ' + repr(scale(1.5, factor=4.0)))
+  print('pick = ' + repr(pick(n, -n, n > 3)) + ' ' + repr(pick(n, -n, n > 30)))
+  print('annotated_add = ' + repr(annotated_add(n, 7)))
+  print('not_inlined = ' + repr(not_inlined(n)))
+  print('triple = ' + repr(triple(n)) + ' ' + repr(triple(add(n, 1))))
+  print('nested = ' + repr(add(add(n, 1), add(scale(n), 2.0))))
+
+def test_references(name):
+  s = greet(name)
+  print(s)
+  print(greet(greet(name)))
+  p = Point(name, 3, 4)
+  print('get_x = ' + repr(p.get_x()))
+  print('x_of = ' + repr(x_of(p)))
+  print('norm2 = ' + repr(p.norm2()))
+  print('get_name = ' + p.get_name())
+  print('x_of(temporary) = ' + repr(x_of(Point('temporary', 5, 6))))
+
+test_scalars(10)
+test_references('inline')
+print('done')
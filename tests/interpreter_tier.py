@@ -0,0 +1,59 @@
+# these functions can all run in the interpreter tier, and are called enough
+# times to be compiled partway through when it's enabled
+
+def collatz_steps(n):
+  steps = 0
+  while n != 1:
+    if (n & 1) == 0:
+      n = n >> 1
+    else:
+      n = 3 * n + 1
+    steps = steps + 1
+  return steps
+
+def mix(a, b, c):
+  if c:
+    return a * b - 1.5
+  elif a > 3:
+    return a / b
+  return -b
+
+def classify(x):
+  """docstrings are ignored"""
+  if x < 2:
+    return 1
+  elif x == 2:
+    return 2
+  else:
+    return ~x
+
+def search(limit, step):
+  i = 0
+  total = 0
+  while i < limit:
+    i = i + step
+    if i == 7:
+      continue
+    if total > 20:
+      break
+    total = total + i
+  else:
+    total = -total
+  return total
+
+def either(a, b):
+  return (not a) or (a and b)
+
+def pick(x, y):
+  return x if x > y else y * 0.5
+
+x = 1
+while x < 8:
+  print('collatz_steps(%d) = %d' % (x, collatz_steps(x)))
+  print('mix(%d, 2.5, ...) = %g, %g' % (x, mix(x, 2.5, True), mix(x, 2.5, False)))
+  print('classify(%d) = %d' % (x, classify(x)))
+  print('search(%d, 2) = %d' % (x * 3, search(x * 3, 2)))
+  if either(x > 3, x > 5):
+    print('either(%d > 3, %d > 5)' % (x, x))
+  print('pick(%g, 3.0) = %g' % (x * 0.75, pick(x * 0.75, 3.0)))
+  x = x + 1
@@ -0,0 +1,74 @@
+# these functions are all in the scalar subset, so they're compiled through the
+# IR when it's enabled. they're written to give each optimization pass
+# something to do
+
+def alternating_sum(i, limit, threshold):
+  total = 0
+  while i < limit:
+    if i & 1 == 0 or i > threshold:
+      total = total + i * 2
+    else:
+      total = total - 1
+    i = i + 1
+  return total
+
+def scale(x):
+  y = x * 2.5
+  z = y if x > 3 else -y
+  c = 3 + 4 * 2
+  return z + c + x * 2.5
+
+def bits(a, b):
+  t = a and b
+  d = a - 2
+  e = a ^ b
+  l = a << 2
+  r = a >> 1
+  return t + d * d + e + ~a + l + r
+
+def nested_loops(s, i, n):
+  while i < n:
+    j = s - s
+    while j < i:
+      s = s + j
+      if s > 1000:
+        break
+      j = j + 1
+    else:
+      s = s + 1
+    i = i + 1
+  return s
+
+def compare(a, b):
+  r = 0.0
+  if a < b:
+    r = r + 1.0
+  if a <= b:
+    r = r + 2.0
+  if a == b:
+    r = r + 4.0
+  if a != b:
+    r = r + 8.0
+  if a > b:
+    r = r + 16.0
+  if a >= b:
+    r = r + 32.0
+  return r + a / b - b * 1.0
+
+def constant_branches():
+  x = 3
+  if x > 2:
+    x = x * 10
+  if 0:
+    x = -1
+  return x + 2 * 3
+
+x = 0
+while x < 8:
+  print('alternating_sum(0, %d, 10) = %d' % (x * 5, alternating_sum(0, x * 5, 10)))
+  print('scale(%d) = %g' % (x, scale(x)))
+  print('bits(%d, 3) = %d' % (x, bits(x, 3)))
+  print('nested_loops(0, 0, %d) = %d' % (x * 10, nested_loops(0, 0, x * 10)))
+  print('compare(%g, 2.0) = %g' % (x * 0.5, compare(x * 0.5, 2.0)))
+  x = x + 1
+print('constant_branches() = %d' % constant_branches())
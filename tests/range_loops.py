@@ -0,0 +1,101 @@
+def sum_range(n):
+  total = 0
+  for i in range(n):
+    total = total + i
+  return total
+
+def sum_range_start(a, b):
+  total = 0
+  for i in range(a, b):
+    total = total + i
+  return total
+
+def stepped(a, b, step):
+  # the sign of the step isn't known when this is compiled
+  values = 0
+  count = 0
+  for i in range(a, b, step):
+    values = values * 3 + i
+    count = count + 1
+  args = repr(a) + ', ' + repr(b) + ', ' + repr(step)
+  print('stepped(' + args + '): count=' + repr(count) + ' values=' + repr(values))
+
+def countdown(n):
+  for i in range(n, 0, -1):
+    print('countdown ' + repr(i))
+
+def break_and_continue(n):
+  total = 0
+  for i in range(n):
+    if i & 1:
+      continue
+    if i > 20:
+      break
+    total = total + i
+  return total
+
+def modify_variable(n):
+  # assigning to the loop variable doesn't affect the iteration
+  total = 0
+  for i in range(n):
+    total = total + i
+    i = 100
+  return total
+
+def nested(n):
+  total = 0
+  for i in range(n):
+    for j in range(i):
+      total = total + i * j
+  return total
+
+def with_calls(a, b):
+  for i in range(a, b, 2):
+    print('with_calls ' + repr(i))
+
+def near_limits(a, b, step):
+  # the counter would overflow after the last iteration in these loops
+  count = 0
+  last = 0
+  for i in range(a, b, step):
+    count = count + 1
+    last = i
+  args = repr(a) + ', ' + repr(b) + ', ' + repr(step)
+  print('near_limits(' + args + '): count=' + repr(count) + ' last=' + repr(last))
+
+def near_max_constant():
+  count = 0
+  for i in range(9223372036854775800, 9223372036854775807, 3):
+    count = count + 1
+    print('near_max_constant ' + repr(i))
+  return count
+
+def zero_step(n):
+  try:
+    for i in range(0, 10, n):
+      print('unreachable')
+  except ValueError:
+    print('range() step was zero')
+
+print('sum_range(10) = ' + repr(sum_range(10)))
+print('sum_range(0) = ' + repr(sum_range(0)))
+print('sum_range(-5) = ' + repr(sum_range(-5)))
+print('sum_range_start(5, 15) = ' + repr(sum_range_start(5, 15)))
+print('sum_range_start(15, 5) = ' + repr(sum_range_start(15, 5)))
+stepped(0, 10, 3)
+stepped(10, 0, -3)
+stepped(10, 0, 3)
+stepped(-4, 5, 1)
+countdown(3)
+print('break_and_continue(100) = ' + repr(break_and_continue(100)))
+print('modify_variable(5) = ' + repr(modify_variable(5)))
+print('nested(6) = ' + repr(nested(6)))
+with_calls(3, 8)
+near_limits(9223372036854775806, 9223372036854775807, 2)
+near_limits(9223372036854775800, 9223372036854775807, 3)
+near_limits(-9223372036854775807, -9223372036854775807 - 1, -2)
+near_limits(0, 9223372036854775807, 9223372036854775807)
+print('near_max_constant() = ' + repr(near_max_constant()))
+zero_step(0)
+print('len(range(7)) = ' + repr(len(range(7))))
+print('len(range(1, 10, 4)) = ' + repr(len(range(1, 10, 4))))
@@ -0,0 +1,51 @@
+class Item:
+  def __init__(self, name, value):
+    self.name = name
+    self.value = value
+
+  def __del__(self):
+    print('destroying ' + self.name)
+
+  def get_value(self):
+    return self.value
+
+  def describe(self):
+    return self.name + '=' + repr(self.value)
+
+def prefixed(s, prefix):
+  return prefix + s
+
+def test_attributes():
+  a = Item('a', 3)
+  b = Item('b', 4)
+  total = 0
+  i = 0
+  while i < 5:
+    total = total + a.value * b.value
+    i = i + 1
+  print('total = ' + repr(total))
+  print('get_value = ' + repr(a.get_value() + b.get_value()))
+  print(a.describe() + ' ' + b.describe())
+  a = b
+  print('after reassignment: ' + a.describe())
+
+def test_strings(name):
+  s = 'x'
+  t = name
+  i = 0
+  while i < 3:
+    s = s + t
+    i = i + 1
+  print(s)
+  print(prefixed(s, t))
+  print(prefixed(s + t, 'p:'))
+  print(s == t)
+  print(t + t == name + name)
+
+def test_temporary():
+  print('temporary value = ' + repr(Item('temporary', 7).value))
+
+test_attributes()
+test_strings('abc')
+test_temporary()
+print('done')
@@ -0,0 +1,58 @@
+def add(a, b):
+  return a + b
+
+def sum_to(n):
+  i = 0
+  total = 0
+  while i < n:
+    i = i + 1
+    total = total + i
+  return total
+
+def sum_to_with_calls(n):
+  # locals in caller-save registers must survive these calls
+  i = 0
+  total = 0
+  scale = 0.5
+  acc = 0.0
+  while i < n:
+    i = add(i, 1)
+    total = add(total, i)
+    acc = acc + scale * i
+  print('acc is %g' % acc)
+  return total
+
+def many_args(a, b, c, d, e, f, g):
+  return a + b + c + d + e + f + g
+
+def sum_with_wide_calls(n):
+  i = 0
+  total = 0
+  while i < n:
+    i = i + 1
+    total = total + many_args(i, i, i, i, i, i, i)
+  return total
+
+def modified_before_raise(n):
+  # the except block has to see the values from the point of the raise, not
+  # from the beginning of the try block
+  i = 0
+  x = 1.0
+  ok = True
+  try:
+    while i < n:
+      i = i + 1
+      x = x * 2.0
+    ok = False
+    assert i < n, 'loop finished'
+  except AssertionError as e:
+    print('caught at i=%d, x=%g' % (i, x))
+    print('ok is ' + repr(ok))
+  finally:
+    i = i + 100
+  return i
+
+print('sum_to(100) = %d' % sum_to(100))
+print('sum_to_with_calls(10) = %d' % sum_to_with_calls(10))
+print('sum_with_wide_calls(10) = %d' % sum_with_wide_calls(10))
+print('modified_before_raise(5) = %d' % modified_before_raise(5))
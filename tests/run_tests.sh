@@ -16,7 +16,11 @@ for FILE in *.py; do
   fi
 done
 
-for OPTIONS in "" "-XNoInlineRefcounting" "-XNoEagerCompilation" "-XNoInlineRefcounting -XNoEagerCompilation"; do
+# the code cache options appear twice: the first run fills the cache and the
+# second run loads from it
+CODE_CACHE_DIR=$(mktemp -d)
+
+for OPTIONS in "" "-XNoInlineRefcounting" "-XNoEagerCompilation" "-XNoInlineRefcounting -XNoEagerCompilation" "-XBackgroundCompilation" "-T2" "-T1,10" "-XIRCompilation" "-XNoInlining" "-XNoPeephole" "-C$CODE_CACHE_DIR" "-C$CODE_CACHE_DIR"; do
   for FILE in *.py; do
     if [ -e $FILE.input.1 ]; then
       for INPUT_FILE in $FILE.input.*; do
@@ -33,3 +37,4 @@ done
 echo "-- all tests passed"
 
 rm -f output.*.txt
+rm -rf $CODE_CACHE_DIR
@@ -0,0 +1,71 @@
+class Vec:
+  def __init__(self, x, y):
+    self.x = x
+    self.y = y
+    self.norm2 = x * x + y * y
+
+  def dot(self, other):
+    return self.x * other.x + self.y * other.y
+
+class Named:
+  def __init__(self, name):
+    self.name = name
+
+  def __del__(self):
+    print('destroying ' + self.name)
+
+def sum_norms(n):
+  # v never escapes, so it can live in the stack frame
+  total = 0
+  i = 0
+  while i < n:
+    v = Vec(i, i + 1)
+    v.x = v.x * 2
+    total = total + v.x + v.y + v.norm2
+    i = i + 1
+  return total
+
+def dot_products(n):
+  # calling a method passes the instance to it, so these can't be on the stack
+  total = 0
+  i = 0
+  while i < n:
+    a = Vec(i, 1)
+    b = Vec(2, i)
+    total = total + a.dot(b)
+    i = i + 1
+  return total
+
+def returned(x, y):
+  v = Vec(x, y)
+  return v
+
+def reconstructed(n):
+  # the arguments use the previous instance, so this one stays on the heap
+  v = Vec(0, 1)
+  i = 0
+  while i < n:
+    v = Vec(v.y, v.x + v.y)
+    i = i + 1
+  return v.x
+
+def with_del(name):
+  # classes with __del__ are never on the stack
+  n = Named(name)
+  print('created ' + n.name)
+
+def branches(flag):
+  if flag:
+    v = Vec(1, 2)
+  else:
+    v = Vec(3, 4)
+  return v.x + v.y
+
+print('sum_norms(10) = ' + repr(sum_norms(10)))
+print('dot_products(10) = ' + repr(dot_products(10)))
+r = returned(3, 4)
+print('returned = ' + repr(r.x) + ' ' + repr(r.y) + ' ' + repr(r.norm2))
+print('reconstructed(10) = ' + repr(reconstructed(10)))
+with_del('named')
+print('branches = ' + repr(branches(True)) + ' ' + repr(branches(False)))
+print('done')
@@ -0,0 +1,36 @@
+# strings are stored with 1, 2 or 4 bytes per character, depending on the
+# largest character they contain. this checks that operations on strings with
+# different character sizes agree with each other
+
+latin1 = 'caf' + chr(0xE9)
+ucs2 = 'sh' + chr(0x4E16) + 'jie'
+ucs4 = 'face' + chr(0x1F600)
+
+print('len(latin1) == ' + repr(len(latin1)))
+print('len(ucs2) == ' + repr(len(ucs2)))
+print('len(ucs4) == ' + repr(len(ucs4)))
+print('ord(chr(0x1F600)) == ' + repr(ord(chr(0x1F600))))
+
+combined = 'abc' + latin1 + ucs2 + ucs4
+print('len(combined) == ' + repr(len(combined)))
+print('latin1 in combined == ' + repr(latin1 in combined))
+print('ucs2 in combined == ' + repr(ucs2 in combined))
+print('ucs4 in combined == ' + repr(ucs4 in combined))
+print('\'abc\' in combined == ' + repr('abc' in combined))
+print('ucs4 in latin1 == ' + repr(ucs4 in latin1))
+print('chr(0x100) in chr(0x101) == ' + repr(chr(0x100) in chr(0x101)))
+
+print('(\'caf\' + chr(0xE9)) == latin1 == ' + repr(('caf' + chr(0xE9)) == latin1))
+print('(\'caf\' + chr(0xE8)) == latin1 == ' + repr(('caf' + chr(0xE8)) == latin1))
+print('(\'sh\' + chr(0x4E16) + \'jie\') == ucs2 == ' + repr(('sh' + chr(0x4E16) + 'jie') == ucs2))
+print('\'cafe\' < latin1 == ' + repr('cafe' < latin1))
+print('latin1 < ucs2 == ' + repr(latin1 < ucs2))
+print('chr(0xFF) < chr(0x100) == ' + repr(chr(0xFF) < chr(0x100)))
+print('chr(0xFFFF) < chr(0x10000) == ' + repr(chr(0xFFFF) < chr(0x10000)))
+
+print('hex(255) == ' + hex(255))
+print('hex(-4096) == ' + hex(-4096))
+print('bin(10) == ' + bin(10))
+print('oct(-8) == ' + oct(-8))
+print('%s has %d characters' % ('abc', 3))
+print('len(\'%s!\' % ucs2) == ' + repr(len('%s!' % ucs2)))
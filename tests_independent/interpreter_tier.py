@@ -0,0 +1,116 @@
+import __nemesys__
+
+
+def square(x):
+  return x * x
+
+def count_up(n):
+  i = 0
+  while i < n:
+    i = i + 1
+  return i
+
+
+def check_call_counts():
+  call_threshold = __nemesys__.interpreter_call_threshold()
+
+  calls = 0
+  while calls < 5:
+    assert square(calls) == calls * calls
+    calls = calls + 1
+
+  call_count = __nemesys__.function_interpreted_call_count(square)
+  interpreted_count = __nemesys__.function_interpreted_fragment_count(square)
+  print('square: %d interpreted calls, %d interpreted fragments' % (
+      call_count, interpreted_count))
+
+  if call_threshold == 0:
+    print('note: the interpreter is disabled')
+    assert call_count == 0
+    assert interpreted_count == 0
+  elif call_threshold > calls:
+    assert call_count == calls
+    assert interpreted_count == 1
+  else:
+    assert call_count == call_threshold
+    assert interpreted_count == 0
+
+check_call_counts()
+
+
+def check_back_edge_counts():
+  back_edge_threshold = __nemesys__.interpreter_back_edge_threshold()
+
+  # the first call's loop runs in the interpreter until it reaches the
+  # threshold, then the rest of the call runs in the compiled code
+  assert count_up(100) == 100
+  assert count_up(100) == 100
+
+  call_count = __nemesys__.function_interpreted_call_count(count_up)
+  back_edge_count = __nemesys__.function_interpreted_back_edge_count(count_up)
+  print('count_up: %d interpreted calls, %d interpreted loop iterations' % (
+      call_count, back_edge_count))
+
+  if __nemesys__.interpreter_call_threshold() == 0:
+    assert call_count == 0
+    assert back_edge_count == 0
+  elif back_edge_threshold <= 100:
+    assert call_count == 1
+    assert back_edge_count == back_edge_threshold
+    assert __nemesys__.function_interpreted_fragment_count(count_up) == 0
+
+check_back_edge_counts()
+
+
+def weighted_sum(n):
+  i = 0
+  total = 0
+  scale = 0.5
+  weight = 0.0
+  while i < n:
+    total = total + i * 3
+    weight = weight + scale
+    i = i + 1
+  if weight != 50.0:
+    return -1
+  return total
+
+
+def check_osr_locals():
+  # the loop enters the compiled code with all of its locals live, so they must
+  # all be loaded into their registers before it continues
+  assert weighted_sum(100) == 14900
+  assert weighted_sum(100) == 14900
+
+check_osr_locals()
+
+
+scale_factor = 3
+scaled_calls = 0
+
+def scaled(x):
+  global scaled_calls
+  scaled_calls = scaled_calls + 1
+  return x * scale_factor
+
+
+def check_globals():
+  # the interpreter reads and writes scalar globals in the module's global
+  # space, so the compiled code sees the same values afterward
+  call_threshold = __nemesys__.interpreter_call_threshold()
+
+  calls = 0
+  while calls < 5:
+    assert scaled(calls) == calls * 3
+    calls = calls + 1
+  assert scaled_calls == calls
+
+  call_count = __nemesys__.function_interpreted_call_count(scaled)
+  if call_threshold == 0:
+    assert call_count == 0
+  elif call_threshold > calls:
+    assert call_count == calls
+  else:
+    assert call_count == call_threshold
+
+check_globals()
@@ -1,20 +1,27 @@
 import __nemesys__
 
 import posix
+import time
 
 
 def check_counters():
   code_buffer_size = __nemesys__.code_buffer_size()
   code_buffer_used_size = __nemesys__.code_buffer_used_size()
+  code_buffer_reclaimed_size = __nemesys__.code_buffer_reclaimed_size()
 
   print('''nemesys counters:
 code_buffer_size == 0x%X
-code_buffer_used_size == 0x%X''' % (
+code_buffer_used_size == 0x%X
+code_buffer_reclaimed_size == 0x%X''' % (
       code_buffer_size,
-      code_buffer_used_size))
+      code_buffer_used_size,
+      code_buffer_reclaimed_size))
 
   assert code_buffer_size > 0
   assert code_buffer_used_size > 0
+  assert code_buffer_used_size <= code_buffer_size
+  assert code_buffer_reclaimed_size >= 0
+  assert __nemesys__.code_buffer_reclaimed_block_count() >= 0
 
 check_counters()
 
@@ -88,8 +95,9 @@ def check_module_inspection():
 
   assert phase == "Analyzed"  # doesn't become Imported until the root scope returns
   assert compiled_size > 0
-  assert global_count == 8
-  # note: the globals are __doc__, __name__, __nemesys__, posix, and the four functions
+  assert global_count == 14
+  # note: the globals are __doc__, __name__, __nemesys__, posix, time, the
+  # eight functions, and CounterTestObject
 
   assert b'this string appears verbatim in the module source' in source
   assert b'this string does not appear verbatim because it has an escaped\x20character' not in source
@@ -101,3 +109,91 @@ def check_module_inspection():
   assert data == source, '%s != %s' % (repr(data), repr(source))
 
 check_module_inspection()
+
+
+def check_allocator_stats():
+  num_classes = __nemesys__.allocator_size_class_count()
+  assert num_classes > 0
+  assert __nemesys__.allocator_block_size(num_classes) == 0
+
+  before = 0
+  for size_class in range(num_classes + 1):
+    before = before + __nemesys__.allocator_allocation_count(size_class)
+  items = [1, 2, 3]
+  for x in range(10):
+    items = [x, x + 1, x + 2]
+  after = 0
+  for size_class in range(num_classes + 1):
+    after = after + __nemesys__.allocator_allocation_count(size_class)
+  print('allocations before: %d, after: %d' % (before, after))
+  assert after > before
+
+  prev_block_size = 0
+  for size_class in range(num_classes):
+    block_size = __nemesys__.allocator_block_size(size_class)
+    assert block_size > prev_block_size
+    prev_block_size = block_size
+    assert __nemesys__.allocator_allocation_count(size_class) >= __nemesys__.allocator_free_count(size_class)
+    assert __nemesys__.allocator_refill_count(size_class) >= 0
+
+check_allocator_stats()
+
+
+def check_profiler():
+  # the profiler samples CPU time, so this has to keep the CPU busy instead of
+  # sleeping
+  __nemesys__.start_profile()
+  start = time.time()
+  x = 0
+  while time.time() - start < 0.2:
+    x = x + 1
+  __nemesys__.stop_profile()
+
+  sample_count = __nemesys__.profile_sample_count()
+  print('profile samples: %d' % sample_count)
+  assert sample_count > 0
+
+check_profiler()
+
+
+class CounterTestObject:
+  def __init__(self, x):
+    self.x = x
+
+def make_counter_test_object(x):
+  # returning the instance keeps it off the stack, so it's counted
+  o = CounterTestObject(x)
+  return o
+
+def check_runtime_counters():
+  assert len(__nemesys__.counter_names()) > 0
+  assert __nemesys__.counter('fragments_compiled') > 0
+  assert __nemesys__.counter('code_bytes_installed') > 0
+  assert __nemesys__.counter('compile_nsecs') > 0
+
+  allocated_name = 'instances.' + __name__ + '.CounterTestObject.allocated'
+  freed_name = 'instances.' + __name__ + '.CounterTestObject.freed'
+  instances_before = __nemesys__.counter(allocated_name)
+  lists_before = __nemesys__.counter('objects.list.allocated')
+  for x in range(10):
+    o = make_counter_test_object(x)
+    items = [x, o.x]
+  assert __nemesys__.counter(allocated_name) == instances_before + 10
+  assert __nemesys__.counter(freed_name) >= instances_before + 9
+  assert __nemesys__.counter('objects.list.allocated') >= lists_before + 10
+
+  raised_before = __nemesys__.counter('exceptions_raised')
+  unwound_before = __nemesys__.counter('exceptions_unwound')
+  try:
+    __nemesys__.counter('this counter does not exist')
+    assert False, 'counter() did not raise KeyError'
+  except KeyError:
+    pass
+  assert __nemesys__.counter('exceptions_raised') == raised_before + 1
+  assert __nemesys__.counter('exceptions_unwound') > unwound_before
+
+  print('runtime counters: %d fragments compiled, %d exceptions raised' % (
+      __nemesys__.counter('fragments_compiled'),
+      __nemesys__.counter('exceptions_raised')))
+
+check_runtime_counters()
@@ -2,13 +2,23 @@
 
 set -e
 
-for OPTIONS in "" "-XNoInlineRefcounting" "-XNoEagerCompilation" "-XNoInlineRefcounting -XNoEagerCompilation"; do
+for OPTIONS in "" "-XNoInlineRefcounting" "-XNoEagerCompilation" "-XNoInlineRefcounting -XNoEagerCompilation" "-XBackgroundCompilation" "-T2" "-T1,10" "-XIRCompilation" "-XNoInlining"; do
   for FILE in *.py; do
     echo "-- nemesys $OPTIONS $FILE"
     ../nemesys $OPTIONS $FILE > output.$FILE.txt
   done
 done
 
+# make sure the trace is valid JSON, including events from the background
+# compiler
+TRACE_FILE=$(mktemp)
+for FILE in *.py; do
+  echo "-- nemesys -t$TRACE_FILE -XBackgroundCompilation $FILE"
+  ../nemesys -t$TRACE_FILE -XBackgroundCompilation $FILE > output.$FILE.txt
+  python3 -c "import json, sys; assert json.load(open(sys.argv[1]))" $TRACE_FILE
+done
+rm -f $TRACE_FILE
+
 echo "-- all tests passed"
 
 rm -f output.*.txt